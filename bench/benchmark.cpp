@@ -0,0 +1,233 @@
+// Micro-benchmark for the in-process engines.
+// Runs the loop workload from benchmark.ipynb and a call-heavy workload shaped
+// like converter.py output, and reports cycles per guest op. Built with
+// -DCOUNT_DISPATCH (thd_vm_dispatch) it reports dispatches per guest op for the
+// engines that count them instead. Where the hardware counters are readable
+// (Linux perf events), it also reports branch mispredictions per 1000 guest ops.
+// Usage: thd_vm_bench [loop_count] [repeats]
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "symbol.hpp"
+#include "directthreading.cpp"
+#include "indirectthreading.cpp"
+#include "swthreading.cpp"
+#include "replthreading.cpp"
+#include "contextthreading.cpp"
+#include "regthreading.cpp"
+#include "jitthreading.cpp"
+#include "tailthreading.cpp"
+#ifdef HAVE_STENCILS
+#include "stencilthreading.cpp"
+#endif
+
+static inline uint64_t cycles_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Branch mispredictions of this thread in user mode, read from the hardware
+// counter. Not available in most VMs and containers, or off Linux.
+class BranchMisses {
+    int fd = -1;
+public:
+    BranchMisses() {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    ~BranchMisses() {
+#ifdef __linux__
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+    bool available() const { return fd >= 0; }
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    uint64_t stop() {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+};
+
+struct Workload {
+    std::string name;
+    std::vector<uint32_t> code;
+    uint64_t guest_ops; // Instructions the guest executes for one run
+};
+
+// benchmark.ipynb: sum 1..n through memory, with the loop closed by DT_JZ
+// (branch offsets count from the word after the branch).
+static Workload loop_workload(uint32_t n) {
+    uint32_t back = static_cast<uint32_t>(5 - 20);
+    Workload w;
+    w.name = "loop(" + std::to_string(n) + ")";
+    w.code = {DT_IMMI, 0, DT_STO_IMMI, 0, 1, DT_LOD, 0, DT_ADD, DT_LOD, 0, DT_INC, DT_STO, 0,
+              DT_LOD, 0, DT_IMMI, n, DT_GT, DT_JZ, back, DT_SEEK, DT_END};
+    w.guest_ops = 2 + 9ull * n + 2;
+    return w;
+}
+
+// Straight-line code: a block of `count` DT_INCs with no branch in it, run
+// `rounds` times so the load-time work does not dominate. Nearly all the time
+// is dispatch and handler bookkeeping.
+static Workload inc_workload(uint32_t count, uint32_t rounds) {
+    Workload w;
+    w.name = "inc(" + std::to_string(count) + "x" + std::to_string(rounds) + ")";
+    w.code = {DT_IMMI, 0};
+    w.code.insert(w.code.end(), count, DT_INC);
+    uint32_t back = static_cast<uint32_t>(-static_cast<int32_t>(count + 6));
+    w.code.insert(w.code.end(), {DT_DUP, DT_IMMI, count * rounds, DT_LT, DT_JUMP_IF, back, DT_SEEK, DT_END});
+    w.guest_ops = 1 + rounds * (count + 4ull) + 2;
+    return w;
+}
+
+// converter.py's shape: a grammar function guards its recursion depth with
+// `DUP, IMMI depth, GT, IF_ELSE` and descends with `DUP, INC, CALL f 1`. The
+// top-level loop calls it `iterations` times from depth 0.
+static Workload call_workload(uint32_t iterations, uint32_t depth) {
+    Workload w;
+    w.name = "calls(" + std::to_string(iterations) + ")";
+    w.code = {DT_IMMI, iterations,
+              DT_DUP, DT_JZ, 8,                         // 2: loop while the counter is non-zero
+              DT_IMMI, 0, DT_CALL, 15, 1,
+              DT_DEC, DT_JMP, static_cast<uint32_t>(-11),
+              DT_SEEK, DT_END,
+              DT_DUP, DT_IMMI, depth, DT_GT, DT_IF_ELSE, 5, 0, // 15: f(x)
+              DT_DUP, DT_INC, DT_CALL, 15, 1,
+              DT_JZ, 0, DT_RET};
+    // Each iteration runs f for x = 0..depth+1; all but the last recurse.
+    w.guest_ops = 1 + iterations * (6 + 9ull * (depth + 1) + 6) + 4;
+    return w;
+}
+
+// Best-of-`repeats` cycles for one complete run of the workload on a fresh VM,
+// and the branch misses of that run.
+template <typename VM>
+static std::pair<uint64_t, uint64_t> measure(const Workload& w, int repeats, BranchMisses& counter) {
+    uint64_t best = UINT64_MAX;
+    uint64_t misses = 0;
+    for (int r = 0; r < repeats; r++) {
+        VM vm;
+        std::vector<uint32_t> code = w.code;
+        counter.start();
+        uint64_t start = cycles_now();
+        vm.run_vm(code);
+        uint64_t elapsed = cycles_now() - start;
+        uint64_t missed = counter.stop();
+        if (elapsed < best) {
+            best = elapsed;
+            misses = missed;
+        }
+    }
+    return {best, misses};
+}
+
+template <typename VM>
+static void report(const char* engine, const Workload& w, int repeats, BranchMisses& counter) {
+    auto [cycles, misses] = measure<VM>(w, repeats, counter);
+    std::cout << std::left << std::setw(12) << engine << std::setw(18) << w.name
+              << std::right << std::setw(14) << w.guest_ops
+              << std::setw(16) << cycles
+              << std::setw(12) << std::fixed << std::setprecision(2)
+              << static_cast<double>(cycles) / w.guest_ops;
+    if (counter.available()) {
+        std::cout << std::setw(14) << 1000.0 * misses / w.guest_ops;
+    }
+    std::cout << std::endl;
+}
+
+#ifdef COUNT_DISPATCH
+template <typename VM>
+static void report_dispatch(const char* engine, const Workload& w) {
+    VM vm;
+    std::vector<uint32_t> code = w.code;
+    vm.run_vm(code);
+    std::cout << std::left << std::setw(12) << engine << std::setw(18) << w.name
+              << std::right << std::setw(14) << w.guest_ops
+              << std::setw(16) << vm.dispatch_count
+              << std::setw(12) << std::fixed << std::setprecision(2)
+              << static_cast<double>(vm.dispatch_count) / w.guest_ops << std::endl;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    uint32_t n = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 10000000;
+    int repeats = argc > 2 ? std::atoi(argv[2]) : 5;
+    Workload loop = loop_workload(n);
+    Workload calls = call_workload(n / 100, 8);
+    Workload incs = inc_workload(1000, n / 1000);
+#ifdef COUNT_DISPATCH
+    std::cout << std::left << std::setw(12) << "engine" << std::setw(18) << "workload"
+              << std::right << std::setw(14) << "guest ops" << std::setw(16) << "dispatches"
+              << std::setw(12) << "disp/op" << std::endl;
+    for (const Workload* w : {&loop, &calls, &incs}) {
+        report_dispatch<IndirectThreadingVM>("indirect", *w);
+        report_dispatch<RegThreadingVM>("reg", *w);
+    }
+    (void)repeats;
+#else
+    BranchMisses counter;
+    std::cout << std::left << std::setw(12) << "engine" << std::setw(18) << "workload"
+              << std::right << std::setw(14) << "guest ops" << std::setw(16) << "cycles"
+              << std::setw(12) << "cyc/op";
+    if (counter.available()) {
+        std::cout << std::setw(14) << "miss/kop";
+    }
+    std::cout << std::endl;
+    for (const Workload* w : {&loop, &calls, &incs}) {
+        report<DirectThreadingVM>("direct", *w, repeats, counter);
+        report<IndirectThreadingVM>("indirect", *w, repeats, counter);
+        report<SwThreadingVM>("sw", *w, repeats, counter);
+        report<ReplThreadingModel>("repl", *w, repeats, counter);
+        report<ContextThreadingVM>("context", *w, repeats, counter);
+        report<RegThreadingVM>("reg", *w, repeats, counter);
+        report<JitThreadingVM>("jit", *w, repeats, counter);
+        report<TailThreadingVM>("tail", *w, repeats, counter);
+#ifdef HAVE_STENCILS
+        report<StencilThreadingVM>("stencil", *w, repeats, counter);
+#endif
+    }
+#endif
+    return 0;
+}
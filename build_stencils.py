@@ -0,0 +1,137 @@
+"""Turns the compiled stencils (src/stencils.c) into stencils.hpp for the
+copy-and-patch engine.
+
+usage: python3 build_stencils.py stencils.o stencils.hpp
+
+Reads the x86-64 ELF object directly: every stencil_<OP> function (one section
+each, from -ffunction-sections) becomes a byte array plus its holes, i.e. the
+relocations against the HOLE_* symbols. A trailing `jmp HOLE_CONTINUE` is cut
+off so the next stencil follows without a jump.
+"""
+import struct
+import sys
+
+SHT_SYMTAB = 2
+SHT_RELA = 4
+STT_FUNC = 2
+
+R_X86_64_PC32 = 2
+R_X86_64_PLT32 = 4
+R_X86_64_32 = 10
+R_X86_64_32S = 11
+
+HOLES = {
+    'HOLE_IMM0': 'STENCIL_IMM0',
+    'HOLE_IMM1': 'STENCIL_IMM1',
+    'HOLE_IMM2': 'STENCIL_IMM2',
+    'HOLE_CONTINUE': 'STENCIL_CONTINUE',
+    'HOLE_TARGET': 'STENCIL_TARGET',
+    'HOLE_ELSE': 'STENCIL_ELSE',
+}
+# Relocation type -> hole flavour in the generated table
+KINDS = {
+    R_X86_64_PC32: 'STENCIL_REL32',
+    R_X86_64_PLT32: 'STENCIL_REL32',
+    R_X86_64_32: 'STENCIL_ABS32',
+    R_X86_64_32S: 'STENCIL_ABS32S',
+}
+
+
+def read_sections(data):
+    if data[:4] != b'\x7fELF' or data[4] != 2 or data[5] != 1:
+        sys.exit('build_stencils: expected a little-endian ELF64 object')
+    e_shoff, = struct.unpack_from('<Q', data, 0x28)
+    e_shentsize, e_shnum, e_shstrndx = struct.unpack_from('<HHH', data, 0x3A)
+    sections = []
+    for i in range(e_shnum):
+        name, kind, _, _, offset, size, link, info, _, entsize = struct.unpack_from(
+            '<IIQQQQIIQQ', data, e_shoff + i * e_shentsize)
+        sections.append({'name': name, 'type': kind, 'offset': offset, 'size': size,
+                         'link': link, 'info': info, 'entsize': entsize})
+    return sections
+
+
+def c_string(data, offset):
+    return data[offset:data.index(b'\0', offset)].decode()
+
+
+def read_symbols(data, sections, symtab):
+    strtab = sections[symtab['link']]['offset']
+    symbols = []
+    for off in range(symtab['offset'], symtab['offset'] + symtab['size'], 24):
+        name, info, _, shndx, value, size = struct.unpack_from('<IBBHQQ', data, off)
+        symbols.append({'name': c_string(data, strtab + name), 'type': info & 0xF,
+                        'shndx': shndx, 'value': value, 'size': size})
+    return symbols
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: build_stencils.py stencils.o stencils.hpp')
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    sections = read_sections(data)
+    symtab = next(s for s in sections if s['type'] == SHT_SYMTAB)
+    symbols = read_symbols(data, sections, symtab)
+
+    relocations = {}    # section index -> [(offset, symbol, type, addend)]
+    for s in sections:
+        if s['type'] != SHT_RELA:
+            continue
+        for off in range(s['offset'], s['offset'] + s['size'], 24):
+            r_offset, r_info, r_addend = struct.unpack_from('<QQq', data, off)
+            relocations.setdefault(s['info'], []).append(
+                (r_offset, symbols[r_info >> 32]['name'], r_info & 0xFFFFFFFF, r_addend))
+
+    stencils = []
+    for sym in symbols:
+        if sym['type'] != STT_FUNC or not sym['name'].startswith('stencil_'):
+            continue
+        op = sym['name'][len('stencil_'):]
+        start = sections[sym['shndx']]['offset'] + sym['value']
+        code = bytearray(data[start:start + sym['size']])
+        holes = []
+        for offset, target, kind, addend in relocations.get(sym['shndx'], []):
+            if not sym['value'] <= offset < sym['value'] + sym['size']:
+                continue
+            if target not in HOLES or kind not in KINDS:
+                sys.exit(f'build_stencils: stencil_{op} refers to {target} (relocation type {kind}); '
+                         'stencils may only use HOLE_* symbols')
+            holes.append((offset - sym['value'], HOLES[target], KINDS[kind], addend))
+        holes.sort()
+        if (holes and holes[-1][0] == len(code) - 4 and holes[-1][1] == 'STENCIL_CONTINUE'
+                and code[-5] == 0xE9):
+            del code[-5:]
+            holes.pop()
+        stencils.append((op, code, holes))
+
+    out = ['// Generated by build_stencils.py from src/stencils.c; do not edit.',
+           '#ifndef STENCILS_GENERATED_H',
+           '#define STENCILS_GENERATED_H',
+           '',
+           '// Included by src/stencilthreading.cpp after symbol.hpp and stencilstate.h.',
+           '']
+    for op, code, holes in stencils:
+        out.append(f'static const uint8_t stencil_code_{op}[] = {{')
+        for i in range(0, len(code), 16):
+            out.append('    ' + ', '.join(f'0x{b:02X}' for b in code[i:i + 16]) + ',')
+        out.append('};')
+        if holes:
+            out.append(f'static const StencilPatch stencil_holes_{op}[] = {{')
+            for offset, hole, kind, addend in holes:
+                out.append(f'    {{{offset}, {hole}, {kind}, {addend}}},')
+            out.append('};')
+    out.append('')
+    out.append('static const StencilCode stencil_table[] = {')
+    for op, code, holes in stencils:
+        table = f'stencil_holes_{op}' if holes else 'nullptr'
+        out.append(f'    {{DT_{op}, stencil_code_{op}, {len(code)}, {table}, {len(holes)}}},')
+    out.append('};')
+    out.append('')
+    out.append('#endif // STENCILS_GENERATED_H')
+    with open(sys.argv[2], 'w') as f:
+        f.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -41,7 +41,11 @@ instruction_dict = {
     'DT_FP_READ': 36,
     'DT_Tik': 37,
     'DT_SYSCALL': 38,
-    'DT_RND': 39
+    'DT_RND': 39,
+    'DT_GUARD_GT': 40,
+    'DT_GUARD_EQ': 41,
+    'DT_CALL_INC': 42,
+    'DT_TAILCALL': 43
 }
 
 def binary(input_file, output_file):
@@ -58,7 +62,7 @@ def binary(input_file, output_file):
             match = re.search(r"\((\d+\.\d+)\)", item)
             byte_stream.extend(struct.pack('f', float(match.group(1))))
         else:
-            byte_stream.extend(struct.pack('I', int(item)))
+            byte_stream.extend(struct.pack('I', int(item) & 0xFFFFFFFF))
     with open(output_file, 'wb') as file:
         file.write(byte_stream)
 
@@ -2,34 +2,44 @@ import json
 
 MAX_DEPTH = 5
 
+# Immediate operand count of every instruction the converter emits.
+OPERANDS = {
+    "DT_DUP": 0, "DT_INC": 0, "DT_GT": 0, "DT_EQ": 0, "DT_RND": 0, "DT_RET": 0,
+    "DT_IMMI": 1, "DT_JMP": 1, "DT_JZ": 1,
+    "DT_IF_ELSE": 2, "DT_CALL": 2,
+}
+
 def generate_function_code(func_name, branches=None):
     """
     Generates code for a function.
     
-    Every function begins with a depth–check sequence:
+    Every function takes its recursion depth as its only parameter and begins
+    with a depth–check sequence:
       DT_DUP, DT_IMMI MAX_DEPTH, DT_GT, DT_IF_ELSE, <RET_addr>, <BODY_addr>
     
-    For a simple (terminal) function (branches is None) the function simply emits DT_RET
-    after the depth–check.
+    For a simple (terminal) function (branches is None) the body is empty and
+    both targets reach the return sequence.
     
     For a branching (nonterminal) function:
-      1. A comparison block is generated. For each branch i (1 ≤ i ≤ k) it:
-         - pushes immediate i,
-         - executes DT_EQ,
-         - then DT_IF_ELSE with:
+      1. A random choice in [0, k) is pushed with DT_IMMI k, DT_RND. For each
+         branch i (1 ≤ i ≤ k) the comparison block then:
+         - duplicates the choice and compares it with i-1 (DT_DUP, DT_IMMI, DT_EQ),
+         - executes DT_IF_ELSE with:
                true target: label for branch i’s body,
-               false target: for branches 1..(k–1) the next comparison label,
-                              and for the last branch the function return label.
-         (Here the patch tokens for jumps are in relative mode.)
-      2. For each branch, the body is generated. For every call in the branch,
-         the code emits DT_DUP and DT_INC (to pass depth+1) and then DT_CALL using an
-         absolute patch token. At the end of each branch a DT_JMP (relative patch)
-         jumps to the function return.
-      3. Finally, the function’s return label is set and DT_RET is emitted.
+               false target: the next comparison label (the last comparison
+                             falls back to its own branch, since one must match).
+      2. For each branch, the body first drops the choice (DT_JZ 0 pops the top
+         and continues with the next instruction either way). For every call in
+         the branch, the code emits DT_DUP and DT_INC (to pass depth+1) and then
+         DT_CALL using an absolute patch token. At the end of each branch a
+         DT_JMP (relative patch) jumps to the function return.
+      3. Finally, the function’s return label drops the depth (DT_JZ 0) and
+         emits DT_RET, so functions return nothing and every caller's stack
+         depth stays the same across a call.
     
     Jump patch tokens are represented as tuples ("PATCH", label, mode),
-    where mode is "rel" (relative; final value = target_absolute – patch_token_index)
-    or "abs" (absolute).
+    where mode is "rel" (relative; final value = target_absolute – address of
+    the instruction following the jump) or "abs" (absolute).
     
     Nonterminal functions (defined in JSON with keys like "<a>") keep their angle brackets,
     so that a call "a" (terminal) is distinct from a call "<a>" (nonterminal).
@@ -51,30 +61,29 @@ def generate_function_code(func_name, branches=None):
         "DT_IF_ELSE", ("PATCH", func_name + "_ret", "rel"), ("PATCH", func_name + "_body", "rel")
     ])
     # Mark the beginning of the function body.
-    # (The depth-check occupies indices 0..6, so the body ideally starts at 7.)
+    # (The depth-check occupies indices 0..6, so the body starts at 7.)
     labels[func_name + "_body"] = len(code)
 
-    if branches is None:
-        # Terminal function: simply mark return label and emit DT_RET.
-        labels[func_name + "_ret"] = len(code)
-        code.append("DT_RET")
-    else:
+    if branches is not None:
         k = len(branches)
-        # --- Generate comparison block ---
+        # --- Generate comparison block on a random choice ---
+        code.extend(["DT_IMMI", k, "DT_RND"])
         labels[func_name + "_cmp_1"] = len(code)
         for i in range(1, k + 1):
-            # For branch i: if not last, false target is next comparison label; if last, false target is function return.
-            next_cmp = f"{func_name}_cmp_{i+1}" if i < k else f"{func_name}_ret"
+            # For branch i: if not last, false target is next comparison label; if last, its own branch.
+            next_cmp = f"{func_name}_cmp_{i+1}" if i < k else f"{func_name}_branch_{i}"
             code.extend([
-                "DT_IMMI", i,
+                "DT_DUP",
+                "DT_IMMI", i - 1,
                 "DT_EQ",
                 "DT_IF_ELSE", ("PATCH", f"{func_name}_branch_{i}", "rel"), ("PATCH", next_cmp, "rel")
             ])
-            if next_cmp not in labels:
+            if i < k:
                 labels[next_cmp] = len(code)
         # --- Generate branch bodies ---
         for i, branch in enumerate(branches, start=1):
             labels[f"{func_name}_branch_{i}"] = len(code)
+            code.extend(["DT_JZ", 0])
             for call in branch:
                 # For each call: do not strip angle brackets.
                 target_func = call
@@ -85,9 +94,9 @@ def generate_function_code(func_name, branches=None):
                 ])
             # End branch with unconditional jump to function return.
             code.extend(["DT_JMP", ("PATCH", f"{func_name}_ret", "rel")])
-        # --- Mark function return label and emit DT_RET.
-        labels[f"{func_name}_ret"] = len(code)
-        code.append("DT_RET")
+    # --- Mark function return label, drop the depth and emit DT_RET.
+    labels[f"{func_name}_ret"] = len(code)
+    code.extend(["DT_JZ", 0, "DT_RET"])
     return code, labels
 
 def generate_all_code(json_data):
@@ -167,9 +176,16 @@ def generate_all_code(json_data):
             abs_labels[label] = func_start + offset
         abs_code.extend(func_codes[fname])
 
-    # Patch all placeholders.
-    for i, token in enumerate(abs_code):
-        if isinstance(token, tuple) and token[0] == "PATCH":
+    # Patch all placeholders. Relative offsets count from the instruction
+    # after the jump, so walk the code an instruction at a time.
+    pc = 0
+    while pc < len(abs_code):
+        opcode = abs_code[pc]
+        next_pc = pc + 1 + OPERANDS[opcode]
+        for i in range(pc + 1, next_pc):
+            token = abs_code[i]
+            if not (isinstance(token, tuple) and token[0] == "PATCH"):
+                continue
             label = token[1]
             mode = token[2]
             if label not in abs_labels:
@@ -178,11 +194,11 @@ def generate_all_code(json_data):
             if mode == "abs":
                 patched = target
             elif mode == "rel":
-                # Relative offset computed as: target_absolute - patch_token_index.
-                patched = target - i
+                patched = target - next_pc
             else:
                 raise ValueError("Unknown patch mode: " + mode)
             abs_code[i] = patched
+        pc = next_pc
 
     return ",".join(str(x) for x in abs_code)
 
@@ -0,0 +1,356 @@
+#ifndef AOTTHREADING_H
+#define AOTTHREADING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "symbol.hpp"
+#include "readfile.hpp"
+#include "interface.hpp"
+#include "verifier.hpp"
+#include "optimizer.hpp"
+#include "nativebuild.hpp"
+
+// Ahead-of-time compiler: every guest function (word 0 and each DT_CALL
+// target) becomes a C function of its own, the way test.c sketches a grammar.
+// The verifier knows the frame depth before every instruction, so each frame
+// slot is a C local (s0 is the deepest, the parameters come first) and every
+// instruction an assignment between fixed locals; calls are native calls with
+// the parameters as arguments, and a function's value is its C return value.
+// The C compiler can then keep a frame in registers and inline one rule into
+// another. The program is compiled into a shared object (or found in the
+// compile cache), loaded, and run in-process through fvm_run().
+class AotThreadingVM : public Interface {
+    // Nested DT_CALLs allowed before the program stops with an overflow, and
+    // the stack the compiled code runs on to hold them.
+    static constexpr uint32_t MAX_CALL_DEPTH = 1 << 18;
+    static constexpr size_t NATIVE_STACK_BYTES = size_t(256) << 20;
+    // Part of the compile cache key: bump it whenever the generated C
+    // changes, so builds cached by an older generator are not reused.
+    static constexpr uint32_t C_GENERATOR_VERSION = 1;
+
+    StackProfile profile;
+    std::vector<uint32_t> instructions;
+    char* buffer;
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+    FvmLibrary library;
+
+    // The instructions of the function at `entry`, in order.
+    std::vector<uint32_t> functionBody(uint32_t entry) const {
+        std::vector<uint32_t> body;
+        for (uint32_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.owner[pc] == entry) {
+                body.push_back(pc);
+            }
+        }
+        return body;
+    }
+
+    // Word that branch operand `operand` of the instruction at `pc` lands on.
+    uint32_t branchTarget(uint32_t pc, int operand) const {
+        uint32_t next = pc + 1 + instructionInfo[instructions[pc]].operands;
+        return next + static_cast<int32_t>(instructions[pc + 1 + operand]);
+    }
+
+    static std::string slot(int32_t k) {
+        return "s" + std::to_string(k);
+    }
+
+    static std::string literal(uint32_t v) {
+        return std::to_string(v) + "u";
+    }
+
+    static std::string functionName(uint32_t entry) {
+        return "fvm_f" + std::to_string(entry);
+    }
+
+    std::string signature(uint32_t entry) const {
+        std::string params;
+        for (int32_t k = 0; k < profile.depth[entry]; k++) {
+            params += (k ? ", uint32_t " : "uint32_t ") + slot(k);
+        }
+        bool value = entry != 0 && profile.returns_value[entry];
+        return std::string("static ") + (value ? "uint32_t " : "void ") + functionName(entry) + "(" +
+               (params.empty() ? "void" : params) + ")";
+    }
+
+    // The call of the instruction at `pc` with its parameters, the top
+    // `num_params` of the `d` values of the frame, as arguments.
+    std::string callExpression(uint32_t target, uint32_t num_params, int32_t d) const {
+        std::string call = functionName(target) + "(";
+        for (uint32_t k = 0; k < num_params; k++) {
+            call += (k ? ", " : "") + slot(d - num_params + k);
+        }
+        return call + ")";
+    }
+
+    void emitFunction(std::ofstream& out, uint32_t entry) const {
+        std::vector<uint32_t> body = functionBody(entry);
+        std::set<uint32_t> labels;
+        for (uint32_t pc : body) {
+            switch (instructions[pc]) {
+                case DT_JMP: case DT_JZ: case DT_JUMP_IF:
+                    labels.insert(branchTarget(pc, 0));
+                    break;
+                case DT_IF_ELSE:
+                    labels.insert(branchTarget(pc, 0));
+                    labels.insert(branchTarget(pc, 1));
+                    break;
+                case DT_GUARD_GT: case DT_GUARD_EQ:
+                    labels.insert(branchTarget(pc, 1));
+                    labels.insert(branchTarget(pc, 2));
+                    break;
+                case DT_TAILCALL:
+                    if (instructions[pc + 1] == entry) {
+                        labels.insert(entry);
+                    }
+                    break;
+            }
+        }
+        // A loop can put words of the function before its entry.
+        bool entry_first = body.front() == entry;
+        if (!entry_first) {
+            labels.insert(entry);
+        }
+        bool value = entry != 0 && profile.returns_value[entry];
+
+        out << signature(entry) << " {\n";
+        // One more than the deepest frame, for DT_CALL_INC's parameter.
+        for (int32_t k = profile.depth[entry]; k <= static_cast<int32_t>(profile.frame_depth[entry]); k++) {
+            out << "    uint32_t " << slot(k) << ";\n";
+        }
+        if (!entry_first) {
+            out << "    goto L" << entry << ";\n";
+        }
+        for (uint32_t pc : body) {
+            uint32_t op = instructions[pc];
+            int32_t d = profile.depth[pc];
+            auto operand = [&](int k) { return instructions[pc + 1 + k]; };
+            auto jump = [&](int k) { return "goto L" + std::to_string(branchTarget(pc, k)) + ";"; };
+            std::string top = slot(d - 1);
+            std::string second = slot(d - 2);
+            if (labels.count(pc)) {
+                out << "L" << pc << ":\n";
+            }
+            out << "    ";
+            switch (op) {
+                case DT_ADD: out << second << " += " << top << ";"; break;
+                case DT_SUB: out << second << " -= " << top << ";"; break;
+                case DT_MUL: out << second << " *= " << top << ";"; break;
+                case DT_DIV:
+                case DT_MOD:
+                    out << "if (" << top << " == 0) divide_by_zero(); " << second << (op == DT_DIV ? " /= " : " %= ")
+                        << top << ";";
+                    break;
+                case DT_SHL: out << second << " <<= " << top << " & 31;"; break;
+                case DT_SHR: out << second << " >>= " << top << " & 31;"; break;
+                case DT_FP_ADD: case DT_FP_SUB: case DT_FP_MUL: case DT_FP_DIV: {
+                    const char* sign = op == DT_FP_ADD ? "+" : op == DT_FP_SUB ? "-" : op == DT_FP_MUL ? "*" : "/";
+                    if (op == DT_FP_DIV) {
+                        out << "if (to_float(" << top << ") == 0.0f) divide_by_zero(); ";
+                    }
+                    out << second << " = from_float(to_float(" << second << ") " << sign << " to_float(" << top << "));";
+                    break;
+                }
+                case DT_DUP: out << slot(d) << " = " << top << ";"; break;
+                case DT_END: out << "FVM_EXIT(0);"; break;
+                case DT_LOD: out << slot(d) << " = lod(" << literal(operand(0)) << ");"; break;
+                case DT_STO: out << "sto(" << literal(operand(0)) << ", " << top << ");"; break;
+                case DT_IMMI: out << slot(d) << " = " << literal(operand(0)) << ";"; break;
+                case DT_INC: out << top << "++;"; break;
+                case DT_DEC: out << top << "--;"; break;
+                case DT_STO_IMMI: out << "sto(" << literal(operand(0)) << ", " << literal(operand(1)) << ");"; break;
+                case DT_MEMCPY:
+                    out << "memcpy(buffer + " << literal(operand(0)) << ", buffer + " << literal(operand(1)) << ", "
+                        << operand(2) << ");";
+                    break;
+                case DT_MEMSET:
+                    out << "memset(buffer + " << literal(operand(0)) << ", " << operand(1) << ", " << operand(2) << ");";
+                    break;
+                case DT_JMP: out << jump(0); break;
+                case DT_JZ: out << "if (" << top << " == 0) " << jump(0); break;
+                case DT_JUMP_IF: out << "if (" << top << " != 0) " << jump(0); break;
+                case DT_IF_ELSE: out << "if (" << top << " != 0) " << jump(0) << " " << jump(1); break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    out << "if (" << top << (op == DT_GUARD_GT ? " > " : " == ") << literal(operand(0)) << ") "
+                        << jump(1) << " " << jump(2);
+                    break;
+                case DT_GT: out << second << " = " << second << " > " << top << ";"; break;
+                case DT_LT: out << second << " = " << second << " < " << top << ";"; break;
+                case DT_EQ: out << second << " = " << second << " == " << top << ";"; break;
+                case DT_GT_EQ: out << second << " = " << second << " >= " << top << ";"; break;
+                case DT_LT_EQ: out << second << " = " << second << " <= " << top << ";"; break;
+                case DT_CALL_INC:
+                    out << slot(d) << " = " << top << " + 1; ";
+                    d++;
+                    [[fallthrough]];
+                case DT_CALL: {
+                    uint32_t target = operand(0);
+                    uint32_t num_params = operand(1);
+                    // Only unbounded recursion needs the depth counted.
+                    if (profile.recursive) {
+                        out << "enter(); ";
+                    }
+                    if (profile.returns_value[target]) {
+                        out << slot(d - num_params) << " = ";
+                    }
+                    out << callExpression(target, num_params, d) << ";";
+                    if (profile.recursive) {
+                        out << " call_depth--;";
+                    }
+                    break;
+                }
+                case DT_TAILCALL: {
+                    uint32_t target = operand(0);
+                    uint32_t num_params = operand(1);
+                    if (target == entry) {
+                        // Tail recursion is a loop: the parameters move down to s0.
+                        for (uint32_t k = 0; k < num_params && static_cast<uint32_t>(d) > num_params; k++) {
+                            out << slot(k) << " = " << slot(d - num_params + k) << "; ";
+                        }
+                        out << "goto L" << entry << ";";
+                    } else if (value) {
+                        out << "return " << callExpression(target, num_params, d) << ";";
+                    } else {
+                        out << callExpression(target, num_params, d) << "; return;";
+                    }
+                    break;
+                }
+                case DT_RET:
+                    out << (value ? "return " + top + ";" : std::string("return;"));
+                    break;
+                case DT_SEEK: out << "debug_num = " << top << ";"; break;
+                case DT_PRINT: out << "printf(\"%d\\n\", (int32_t)" << top << ");"; break;
+                case DT_READ_INT: out << "read_int(" << literal(operand(0)) << ");"; break;
+                case DT_FP_PRINT: out << "printf(\"%g\\n\", to_float(" << top << "));"; break;
+                case DT_FP_READ: out << "read_fp(" << literal(operand(0)) << ");"; break;
+                case DT_Tik: out << "printf(\"tik\\n\");"; break;
+                case DT_RND: out << top << " = " << top << " ? rd() % " << top << " : 0;"; break;
+                default:
+                    out << "fprintf(stderr, \"Error: unknown instruction code " << op << "\\n\"); FVM_EXIT(1);";
+                    break;
+            }
+            out << "\n";
+        }
+        out << "}\n\n";
+    }
+
+public:
+    uint32_t debug_num;
+
+    AotThreadingVM() : buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
+    }
+    ~AotThreadingVM() {
+        library.close();
+        delete[] buffer;
+    }
+
+    // Writes the verified, optimized `instructions` as C to `path`: one
+    // function per guest function and fvm_run(), which runs word 0 on the
+    // caller's buffer and returns 0 when the program ends, 1 on an error.
+    bool write_c(const std::string& path) const {
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "Unable to open file " << path << " for writing." << std::endl;
+            return false;
+        }
+        out << "#include <stdint.h>\n#include <stdio.h>\n#include <string.h>\n#include <setjmp.h>\n\n" << FVM_CONTEXT_C
+            << "static char* buffer;\n"
+               "static uint32_t debug_num;\n"
+               "static uint32_t seed;\n"
+               "static uint32_t call_depth;\n"
+               "static jmp_buf fvm_exit;\n"
+               "#define FVM_EXIT(code) longjmp(fvm_exit, (code) + 1)\n\n"
+               "static inline uint32_t rd(void) {\n"
+               "    seed ^= seed << 13;\n"
+               "    seed ^= seed >> 17;\n"
+               "    seed ^= seed << 5;\n"
+               "    return seed;\n"
+               "}\n"
+               "static inline uint32_t lod(uint32_t offset) { uint32_t v; memcpy(&v, buffer + offset, 4); return v; }\n"
+               "static inline void sto(uint32_t offset, uint32_t v) { memcpy(buffer + offset, &v, 4); }\n"
+               "static inline float to_float(uint32_t v) { float f; memcpy(&f, &v, 4); return f; }\n"
+               "static inline uint32_t from_float(float f) { uint32_t v; memcpy(&v, &f, 4); return v; }\n"
+               "static void read_int(uint32_t offset) { int32_t v = 0; scanf(\"%d\", &v); memcpy(buffer + offset, &v, 4); }\n"
+               "static void read_fp(uint32_t offset) { float v = 0; scanf(\"%f\", &v); memcpy(buffer + offset, &v, 4); }\n"
+               "static void divide_by_zero(void) {\n"
+               "    fprintf(stderr, \"Error: Division by zero\\n\");\n"
+               "    FVM_EXIT(1);\n"
+               "}\n"
+               "static inline void enter(void) {\n"
+               "    if (++call_depth > " << MAX_CALL_DEPTH << "u) {\n"
+               "        fprintf(stderr, \"Error: Stack overflow, too many nested function calls\\n\");\n"
+               "        FVM_EXIT(1);\n"
+               "    }\n"
+               "}\n\n";
+        for (uint32_t entry : profile.entries) {
+            out << signature(entry) << ";\n";
+        }
+        out << "\n";
+        for (uint32_t entry : profile.entries) {
+            emitFunction(out, entry);
+        }
+        out << "int fvm_run(struct fvm_ctx* ctx) {\n"
+               "    buffer = ctx->buffer;\n"
+               "    debug_num = ctx->debug_num;\n"
+               "    seed = ctx->seed;\n"
+               "    call_depth = 0;\n"
+               "    int status = setjmp(fvm_exit);\n"
+               "    if (status == 0) {\n"
+               "        " << functionName(0) << "();\n"
+               "        status = 1;\n"
+               "    }\n"
+               "    fflush(stdout);\n"
+               "    ctx->debug_num = debug_num;\n"
+               "    ctx->seed = seed;\n"
+               "    return status - 1;\n"
+               "}\n";
+        out.close();
+        return static_cast<bool>(out);
+    }
+
+    void run_vm(std::string filename, bool benchmarkMode) {
+        std::vector<uint32_t> code;
+        try {
+            code = readFileToUint32Array(filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        if (benchmarkMode) {
+            std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+        }
+        run_vm(code);
+    }
+
+    void run_vm(std::vector<uint32_t>& code) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+
+        if (!library.load("aot", C_GENERATOR_VERSION, instructions, "",
+                          [&](const std::string& path) { return write_c(path); })) {
+            std::cerr << "Error: cannot compile and load the generated C" << std::endl;
+            return;
+        }
+        // On a thread of its own, whose stack holds MAX_CALL_DEPTH frames.
+        FvmContext ctx{buffer, debug_num, seed};
+        library.run(ctx, NATIVE_STACK_BYTES);
+        debug_num = ctx.debug_num;
+        seed = ctx.seed;
+    }
+};
+
+#endif // AOTTHREADING_H
@@ -1,28 +1,34 @@
 #ifndef CONTEXTTHREADING_H
 #define CONTEXTTHREADING_H
 #include <vector>
-#include <stack>
 #include <iostream>
 #include <unistd.h>   
 #include <fcntl.h>
 #include <fstream>    
 #include <sys/types.h> 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <cstring>
 #include "symbol.hpp"
 #include "readfile.hpp"
 #include "interface.hpp"
+#include "framestack.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
 #ifdef _WIN32
 #include <windows.h> // Windows-specific headers for file operations
 #endif
 
 class ContextThreadingVM : public Interface {
     uint32_t ip; // Instruction pointer
-    std::vector<std::stack<uint32_t>> sts; // Stack for operations
-    std::stack<uint32_t> st;
+    FrameStack st; // Operand stack shared by all call frames
+    StackProfile profile; // Verified stack depths of the loaded program
     std::vector<uint32_t> instructions; // Instruction set
     char* buffer; // Memory buffer
-    void (ContextThreadingVM::*instructionTable[256])(void); // Function pointer table for instructions
-    std::stack<uint32_t> callStack; // Call stack for function calls
+    void (*thunks[256])(ContextThreadingVM*) = {}; // Handlers of the instructions without operands
+    static constexpr uint32_t MAX_CALL_DEPTH = 1 << 17; // Guest calls nest on the native stack
+    uint32_t call_depth = 0; // Guest calls in progress
     uint32_t seed = 2463534242UL; // Seed for random number generation
     uint32_t rd() {
         seed ^= seed << 13;
@@ -76,24 +82,27 @@ class ContextThreadingVM : public Interface {
         st.push(a * b);
     }
 
-    inline void do_div() {
+    // Division by zero reports the error and returns 1 to stop the program.
+    inline uint32_t do_div() {
         uint32_t a = st.top(); st.pop();
         uint32_t b = st.top(); st.pop();
-        if (b == 0) {
+        if (a == 0) {
             std::cerr << "Error: Divided by zero error" << std::endl;
-            return;
+            return 1;
         }
         st.push(b / a);
+        return 0;
     }
 
-    inline void do_mod() {
+    inline uint32_t do_mod() {
         uint32_t a = st.top(); st.pop();
         uint32_t b = st.top(); st.pop();
-        if (b == 0) {
+        if (a == 0) {
             std::cerr << "Error: Divided by zero error" << std::endl;
-            return;
+            return 1;
         }
         st.push(b % a);
+        return 0;
     }
 
     inline void do_fp_add() {
@@ -117,15 +126,16 @@ class ContextThreadingVM : public Interface {
         st.push(from_float(result));
     }
 
-    inline void do_fp_div() {
+    inline uint32_t do_fp_div() {
         float a = to_float(st.top()); st.pop();
         float b = to_float(st.top()); st.pop();
-        if (b == 0.0f) {
+        if (a == 0.0f) {
             std::cerr << "Division by zero error" << std::endl;
-            return;
+            return 1;
         }
         float result = b / a;
         st.push(from_float(result));
+        return 0;
     }
 
     inline void do_inc() {
@@ -156,75 +166,52 @@ class ContextThreadingVM : public Interface {
     }
 
     inline void do_end() {
-        st = std::stack<uint32_t>();
+        st.clear();
         instructions = std::vector<uint32_t>();
         ip = 0;
     }
 
-    inline void do_lod() {
-        uint32_t offset = instructions[++ip];
+    inline void do_lod(uint32_t offset) {
         uint32_t a = read_mem32(buffer,offset);
         st.push(a);
     }
 
-    inline void do_sto() {
-        uint32_t offset = instructions[++ip];
+    inline void do_sto(uint32_t offset) {
         uint32_t a = st.top(); st.pop();
         write_mem32(buffer,a,offset);
     }
 
-    inline void do_immi() {
-        uint32_t a = instructions[++ip];
+    inline void do_immi(uint32_t a) {
         st.push(a);
     }
 
-    inline void do_memcpy() {
-        uint32_t dest = instructions[++ip];
-        uint32_t src = instructions[++ip];
-        uint32_t len = instructions[++ip];
+    inline void do_memcpy(uint32_t dest, uint32_t src, uint32_t len) {
         memcpy(buffer + dest, buffer + src, len);
     }
 
-    inline void do_memset() {
-        uint32_t dest = instructions[++ip];
-        uint32_t val = instructions[++ip];
-        uint32_t len = instructions[++ip];
+    inline void do_memset(uint32_t dest, uint32_t val, uint32_t len) {
         memset(buffer + dest, val, len);
     }
-    inline void do_sto_immi() {
-        uint32_t offset = instructions[++ip];
-        uint32_t number = instructions[++ip];
+    inline void do_sto_immi(uint32_t offset, uint32_t number) {
         write_mem32(buffer,number,offset);
     }
 
-    inline void do_jmp() {
-        int32_t offset = static_cast<int32_t>(instructions[++ip]);
-        ip += offset;
-    }
-
-    inline void do_jz() {
-        int32_t offset = static_cast<int32_t>(instructions[++ip]);
-        if (st.top() == 0) {
-            ip += offset;
-        }
-        st.pop();
-    }
-
-    inline void do_jump_if() {
+    // Conditional branches are native jumps; the handler only pops the condition.
+    inline uint32_t do_condition() {
         uint32_t condition = st.top(); st.pop();
-        int32_t offset = static_cast<int32_t>(instructions[++ip]);
-        if (condition) {
-            ip += offset;
-        }
+        return condition;
     }
 
-    inline void do_if_else() {
-        uint32_t condition = st.top(); st.pop();
-        int32_t trueOffset = static_cast<int32_t>(instructions[++ip]);
-        int32_t falseOffset = static_cast<int32_t>(instructions[++ip]);
-        ip += condition ? trueOffset : falseOffset;
+    // DT_GUARD_GT / DT_GUARD_EQ compare the top natively and leave it in place.
+    inline uint32_t do_top() {
+        return st.top();
     }
 
+    // DT_CALL_INC: pushes top + 1 as the last parameter of the call that follows.
+    inline void do_dup_inc() {
+        uint32_t a = st.top();
+        st.push(a + 1);
+    }
 
     inline void do_gt() {
         uint32_t a = st.top(); st.pop();
@@ -256,27 +243,34 @@ class ContextThreadingVM : public Interface {
         st.push(b <= a ? 1 : 0);
     }
 
-    inline void do_call() {
-        uint32_t target = instructions[++ip]; 
-        uint32_t num_params = instructions[++ip]; 
-        std::stack<uint32_t> newStack;
-         for (uint32_t i = 0; i < num_params; ++i) {
-            newStack.push(st.top());
-            st.pop();
+    // The native call into the callee follows; this only switches frames.
+    // Returns 1 to stop the program once calls nest deeper than
+    // MAX_CALL_DEPTH, before the native stack runs out.
+    inline uint32_t do_call(uint32_t num_params, uint32_t frame_depth) {
+        if (++call_depth > MAX_CALL_DEPTH) {
+            std::cerr << "Error: call stack overflow" << std::endl;
+            return 1;
         }
-        sts.push_back(newStack);
-        st=sts.back();//st always refer to the top of stacks.
-        callStack.push(ip); 
-        ip = target - 1; 
+        st.call(num_params);
+        st.reserve(frame_depth);
+        return 0;
     }
 
-    inline void do_ret() {
-        if (callStack.empty()) {
-            exit(0);
+    // A native jump into the callee follows, so it returns to this frame's caller.
+    inline void do_tail_call(uint32_t num_params, uint32_t frame_depth) {
+        st.tail_call(num_params);
+        st.reserve(frame_depth);
+    }
+
+    // Returns 1 for a DT_RET in the top-level code, which ends the program;
+    // otherwise the native ret that follows goes back to the caller.
+    inline uint32_t do_ret() {
+        if (st.depth() == 0) {
+            return 1;
         }
-        ip = callStack.top(); callStack.pop(); 
-        sts.pop_back();
-        st = sts.back();
+        st.ret();
+        call_depth--;
+        return 0;
     }
 
     inline void do_seek() {
@@ -284,32 +278,22 @@ class ContextThreadingVM : public Interface {
     }
 
     inline void do_print() {
-        if (!st.empty()) {
-            std::cout <<(int)st.top() << std::endl;
-        } else {
-            std::cerr << "Stack is empty." << std::endl;
-        }
+        std::cout <<(int)st.top() << std::endl;
     }
 
     inline void do_print_fp() {
-        if (!st.empty()) {
-            uint32_t num = st.top();
-            float* floatPtr = (float*)&num;
-            std::cout <<*floatPtr << std::endl;
-        } else {
-            std::cerr << "Stack is empty." << std::endl;
-        }
+        uint32_t num = st.top();
+        float* floatPtr = (float*)&num;
+        std::cout <<*floatPtr << std::endl;
     }
 
-    inline void do_read_fp() {
-        uint32_t offset = instructions[++ip];
+    inline void do_read_fp(uint32_t offset) {
         float val;
         std::cin >> val; 
         write_mem32(buffer,from_float(val), offset);
     }
 
-    inline void do_read_int() {
-        uint32_t offset = instructions[++ip];
+    inline void do_read_int(uint32_t offset) {
         int val;
         std::cin >> val;
         write_mem32(buffer, val, offset);
@@ -320,51 +304,249 @@ class ContextThreadingVM : public Interface {
     }
 
     inline void do_rnd() {
-        if(!st.empty()){
-            uint32_t a = st.top();st.pop();
-            st.push(rd() % a);
+        uint32_t a = st.top();st.pop();
+        st.push(a ? rd() % a : 0);
+    }
+
+    // Entry points called from the generated code (System V: the VM in rdi,
+    // operands in esi, edx, ecx). Handlers that can stop the program return
+    // non-zero to make the generated code leave.
+    template <void (ContextThreadingVM::*op)()>
+    static void thunk(ContextThreadingVM* vm) { (vm->*op)(); }
+    template <uint32_t (ContextThreadingVM::*op)()>
+    static uint32_t thunk_status(ContextThreadingVM* vm) { return (vm->*op)(); }
+    template <void (ContextThreadingVM::*op)(uint32_t)>
+    static void thunk1(ContextThreadingVM* vm, uint32_t a) { (vm->*op)(a); }
+    template <void (ContextThreadingVM::*op)(uint32_t, uint32_t)>
+    static void thunk2(ContextThreadingVM* vm, uint32_t a, uint32_t b) { (vm->*op)(a, b); }
+    template <uint32_t (ContextThreadingVM::*op)(uint32_t, uint32_t)>
+    static uint32_t thunk2_status(ContextThreadingVM* vm, uint32_t a, uint32_t b) { return (vm->*op)(a, b); }
+    template <void (ContextThreadingVM::*op)(uint32_t, uint32_t, uint32_t)>
+    static void thunk3(ContextThreadingVM* vm, uint32_t a, uint32_t b, uint32_t c) { (vm->*op)(a, b, c); }
+
+    void init_instruction_table() {
+        thunks[DT_ADD] = &thunk<&ContextThreadingVM::do_add>;
+        thunks[DT_SUB] = &thunk<&ContextThreadingVM::do_sub>;
+        thunks[DT_MUL] = &thunk<&ContextThreadingVM::do_mul>;
+        thunks[DT_SHL] = &thunk<&ContextThreadingVM::do_shl>;
+        thunks[DT_SHR] = &thunk<&ContextThreadingVM::do_shr>;
+        thunks[DT_FP_ADD] = &thunk<&ContextThreadingVM::do_fp_add>;
+        thunks[DT_FP_SUB] = &thunk<&ContextThreadingVM::do_fp_sub>;
+        thunks[DT_FP_MUL] = &thunk<&ContextThreadingVM::do_fp_mul>;
+        thunks[DT_INC] = &thunk<&ContextThreadingVM::do_inc>;
+        thunks[DT_DEC] = &thunk<&ContextThreadingVM::do_dec>;
+        thunks[DT_GT] = &thunk<&ContextThreadingVM::do_gt>;
+        thunks[DT_LT] = &thunk<&ContextThreadingVM::do_lt>;
+        thunks[DT_EQ] = &thunk<&ContextThreadingVM::do_eq>;
+        thunks[DT_GT_EQ] = &thunk<&ContextThreadingVM::do_gt_eq>;
+        thunks[DT_LT_EQ] = &thunk<&ContextThreadingVM::do_lt_eq>;
+        thunks[DT_SEEK] = &thunk<&ContextThreadingVM::do_seek>;
+        thunks[DT_PRINT] = &thunk<&ContextThreadingVM::do_print>;
+        thunks[DT_FP_PRINT] = &thunk<&ContextThreadingVM::do_print_fp>;
+        thunks[DT_Tik] = &thunk<&ContextThreadingVM::tik>;
+        thunks[DT_RND] = &thunk<&ContextThreadingVM::do_rnd>;
+        thunks[DT_DUP] = &thunk<&ContextThreadingVM::do_dup>;
+    }
+
+    uint8_t* native = nullptr; // Generated code for the loaded program
+    size_t native_size = 0;
+
+    void release_native() {
+        if (native) {
+            munmap(native, native_size);
+            native = nullptr;
         }
     }
-    void init_instruction_table() {
-        instructionTable[DT_ADD] = &ContextThreadingVM::do_add;
-        instructionTable[DT_SUB] = &ContextThreadingVM::do_sub;
-        instructionTable[DT_MUL] = &ContextThreadingVM::do_mul;
-        instructionTable[DT_DIV] = &ContextThreadingVM::do_div;
-        instructionTable[DT_MOD] = &ContextThreadingVM::do_mod;
-        instructionTable[DT_SHL] = &ContextThreadingVM::do_shl;
-        instructionTable[DT_SHR] = &ContextThreadingVM::do_shr;
-        instructionTable[DT_FP_ADD] = &ContextThreadingVM::do_fp_add;
-        instructionTable[DT_FP_SUB] = &ContextThreadingVM::do_fp_sub;
-        instructionTable[DT_FP_MUL] = &ContextThreadingVM::do_fp_mul;
-        instructionTable[DT_FP_DIV] = &ContextThreadingVM::do_fp_div;
-        instructionTable[DT_END] = &ContextThreadingVM::do_end;
-        instructionTable[DT_LOD] = &ContextThreadingVM::do_lod;
-        instructionTable[DT_STO] = &ContextThreadingVM::do_sto;
-        instructionTable[DT_IMMI] = &ContextThreadingVM::do_immi;
-        instructionTable[DT_STO_IMMI] = &ContextThreadingVM::do_sto_immi;
-        instructionTable[DT_MEMCPY] = &ContextThreadingVM::do_memcpy;
-        instructionTable[DT_MEMSET] = &ContextThreadingVM::do_memset;
-        instructionTable[DT_INC] = &ContextThreadingVM::do_inc;
-        instructionTable[DT_DEC] = &ContextThreadingVM::do_dec;
-        instructionTable[DT_JMP] = &ContextThreadingVM::do_jmp;
-        instructionTable[DT_JZ] = &ContextThreadingVM::do_jz;
-        instructionTable[DT_IF_ELSE] = &ContextThreadingVM::do_if_else;
-        instructionTable[DT_JUMP_IF] = &ContextThreadingVM::do_jump_if;
-        instructionTable[DT_GT] = &ContextThreadingVM::do_gt;
-        instructionTable[DT_LT] = &ContextThreadingVM::do_lt;
-        instructionTable[DT_EQ] = &ContextThreadingVM::do_eq;
-        instructionTable[DT_GT_EQ] = &ContextThreadingVM::do_gt_eq;
-        instructionTable[DT_LT_EQ] = &ContextThreadingVM::do_lt_eq;
-        instructionTable[DT_CALL] = &ContextThreadingVM::do_call;
-        instructionTable[DT_RET] = &ContextThreadingVM::do_ret;
-        instructionTable[DT_SEEK] = &ContextThreadingVM::do_seek;
-        instructionTable[DT_PRINT] = &ContextThreadingVM::do_print;
-        instructionTable[DT_READ_INT] = &ContextThreadingVM::do_read_int;
-        instructionTable[DT_FP_PRINT] = &ContextThreadingVM::do_print_fp;
-        instructionTable[DT_FP_READ] = &ContextThreadingVM::do_read_fp;
-        instructionTable[DT_Tik] = &ContextThreadingVM::tik;
-        instructionTable[DT_RND] = &ContextThreadingVM::do_rnd;
-        instructionTable[DT_DUP] = &ContextThreadingVM::do_dup;
+
+    // Little x86-64 assembler for the few instruction forms the generator uses.
+    struct Emitter {
+        std::vector<uint8_t> bytes;
+        void raw(std::initializer_list<uint8_t> b) { bytes.insert(bytes.end(), b); }
+        void u32(uint32_t v) { for (int i = 0; i < 4; i++) bytes.push_back(v >> (8 * i)); }
+        void u64(uint64_t v) { for (int i = 0; i < 8; i++) bytes.push_back(v >> (8 * i)); }
+        size_t here() const { return bytes.size(); }
+        // Emits a rel32 placeholder and returns its position.
+        size_t rel32() { size_t at = here(); u32(0); return at; }
+        void patch(size_t at, size_t target) {
+            uint32_t rel = static_cast<uint32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+            memcpy(&bytes[at], &rel, 4);
+        }
+        // mov rdi, rbx; [mov esi/edx/ecx, imm32]; mov rax, handler; call rax
+        void call_handler(const void* handler, std::initializer_list<uint32_t> args = {}) {
+            raw({0x48, 0x89, 0xDF});
+            static const uint8_t mov_imm[] = {0xBE, 0xBA, 0xB9};
+            int k = 0;
+            for (uint32_t a : args) {
+                raw({mov_imm[k++]});
+                u32(a);
+            }
+            raw({0x48, 0xB8});
+            u64(reinterpret_cast<uint64_t>(handler));
+            raw({0xFF, 0xD0});
+        }
+    };
+
+    // Context threading: one native call per guest instruction into its
+    // handler, in the order of the guest code, so the hardware sees the
+    // guest's control flow directly. DT_JMP, DT_JZ, DT_JUMP_IF and DT_IF_ELSE
+    // become native jumps on the condition their handler pops (the guards on
+    // the top their handler reads), and DT_CALL /
+    // DT_RET become a native call / ret, which keeps the return-address stack
+    // in step with the guest's calls.
+    //
+    // Register use: rbx holds the VM, r12 the native stack pointer on entry
+    // (DT_END inside a call unwinds to it). Each DT_CALL adjusts rsp by 8
+    // around the native call so handlers are always called 16-byte aligned,
+    // and leaves through the epilogue when its handler reports the call too deep.
+    bool generate() {
+        Emitter e;
+        std::vector<size_t> nativeAt(instructions.size(), 0);
+        std::vector<std::pair<size_t, uint32_t>> fixups;  // rel32 position, guest word
+        std::vector<size_t> exits;                        // rel32 positions jumping to the epilogue
+
+        // push rbx; push r12; push rbp; mov rbx, rdi; mov r12, rsp
+        e.raw({0x53, 0x41, 0x54, 0x55, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xE4});
+        auto branch = [&](size_t pc, size_t next, int operand) {
+            return static_cast<uint32_t>(next + static_cast<int32_t>(instructions[pc + 1 + operand]));
+        };
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + instructionInfo[op].operands;
+            const uint32_t* operand = &instructions[pc + 1];
+            nativeAt[pc] = e.here();
+            switch (op) {
+                case DT_DIV:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_div>));
+                    e.raw({0x85, 0xC0, 0x0F, 0x85});             // test eax, eax; jnz epilogue
+                    exits.push_back(e.rel32());
+                    break;
+                case DT_MOD:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_mod>));
+                    e.raw({0x85, 0xC0, 0x0F, 0x85});
+                    exits.push_back(e.rel32());
+                    break;
+                case DT_FP_DIV:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_fp_div>));
+                    e.raw({0x85, 0xC0, 0x0F, 0x85});
+                    exits.push_back(e.rel32());
+                    break;
+                case DT_END:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk<&ContextThreadingVM::do_end>));
+                    e.raw({0xE9});                               // jmp epilogue
+                    exits.push_back(e.rel32());
+                    break;
+                case DT_LOD:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk1<&ContextThreadingVM::do_lod>), {operand[0]});
+                    break;
+                case DT_STO:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk1<&ContextThreadingVM::do_sto>), {operand[0]});
+                    break;
+                case DT_IMMI:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk1<&ContextThreadingVM::do_immi>), {operand[0]});
+                    break;
+                case DT_READ_INT:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk1<&ContextThreadingVM::do_read_int>), {operand[0]});
+                    break;
+                case DT_FP_READ:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk1<&ContextThreadingVM::do_read_fp>), {operand[0]});
+                    break;
+                case DT_STO_IMMI:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk2<&ContextThreadingVM::do_sto_immi>),
+                                   {operand[0], operand[1]});
+                    break;
+                case DT_MEMCPY:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk3<&ContextThreadingVM::do_memcpy>),
+                                   {operand[0], operand[1], operand[2]});
+                    break;
+                case DT_MEMSET:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk3<&ContextThreadingVM::do_memset>),
+                                   {operand[0], operand[1], operand[2]});
+                    break;
+                case DT_JMP:
+                    e.raw({0xE9});
+                    fixups.push_back({e.rel32(), branch(pc, next, 0)});
+                    break;
+                case DT_JZ:
+                case DT_JUMP_IF:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_condition>));
+                    // test eax, eax; jz / jnz target
+                    e.raw({0x85, 0xC0, 0x0F, static_cast<uint8_t>(op == DT_JZ ? 0x84 : 0x85)});
+                    fixups.push_back({e.rel32(), branch(pc, next, 0)});
+                    break;
+                case DT_IF_ELSE:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_condition>));
+                    e.raw({0x85, 0xC0, 0x0F, 0x85});             // test eax, eax; jnz true
+                    fixups.push_back({e.rel32(), branch(pc, next, 0)});
+                    e.raw({0xE9});                               // jmp false
+                    fixups.push_back({e.rel32(), branch(pc, next, 1)});
+                    break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_top>));
+                    e.raw({0x3D});                               // cmp eax, k; ja / je true
+                    e.u32(operand[0]);
+                    e.raw({0x0F, static_cast<uint8_t>(op == DT_GUARD_GT ? 0x87 : 0x84)});
+                    fixups.push_back({e.rel32(), branch(pc, next, 1)});
+                    e.raw({0xE9});                               // jmp false
+                    fixups.push_back({e.rel32(), branch(pc, next, 2)});
+                    break;
+                case DT_CALL_INC:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk<&ContextThreadingVM::do_dup_inc>));
+                    [[fallthrough]];
+                case DT_CALL:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk2_status<&ContextThreadingVM::do_call>),
+                                   {operand[1], profile.frame_depth[operand[0]]});
+                    e.raw({0x85, 0xC0, 0x0F, 0x85});             // too deep: jnz epilogue
+                    exits.push_back(e.rel32());
+                    e.raw({0x48, 0x83, 0xEC, 0x08, 0xE8});       // sub rsp, 8; call callee
+                    fixups.push_back({e.rel32(), operand[0]});
+                    e.raw({0x48, 0x83, 0xC4, 0x08});             // add rsp, 8
+                    break;
+                case DT_TAILCALL:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk2<&ContextThreadingVM::do_tail_call>),
+                                   {operand[1], profile.frame_depth[operand[0]]});
+                    e.raw({0xE9});                               // jmp callee
+                    fixups.push_back({e.rel32(), operand[0]});
+                    break;
+                case DT_RET:
+                    e.call_handler(reinterpret_cast<const void*>(&thunk_status<&ContextThreadingVM::do_ret>));
+                    e.raw({0x85, 0xC0, 0x0F, 0x85});             // top level: jnz epilogue
+                    exits.push_back(e.rel32());
+                    e.raw({0xC3});                               // ret
+                    break;
+                default:
+                    e.call_handler(reinterpret_cast<const void*>(thunks[op]));
+                    break;
+            }
+            pc = next - 1;
+        }
+        size_t epilogue = e.here();
+        // mov rsp, r12; pop rbp; pop r12; pop rbx; ret
+        e.raw({0x4C, 0x89, 0xE4, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+        for (const auto& [at, word] : fixups) {
+            e.patch(at, nativeAt[word]);
+        }
+        for (size_t at : exits) {
+            e.patch(at, epilogue);
+        }
+
+        release_native();
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        native_size = (e.bytes.size() + page - 1) / page * page;
+        void* mem = mmap(nullptr, native_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        native = static_cast<uint8_t*>(mem);
+        memcpy(native, e.bytes.data(), e.bytes.size());
+        if (mprotect(native, native_size, PROT_READ | PROT_EXEC) != 0) {
+            release_native();
+            return false;
+        }
+        return true;
     }
 
 public:
@@ -372,11 +554,10 @@ public:
     ContextThreadingVM() : ip(0), buffer(new char[4 * 1024 * 1024]) { 
         init_instruction_table();
         debug_num = 0xFFFFFFFF;
-        sts.push_back(std::stack<uint32_t>());
-        st = sts.back();
     }
 
     ~ContextThreadingVM() {
+        release_native();
         delete[] buffer;
     }
 
@@ -386,23 +567,36 @@ public:
             if (benchmarkMode) {
                 std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
             }
-            for (ip = 0; ip < instructions.size(); ip++) {
-                (this->*instructionTable[instructions[ip]])();
-            }
         } catch (const std::exception& e) {
             std::cerr << "Error: " << e.what() << std::endl;
+            return;
         }
+        run_vm(instructions);
     }
 
     void run_vm(std::vector<uint32_t>& code) {
         this->instructions = code;
         try {
-            for (ip = 0; ip < instructions.size(); ip++) {
-                (this->*instructionTable[instructions[ip]])();
-            }
+            profile = verifyProgram(instructions);
         } catch (const std::exception& e) {
             std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+#if defined(__x86_64__) && !defined(_WIN32)
+        if (!generate()) {
+            std::cerr << "Error: cannot map executable memory for the generated code" << std::endl;
+            return;
         }
+        // A run that stopped on an error inside a callee left its frames.
+        st.clear();
+        st.reserve(profile.max_stack);
+        call_depth = 0;
+        reinterpret_cast<void (*)(ContextThreadingVM*)>(native)(this);
+#else
+        std::cerr << "Error: context threading generates x86-64 code and cannot run on this target" << std::endl;
+#endif
     }
 };
-#endif // CONTEXTTHREADING_H
\ No newline at end of file
+#endif // CONTEXTTHREADING_H
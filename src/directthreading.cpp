@@ -2,273 +2,767 @@
 #define DIRECTTHREADINGVM_H
 
 #include <vector>
-#include <stack>
 #include <iostream>
 #include <cstring>
 #include <fstream>
 #include <cstdlib>
+#include <cstdio>
 #include <ctime>
 #include "readfile.hpp"
 #include "interface.hpp"
+#include "framestack.hpp"
 #ifdef _WIN32
 #include <windows.h>
 #endif
 #include "symbol.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
+#include "nativebuild.hpp"
 
 class DirectThreadingVM : public Interface {
 private:
+    // One cell of pre-decoded threaded code: a handler address followed by
+    // that instruction's operands, with branch and call targets resolved to
+    // the cell they land on.
+    union Cell {
+        const void* handler;
+        const Cell* target;
+        uint32_t value;
+    };
+
     uint32_t ip; // Instruction pointer (not used in the generated C file)
-    std::vector<std::stack<uint32_t>> sts; // Collection of operand stacks
-    std::stack<uint32_t> st;             // Current operand stack (st = sts.back())
+    FrameStack st;                       // Operand stack shared by all call frames
+    StackProfile profile;                // Verified stack depths of the loaded program
     std::vector<uint32_t> instructions;  // Parsed instruction stream (including operands)
+    std::vector<Cell> threaded;          // Pre-decoded code run by run_vm(std::vector&)
+    std::vector<const Cell*> callStack;  // Return addresses
+    std::vector<int> c_label_of_word;    // Label of each instruction word in the last C output, or -1
     char* buffer;                        // Memory buffer
-    std::stack<uint32_t> callStack;      // Call stack
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+    FvmLibrary library;           // The program compiled from the C output (emit_c)
+    uint32_t rd() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+    inline float to_float(uint32_t val) {
+        float f;
+        memcpy(&f, &val, sizeof(f));
+        return f;
+    }
+    inline uint32_t from_float(float val) {
+        uint32_t u;
+        memcpy(&u, &val, sizeof(u));
+        return u;
+    }
+    inline void write_mem32(uint32_t val, uint32_t offset) {
+        memcpy(buffer + offset, &val, 4);
+    }
+    inline uint32_t read_mem32(uint32_t offset) {
+        uint32_t val;
+        memcpy(&val, buffer + offset, 4);
+        return val;
+    }
 
     // Returns the number of immediate operands expected for an opcode.
     int operandCount(uint32_t opcode) {
-        switch (opcode) {
-            case DT_ADD:
-            case DT_SUB:
-            case DT_MUL:
-            case DT_DIV:
-            case DT_MOD:
-            case DT_SHL:
-            case DT_SHR:
-            case DT_FP_ADD:
-            case DT_FP_SUB:
-            case DT_FP_MUL:
-            case DT_FP_DIV:
-            case DT_END:
-            case DT_INC:
-            case DT_DEC:
-            case DT_GT:
-            case DT_LT:
-            case DT_EQ:
-            case DT_GT_EQ:
-            case DT_LT_EQ:
-            case DT_PRINT:
-            case DT_FP_PRINT:
-            case DT_Tik:
-            case DT_RET:
-            case DT_RND:
-            case DT_DUP:
-                return 0;
-            case DT_LOD:
-            case DT_STO:
-            case DT_IMMI:
-            case DT_READ_INT:
-            case DT_FP_READ:
-            case DT_JMP:
-            case DT_JZ:
-            case DT_JUMP_IF:
-            case DT_SEEK:
-                return 1;
-            case DT_STO_IMMI:
-            case DT_IF_ELSE:
-            case DT_CALL:  // Modified: DT_CALL now takes 2 parameters (target, num_params)
-                return 2;
-            case DT_MEMCPY:
-            case DT_MEMSET:
-                return 3;
-            default:
-                return 0;
+        return opcode < DT_NUM_INSTRUCTIONS ? instructionInfo[opcode].operands : 0;
+    }
+
+    // Generated C for a DT_MEMCPY (second = source) or DT_MEMSET (second =
+    // byte value) of `len` bytes at `dest`. A length of 1, 2, 4 or 8 becomes
+    // a single move of that width; the compiler sees any other as a call
+    // with constant arguments.
+    static std::string copyOrFill(uint32_t op, const std::string& dest, uint32_t second, uint32_t len) {
+        static const char* const widths[] = {nullptr, "uint8_t", "uint16_t", nullptr, "uint32_t",
+                                             nullptr, nullptr, nullptr, "uint64_t"};
+        const char* type = len < 9 ? widths[len] : nullptr;
+        std::string src = std::to_string(second) + "u";
+        if (!type) {
+            return std::string("    ") + (op == DT_MEMCPY ? "do_memcpy(" : "do_memset(") + dest + ", " + src + ", " +
+                   std::to_string(len) + "u);\n";
+        }
+        std::string move = "    { " + std::string(type) + " v";
+        if (op == DT_MEMCPY) {
+            move += "; memcpy(&v, buffer + " + src + ", " + std::to_string(len) + ");";
+        } else {
+            char pattern[24];
+            snprintf(pattern, sizeof(pattern), "0x%llxull",
+                     (second & 0xFFull) * (0x0101010101010101ull >> (64 - 8 * len)));
+            move += " = " + std::string(pattern) + ";";
+        }
+        return move + " memcpy(buffer + " + dest + ", &v, " + std::to_string(len) + "); }\n";
+    }
+
+    // Translates the verified `instructions` into `threaded`: one handler
+    // cell per reachable instruction, then its operands. DT_CALL,
+    // DT_CALL_INC and DT_TAILCALL get a third operand cell holding the room
+    // the callee's frame needs.
+    void predecode(const void* const* handlers) {
+        std::vector<uint32_t> cellOf(instructions.size(), 0);
+        size_t cells = 0;
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            cellOf[pc] = cells;
+            cells += 1 + operandCount(op) + (op == DT_CALL || op == DT_CALL_INC || op == DT_TAILCALL ? 1 : 0);
+            pc += operandCount(op);
+        }
+        threaded.assign(cells, Cell{nullptr});
+        // Branch operands count from the word after the branch instruction.
+        auto branch = [&](size_t pc, size_t next, int operand) {
+            int32_t offset = static_cast<int32_t>(instructions[pc + 1 + operand]);
+            return &threaded[cellOf[next + offset]];
+        };
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + operandCount(op);
+            Cell* cell = &threaded[cellOf[pc]];
+            cell[0].handler = handlers[op];
+            switch (op) {
+                case DT_JMP:
+                case DT_JZ:
+                case DT_JUMP_IF:
+                    cell[1].target = branch(pc, next, 0);
+                    break;
+                case DT_IF_ELSE:
+                    cell[1].target = branch(pc, next, 0);
+                    cell[2].target = branch(pc, next, 1);
+                    break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    cell[1].value = instructions[pc + 1];
+                    cell[2].target = branch(pc, next, 1);
+                    cell[3].target = branch(pc, next, 2);
+                    break;
+                case DT_CALL:
+                case DT_CALL_INC:
+                case DT_TAILCALL:
+                    cell[1].target = &threaded[cellOf[instructions[pc + 1]]];
+                    cell[2].value = instructions[pc + 2];
+                    cell[3].value = profile.frame_depth[instructions[pc + 1]] + 1;
+                    break;
+                default:
+                    for (int k = 1; k <= operandCount(op); k++) {
+                        cell[k].value = instructions[pc + k];
+                    }
+                    break;
+            }
+            pc = next - 1;
         }
     }
 
 public:
-    DirectThreadingVM() : ip(0), buffer(new char[4 * 1024 * 1024]) {
-        sts.push_back(std::stack<uint32_t>());
-        st = sts.back();
+    uint32_t debug_num;
+    // Write the program out as C, compile it into a shared object and run
+    // that instead of interpreting the program (thd_vm_direct --emit-c).
+    bool emit_c = false;
+    // Calls the C output can nest: one stack per frame, each only as large
+    // as the deepest verified frame.
+    static constexpr uint32_t C_MAX_STACKS = 1 << 16;
+    // Part of the compile cache key: bump it whenever the generated C
+    // changes, so binaries cached by an older generator are not reused.
+    static constexpr uint32_t C_GENERATOR_VERSION = 2;
+
+    DirectThreadingVM() : ip(0), buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
     }
     ~DirectThreadingVM() {
         delete[] buffer;
     }
-    
-    // run_vm:
-    // Reads the instruction stream from file and generates a pure C source file that implements
-    // the virtual machine using direct threading. The generated code separates instructions and
-    // immediate values, and uses label pointers for correct computed goto implementation.
+
     void run_vm(std::string filename, bool benchmarkMode) {
+        if (emit_c) {
+            compile_to_c(filename, benchmarkMode);
+            return;
+        }
         try {
             instructions = readFileToUint32Array(filename);
         } catch (const std::exception &e) {
             std::cerr << "Error reading file: " << e.what() << std::endl;
             return;
         }
-        
+        if (benchmarkMode) {
+            std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+        }
+        std::vector<uint32_t> code = instructions;
+        run_vm(code);
+    }
+
+    // Direct threading in-process: the verified program is pre-decoded once
+    // into handler addresses with inline operands, then run with computed
+    // goto. The top of stack is cached in `tos` as in the other in-process
+    // engines (see FrameStack).
+    void run_vm(std::vector<uint32_t>& code) {
+        if (emit_c) {
+            run_compiled(code, "");
+            return;
+        }
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+
+        // Designators are kept in enum order so GCC accepts them as well as clang.
+        static const void* handlers[DT_NUM_INSTRUCTIONS] = {
+            [DT_ADD]       = &&L_DT_ADD,
+            [DT_SUB]       = &&L_DT_SUB,
+            [DT_MUL]       = &&L_DT_MUL,
+            [DT_DIV]       = &&L_DT_DIV,
+            [DT_MOD]       = &&L_DT_MOD,
+            [DT_SHL]       = &&L_DT_SHL,
+            [DT_SHR]       = &&L_DT_SHR,
+            [DT_FP_ADD]    = &&L_DT_FP_ADD,
+            [DT_FP_SUB]    = &&L_DT_FP_SUB,
+            [DT_FP_MUL]    = &&L_DT_FP_MUL,
+            [DT_FP_DIV]    = &&L_DT_FP_DIV,
+            [DT_DUP]       = &&L_DT_DUP,
+            [DT_END]       = &&L_DT_END,
+            [DT_LOD]       = &&L_DT_LOD,
+            [DT_STO]       = &&L_DT_STO,
+            [DT_IMMI]      = &&L_DT_IMMI,
+            [DT_INC]       = &&L_DT_INC,
+            [DT_DEC]       = &&L_DT_DEC,
+            [DT_STO_IMMI]  = &&L_DT_STO_IMMI,
+            [DT_MEMCPY]    = &&L_DT_MEMCPY,
+            [DT_MEMSET]    = &&L_DT_MEMSET,
+            [DT_JMP]       = &&L_DT_JMP,
+            [DT_JZ]        = &&L_DT_JZ,
+            [DT_IF_ELSE]   = &&L_DT_IF_ELSE,
+            [DT_JUMP_IF]   = &&L_DT_JUMP_IF,
+            [DT_GT]        = &&L_DT_GT,
+            [DT_LT]        = &&L_DT_LT,
+            [DT_EQ]        = &&L_DT_EQ,
+            [DT_GT_EQ]     = &&L_DT_GT_EQ,
+            [DT_LT_EQ]     = &&L_DT_LT_EQ,
+            [DT_CALL]      = &&L_DT_CALL,
+            [DT_RET]       = &&L_DT_RET,
+            [DT_SEEK]      = &&L_DT_SEEK,
+            [DT_PRINT]     = &&L_DT_PRINT,
+            [DT_READ_INT]  = &&L_DT_READ_INT,
+            [DT_FP_PRINT]  = &&L_DT_FP_PRINT,
+            [DT_FP_READ]   = &&L_DT_FP_READ,
+            [DT_Tik]       = &&L_DT_Tik,
+            [DT_SYSCALL]   = nullptr,  // Rejected by the verifier
+            [DT_RND]       = &&L_DT_RND,
+            [DT_GUARD_GT]  = &&L_DT_GUARD_GT,
+            [DT_GUARD_EQ]  = &&L_DT_GUARD_EQ,
+            [DT_CALL_INC]  = &&L_DT_CALL_INC,
+            [DT_TAILCALL]  = &&L_DT_TAILCALL,
+        };
+        predecode(handlers);
+        callStack.clear();
+
+        const Cell* pc = threaded.data();
+        uint32_t tos = 0;
+        uint32_t* sp = st.reserve(st.bottom() + st.frame_base(), profile.max_stack + 1);
+
+// Each handler finds its operands at pc[1..] and moves pc past them.
+#define NEXT goto *pc->handler
+#define BINARY(expr) { uint32_t b = tos; uint32_t a = *--sp; tos = (expr); } pc += 1; NEXT
+#define FP_BINARY(op) BINARY(from_float(to_float(a) op to_float(b)))
+
+        NEXT;
+
+    L_DT_ADD:    BINARY(a + b);
+    L_DT_SUB:    BINARY(a - b);
+    L_DT_MUL:    BINARY(a * b);
+    L_DT_SHL:    BINARY(a << b);
+    L_DT_SHR:    BINARY(a >> b);
+    L_DT_FP_ADD: FP_BINARY(+);
+    L_DT_FP_SUB: FP_BINARY(-);
+    L_DT_FP_MUL: FP_BINARY(*);
+    L_DT_GT:     BINARY(a > b ? 1 : 0);
+    L_DT_LT:     BINARY(a < b ? 1 : 0);
+    L_DT_EQ:     BINARY(a == b ? 1 : 0);
+    L_DT_GT_EQ:  BINARY(a >= b ? 1 : 0);
+    L_DT_LT_EQ:  BINARY(a <= b ? 1 : 0);
+    L_DT_DIV:
+        if (tos == 0) {
+            goto divide_by_zero;
+        }
+        BINARY(a / b);
+    L_DT_MOD:
+        if (tos == 0) {
+            goto divide_by_zero;
+        }
+        BINARY(a % b);
+    L_DT_FP_DIV:
+        if (to_float(tos) == 0.0f) {
+            goto divide_by_zero;
+        }
+        FP_BINARY(/);
+    L_DT_DUP:
+        *sp++ = tos;
+        pc += 1;
+        NEXT;
+    L_DT_END:
+        st.clear();
+        return;
+    L_DT_LOD:
+        *sp++ = tos;
+        tos = read_mem32(pc[1].value);
+        pc += 2;
+        NEXT;
+    L_DT_STO:
+        write_mem32(tos, pc[1].value);
+        tos = *--sp;
+        pc += 2;
+        NEXT;
+    L_DT_IMMI:
+        *sp++ = tos;
+        tos = pc[1].value;
+        pc += 2;
+        NEXT;
+    L_DT_INC:
+        ++tos;
+        pc += 1;
+        NEXT;
+    L_DT_DEC:
+        --tos;
+        pc += 1;
+        NEXT;
+    L_DT_STO_IMMI:
+        write_mem32(pc[2].value, pc[1].value);
+        pc += 3;
+        NEXT;
+    L_DT_MEMCPY:
+        memcpy(buffer + pc[1].value, buffer + pc[2].value, pc[3].value);
+        pc += 4;
+        NEXT;
+    L_DT_MEMSET:
+        memset(buffer + pc[1].value, pc[2].value, pc[3].value);
+        pc += 4;
+        NEXT;
+    L_DT_JMP:
+        pc = pc[1].target;
+        NEXT;
+    L_DT_JZ:
+    {
+        uint32_t condition = tos;
+        tos = *--sp;
+        pc = condition == 0 ? pc[1].target : pc + 2;
+    }
+        NEXT;
+    L_DT_JUMP_IF:
+    {
+        uint32_t condition = tos;
+        tos = *--sp;
+        pc = condition != 0 ? pc[1].target : pc + 2;
+    }
+        NEXT;
+    L_DT_IF_ELSE:
+    {
+        uint32_t condition = tos;
+        tos = *--sp;
+        pc = condition != 0 ? pc[1].target : pc[2].target;
+    }
+        NEXT;
+    L_DT_GUARD_GT:
+        pc = tos > pc[1].value ? pc[2].target : pc[3].target;
+        NEXT;
+    L_DT_GUARD_EQ:
+        pc = tos == pc[1].value ? pc[2].target : pc[3].target;
+        NEXT;
+    L_DT_CALL_INC:
+        // Pass top + 1 as the last parameter, then call as DT_CALL does.
+        *sp++ = tos;
+        ++tos;
+    L_DT_CALL:
+        // Spill the cached top so the frame below the parameters is complete.
+        *sp = tos;
+        st.enter((sp - st.bottom()) - pc[2].value);
+        sp = st.reserve(sp, pc[3].value);
+        callStack.push_back(pc + 4);
+        pc = pc[1].target;
+        NEXT;
+    L_DT_TAILCALL:
+        // The parameters take over the frame; the return address stays.
+        *sp = tos;
+        sp = st.replace(sp, pc[2].value);
+        sp = st.reserve(sp, pc[3].value);
+        tos = *sp;
+        pc = pc[1].target;
+        NEXT;
+    L_DT_RET:
+    {
+        if (callStack.empty()) {
+            return; // DT_RET in the top-level code ends the program
+        }
+        bool has_value = st.frame_size(sp) > 0;
+        sp = st.bottom() + st.leave();
+        if (has_value) {
+            sp++; // the callee's top becomes the caller's top, already in tos
+        } else {
+            tos = *sp;
+        }
+        pc = callStack.back();
+        callStack.pop_back();
+    }
+        NEXT;
+    L_DT_SEEK:
+        debug_num = tos;
+        pc += 1;
+        NEXT;
+    L_DT_PRINT:
+        std::cout << static_cast<int>(tos) << std::endl;
+        pc += 1;
+        NEXT;
+    L_DT_READ_INT:
+    {
+        int val;
+        std::cin >> val;
+        write_mem32(val, pc[1].value);
+    }
+        pc += 2;
+        NEXT;
+    L_DT_FP_PRINT:
+        std::cout << to_float(tos) << std::endl;
+        pc += 1;
+        NEXT;
+    L_DT_FP_READ:
+    {
+        float val;
+        std::cin >> val;
+        write_mem32(from_float(val), pc[1].value);
+    }
+        pc += 2;
+        NEXT;
+    L_DT_Tik:
+        std::cout << "tik" << std::endl;
+        pc += 1;
+        NEXT;
+    L_DT_RND:
+        tos = tos ? rd() % tos : 0;
+        pc += 1;
+        NEXT;
+    divide_by_zero:
+        std::cerr << "Error: Divided by zero error" << std::endl;
+        return;
+#undef FP_BINARY
+#undef BINARY
+#undef NEXT
+    }
+
+    // Writes `code` as the resumable C library (see write_c) to
+    // `output_filename`, for the tiered engine. Fails if the program does not
+    // verify, or if some reachable instruction has no label of its own
+    // because unreachable words in front of it threw the generator's linear
+    // walk off.
+    bool emit_resumable_c(std::vector<uint32_t> code, const std::string& output_filename) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception &e) {
+            return false;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        if (!write_c(output_filename, true)) {
+            return false;
+        }
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] >= 0 && c_label_of_word[pc] < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Label of the instruction starting at `word` in the last C output.
+    int c_label(uint32_t word) const {
+        return word < c_label_of_word.size() ? c_label_of_word[word] : -1;
+    }
+
+    // compile_to_c:
+    // Reads the instruction stream from file and runs it as compiled C (see
+    // run_compiled), keeping the C and shared object next to it when there is
+    // no compile cache.
+    void compile_to_c(std::string filename, bool benchmarkMode) {
+        std::vector<uint32_t> code;
+        try {
+            code = readFileToUint32Array(filename);
+        } catch (const std::exception &e) {
+            std::cerr << "Error reading file: " << e.what() << std::endl;
+            return;
+        }
+        if (benchmarkMode) {
+            std::cout << "Benchmark mode enabled." << std::endl;
+        }
+        run_compiled(code, filename + "_compiled_dt");
+    }
+
+    // Generates a pure C source file that implements the virtual machine
+    // using direct threading. Every instruction gets a label with its
+    // immediates written in as literals, and label pointers for the computed
+    // goto. The C is compiled into a shared object, unless the compile cache
+    // holds it, whose fvm_run() then runs in-process on this VM's buffer.
+    void run_compiled(std::vector<uint32_t> code, const std::string& stem) {
+        // Reject bytecode that could overflow or underflow the generated
+        // fixed-size stacks; what passes needs no checks at run time.
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        if (!library.load("direct", C_GENERATOR_VERSION, instructions, stem,
+                          [&](const std::string& path) { return write_c(path, false); })) {
+            std::cerr << "Error: cannot compile and load the generated C" << std::endl;
+            return;
+        }
+        FvmContext ctx{buffer, debug_num, seed};
+        library.run(ctx);
+        debug_num = ctx.debug_num;
+        seed = ctx.seed;
+    }
+
+    // Writes the verified, fused `instructions` as C to `output_filename`.
+    // Both forms are libraries working on the caller's buffer. The plain form
+    // exposes fvm_run(), which runs the program from its start. The
+    // resumable form (see emit_resumable_c) is a library exposing
+    // fvm_resume(), which takes over a program the interpreter has started:
+    // it runs on the caller's buffer, starts from the caller's frames at any
+    // instruction, and returns instead of exiting.
+    bool write_c(const std::string& output_filename, bool resumable) {
         // First, analyze the instruction stream to separate opcodes and operands
         std::vector<uint32_t> opcodes;         // Only opcodes
-        std::vector<uint32_t> immediateValues; // Only immediate values
-        std::vector<int> opToImmIndices;       // Maps each opcode to its first immediate index
         
         // Array to map instruction index to label index
         std::vector<int> instToLabelIndex;
         // 新增：记录原始操作码在指令流中的位置
         std::vector<uint32_t> opcode_orig_indices;
+        // Opcode index of each instruction word, used to resolve branch targets
+        std::vector<int> wordToOpcode(instructions.size(), -1);
         
         size_t raw = 0;
-        size_t immediateIndex = 0;
         while (raw < instructions.size()) {
             uint32_t opcode = instructions[raw++];
             opcodes.push_back(opcode);
             instToLabelIndex.push_back(opcodes.size() - 1);
             
-            opToImmIndices.push_back(immediateIndex);
             // 记录当前操作码在原始数组中的位置（raw-1 为opcode所在位置）
             opcode_orig_indices.push_back(raw - 1);
             
-            int nOperands = operandCount(opcode);
-            for (int i = 0; i < nOperands && raw < instructions.size(); i++) {
-                immediateValues.push_back(instructions[raw++]);
-                immediateIndex++;
-            }
+            wordToOpcode[raw - 1] = opcodes.size() - 1;
+            raw = std::min(raw + operandCount(opcode), instructions.size());
         }
         
+        c_label_of_word = wordToOpcode;
+
+        // Branch operands are word offsets from the end of the instruction;
+        // resolve them to opcode indices here, once, so the generated code
+        // jumps straight to the target's label. Every reachable branch must
+        // land on a label (the verifier checked the offsets; a label can only
+        // be missing where unreachable words threw the linear walk off).
+        auto branchTarget = [&](size_t i, int operand) {
+            uint32_t word = opcode_orig_indices[i];
+            int64_t next = word + 1 + operandCount(opcodes[i]);
+            int64_t target = next + static_cast<int32_t>(instructions[word + 1 + operand]);
+            return target >= 0 && target < static_cast<int64_t>(instructions.size()) ? wordToOpcode[target] : -1;
+        };
+        // Call targets are absolute words, resolved the same way.
+        auto callTarget = [&](size_t i) {
+            return wordToOpcode[instructions[opcode_orig_indices[i] + 1]];
+        };
+        for (size_t i = 0; i < opcodes.size(); i++) {
+            uint32_t word = opcode_orig_indices[i];
+            if (profile.depth[word] < 0) {
+                continue;
+            }
+            int first = opcodes[i] == DT_GUARD_GT || opcodes[i] == DT_GUARD_EQ ? 1 : 0;
+            int last = -1;
+            switch (opcodes[i]) {
+                case DT_JMP: case DT_JZ: case DT_JUMP_IF: last = 0; break;
+                case DT_IF_ELSE: last = 1; break;
+                case DT_GUARD_GT: case DT_GUARD_EQ: last = 2; break;
+            }
+            for (int k = first; k <= last; k++) {
+                if (branchTarget(i, k) < 0) {
+                    std::cerr << "Error: branch at word " << word << " has no label to jump to" << std::endl;
+                    return false;
+                }
+            }
+            bool is_call = opcodes[i] == DT_CALL || opcodes[i] == DT_CALL_INC || opcodes[i] == DT_TAILCALL;
+            if (is_call && callTarget(i) < 0) {
+                std::cerr << "Error: call at word " << word << " has no label to jump to" << std::endl;
+                return false;
+            }
+        }
+        // The jump to the label of opcode `target`, `indent` spaces in.
+        auto jumpTo = [&](int target, int indent) {
+            std::string pad(indent, ' ');
+            if (target < 0) {
+                // Only in unreachable code (see above).
+                return pad + "FVM_EXIT(1);\n";
+            }
+            return pad + "goto L" + std::to_string(target) + ";\n";
+        };
+        // Immediate `k` of opcode `i`, as a C literal.
+        auto imm = [&](size_t i, int k) {
+            return std::to_string(instructions[opcode_orig_indices[i] + 1 + k]) + "u";
+        };
+
         // Generate the output file.
-        std::string output_filename = filename + "_compiled_dt" + ".c";
         std::ofstream out(output_filename);
         if (!out) {
             std::cerr << "Unable to open file " << output_filename << " for writing." << std::endl;
-            return;
+            return false;
         }
         
         // Write standard headers and macro definitions.
         out << "#include <stdio.h>\n#include <stdlib.h>\n#include <stdint.h>\n#include <string.h>\n";
-        out << "#include <time.h>\n\n"; // For random number generation
+        out << "#include <setjmp.h>\n\n";
+        // Errors and the end of the program return from fvm_run or fvm_resume.
+        out << "static jmp_buf fvm_exit;\n";
+        out << "#define FVM_EXIT(code) longjmp(fvm_exit, (code) + 1)\n\n";
         
-        out << "#define STACK_SIZE 1024\n#define MAX_STACKS 64\n#define BUFFER_SIZE (4 * 1024 * 1024)\n\n";
+        // Every call gets its own stack, sized for the deepest verified frame.
+        out << "#define STACK_SIZE " << profile.max_frame_depth + 1 << "\n";
+        out << "#define MAX_STACKS " << C_MAX_STACKS << "\n\n";
         
-        // Global variables - modified to support multiple stacks
+        // Global variables - modified to support multiple stacks. Static, so
+        // the shared object reaches them directly rather than through its GOT.
         out << "// Main stack array\n";
-        out << "uint32_t stacks[MAX_STACKS][STACK_SIZE];\n";
-        out << "int stack_tops[MAX_STACKS] = {-1};\n";
-        out << "int current_stack = 0; // Index of current stack\n\n";
+        out << "static uint32_t stacks[MAX_STACKS][STACK_SIZE];\n";
+        out << "static int stack_tops[MAX_STACKS] = {-1}; // Top of each caller's stack, saved by do_call\n";
+        out << "static int current_stack = 0; // Index of current stack\n\n";
         
         out << "// Memory buffer\n";
-        out << "char buffer[BUFFER_SIZE];\n";
+        out << "static char* buffer; // The caller's\n";
         
-        out << "// Call stack\n";
-        out << "uint32_t callStack[STACK_SIZE];\n";
-        out << "int call_top = -1; // Call stack top\n";
+        out << "// Call stack top\n";
+        out << "static int call_top = -1;\n";
         
         out << "// Stack context information for function calls\n";
         out << "struct StackContext {\n";
         out << "    int stack_index;\n";
         out << "    int return_ip;\n";
         out << "};\n";
-        out << "struct StackContext stack_contexts[STACK_SIZE];\n\n";
+        out << "static struct StackContext stack_contexts[MAX_STACKS];\n\n";
         
-        out << "uint32_t debug_num = 0; // For DT_SEEK\n\n";
-        out << "int32_t ip = -1; // Instruction pointer\n\n";
+        out << "static uint32_t debug_num = 0; // For DT_SEEK\n\n";
 
         // Helper conversion functions.
-        out << "float to_float(uint32_t val) {\n";
+        out << "static inline float to_float(uint32_t val) {\n";
         out << "    union { uint32_t i; float f; } u;\n    u.i = val; return u.f;\n}\n";
-        out << "uint32_t from_float(float f) {\n";
+        out << "static inline uint32_t from_float(float f) {\n";
         out << "    union { uint32_t i; float f; } u;\n    u.f = f; return u.i;\n}\n\n";
         
-        // Stack operation macros
-        out << "// Stack operation macros\n";
-        out << "#define PUSH(val) stacks[current_stack][++stack_tops[current_stack]] = (val)\n";
-        out << "#define POP() stacks[current_stack][stack_tops[current_stack]--]\n";
-        out << "#define TOP() stacks[current_stack][stack_tops[current_stack]]\n";
-        out << "#define STACK_TOP stack_tops[current_stack]\n\n";
+        // The current stack is reached through `sp`, one past its top, which
+        // the dispatch function keeps in a local (as it does `ip`) and hands
+        // to every handler that touches the stack; stack_tops is only written
+        // when a call or return switches stacks. Through the globals every
+        // push and pop went to memory.
+        out << "// Stack operation macros, on the local sp\n";
+        out << "#define PUSH(val) (*sp++ = (val))\n";
+        out << "#define POP() (*--sp)\n";
+        out << "#define TOP() (sp[-1])\n\n";
         
-        // Define the NEXT macro (computed goto).
+        // Define the NEXT macro (computed goto). Only a return needs it: every
+        // other instruction's successor is known here, so it falls through to
+        // the next label or jumps straight to its target, and the C compiler
+        // sees the program's control flow instead of one indirect jump per
+        // instruction.
         out << "#define NEXT goto *labels[++ip]\n\n";
-        out << "uint32_t seed = 2463534242UL; // Seed for random number generation\n";
+        out << "static uint32_t seed = 2463534242UL; // Seed for random number generation\n";
         out << "static inline uint32_t rd() {\n";
         out << "    seed ^= seed << 13;\n";
         out << "    seed ^= seed >> 17;\n";
         out << "    seed ^= seed << 5;\n";
         out << "    return seed;\n}\n\n";
         // Embedded instruction implementation functions - modified for the new stack architecture
-        out << "static inline void do_add() {\n"
+        out << "static inline uint32_t* do_add(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH(a + b);\n}\n\n";
+               "    PUSH(a + b);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_sub() {\n"
+        out << "static inline uint32_t* do_sub(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH(b - a);\n}\n\n";
+               "    PUSH(b - a);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_mul() {\n"
+        out << "static inline uint32_t* do_mul(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH(a * b);\n}\n\n";
+               "    PUSH(a * b);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_div() {\n"
+        out << "static inline uint32_t* do_div(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); exit(1); }\n"
-               "    PUSH(b / a);\n}\n\n";
+               "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); FVM_EXIT(1); }\n"
+               "    PUSH(b / a);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_mod() {\n"
+        out << "static inline uint32_t* do_mod(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); exit(1); }\n"
-               "    PUSH(b % a);\n}\n\n";
+               "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); FVM_EXIT(1); }\n"
+               "    PUSH(b % a);\n    return sp;\n}\n\n";
 
-        out << "static inline void do_shl() {\n"
+        out << "static inline uint32_t* do_shl(uint32_t* sp) {\n"
                "    uint32_t shift = POP();\n"
                "    uint32_t value = POP();\n"
-               "    PUSH(value << shift);\n}\n\n";
+               "    PUSH(value << (shift & 31));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_shr() {\n"
+        out << "static inline uint32_t* do_shr(uint32_t* sp) {\n"
                "    uint32_t shift = POP();\n"
                "    uint32_t value = POP();\n"
-               "    PUSH(value >> shift);\n}\n\n";
+               "    PUSH(value >> (shift & 31));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_fp_add() {\n"
+        out << "static inline uint32_t* do_fp_add(uint32_t* sp) {\n"
                "    float a = to_float(POP());\n"
                "    float b = to_float(POP());\n"
-               "    PUSH(from_float(a + b));\n}\n\n";
+               "    PUSH(from_float(a + b));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_fp_sub() {\n"
+        out << "static inline uint32_t* do_fp_sub(uint32_t* sp) {\n"
                "    float a = to_float(POP());\n"
                "    float b = to_float(POP());\n"
-               "    PUSH(from_float(b - a));\n}\n\n";
+               "    PUSH(from_float(b - a));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_fp_mul() {\n"
+        out << "static inline uint32_t* do_fp_mul(uint32_t* sp) {\n"
                "    float a = to_float(POP());\n"
                "    float b = to_float(POP());\n"
-               "    PUSH(from_float(a * b));\n}\n\n";
+               "    PUSH(from_float(a * b));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_fp_div() {\n"
+        out << "static inline uint32_t* do_fp_div(uint32_t* sp) {\n"
                "    float a = to_float(POP());\n"
                "    float b = to_float(POP());\n"
-               "    if(a == 0.0f) { fprintf(stderr, \"Error: Division by zero\\n\"); exit(1); }\n"
-               "    PUSH(from_float(b / a));\n}\n\n";
-        
-        out << "static inline void do_end() {\n"
-               "    // Reset all stacks\n"
-               "    for (int i = 0; i < MAX_STACKS; i++) {\n"
-               "        stack_tops[i] = -1;\n"
-               "    }\n"
-               "    current_stack = 0;\n"
-               "    memset(buffer, 0, BUFFER_SIZE);\n"
-               "}\n\n";
+               "    if(a == 0.0f) { fprintf(stderr, \"Error: Division by zero\\n\"); FVM_EXIT(1); }\n"
+               "    PUSH(from_float(b / a));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_lod(uint32_t offset) {\n"
+        out << "static inline uint32_t* do_lod(uint32_t* sp, uint32_t offset) {\n"
                "    uint32_t value;\n"
                "    memcpy(&value, buffer + offset, sizeof(uint32_t));\n"
-               "    PUSH(value);\n}\n\n";
+               "    PUSH(value);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_sto(uint32_t offset) {\n"
+        out << "static inline uint32_t* do_sto(uint32_t* sp, uint32_t offset) {\n"
                "    uint32_t value = POP();\n"
-               "    memcpy(buffer + offset, &value, sizeof(uint32_t));\n}\n\n";
+               "    memcpy(buffer + offset, &value, sizeof(uint32_t));\n    return sp;\n}\n\n";
         
-        out << "static inline void do_immi(uint32_t value) {\n"
-               "    PUSH(value);\n}\n\n";
+        out << "static inline uint32_t* do_immi(uint32_t* sp, uint32_t value) {\n"
+               "    PUSH(value);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_inc() {\n"
+        out << "static inline uint32_t* do_inc(uint32_t* sp) {\n"
                "    uint32_t value = POP();\n"
-               "    PUSH(value + 1);\n}\n\n";
+               "    PUSH(value + 1);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_dec() {\n"
+        out << "static inline uint32_t* do_dec(uint32_t* sp) {\n"
                "    uint32_t value = POP();\n"
-               "    PUSH(value - 1);\n}\n\n";
+               "    PUSH(value - 1);\n    return sp;\n}\n\n";
         
         out << "static inline void do_sto_immi(uint32_t offset, uint32_t number) {\n"
                "    memcpy(buffer + offset, &number, sizeof(uint32_t));\n}\n\n";
@@ -279,42 +773,40 @@ public:
         out << "static inline void do_memset(uint32_t dest, uint32_t val, uint32_t len) {\n"
                "    memset(buffer + dest, val, len);\n}\n\n";
         
-        out << "static inline void do_gt() {\n"
+        out << "static inline uint32_t* do_gt(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH((b > a) ? 1 : 0);\n}\n\n";
+               "    PUSH((b > a) ? 1 : 0);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_lt() {\n"
+        out << "static inline uint32_t* do_lt(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH((b < a) ? 1 : 0);\n}\n\n";
+               "    PUSH((b < a) ? 1 : 0);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_eq() {\n"
+        out << "static inline uint32_t* do_eq(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH((b == a) ? 1 : 0);\n}\n\n";
+               "    PUSH((b == a) ? 1 : 0);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_gt_eq() {\n"
+        out << "static inline uint32_t* do_gt_eq(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH((b >= a) ? 1 : 0);\n}\n\n";
+               "    PUSH((b >= a) ? 1 : 0);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_lt_eq() {\n"
+        out << "static inline uint32_t* do_lt_eq(uint32_t* sp) {\n"
                "    uint32_t a = POP();\n"
                "    uint32_t b = POP();\n"
-               "    PUSH((b <= a) ? 1 : 0);\n}\n\n";
+               "    PUSH((b <= a) ? 1 : 0);\n    return sp;\n}\n\n";
         
-        out << "static inline void do_dup() {\n"
-               "    if (STACK_TOP >= 0) {\n"
-               "        uint32_t value = TOP();\n"
-               "        PUSH(value);\n"
-               "    } else { fprintf(stderr, \"Stack is empty.\\n\"); }\n"
-               "}\n\n";
-        out << "static inline void do_print() {\n"
-               "    if (STACK_TOP >= 0) {\n"
-               "        printf(\"%u\\n\", TOP());\n"
-               "    } else { fprintf(stderr, \"Stack is empty.\\n\"); }\n"
-               "}\n\n";
+        out << "static inline uint32_t* do_dup(uint32_t* sp) {\n"
+               "    uint32_t value = TOP();\n"
+               "    PUSH(value);\n"
+               "    return sp;\n}\n\n";
+        // Printed as the in-process engines print through std::cout, so the
+        // output does not change when the tiered engine switches over.
+        out << "static inline uint32_t* do_print(uint32_t* sp) {\n"
+               "    printf(\"%d\\n\", (int32_t)TOP());\n"
+               "    return sp;\n}\n\n";
         
         out << "static inline void do_read_int(uint32_t offset) {\n"
                "    uint32_t val;\n"
@@ -322,12 +814,10 @@ public:
                "    memcpy(buffer + offset, &val, sizeof(uint32_t));\n"
                "}\n\n";
         
-        out << "static inline void do_fp_print() {\n"
-               "    if (STACK_TOP >= 0) {\n"
-               "        float f = to_float(TOP());\n"
-               "        printf(\"%f\\n\", f);\n"
-               "    } else { fprintf(stderr, \"Stack is empty.\\n\"); }\n"
-               "}\n\n";
+        out << "static inline uint32_t* do_fp_print(uint32_t* sp) {\n"
+               "    float f = to_float(TOP());\n"
+               "    printf(\"%g\\n\", f);\n"
+               "    return sp;\n}\n\n";
         
         out << "static inline void do_fp_read(uint32_t offset) {\n"
                "    float val;\n"
@@ -336,86 +826,88 @@ public:
                "    memcpy(buffer + offset, &ival, sizeof(uint32_t));\n"
                "}\n\n";
         
-        // Updated do_call to handle parameter passing and multiple stacks
-        out << "static inline void do_call(uint32_t target, uint32_t num_params) {\n"
-               "    // Save current stack context\n"
-               "    stack_contexts[call_top].stack_index = current_stack;\n"
-               "    stack_contexts[call_top].return_ip = ip;\n"
-               "\n"
-               "    // Create a new stack for the function\n"
+        // do_call moves the parameters, in order, onto a fresh stack for the
+        // callee, records where the caller's stack stops, and returns the
+        // callee's sp
+        out << "static inline uint32_t* do_call(uint32_t* sp, uint32_t num_params, int return_ip) {\n"
                "    int new_stack = current_stack + 1;\n"
                "    if (new_stack >= MAX_STACKS) {\n"
                "        fprintf(stderr, \"Error: Stack overflow, too many nested function calls\\n\");\n"
-               "        exit(1);\n"
-               "    }\n"
-               "    \n"
-               "    // Transfer parameters from current stack to new stack\n"
-               "    // Parameters are in reverse order on the caller's stack\n"
-               "    for (uint32_t i = 0; i < num_params; i++) {\n"
-               "        if (stack_tops[current_stack] < 0) {\n"
-               "            fprintf(stderr, \"Error: Stack underflow during parameter passing\\n\");\n"
-               "            exit(1);\n"
-               "        }\n"
-               "        // Pop from current stack\n"
-               "        uint32_t param = stacks[current_stack][stack_tops[current_stack]--];\n"
-               "        \n"
-               "        // Push onto new stack (in reverse order to maintain original order)\n"
-               "        stacks[new_stack][i] = param;\n"
+               "        FVM_EXIT(1);\n"
                "    }\n"
-               "    \n"
-               "    // Set top index for new stack\n"
-               "    stack_tops[new_stack] = num_params - 1;\n"
-               "    \n"
-               "    // Switch to the new stack\n"
+               "    sp -= num_params;\n"
+               "    stack_tops[current_stack] = (int)(sp - stacks[current_stack]) - 1;\n"
+               "    memcpy(stacks[new_stack], sp, num_params * sizeof(uint32_t));\n"
+               "\n"
+               "    // Save the caller's stack and the call site\n"
+               "    call_top++;\n"
+               "    stack_contexts[call_top].stack_index = current_stack;\n"
+               "    stack_contexts[call_top].return_ip = return_ip;\n"
                "    current_stack = new_stack;\n"
-               "    \n"
-               "    // Save the call stack\n"
-               "    callStack[++call_top] = ip;\n"
+               "    return stacks[new_stack] + num_params;\n"
                "}\n\n";
         
-        // Updated do_ret to restore previous stack
-        out << "static inline int do_ret() {\n"
-               "    if (call_top >= 0) {\n"
-            //    "        // Get the return value (if any) from current stack\n"
-            //    "        uint32_t return_value = 0;\n"
-            //    "        if (stack_tops[current_stack] >= 0) {\n"
-            //    "            return_value = stacks[current_stack][stack_tops[current_stack]];\n"
-            //    "        }\n"
-            //    "        \n"
-               "        // Restore previous stack\n"
-               "        current_stack = stack_contexts[call_top].stack_index;\n"
-               "        \n"
-            //    "        // Push return value onto restored stack if there was one\n"
-            //    "        if (stack_tops[current_stack] < STACK_SIZE - 1) {\n"
-            //    "            stacks[current_stack][++stack_tops[current_stack]] = return_value;\n"
-            //    "        }\n"
-            //    "        \n"
-               "        return callStack[call_top--];\n"
-               "    } else {\n"
-               "        exit(0);\n"
+        // do_tail_call keeps the current stack for the callee, with only the parameters on it
+        out << "static inline uint32_t* do_tail_call(uint32_t* sp, uint32_t num_params) {\n"
+               "    memmove(stacks[current_stack], sp - num_params, num_params * sizeof(uint32_t));\n"
+               "    return stacks[current_stack] + num_params;\n"
+               "}\n\n";
+        
+        // do_ret restores the caller's stack and hands it the callee's top
+        // value, if any; it returns the caller's sp and sets *ip to the call site
+        out << "static inline uint32_t* do_ret(uint32_t* sp, int32_t* ip) {\n"
+               "    if (call_top < 0) {\n"
+               "        FVM_EXIT(0);\n"
+               "    }\n"
+               "    int has_value = sp != stacks[current_stack];\n"
+               "    uint32_t return_value = has_value ? TOP() : 0;\n"
+               "    current_stack = stack_contexts[call_top].stack_index;\n"
+               "    sp = stacks[current_stack] + stack_tops[current_stack] + 1;\n"
+               "    if (has_value) {\n"
+               "        PUSH(return_value);\n"
                "    }\n"
-               "    return -1;\n"
+               "    *ip = stack_contexts[call_top--].return_ip;\n"
+               "    return sp;\n"
                "}\n\n";
         
         out << "static inline void do_tik() { printf(\"tik\\n\"); }\n\n";
         
-        out << "static inline void do_seek(uint32_t value) {\n"
-               "    debug_num = value;\n"
-               "}\n\n";
+        out << "static inline uint32_t* do_seek(uint32_t* sp) {\n"
+               "    debug_num = TOP();\n"
+               "    return sp;\n}\n\n";
         
-        out << "static inline void do_rnd() {\n"
+        out << "static inline uint32_t* do_rnd(uint32_t* sp) {\n"
                "    uint32_t max = POP();\n"
                "    if (max == 0) {\n"
                "        PUSH(0);\n"
-               "        return;\n"
+               "        return sp;\n"
                "    }\n"
                "    PUSH(rd() % max);\n"
-               "}\n\n";
+               "    return sp;\n}\n\n";
         
+        if (!resumable) {
+            out << FVM_CONTEXT_C;
+        } else {
+            out << "struct fvm_resume_state {\n"
+                   "    char* buffer;\n"
+                   "    uint32_t ip;                  // Label to resume at\n"
+                   "    uint32_t debug_num;\n"
+                   "    uint32_t seed;\n"
+                   "    uint32_t frames;              // Call depth + 1\n"
+                   "    const uint32_t* sizes;        // Values in each frame, outermost first\n"
+                   "    const uint32_t* values;       // The frames' values back to back\n"
+                   "    const uint32_t* return_ips;   // Label of each active call's DT_CALL\n"
+                   "};\n\n";
+        }
+
         // Generate main function with separate label and immediate arrays
-        out << "int main() {\n";
-        out << "    // Initialize random number generator\n";
-        out << "    srand((unsigned int)time(NULL));\n\n";
+        if (resumable) {
+            // Kept apart from the setjmp in fvm_resume, which would keep
+            // the compiler from holding this function's locals in registers.
+            out << "static __attribute__((noinline)) int fvm_enter(struct fvm_resume_state* s) {\n";
+        } else {
+            out << "static __attribute__((noinline)) int fvm_start(void) {\n";
+        }
         
         // Generate the labels array for each opcode
         out << "    // Label pointer array for computed goto\n";
@@ -428,324 +920,224 @@ public:
         }
         out << "    };\n\n";
         
-        // Generate the immediate values array
-        if (!immediateValues.empty()) {
-            out << "    // Immediate values array\n";
-            out << "    uint32_t immediates[] = {\n";
-            for (size_t i = 0; i < immediateValues.size(); i++) {
-                out << "        " << immediateValues[i];
-                if (i < immediateValues.size() - 1) 
-                    out << ",";
-                out << "\n";
-            }
-            out << "    };\n\n";
+        if (resumable) {
+            // Rebuild the interpreter's frames as one stack per call.
+            out << "\n    buffer = s->buffer;\n"
+                   "    debug_num = s->debug_num;\n"
+                   "    seed = s->seed;\n"
+                   "    const uint32_t* value = s->values;\n"
+                   "    for (uint32_t f = 0; f < s->frames; f++) {\n"
+                   "        memcpy(stacks[f], value, s->sizes[f] * sizeof(uint32_t));\n"
+                   "        value += s->sizes[f];\n"
+                   "        stack_tops[f] = (int)s->sizes[f] - 1;\n"
+                   "        if (f + 1 < s->frames) {\n"
+                   "            stack_contexts[f].stack_index = f;\n"
+                   "            stack_contexts[f].return_ip = s->return_ips[f];\n"
+                   "        }\n"
+                   "    }\n"
+                   "    current_stack = s->frames - 1;\n"
+                   "    call_top = current_stack - 1;\n"
+                   "\n    // Resume execution\n"
+                   "    int32_t ip = s->ip;\n"
+                   "    uint32_t* sp = stacks[current_stack] + stack_tops[current_stack] + 1;\n";
+            out << "    goto *labels[ip];\n\n";
+        } else {
+            out << "\n    // Start execution\n"
+                   "    int32_t ip = -1;\n"
+                   "    uint32_t* sp = stacks[0];\n\n";
         }
         
-        // Generate the opToImmIndices array
-        out << "    // Each instruction's immediate value starting index\n";
-        out << "    int opToImmIndices[] = {\n";
-        for (size_t i = 0; i < opToImmIndices.size(); i++) {
-            out << "        " << opToImmIndices[i];
-            if (i < opToImmIndices.size() - 1) 
-                out << ",";
-            out << " // L" << i;
-            if (operandCount(opcodes[i]) == 0) {
-                out << " - " << opcodes[i] << " (no immediates)";
-            } else {
-                out << " = " << opToImmIndices[i];
-            }
-            out << "\n";
-        }
-        out << "    };\n\n";
-        
-        // 输出原始操作码地址到新标签索引的映射数组
-        out << "    // Mapping array: original opcode addresses\n";
-        out << "    int mapping_size = " << opcodes.size() << ";\n";
-        out << "    uint32_t orig_addresses[] = {\n";
-        for (size_t i = 0; i < opcode_orig_indices.size(); i++) {
-            out << "        " << opcode_orig_indices[i];
-            if (i < opcode_orig_indices.size() - 1)
-                out << ",";
-            out << "\n";
-        }
-        out << "    };\n\n";
-        
-        // Initialize instruction and immediate value indices
-        if (!immediateValues.empty()) {
-            out << "    int imm_index = -1; // Immediate value index\n";
-        }
-        out << "\n    // Start execution\n    NEXT;\n\n";
-        
+
         // Generate label handlers for each opcode
         for (size_t i = 0; i < opcodes.size(); i++) {
             out << "L" << i << ": // Opcode " << opcodes[i] << "\n";
             
             switch (opcodes[i]) {
                 case DT_ADD:
-                    out << "    do_add();\n";
+                    out << "    sp = do_add(sp);\n";
                     break;
                 case DT_SUB:
-                    out << "    do_sub();\n";
+                    out << "    sp = do_sub(sp);\n";
                     break;
                 case DT_MUL:
-                    out << "    do_mul();\n";
+                    out << "    sp = do_mul(sp);\n";
                     break;
                 case DT_DIV:
-                    out << "    do_div();\n";
+                    out << "    sp = do_div(sp);\n";
                     break;
                 case DT_MOD:
-                    out << "    do_mod();\n";
+                    out << "    sp = do_mod(sp);\n";
                     break;
                 case DT_SHL:
-                    out << "    do_shl();\n";
+                    out << "    sp = do_shl(sp);\n";
                     break;
                 case DT_SHR:
-                    out << "    do_shr();\n";
+                    out << "    sp = do_shr(sp);\n";
                     break;
                 case DT_FP_ADD:
-                    out << "    do_fp_add();\n";
+                    out << "    sp = do_fp_add(sp);\n";
                     break;
                 case DT_FP_SUB:
-                    out << "    do_fp_sub();\n";
+                    out << "    sp = do_fp_sub(sp);\n";
                     break;
                 case DT_FP_MUL:
-                    out << "    do_fp_mul();\n";
+                    out << "    sp = do_fp_mul(sp);\n";
                     break;
                 case DT_FP_DIV:
-                    out << "    do_fp_div();\n";
+                    out << "    sp = do_fp_div(sp);\n";
                     break;
                 case DT_INC:
-                    out << "    do_inc();\n";
+                    out << "    sp = do_inc(sp);\n";
                     break;
                 case DT_DUP:
-                    out << "    do_dup();\n";
+                    out << "    sp = do_dup(sp);\n";
                     break;
                 case DT_DEC:
-                    out << "    do_dec();\n";
+                    out << "    sp = do_dec(sp);\n";
                     break;
                 case DT_LOD:
-                    out << "    imm_index++;\n";
-                    out << "    do_lod(immediates[imm_index]);\n";
+                    out << "    sp = do_lod(sp, " << imm(i, 0) << ");\n";
                     break;
                 case DT_STO:
-                    out << "    imm_index++;\n";
-                    out << "    do_sto(immediates[imm_index]);\n";
+                    out << "    sp = do_sto(sp, " << imm(i, 0) << ");\n";
                     break;
                 case DT_IMMI:
-                    out << "    imm_index++;\n";
-                    out << "    do_immi(immediates[imm_index]);\n";
+                    out << "    sp = do_immi(sp, " << imm(i, 0) << ");\n";
                     break;
                 case DT_STO_IMMI:
-                    out << "    imm_index++;\n";
-                    out << "    do_sto_immi(immediates[imm_index], immediates[imm_index+1]);\n";
-                    out << "    imm_index++;\n";
+                    out << "    do_sto_immi(" << imm(i, 0) << ", " << imm(i, 1) << ");\n";
                     break;
                 case DT_MEMCPY:
-                    out << "    imm_index++;\n";
-                    out << "    uint32_t dest = immediates[imm_index];\n";
-                    out << "    imm_index++;\n";
-                    out << "    uint32_t src = immediates[imm_index];\n";
-                    out << "    imm_index++;\n";
-                    out << "    uint32_t len = immediates[imm_index];\n";
-                    out << "    do_memcpy(dest, src, len);\n";
-                    break;
                 case DT_MEMSET:
-                    out << "    imm_index++;\n";
-                    out << "    uint32_t dest_addr = immediates[imm_index];\n";
-                    out << "    imm_index++;\n";
-                    out << "    uint32_t value = immediates[imm_index];\n";
-                    out << "    imm_index++;\n";
-                    out << "    uint32_t length = immediates[imm_index];\n";
-                    out << "    do_memset(dest_addr, value, length);\n";
+                    out << copyOrFill(opcodes[i], imm(i, 0), instructions[opcode_orig_indices[i] + 2],
+                                      instructions[opcode_orig_indices[i] + 3]);
                     break;
                 case DT_GT:
-                    out << "    do_gt();\n";
+                    out << "    sp = do_gt(sp);\n";
                     break;
                 case DT_LT:
-                    out << "    do_lt();\n";
+                    out << "    sp = do_lt(sp);\n";
                     break;
                 case DT_EQ:
-                    out << "    do_eq();\n";
+                    out << "    sp = do_eq(sp);\n";
                     break;
                 case DT_GT_EQ:
-                    out << "    do_gt_eq();\n";
+                    out << "    sp = do_gt_eq(sp);\n";
                     break;
                 case DT_LT_EQ:
-                    out << "    do_lt_eq();\n";
+                    out << "    sp = do_lt_eq(sp);\n";
                     break;
                 case DT_PRINT:
-                    out << "    do_print();\n";
+                    out << "    sp = do_print(sp);\n";
                     break;
                 case DT_READ_INT:
-                    out << "    imm_index++;\n";
-                    out << "    do_read_int(immediates[imm_index]);\n";
+                    out << "    do_read_int(" << imm(i, 0) << ");\n";
                     break;
                 case DT_FP_PRINT:
-                    out << "    do_fp_print();\n";
+                    out << "    sp = do_fp_print(sp);\n";
                     break;
                 case DT_FP_READ:
-                    out << "    imm_index++;\n";
-                    out << "    do_fp_read(immediates[imm_index]);\n";
+                    out << "    do_fp_read(" << imm(i, 0) << ");\n";
                     break;
                 case DT_Tik:
                     out << "    do_tik();\n";
                     break;
                 case DT_RND:
-                    out << "    do_rnd();\n";
+                    out << "    sp = do_rnd(sp);\n";
                     break;
                 case DT_SEEK:
-                    out << "    imm_index++;\n";
-                    out << "    do_seek(immediates[imm_index]);\n";
+                    out << "    sp = do_seek(sp);\n";
                     break;
                 case DT_JMP:
-                    out << "    {\n";
-                    out << "        imm_index++;\n";
-                    out << "        int jump_offset = immediates[imm_index];\n";
-                    out << "        int target_inst = ip + jump_offset;\n";
-                    out << "        if (target_inst >= 0 && target_inst < " << opcodes.size() << ") {\n";
-                    out << "            ip = target_inst;\n";
-                    out << "            imm_index = opToImmIndices[target_inst] - 1;\n";
-                    out << "            goto *labels[ip];\n";
-                    out << "        } else {\n";
-                    out << "            fprintf(stderr, \"Error: Invalid jump target\\n\");\n";
-                    out << "            exit(1);\n";
-                    out << "        }\n";
-                    out << "    }\n";
+                    out << jumpTo(branchTarget(i, 0), 4);
                     break;
                 case DT_JZ:
-                    out << "    {\n";
-                    out << "        imm_index++;\n";
-                    out << "        int jump_offset = immediates[imm_index];\n";
-                    out << "        int target_inst = ip + jump_offset;\n";
-                    out << "        if (POP() == 0) {\n";
-                    out << "            if (target_inst >= 0 && target_inst < " << opcodes.size() << ") {\n";
-                    out << "                ip = target_inst;\n";
-                    out << "                imm_index = opToImmIndices[target_inst] - 1;\n";
-                    out << "                goto *labels[ip];\n";
-                    out << "            } else {\n";
-                    out << "                fprintf(stderr, \"Error: Invalid jump target\\n\");\n";
-                    out << "                exit(1);\n";
-                    out << "            }\n";
-                    out << "        }\n";
-                    out << "        NEXT;\n";
+                    out << "    if (POP() == 0) {\n";
+                    out << jumpTo(branchTarget(i, 0), 8);
                     out << "    }\n";
                     break;
                 case DT_JUMP_IF:
-                    out << "    {\n";
-                    out << "        imm_index++;\n";
-                    out << "        int jump_offset = immediates[imm_index];\n";
-                    out << "        if (POP() != 0) {\n";
-                    out << "            int current_inst = ip;\n";
-                    out << "            int target_inst = current_inst + jump_offset;\n";
-                    out << "            if (target_inst >= 0 && target_inst < " << opcodes.size() << ") {\n";
-                    out << "                ip = target_inst;\n";
-                    out << "                imm_index = opToImmIndices[target_inst] - 1;\n";
-                    out << "                goto *labels[ip];\n";
-                    out << "            } else {\n";
-                    out << "                fprintf(stderr, \"Error: Invalid jump target\\n\");\n";
-                    out << "                exit(1);\n";
-                    out << "            }\n";
-                    out << "        }\n";
-                    out << "        NEXT;\n";
+                    out << "    if (POP() != 0) {\n";
+                    out << jumpTo(branchTarget(i, 0), 8);
                     out << "    }\n";
                     break;
                 case DT_IF_ELSE:
-                    out << "    {\n";
-                    out << "        imm_index++;\n";
-                    out << "        int true_offset = immediates[imm_index];\n";
-                    out << "        imm_index++;\n";
-                    out << "        int false_offset = immediates[imm_index];\n";
-                    out << "        int current_inst = ip;\n";
-                    out << "        int target_inst;\n";
-                    out << "        if (POP() != 0) {\n";
-                    out << "            target_inst = current_inst + true_offset;\n";
-                    out << "        } else {\n";
-                    out << "            target_inst = current_inst + false_offset;\n";
-                    out << "        }\n";
-                    out << "        if (target_inst >= 0 && target_inst < " << opcodes.size() << ") {\n";
-                    out << "            ip = target_inst;\n";
-                    out << "            imm_index = opToImmIndices[target_inst] - 1;\n";
-                    out << "            goto *labels[ip];\n";
-                    out << "        } else {\n";
-                    out << "            fprintf(stderr, \"Error: Invalid jump target\\n\");\n";
-                    out << "            exit(1);\n";
-                    out << "        }\n";
+                    out << "    if (POP() != 0) {\n";
+                    out << jumpTo(branchTarget(i, 0), 8);
                     out << "    }\n";
+                    out << jumpTo(branchTarget(i, 1), 4);
                     break;
-                // Updated CALL implementation with two parameters and address mapping
-                case DT_CALL:
-                    out << "    {\n";
-                    out << "        imm_index++;\n";
-                    out << "        uint32_t target_addr = immediates[imm_index];\n";  // 原始目标地址
-                    out << "        imm_index++;\n";
-                    out << "        uint32_t num_params = immediates[imm_index];\n";
-                    out << "        // 调用函数时传递参数\n";
-                    out << "        do_call(target_addr, num_params);\n";
-                    out << "        uint32_t new_target = (uint32_t)(-1);\n";
-                    out << "        for (int j = 0; j < mapping_size; j++) {\n";
-                    out << "            if (orig_addresses[j] == target_addr) {\n";
-                    out << "                new_target = j;\n";
-                    out << "                break;\n";
-                    out << "            }\n";
-                    out << "        }\n";
-                    out << "        if (new_target != (uint32_t)(-1)) {\n";
-                    out << "            ip = new_target;\n";
-                    out << "            imm_index = opToImmIndices[new_target] - 1;\n";
-                    out << "            goto *labels[ip];\n";
-                    out << "        } else {\n";
-                    out << "            fprintf(stderr, \"Error: Invalid call target address: %u\\n\", target_addr);\n";
-                    out << "            exit(1);\n";
-                    out << "        }\n";
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    out << "    if (TOP() " << (opcodes[i] == DT_GUARD_GT ? ">" : "==") << " " << imm(i, 0) << ") {\n";
+                    out << jumpTo(branchTarget(i, 1), 8);
                     out << "    }\n";
+                    out << jumpTo(branchTarget(i, 2), 4);
+                    break;
+                // DT_CALL_INC pushes top + 1 as the last parameter, then calls as DT_CALL does
+                case DT_CALL_INC:
+                    out << "    sp = do_dup(sp);\n";
+                    out << "    sp = do_inc(sp);\n";
+                    [[fallthrough]];
+                // The callee's label is resolved here, so the call is a direct goto
+                case DT_CALL:
+                case DT_TAILCALL: {
+                    uint32_t num_params = instructions[opcode_orig_indices[i] + 2];
+                    if (opcodes[i] == DT_TAILCALL) {
+                        out << "    sp = do_tail_call(sp, " << num_params << ");\n";
+                    } else {
+                        out << "    sp = do_call(sp, " << num_params << ", " << i << ");\n";
+                    }
+                    out << jumpTo(callTarget(i), 4);
                     break;
+                }
+                // The return address is the label of a DT_CALL this code
+                // saved, so it needs no check; NEXT goes on after that call.
                 case DT_RET:
-                    out << "    {\n";
-                    out << "        int return_ip = do_ret();\n";
-                    out << "        if (return_ip >= 0 && return_ip < " << opcodes.size() << ") {\n";
-                    out << "            ip = return_ip;\n";
-                    out << "            imm_index = opToImmIndices[ip] - 1;\n";
-                    out << "            NEXT;\n";
-                    out << "        } else {\n";
-                    out << "            fprintf(stderr, \"Error: Invalid return address\\n\");\n";
-                    out << "            exit(1);\n";
-                    out << "        }\n";
-                    out << "    }\n";
+                    out << "    sp = do_ret(sp, &ip);\n";
+                    out << "    NEXT;\n";
                     break;
                 case DT_END:
-                    out << "    do_end();\n";
                     out << "    return 0;\n";
                     break;
                 default:
                     out << "    fprintf(stderr, \"Unknown opcode encountered: " << opcodes[i] << "\\n\");\n";
-                    out << "    exit(1);\n";
+                    out << "    FVM_EXIT(1);\n";
                     break;
             }
-            
-            if (opcodes[i] != DT_END && 
-                opcodes[i] != DT_JMP && 
-                opcodes[i] != DT_JZ && 
-                opcodes[i] != DT_JUMP_IF && 
-                opcodes[i] != DT_IF_ELSE &&
-                opcodes[i] != DT_CALL) {
-                out << "    NEXT;\n";
-            }
-            
+            // Every other instruction falls through to the next label.
             out << "\n";
         }
         
         out << "    return 0;\n}\n";
-        out.close();
-        
-        std::cout << "C file generated successfully: " << output_filename << std::endl;
-        std::string clang_command = "clang -o " + filename + "_compiled_dt" + " " + output_filename;
-        std::cout << "Compiling generated C file with clang: " << clang_command << std::endl;
-        system(clang_command.c_str());
-        std::string exec_command = filename + "_compiled_dt";
-        std::cout << "Executing compiled binary: " << exec_command << std::endl;
-        if (benchmarkMode) {
-            std::cout << "Benchmark mode enabled." << std::endl;
+        if (!resumable) {
+            out << "\nint fvm_run(struct fvm_ctx* ctx) {\n"
+                   "    buffer = ctx->buffer;\n"
+                   "    debug_num = ctx->debug_num;\n"
+                   "    seed = ctx->seed;\n"
+                   "    current_stack = 0;\n"
+                   "    call_top = -1;\n"
+                   "    int status = setjmp(fvm_exit);\n"
+                   "    if (status == 0) {\n"
+                   "        status = fvm_start() + 1;\n"
+                   "    }\n"
+                   "    fflush(stdout);\n"
+                   "    ctx->debug_num = debug_num;\n"
+                   "    ctx->seed = seed;\n"
+                   "    return status - 1;\n"
+                   "}\n";
+        } else {
+            out << "\nint fvm_resume(struct fvm_resume_state* s) {\n"
+                   "    int status = setjmp(fvm_exit);\n"
+                   "    if (status == 0) {\n"
+                   "        status = fvm_enter(s) + 1;\n"
+                   "    }\n"
+                   "    s->debug_num = debug_num;\n"
+                   "    return status - 1;\n"
+                   "}\n";
         }
-        system(exec_command.c_str());
+        out.close();
+        return static_cast<bool>(out);
     }
 };
 
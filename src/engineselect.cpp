@@ -0,0 +1,206 @@
+#ifndef ENGINESELECT_H
+#define ENGINESELECT_H
+
+// Run-time engine selection for the multi-engine binary thd_vm: every engine
+// is linked in behind Interface and picked by name, or by `auto`, which looks
+// at the program and times the in-process engines on a short calibration
+// kernel shaped like it.
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "symbol.hpp"
+#include "interface.hpp"
+#include "directthreading.cpp"
+#include "indirectthreading.cpp"
+#include "routinethreading.cpp"
+#include "contextthreading.cpp"
+#include "swthreading.cpp"
+#include "replthreading.cpp"
+#include "regthreading.cpp"
+#include "jitthreading.cpp"
+#include "tailthreading.cpp"
+#include "tierthreading.cpp"
+#include "aotthreading.cpp"
+#ifdef HAVE_STENCILS
+#include "stencilthreading.cpp"
+#endif
+
+struct EngineEntry {
+    const char* name;
+    std::unique_ptr<Interface> (*make)();
+    // Nanoseconds for one complete in-process run of `code`, or nullptr for
+    // engines that run a C compiler (routine, tier, aot) and cannot be calibrated
+    // on a short kernel.
+    uint64_t (*time_run)(const std::vector<uint32_t>& code);
+};
+
+template <typename VM>
+static std::unique_ptr<Interface> makeEngine() {
+    return std::make_unique<VM>();
+}
+
+template <typename VM>
+static uint64_t timeRun(const std::vector<uint32_t>& code) {
+    VM vm;
+    std::vector<uint32_t> copy = code;
+    auto start = std::chrono::steady_clock::now();
+    vm.run_vm(copy);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+static const EngineEntry engines[] = {
+    {"direct",   makeEngine<DirectThreadingVM>,   timeRun<DirectThreadingVM>},
+    {"indirect", makeEngine<IndirectThreadingVM>, timeRun<IndirectThreadingVM>},
+    {"routine",  makeEngine<RoutineThreadingVM>,  nullptr},
+#if defined(__x86_64__) && !defined(_WIN32)
+    {"context",  makeEngine<ContextThreadingVM>,  timeRun<ContextThreadingVM>},
+#endif
+    {"sw",       makeEngine<SwThreadingVM>,       timeRun<SwThreadingVM>},
+    {"repl",     makeEngine<ReplThreadingModel>,  timeRun<ReplThreadingModel>},
+    {"reg",      makeEngine<RegThreadingVM>,      timeRun<RegThreadingVM>},
+#if defined(__x86_64__) && !defined(_WIN32)
+    {"jit",      makeEngine<JitThreadingVM>,      timeRun<JitThreadingVM>},
+#endif
+    {"tail",     makeEngine<TailThreadingVM>,     timeRun<TailThreadingVM>},
+    {"tier",     makeEngine<TierThreadingVM>,     nullptr},
+    {"aot",      makeEngine<AotThreadingVM>,      nullptr},
+#ifdef HAVE_STENCILS
+    {"stencil",  makeEngine<StencilThreadingVM>,  timeRun<StencilThreadingVM>},
+#endif
+};
+
+// Engine for programs that cannot loop: it has the cheapest load, and with
+// the stencils built it inlines straight-line runs as well.
+static constexpr const char* STRAIGHT_LINE_ENGINE = "indirect";
+
+static const EngineEntry* findEngine(const std::string& name) {
+    for (const EngineEntry& e : engines) {
+        if (name == e.name) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+static std::string engineNames() {
+    std::string names;
+    for (const EngineEntry& e : engines) {
+        names += names.empty() ? "" : ", ";
+        names += e.name;
+    }
+    return names;
+}
+
+// What `auto` needs to know about a program before it is verified: whether it
+// can run longer than its own length (a backward branch or a call), and
+// whether its time is likely to go into calls.
+struct ProgramShape {
+    size_t words = 0;
+    bool loops = false;
+    bool calls = false;
+};
+
+static ProgramShape programShape(const std::vector<uint32_t>& code) {
+    ProgramShape shape;
+    shape.words = code.size();
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        uint32_t op = code[pc];
+        if (op >= DT_NUM_INSTRUCTIONS) {
+            break; // The verifier reports it when the program is run
+        }
+        uint32_t operands = instructionInfo[op].operands;
+        switch (op) {
+            case DT_CALL:
+            case DT_CALL_INC:
+            case DT_TAILCALL:
+                shape.calls = true;
+                break;
+            case DT_JMP:
+            case DT_JZ:
+            case DT_JUMP_IF:
+            case DT_IF_ELSE:
+            case DT_GUARD_GT:
+            case DT_GUARD_EQ:
+                // Branch offsets are the trailing operands; a negative one
+                // can reach back.
+                for (uint32_t k = (op == DT_GUARD_GT || op == DT_GUARD_EQ) ? 2 : 1; k <= operands; k++) {
+                    if (pc + k < code.size() && static_cast<int32_t>(code[pc + k]) < 0) {
+                        shape.loops = true;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+        pc += operands;
+    }
+    return shape;
+}
+
+// Calibration kernels, about 10^5 guest instructions each, after the `loop`
+// and `calls` workloads of bench/benchmark.cpp.
+static std::vector<uint32_t> loopKernel() {
+    uint32_t n = 12000;
+    return {DT_IMMI, 0, DT_STO_IMMI, 0, 1, DT_LOD, 0, DT_ADD, DT_LOD, 0, DT_INC, DT_STO, 0,
+            DT_LOD, 0, DT_IMMI, n, DT_GT, DT_JZ, static_cast<uint32_t>(5 - 20), DT_SEEK, DT_END};
+}
+
+static std::vector<uint32_t> callKernel() {
+    uint32_t iterations = 1200;
+    uint32_t depth = 8;
+    return {DT_IMMI, iterations,
+            DT_DUP, DT_JZ, 8,
+            DT_IMMI, 0, DT_CALL, 15, 1,
+            DT_DEC, DT_JMP, static_cast<uint32_t>(-11),
+            DT_SEEK, DT_END,
+            DT_DUP, DT_IMMI, depth, DT_GT, DT_IF_ELSE, 5, 0,
+            DT_DUP, DT_INC, DT_CALL, 15, 1,
+            DT_JZ, 0, DT_RET};
+}
+
+// Picks the engine for `code`. A program with no backward branch and no call
+// executes each instruction at most once, so it finishes faster than any
+// calibration would and goes to STRAIGHT_LINE_ENGINE. Anything else may run
+// for long: every calibratable engine runs the kernel matching the program
+// (calls or a plain loop), best of three, and the fastest one wins.
+static const EngineEntry* chooseEngine(const std::vector<uint32_t>& code, bool verbose) {
+    ProgramShape shape = programShape(code);
+    if (!shape.loops && !shape.calls) {
+        if (verbose) {
+            std::cout << "auto: " << shape.words << " words of straight-line code, using "
+                      << STRAIGHT_LINE_ENGINE << std::endl;
+        }
+        return findEngine(STRAIGHT_LINE_ENGINE);
+    }
+    const std::vector<uint32_t> kernel = shape.calls ? callKernel() : loopKernel();
+    const EngineEntry* best = findEngine(STRAIGHT_LINE_ENGINE);
+    uint64_t bestTime = UINT64_MAX;
+    for (const EngineEntry& e : engines) {
+        if (!e.time_run) {
+            continue;
+        }
+        uint64_t t = UINT64_MAX;
+        for (int r = 0; r < 3; r++) {
+            t = std::min(t, e.time_run(kernel));
+        }
+        if (verbose) {
+            std::cout << "auto: " << e.name << " " << t << " ns" << std::endl;
+        }
+        if (t < bestTime) {
+            bestTime = t;
+            best = &e;
+        }
+    }
+    if (verbose) {
+        std::cout << "auto: " << shape.words << " words, " << (shape.calls ? "calls" : "loops")
+                  << ", using " << best->name << std::endl;
+    }
+    return best;
+}
+
+#endif // ENGINESELECT_H
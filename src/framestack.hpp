@@ -0,0 +1,116 @@
+#ifndef FRAMESTACK_HPP
+#define FRAMESTACK_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+
+// One contiguous operand stack shared by every call frame.
+// A frame is the window [base, sp) of `slots`. DT_CALL leaves the top
+// num_params values where they are and moves `base` down over them, so the
+// parameters become the callee's frame without being copied. DT_RET drops the
+// callee's window and hands its top value (if any) back to the caller.
+// DT_TAILCALL keeps `base` and moves the parameters down to it instead: the
+// callee's frame replaces the current one, and its DT_RET returns for both.
+// The member names mirror std::stack so the handlers read the same as before.
+// push() does not check capacity: engines run verified bytecode (see
+// verifier.hpp) and reserve each frame's maximum depth when entering it.
+class FrameStack {
+    std::vector<uint32_t> slots;  // Operand storage for all frames
+    std::vector<uint32_t> bases;  // Saved frame pointers of the callers
+    uint32_t base;                // First slot of the current frame
+    uint32_t sp;                  // One past the top of the current frame
+
+public:
+    explicit FrameStack(size_t capacity = 1 << 16) : slots(capacity), base(0), sp(0) {
+        bases.reserve(256);
+    }
+
+    inline uint32_t& top() { return slots[sp - 1]; }
+    inline void pop() { --sp; }
+    inline void push(uint32_t val) { slots[sp++] = val; }
+    // Makes room for n more values above the current top.
+    inline void reserve(size_t n) {
+        if (sp + n >= slots.size()) {
+            slots.resize(std::max(slots.size() * 2, sp + n + 1));
+        }
+    }
+    inline bool empty() const { return sp == base; }
+    inline size_t size() const { return sp - base; }
+    // Number of active calls (0 while running the top-level code).
+    inline size_t depth() const { return bases.size(); }
+
+    // Enter a callee whose frame starts with the top num_params values.
+    inline void call(uint32_t num_params) {
+        bases.push_back(base);
+        base = sp - num_params;
+    }
+
+    // Replace the current frame with one holding just its top num_params values.
+    inline void tail_call(uint32_t num_params) {
+        std::memmove(&slots[base], &slots[sp - num_params], num_params * sizeof(uint32_t));
+        sp = base + num_params;
+    }
+
+    // Leave the current frame; its top value, if any, is the return value.
+    inline void ret() {
+        uint32_t callee_base = base;
+        bool has_value = sp > callee_base;
+        uint32_t value = has_value ? slots[sp - 1] : 0;
+        base = bases.back();
+        bases.pop_back();
+        sp = callee_base;
+        if (has_value) {
+            slots[sp++] = value;
+        }
+    }
+
+    // Raw interface for engines that cache the top of stack in a register.
+    // Such an engine keeps its own `sp` and `tos`: the logical top lives in
+    // `tos`, the values below it in [base + 1, sp), and slots[base] is the
+    // frame's phantom cell (the caller's value just below the parameters).
+    // The frame therefore holds (sp - bottom()) - frame_base() values.
+    inline uint32_t* bottom() { return slots.data(); }
+    inline uint32_t* limit() { return slots.data() + slots.size(); }
+    inline uint32_t frame_base() const { return base; }
+    // Bases of the callers' frames, outermost first.
+    inline const std::vector<uint32_t>& caller_bases() const { return bases; }
+    inline size_t frame_size(const uint32_t* sp) const { return (sp - slots.data()) - base; }
+    // Makes room for n more values above `sp` and returns it rebased onto
+    // the (possibly reallocated) storage.
+    inline uint32_t* reserve(uint32_t* sp, size_t n) {
+        size_t offset = sp - slots.data();
+        if (offset + n >= slots.size()) {
+            slots.resize(std::max(slots.size() * 2, offset + n + 1));
+        }
+        return slots.data() + offset;
+    }
+    inline void enter(uint32_t new_base) {
+        bases.push_back(base);
+        base = new_base;
+    }
+    // Tail call: moves the top num_params values, the last of them at `sp`,
+    // to the bottom of the current frame and returns the frame's new `sp`.
+    inline uint32_t* replace(uint32_t* sp, uint32_t num_params) {
+        uint32_t* first = slots.data() + base + 1;
+        std::memmove(first, sp + 1 - num_params, num_params * sizeof(uint32_t));
+        return first + num_params - 1;
+    }
+    // Restores the caller's frame and returns the callee's base.
+    inline uint32_t leave() {
+        uint32_t callee_base = base;
+        base = bases.back();
+        bases.pop_back();
+        return callee_base;
+    }
+
+    inline void clear() {
+        bases.clear();
+        base = 0;
+        sp = 0;
+    }
+};
+
+#endif // FRAMESTACK_HPP
@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <stack>
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <unistd.h>
 #include <fcntl.h>
@@ -13,6 +15,15 @@
 #include "symbol.hpp"
 #include "readfile.hpp"
 #include "interface.hpp"
+#include "framestack.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
+#ifdef HAVE_STENCILS
+#include <sys/mman.h>
+#include "stencilstate.h"
+#include "stencils.hpp"     // Generated by build_stencils.py
+#endif
 #ifdef _WIN32
 #include <windows.h> // Windows-specific headers for file operations
 #endif
@@ -20,12 +31,46 @@
 
 class IndirectThreadingVM : public Interface {
     uint32_t ip; // Instruction pointer (used for compatibility with inline functions)
-    std::vector<std::stack<uint32_t>> sts; // Stack for operations (for function calls)
-    std::stack<uint32_t> st;             // Primary operand stack
+    FrameStack st;                       // Operand stack shared by all call frames
+    StackProfile profile;                // Verified stack depths of the loaded program
+    // A word of loaded code. Opcodes and immediates keep their value; the
+    // operands of branches and calls are replaced by the slot they lead to,
+    // so no handler turns an index back into an address.
+    union Slot {
+        uint32_t word;
+        const Slot* target;
+        struct {
+            uint32_t num_params;
+            uint32_t reserve;   // Room the callee's frame needs
+        } call;                 // Second operand of DT_CALL and DT_TAILCALL
+    };
+
     std::vector<uint32_t> instructions;  // Instruction set
+    std::vector<Slot> code;              // Loaded form of `instructions`, one slot per word
     char* buffer;                        // Memory buffer
     void (IndirectThreadingVM::*instructionTable[256])(void); // (Unused in computed goto version)
-    std::stack<uint32_t> callStack;        // Call stack for function calls
+    std::vector<const Slot*> callStack;  // Return addresses for function calls
+#ifdef HAVE_STENCILS
+    // Selective inlining: a run of straight-line instructions inside a basic
+    // block is replaced by one dispatch of INLINED, whose native code is the
+    // machine code of the run's handlers copied back to back. Only handlers
+    // that are relocatable as copied are inlined; calls, branches, I/O and
+    // the division handlers (which report errors) stay interpreted. The
+    // copies come from the stencils (src/stencils.c), because the labels of
+    // the computed-goto loop below are not relocatable: GCC shares and
+    // reorders their code freely.
+    using Block = StencilRegs (*)(uint32_t*, uint32_t, char*, StencilState*);
+    struct InlinedRun {
+        Block run;
+        const Slot* resume;     // Slot after the run
+    };
+    static constexpr uint32_t INLINED = DT_NUM_INSTRUCTIONS;   // Dispatch entry past every DT opcode
+    const StencilCode* stencilFor[DT_NUM_INSTRUCTIONS] = {};
+    std::vector<InlinedRun> runs;
+    StencilState inlineState{};
+    uint8_t* native = nullptr;
+    size_t native_size = 0;
+#endif
     uint32_t seed = 2463534242UL; // Seed for random number generation
     uint32_t rd() {
         seed ^= seed << 13;
@@ -61,101 +106,109 @@ class IndirectThreadingVM : public Interface {
         return buf[0];
     }
 
+    // The handlers below use a top-of-stack cached discipline: `tos` holds the
+    // top value and `sp` points one past the values spilled below it (see
+    // FrameStack). Both are locals of run_vm, so they stay in registers across
+    // dispatch and a binary op touches memory only once. The program is
+    // verified before it runs, so push and pop never check the frame bounds.
+    inline void push(uint32_t& tos, uint32_t*& sp, uint32_t val) {
+        *sp++ = tos;
+        tos = val;
+    }
+
+    inline uint32_t pop(uint32_t& tos, uint32_t*& sp) {
+        uint32_t val = tos;
+        tos = *--sp;
+        return val;
+    }
+
     // Arithmetic operations (integer and floating point)
-    inline void do_add() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(a + b);
+    inline void do_add(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b + tos;
     }
 
-    inline void do_sub() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b - a);
+    inline void do_sub(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b - tos;
     }
 
-    inline void do_mul() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(a * b);
+    inline void do_mul(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b * tos;
     }
 
-    inline void do_div() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
+    inline void do_div(uint32_t& tos, uint32_t*& sp) {
+        uint32_t a = tos;
+        uint32_t b = *--sp;
         if (a == 0) {
             std::cerr << "Error: Divided by zero error" << std::endl;
+            tos = *--sp;
             return;
         }
-        st.push(b / a);
+        tos = b / a;
     }
     
-    inline void do_mod() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
+    inline void do_mod(uint32_t& tos, uint32_t*& sp) {
+        uint32_t a = tos;
+        uint32_t b = *--sp;
         if (a == 0) {
             std::cerr << "Error: Modulo by zero error" << std::endl;
+            tos = *--sp;
             return;
         }
-        st.push(b % a);
+        tos = b % a;
     }
 
-    inline void do_fp_add() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
-        float result = a + b;
-        st.push(from_float(result));
+    inline void do_fp_add(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
+        tos = from_float(a + b);
     }
 
-    inline void do_fp_sub() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
-        float result = b - a;
-        st.push(from_float(result));
+    inline void do_fp_sub(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
+        tos = from_float(b - a);
     }
 
-    inline void do_fp_mul() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
-        float result = a * b;
-        st.push(from_float(result));
+    inline void do_fp_mul(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
+        tos = from_float(a * b);
     }
 
-    inline void do_fp_div() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
+    inline void do_fp_div(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
         if (a == 0.0f) {
             std::cerr << "Division by zero error" << std::endl;
+            tos = *--sp;
             return;
         }
-        float result = b / a;
-        st.push(from_float(result));
+        tos = from_float(b / a);
     }
 
-    inline void do_inc() {
-        uint32_t a = st.top(); st.pop();
-        st.push(++a);
+    inline void do_inc(uint32_t& tos) {
+        ++tos;
     }
 
-    inline void do_dec() {
-        uint32_t a = st.top(); st.pop();
-        st.push(--a);
+    inline void do_dec(uint32_t& tos) {
+        --tos;
     }
 
-    inline void do_shl() {
-        uint32_t shift = st.top(); st.pop();
-        uint32_t value = st.top(); st.pop();
-        st.push(value << shift);
+    inline void do_shl(uint32_t& tos, uint32_t*& sp) {
+        uint32_t value = *--sp;
+        tos = value << tos;
     }
 
-    inline void do_shr() {
-        uint32_t shift = st.top(); st.pop();
-        uint32_t value = st.top(); st.pop();
-        st.push(value >> shift);
+    inline void do_shr(uint32_t& tos, uint32_t*& sp) {
+        uint32_t value = *--sp;
+        tos = value >> tos;
     }
 
     inline void do_end() {
-        st = std::stack<uint32_t>();
+        st.clear();
         instructions = std::vector<uint32_t>();
         ip = 0;
     }
@@ -165,10 +218,241 @@ class IndirectThreadingVM : public Interface {
         std::cout << "tik" << std::endl;
     }
 
-    inline void do_rnd() {
-        if(!st.empty()){
-            uint32_t a = st.top(); st.pop();
-            st.push(rd() % a);
+    inline void do_rnd(uint32_t& tos) {
+        tos = tos ? rd() % tos : 0;
+    }
+
+    // Copies the verified program into `code`, resolving every branch offset
+    // and call target of a reachable instruction to a slot pointer. Slot i
+    // holds word i, so `pc - code.data()` is still the word index.
+    void load() {
+        code.resize(instructions.size());
+        for (size_t i = 0; i < instructions.size(); i++) {
+            code[i].target = nullptr;
+            code[i].word = instructions[i];
+        }
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + instructionInfo[op].operands;
+            // Branch operands count from the word after the branch instruction.
+            auto branch = [&](int operand) {
+                return &code[next + static_cast<int32_t>(instructions[pc + 1 + operand])];
+            };
+            switch (op) {
+                case DT_JMP:
+                case DT_JZ:
+                case DT_JUMP_IF:
+                    code[pc + 1].target = branch(0);
+                    break;
+                case DT_IF_ELSE:
+                    code[pc + 1].target = branch(0);
+                    code[pc + 2].target = branch(1);
+                    break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    code[pc + 2].target = branch(1);
+                    code[pc + 3].target = branch(2);
+                    break;
+                case DT_CALL:
+                case DT_CALL_INC:
+                case DT_TAILCALL: {
+                    uint32_t target = instructions[pc + 1];
+                    code[pc + 1].target = &code[target];
+                    code[pc + 2].call = {instructions[pc + 2], profile.frame_depth[target] + 1};
+                    break;
+                }
+            }
+            pc = next - 1;
+        }
+    }
+
+#ifdef HAVE_STENCILS
+    // Whether the reachable instruction at pc can be copied into a run: its
+    // handler has no control flow or side exit, and every operand fits the
+    // immediate its stencil holds it in.
+    bool inlinable(size_t pc) const {
+        switch (instructions[pc]) {
+            case DT_ADD: case DT_SUB: case DT_MUL: case DT_SHL: case DT_SHR:
+            case DT_FP_ADD: case DT_FP_SUB: case DT_FP_MUL:
+            case DT_DUP: case DT_LOD: case DT_STO: case DT_IMMI: case DT_INC: case DT_DEC:
+            case DT_STO_IMMI: case DT_MEMCPY: case DT_MEMSET:
+            case DT_GT: case DT_LT: case DT_EQ: case DT_GT_EQ: case DT_LT_EQ:
+                break;
+            default:
+                return false;
+        }
+        const StencilCode* s = stencilFor[instructions[pc]];
+        if (!s) {
+            return false;
+        }
+        for (uint8_t h = 0; h < s->num_holes; h++) {
+            const StencilPatch& p = s->holes[h];
+            if (p.kind == STENCIL_ABS32S && p.hole != STENCIL_CONTINUE &&
+                instructions[pc + 1 + (p.hole - STENCIL_IMM0)] + static_cast<int64_t>(p.addend) > INT32_MAX) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void release_native() {
+        if (native) {
+            munmap(native, native_size);
+            native = nullptr;
+        }
+    }
+
+    // Finds the runs of at least two inlinable instructions that no branch,
+    // call or return enters past their first word, copies the handlers of
+    // each into executable memory followed by a return to the interpreter,
+    // and rewrites the run's first slots to dispatch to that code. Falls back
+    // to plain threaded code if the memory cannot be mapped.
+    void inline_runs() {
+        runs.clear();
+        release_native();
+        std::vector<uint8_t> leader(instructions.size() + 1, 0);
+        for (uint32_t entry : profile.entries) {
+            leader[entry] = 1;
+        }
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + instructionInfo[op].operands;
+            auto mark = [&](size_t operand) { leader[code[operand].target - code.data()] = 1; };
+            switch (op) {
+                case DT_JMP:
+                case DT_JZ:
+                case DT_JUMP_IF:
+                    mark(pc + 1);
+                    break;
+                case DT_IF_ELSE:
+                    mark(pc + 1);
+                    mark(pc + 2);
+                    break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    mark(pc + 2);
+                    mark(pc + 3);
+                    break;
+                case DT_CALL:
+                case DT_CALL_INC:
+                    leader[next] = 1;   // Return point
+                    break;
+            }
+            pc = next - 1;
+        }
+
+        // Runs as [first word, word after the run), and the size of their code
+        std::vector<std::pair<size_t, size_t>> found;
+        size_t size = 0;
+        for (size_t pc = 0; pc < instructions.size();) {
+            if (profile.depth[pc] < 0 || !inlinable(pc)) {
+                pc += profile.depth[pc] < 0 ? 1 : 1 + instructionInfo[instructions[pc]].operands;
+                continue;
+            }
+            size_t end = pc;
+            size_t count = 0;
+            size_t bytes = 0;
+            do {
+                bytes += stencilFor[instructions[end]]->size;
+                end += 1 + instructionInfo[instructions[end]].operands;
+                count++;
+            } while (end < instructions.size() && !leader[end] && profile.depth[end] >= 0 &&
+                     inlinable(end));
+            if (count >= 2) {
+                found.push_back({pc, end});
+                size += bytes + sizeof(EXIT_STUB);
+            }
+            pc = end;
+        }
+        if (found.empty()) {
+            return;
+        }
+
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        native_size = (size + page - 1) / page * page;
+        void* mem = mmap(nullptr, native_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return;
+        }
+        native = static_cast<uint8_t*>(mem);
+        uint8_t* at = native;
+        for (const auto& [first, end] : found) {
+            uint8_t* start = at;
+            for (size_t pc = first; pc < end; pc += 1 + instructionInfo[instructions[pc]].operands) {
+                const StencilCode* s = stencilFor[instructions[pc]];
+                memcpy(at, s->code, s->size);
+                uint8_t* after = at + s->size;
+                for (uint8_t h = 0; h < s->num_holes; h++) {
+                    const StencilPatch& p = s->holes[h];
+                    uint64_t value;
+                    if (p.hole == STENCIL_CONTINUE) {
+                        // The next handler, or the exit stub, follows directly.
+                        value = reinterpret_cast<uint64_t>(after) - reinterpret_cast<uint64_t>(at + p.offset);
+                    } else {
+                        value = instructions[pc + 1 + (p.hole - STENCIL_IMM0)];
+                    }
+                    value += p.addend;
+                    uint32_t patched = static_cast<uint32_t>(value);
+                    memcpy(at + p.offset, &patched, 4);
+                }
+                at = after;
+            }
+            memcpy(at, EXIT_STUB, sizeof(EXIT_STUB));
+            at += sizeof(EXIT_STUB);
+            code[first].word = INLINED;
+            code[first + 1].word = static_cast<uint32_t>(runs.size());
+            runs.push_back({reinterpret_cast<Block>(start), &code[end]});
+        }
+        if (mprotect(native, native_size, PROT_READ | PROT_EXEC) != 0) {
+            // Undo the rewrite and run the plain threaded code.
+            for (const auto& [first, end] : found) {
+                code[first].word = instructions[first];
+                code[first + 1].word = instructions[first + 1];
+            }
+            runs.clear();
+            release_native();
+        }
+    }
+
+    // Returns the stencils' (sp, tos) to the interpreter:
+    // mov rax, rdi; mov edx, esi; ret
+    static constexpr uint8_t EXIT_STUB[] = {0x48, 0x89, 0xF8, 0x89, 0xF2, 0xC3};
+#endif
+
+    // Records the interpreter's state at the safe point `at` in `suspended`:
+    // the frames of FrameStack's shared stack, outermost first, and the
+    // DT_CALL behind each return address.
+    void suspend(const Slot* at, uint32_t tos, uint32_t* sp) {
+        suspended.valid = true;
+        suspended.word = at - code.data();
+        suspended.debug_num = debug_num;
+        suspended.seed = seed;
+        suspended.sizes.clear();
+        suspended.values.clear();
+        suspended.calls.clear();
+        std::vector<uint32_t> bases = st.caller_bases();
+        bases.push_back(st.frame_base());
+        const uint32_t* slots = st.bottom();
+        // A caller's values are the words above its phantom cell, up to the
+        // callee's base (DT_CALL spilled the cached top there).
+        for (size_t f = 0; f + 1 < bases.size(); f++) {
+            suspended.sizes.push_back(bases[f + 1] - bases[f]);
+            suspended.values.insert(suspended.values.end(), slots + bases[f] + 1, slots + bases[f + 1] + 1);
+        }
+        size_t size = st.frame_size(sp);
+        suspended.sizes.push_back(size);
+        if (size > 0) {
+            suspended.values.insert(suspended.values.end(), slots + bases.back() + 1, static_cast<const uint32_t*>(sp));
+            suspended.values.push_back(tos);
+        }
+        for (const Slot* back : callStack) {
+            suspended.calls.push_back((back - code.data()) - 3);
         }
     }
 
@@ -179,17 +463,55 @@ class IndirectThreadingVM : public Interface {
 
 public:
     uint32_t debug_num;
+    uint64_t dispatch_count = 0;  // Instructions dispatched, counted with -DCOUNT_DISPATCH
+
+    // Tier-up (src/tierthreading.cpp). While `tier_request` is set, every
+    // call and every backward branch is a safe point: once the flag reads
+    // true there, and fewer than `tier_max_calls` calls are active, run_vm
+    // stops before that instruction, leaves its state in `suspended` and
+    // returns, so compiled code can carry on from there.
+    const std::atomic<bool>* tier_request = nullptr;
+    size_t tier_max_calls = SIZE_MAX;
+    struct Suspended {
+        bool valid = false;
+        uint32_t word;                  // Instruction to resume at
+        uint32_t debug_num;
+        uint32_t seed;
+        std::vector<uint32_t> sizes;    // Values in each frame, outermost first
+        std::vector<uint32_t> values;   // The frames' values back to back
+        std::vector<uint32_t> calls;    // Word of each active call's DT_CALL
+    } suspended;
     IndirectThreadingVM() : ip(0), buffer(new char[4 * 1024 * 1024]) { 
         init_instruction_table();
         debug_num = 0xFFFFFFFF;
-        sts.push_back(std::stack<uint32_t>());
-        st = sts.back();
+#ifdef HAVE_STENCILS
+        for (const StencilCode& s : stencil_table) {
+            stencilFor[s.op] = &s;
+        }
+        inlineState.copy = memcpy;
+        inlineState.fill = memset;
+#endif
     }
 
     ~IndirectThreadingVM() {
+#ifdef HAVE_STENCILS
+        release_native();
+#endif
         delete[] buffer;
     }
 
+    // The 4 MiB memory buffer the program runs on.
+    char* memory() { return buffer; }
+
+    // Number of instruction runs the last program inlined into native code.
+    size_t inlined_runs() const {
+#ifdef HAVE_STENCILS
+        return runs.size();
+#else
+        return 0;
+#endif
+    }
+
     // The filename-based run_vm now loads the instructions and then calls the computed goto version.
     void run_vm(std::string filename, bool benchmarkMode) {
         try {
@@ -204,12 +526,35 @@ public:
     }
 
     // The main interpreter loop using computed gotos (Indirect threading)
-    void run_vm(std::vector<uint32_t>& code) {
-        instructions = code;
-        // Pointer into our instruction array.
-        uint32_t* iptr = instructions.data();
+    void run_vm(std::vector<uint32_t>& program) {
+        try {
+            profile = verifyProgram(program);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = program;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        load();
+        suspended.valid = false;
+        // A run that ended inside a callee leaves its frames and return
+        // addresses behind, pointing into the code just replaced.
+        callStack.clear();
+        st.clear();
+#ifdef HAVE_STENCILS
+        inline_runs();
+#endif
+        // Cursor into the loaded code: handlers advance it past their
+        // operands and branches replace it with a pre-resolved target.
+        const Slot* pc = code.data();
+        // Cached top of stack and spill pointer (see FrameStack), with room
+        // for the deepest chain of frames the verifier found.
+        uint32_t tos = 0;
+        uint32_t* sp = st.reserve(st.bottom() + st.frame_base(), profile.max_stack + 1);
 
         // Build a dispatch table mapping opcodes to local labels.
+        // Designators are kept in enum order so GCC accepts them as well as clang.
         static void* dispatch[256] = {
             [DT_ADD]       = &&L_DT_ADD,
             [DT_SUB]       = &&L_DT_SUB,
@@ -222,19 +567,20 @@ public:
             [DT_FP_SUB]    = &&L_DT_FP_SUB,
             [DT_FP_MUL]    = &&L_DT_FP_MUL,
             [DT_FP_DIV]    = &&L_DT_FP_DIV,
+            [DT_DUP]       = &&L_DT_DUP,
             [DT_END]       = &&L_DT_END,
             [DT_LOD]       = &&L_DT_LOD,
             [DT_STO]       = &&L_DT_STO,
             [DT_IMMI]      = &&L_DT_IMMI,
+            [DT_INC]       = &&L_DT_INC,
+            [DT_DEC]       = &&L_DT_DEC,
             [DT_STO_IMMI]  = &&L_DT_STO_IMMI,
             [DT_MEMCPY]    = &&L_DT_MEMCPY,
             [DT_MEMSET]    = &&L_DT_MEMSET,
-            [DT_INC]       = &&L_DT_INC,
-            [DT_DEC]       = &&L_DT_DEC,
             [DT_JMP]       = &&L_DT_JMP,
             [DT_JZ]        = &&L_DT_JZ,
-            [DT_JUMP_IF]   = &&L_DT_JUMP_IF,
             [DT_IF_ELSE]   = &&L_DT_IF_ELSE,
+            [DT_JUMP_IF]   = &&L_DT_JUMP_IF,
             [DT_GT]        = &&L_DT_GT,
             [DT_LT]        = &&L_DT_LT,
             [DT_EQ]        = &&L_DT_EQ,
@@ -248,332 +594,253 @@ public:
             [DT_FP_PRINT]  = &&L_DT_FP_PRINT,
             [DT_FP_READ]   = &&L_DT_FP_READ,
             [DT_Tik]       = &&L_DT_Tik,
+            [DT_SYSCALL]   = &&L_DT_UNKNOWN,
             [DT_RND]       = &&L_DT_RND,
-            [DT_DUP]       = &&L_DT_DUP,
+            [DT_GUARD_GT]  = &&L_DT_GUARD_GT,
+            [DT_GUARD_EQ]  = &&L_DT_GUARD_EQ,
+            [DT_CALL_INC]  = &&L_DT_CALL_INC,
+            [DT_TAILCALL]  = &&L_DT_TAILCALL,
+#ifdef HAVE_STENCILS
+            [INLINED]      = &&L_INLINED,
+#endif
         };
 
         // Macro to jump to the next instruction.
-#define NEXT goto *dispatch[*iptr++]
+#ifdef COUNT_DISPATCH
+#define NEXT do { dispatch_count++; goto *dispatch[(pc++)->word]; } while (0)
+#else
+#define NEXT goto *dispatch[(pc++)->word]
+#endif
+#define SAFEPOINT(at) \
+        if (tier_request && tier_request->load(std::memory_order_acquire) && callStack.size() < tier_max_calls) { \
+            suspend(at, tos, sp); \
+            return; \
+        }
+        // Takes a branch; a backward one is a safe point.
+#define BRANCH(to) \
+        { \
+            const Slot* from = pc; \
+            pc = (to); \
+            if (pc < from) { \
+                SAFEPOINT(pc); \
+            } \
+        } \
+        NEXT
 
         NEXT;
 
     L_DT_ADD:
-        ip = (iptr - instructions.data()) - 1;
-        do_add();
-        iptr = instructions.data() + ip + 1;
+        do_add(tos, sp);
         NEXT;
     L_DT_SUB:
-        ip = (iptr - instructions.data()) - 1;
-        do_sub();
-        iptr = instructions.data() + ip + 1;
+        do_sub(tos, sp);
         NEXT;
     L_DT_MUL:
-        ip = (iptr - instructions.data()) - 1;
-        do_mul();
-        iptr = instructions.data() + ip + 1;
+        do_mul(tos, sp);
         NEXT;
     L_DT_DIV:
-        ip = (iptr - instructions.data()) - 1;
-        do_div();
-        iptr = instructions.data() + ip + 1;
+        do_div(tos, sp);
         NEXT;
     L_DT_MOD:
-        ip = (iptr - instructions.data()) - 1;
-        do_mod();
-        iptr = instructions.data() + ip + 1;
+        do_mod(tos, sp);
         NEXT;
     L_DT_SHL:
-        ip = (iptr - instructions.data()) - 1;
-        do_shl();
-        iptr = instructions.data() + ip + 1;
+        do_shl(tos, sp);
         NEXT;
     L_DT_SHR:
-        ip = (iptr - instructions.data()) - 1;
-        do_shr();
-        iptr = instructions.data() + ip + 1;
+        do_shr(tos, sp);
         NEXT;
     L_DT_FP_ADD:
-        ip = (iptr - instructions.data()) - 1;
-        do_fp_add();
-        iptr = instructions.data() + ip + 1;
+        do_fp_add(tos, sp);
         NEXT;
     L_DT_FP_SUB:
-        ip = (iptr - instructions.data()) - 1;
-        do_fp_sub();
-        iptr = instructions.data() + ip + 1;
+        do_fp_sub(tos, sp);
         NEXT;
     L_DT_FP_MUL:
-        ip = (iptr - instructions.data()) - 1;
-        do_fp_mul();
-        iptr = instructions.data() + ip + 1;
+        do_fp_mul(tos, sp);
         NEXT;
     L_DT_FP_DIV:
-        ip = (iptr - instructions.data()) - 1;
-        do_fp_div();
-        iptr = instructions.data() + ip + 1;
+        do_fp_div(tos, sp);
         NEXT;
     L_DT_END:
-        ip = (iptr - instructions.data()) - 1;
         do_end();
         return;
     L_DT_LOD:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
+        uint32_t offset = (pc++)->word;
         uint32_t a = read_mem32(buffer, offset);
-        st.push(a);
+        push(tos, sp, a);
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_STO:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
-        uint32_t a = st.top(); st.pop();
+        uint32_t offset = (pc++)->word;
+        uint32_t a = pop(tos, sp);
         write_mem32(buffer, a, offset);
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_IMMI:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = instructions[++ip];
-        st.push(a);
-    }
-        iptr = instructions.data() + ip + 1;
+        push(tos, sp, (pc++)->word);
         NEXT;
     L_DT_DUP:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = st.top();
-        st.push(a);
-    }
-        iptr = instructions.data() + ip + 1;
+        push(tos, sp, tos);
         NEXT;
     L_DT_STO_IMMI:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
-        uint32_t number = instructions[++ip];
-        write_mem32(buffer, number, offset);
-    }
-        iptr = instructions.data() + ip + 1;
+        write_mem32(buffer, pc[1].word, pc[0].word);
+        pc += 2;
         NEXT;
     L_DT_MEMCPY:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t dest = instructions[++ip];
-        uint32_t src = instructions[++ip];
-        uint32_t len = instructions[++ip];
-        memcpy(buffer + dest, buffer + src, len);
-    }
-        iptr = instructions.data() + ip + 1;
+        memcpy(buffer + pc[0].word, buffer + pc[1].word, pc[2].word);
+        pc += 3;
         NEXT;
     L_DT_MEMSET:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t dest = instructions[++ip];
-        uint32_t val = instructions[++ip];
-        uint32_t len = instructions[++ip];
-        memset(buffer + dest, val, len);
-    }
-        iptr = instructions.data() + ip + 1;
+        memset(buffer + pc[0].word, pc[1].word, pc[2].word);
+        pc += 3;
         NEXT;
     L_DT_INC:
-        ip = (iptr - instructions.data()) - 1;
-        do_inc();
-        iptr = instructions.data() + ip + 1;
+        do_inc(tos);
         NEXT;
     L_DT_DEC:
-        ip = (iptr - instructions.data()) - 1;
-        do_dec();
-        iptr = instructions.data() + ip + 1;
+        do_dec(tos);
         NEXT;
-    // 修改：将跳转指令的立即数视为相对偏移量
     L_DT_JMP:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
-        ip = ip + offset;
-    }
-        iptr = instructions.data() + ip + 1;
-        NEXT;
+        BRANCH(pc->target);
     L_DT_JZ:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
-        if (st.top() == 0) {
-            ip = ip + offset;
-        }
-        st.pop();
-    }
-        iptr = instructions.data() + ip + 1;
-        NEXT;
+        BRANCH(pop(tos, sp) == 0 ? pc->target : pc + 1);
     L_DT_JUMP_IF:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t condition = st.top(); st.pop();
-        uint32_t offset = instructions[++ip];
-        if (condition) {
-            ip = ip + offset;
-        }
-    }
-        iptr = instructions.data() + ip + 1;
-        NEXT;
+        BRANCH(pop(tos, sp) ? pc->target : pc + 1);
     L_DT_IF_ELSE:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t condition = st.top(); st.pop();
-        uint32_t trueOffset = instructions[++ip];
-        uint32_t falseOffset = instructions[++ip];
-        ip = condition ? ip + trueOffset : ip + falseOffset;
-    }
-        iptr = instructions.data() + ip + 1;
-        NEXT;
+        BRANCH(pop(tos, sp) ? pc[0].target : pc[1].target);
     L_DT_GT:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b > a ? 1 : 0);
+        uint32_t b = *--sp;
+        tos = b > tos ? 1 : 0;
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_LT:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b < a ? 1 : 0);
+        uint32_t b = *--sp;
+        tos = b < tos ? 1 : 0;
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_EQ:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b == a ? 1 : 0);
+        uint32_t b = *--sp;
+        tos = b == tos ? 1 : 0;
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_GT_EQ:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b >= a ? 1 : 0);
+        uint32_t b = *--sp;
+        tos = b >= tos ? 1 : 0;
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_LT_EQ:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b <= a ? 1 : 0);
-    }
-        iptr = instructions.data() + ip + 1;
-        NEXT;
+        uint32_t b = *--sp;
+        tos = b <= tos ? 1 : 0;
+    }
+        NEXT;
+    L_DT_GUARD_GT:
+        BRANCH(tos > pc[0].word ? pc[1].target : pc[2].target);
+    L_DT_GUARD_EQ:
+        BRANCH(tos == pc[0].word ? pc[1].target : pc[2].target);
+    L_DT_CALL_INC:
+        SAFEPOINT(pc - 1);
+        // Pass top + 1 as the last parameter, then call as DT_CALL does.
+        push(tos, sp, tos + 1);
+        goto call;
     L_DT_CALL:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t target = instructions[++ip];
-        uint32_t num_params = instructions[++ip];
-        std::stack<uint32_t> newStack;
-        for (uint32_t i = 0; i < num_params; ++i) {
-            newStack.push(st.top());
-            st.pop();
-        }
-        sts.push_back(newStack);
-        st = sts.back();
-        callStack.push(ip);
-        ip = target - 1;
-    }
-        iptr = instructions.data() + ip + 1;
+        SAFEPOINT(pc - 1);
+    call:
+        // Spill the cached top so the frame below the parameters is complete.
+        *sp = tos;
+        st.enter((sp - st.bottom()) - pc[1].call.num_params);
+        sp = st.reserve(sp, pc[1].call.reserve);
+        callStack.push_back(pc + 2);
+        pc = pc[0].target;
+        NEXT;
+    L_DT_TAILCALL:
+        // A safe point too: tail recursion loops without a backward branch.
+        SAFEPOINT(pc - 1);
+        // The parameters take over the frame; the return address stays.
+        *sp = tos;
+        sp = st.replace(sp, pc[1].call.num_params);
+        sp = st.reserve(sp, pc[1].call.reserve);
+        tos = *sp;
+        pc = pc[0].target;
         NEXT;
     L_DT_RET:
     {
-        ip = (iptr - instructions.data()) - 1;
         if (callStack.empty()) {
             return;
         }
-        // uint32_t return_value = st.top();
-        ip = callStack.top(); callStack.pop();
-        sts.pop_back();
-        st = sts.back();
-        // st.push(return_value);
+        pc = callStack.back(); callStack.pop_back();
+        bool has_value = st.frame_size(sp) > 0;
+        sp = st.bottom() + st.leave();
+        if (has_value) {
+            sp++; // the callee's top becomes the caller's top, already in tos
+        } else {
+            tos = *sp;
+        }
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_SEEK:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        debug_num = st.top();
-    }
-        iptr = instructions.data() + ip + 1;
+        debug_num = tos;
         NEXT;
     L_DT_PRINT:
-    {
-        ip = (iptr - instructions.data()) - 1;
-        if (!st.empty()) {
-            std::cout << (int)st.top() << std::endl;
-        } else {
-            std::cerr << "Stack is empty." << std::endl;
-        }
-    }
-        iptr = instructions.data() + ip + 1;
+        std::cout << (int)tos << std::endl;
         NEXT;
     L_DT_READ_INT:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
+        uint32_t offset = (pc++)->word;
         int val;
         std::cin >> val;
         write_mem32(buffer, val, offset);
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_FP_PRINT:
     {
-        ip = (iptr - instructions.data()) - 1;
-        if (!st.empty()) {
-            uint32_t num = st.top();
-            float* floatPtr = reinterpret_cast<float*>(&num);
-            std::cout << *floatPtr << std::endl;
-        } else {
-            std::cerr << "Stack is empty." << std::endl;
-        }
+        uint32_t num = tos;
+        float* floatPtr = reinterpret_cast<float*>(&num);
+        std::cout << *floatPtr << std::endl;
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_FP_READ:
     {
-        ip = (iptr - instructions.data()) - 1;
-        uint32_t offset = instructions[++ip];
+        uint32_t offset = (pc++)->word;
         float val;
         std::cin >> val;
         write_mem32(buffer, from_float(val), offset);
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_Tik:
-    {
-        ip = (iptr - instructions.data()) - 1;
         tik();
-    }
-        iptr = instructions.data() + ip + 1;
         NEXT;
     L_DT_RND:
+        do_rnd(tos);
+        NEXT;
+#ifdef HAVE_STENCILS
+    L_INLINED:
     {
-        ip = (iptr - instructions.data()) - 1;
-        do_rnd();
+        const InlinedRun& run = runs[pc->word];
+        StencilRegs regs = run.run(sp, tos, buffer, &inlineState);
+        sp = regs.sp;
+        tos = regs.tos;
+        pc = run.resume;
     }
-        iptr = instructions.data() + ip + 1;
         NEXT;
+#endif
+    L_DT_UNKNOWN:
+        // The word index is only needed to report where the program failed.
+        ip = (pc - code.data()) - 1;
+        std::cerr << "Unknown instruction code: " << code[ip].word << " at word " << ip << std::endl;
+        return;
+#undef BRANCH
+#undef SAFEPOINT
 #undef NEXT
         // End of computed goto loop.
         return;
     }
 };
-#endif // INDIRECTTHREADING_H
\ No newline at end of file
+#endif // INDIRECTTHREADING_H
@@ -0,0 +1,483 @@
+#ifndef JITTHREADING_H
+#define JITTHREADING_H
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "symbol.hpp"
+#include "readfile.hpp"
+#include "interface.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
+
+// Template JIT for x86-64: every instruction of the verified program is
+// emitted as a fixed machine-code template into an executable buffer, and
+// DT_CALL / DT_RET become native call / ret, and DT_TAILCALL a native jmp.
+// No C compiler is involved, so a program starts running as soon as it is
+// verified.
+//
+// Register use in the generated code (all callee-saved, so helper calls into
+// C++ keep them):
+//   rbx  JitState of the run       r12  operand stack pointer (one past the
+//   r13d cached top of stack            values spilled below the top)
+//   r14  memory buffer             r15  call depth
+// The operand stack is one contiguous array shared by all frames: a callee's
+// frame is simply the top num_params values, so DT_CALL needs no frame
+// bookkeeping and DT_RET drops the rest of the callee's frame, whose depth
+// the verifier knows, with a single subtraction.
+class JitThreadingVM : public Interface {
+    // State the generated code reaches through rbx. Offsets are used by the
+    // templates, so the layout must not change without updating them.
+    struct JitState {
+        uint64_t entry_rsp;         // 0: native stack pointer after the prologue
+        uint32_t* stack;            // 8: operand stack
+        uint32_t* stack_limit;      // 16: end of the operand stack
+        char* memory;               // 24: memory buffer
+        uint32_t debug_num;         // 32: DT_SEEK
+        JitThreadingVM* vm;         // 40
+    };
+
+    // Deepest chain of guest calls; keeps recursion off the native stack limit.
+    static constexpr uint32_t MAX_CALL_DEPTH = 1 << 17;
+    // Operand stack for recursive programs, whose depth the verifier cannot bound.
+    static constexpr size_t RECURSIVE_STACK_SLOTS = 1 << 20;
+
+    StackProfile profile;
+    std::vector<uint32_t> instructions;
+    std::vector<uint32_t> stack;
+    char* buffer;
+    uint8_t* native = nullptr;
+    size_t native_size = 0;
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+
+    uint32_t rd() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    // Helpers called from the generated code for the instructions that do I/O.
+    static void print_int(JitState*, uint32_t v) {
+        std::cout << static_cast<int>(v) << std::endl;
+    }
+    static void print_fp(JitState*, uint32_t v) {
+        float f;
+        memcpy(&f, &v, sizeof(f));
+        std::cout << f << std::endl;
+    }
+    static void read_int(JitState* s, uint32_t offset) {
+        int val;
+        std::cin >> val;
+        memcpy(s->memory + offset, &val, 4);
+    }
+    static void read_fp(JitState* s, uint32_t offset) {
+        float val;
+        std::cin >> val;
+        memcpy(s->memory + offset, &val, 4);
+    }
+    static void tik(JitState*) {
+        std::cout << "tik" << std::endl;
+    }
+    static uint32_t rnd(JitState* s, uint32_t range) {
+        return range ? s->vm->rd() % range : 0;
+    }
+    static void divide_by_zero(JitState*) {
+        std::cerr << "Error: Divided by zero error" << std::endl;
+    }
+    static void stack_overflow(JitState*) {
+        std::cerr << "Error: call stack overflow" << std::endl;
+    }
+
+    // Byte buffer with the handful of encodings the templates need.
+    struct Assembler {
+        std::vector<uint8_t> code;
+        void emit(std::initializer_list<uint8_t> b) { code.insert(code.end(), b); }
+        void imm32(uint32_t v) { for (int i = 0; i < 4; i++) code.push_back(v >> (8 * i)); }
+        void imm64(uint64_t v) { for (int i = 0; i < 8; i++) code.push_back(v >> (8 * i)); }
+        size_t here() const { return code.size(); }
+        // Emits a rel32 placeholder and returns its position for patch().
+        size_t rel32() { size_t at = here(); imm32(0); return at; }
+        void patch(size_t at, size_t target) {
+            uint32_t rel = static_cast<uint32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+            memcpy(&code[at], &rel, 4);
+        }
+
+        void push_tos()  { emit({0x45, 0x89, 0x2C, 0x24, 0x49, 0x83, 0xC4, 0x04}); } // mov [r12], r13d; add r12, 4
+        void pop_tos()   { emit({0x49, 0x83, 0xEC, 0x04, 0x45, 0x8B, 0x2C, 0x24}); } // sub r12, 4; mov r13d, [r12]
+        void drop_next() { emit({0x49, 0x83, 0xEC, 0x04}); }                         // sub r12, 4 (value now at [r12])
+        void tos_to_eax() { emit({0x44, 0x89, 0xE8}); }                              // mov eax, r13d
+        void call(const void* fn) {                                                   // mov rax, fn; call rax
+            emit({0x48, 0xB8});
+            imm64(reinterpret_cast<uint64_t>(fn));
+            emit({0xFF, 0xD0});
+        }
+        // Calls fn(state, tos) or fn(state, imm).
+        void call_with_tos(const void* fn) { emit({0x48, 0x89, 0xDF, 0x44, 0x89, 0xEE}); call(fn); }
+        void call_with_imm(const void* fn, uint32_t v) { emit({0x48, 0x89, 0xDF, 0xBE}); imm32(v); call(fn); }
+        void jump(uint8_t cc) { emit({0x0F, cc}); }   // jcc rel32, followed by rel32()
+    };
+
+    static constexpr uint8_t JZ = 0x84, JNZ = 0x85, JA = 0x87;
+
+    void release_native() {
+        if (native) {
+            munmap(native, native_size);
+            native = nullptr;
+        }
+    }
+
+    bool compile() {
+        Assembler a;
+        std::vector<size_t> nativeAt(instructions.size(), 0);
+        std::vector<std::pair<size_t, uint32_t>> fixups;   // rel32 position, guest word
+        std::vector<size_t> toEpilogue, toDivError, toOverflow;
+
+        // push rbx, r12, r13, r14, r15; mov rbx, rdi; mov [rbx], rsp;
+        // mov r12, [rbx+8]; mov r14, [rbx+24]; xor r13d, r13d; xor r15d, r15d
+        a.emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+                0x48, 0x89, 0xFB, 0x48, 0x89, 0x23,
+                0x4C, 0x8B, 0x63, 0x08, 0x4C, 0x8B, 0x73, 0x18,
+                0x45, 0x31, 0xED, 0x45, 0x31, 0xFF});
+
+        auto branch = [&](size_t pc, size_t next, int operand) {
+            return static_cast<uint32_t>(next + static_cast<int32_t>(instructions[pc + 1 + operand]));
+        };
+        // Compare the value below the top with the top: cmp [r12], r13d; setcc al; movzx r13d, al
+        auto compare = [&](uint8_t setcc) {
+            a.drop_next();
+            a.emit({0x45, 0x39, 0x2C, 0x24, 0x0F, setcc, 0xC0, 0x44, 0x0F, 0xB6, 0xE8});
+        };
+        // movd xmm0, [r12]; movd xmm1, r13d; <op>ss xmm0, xmm1; movd r13d, xmm0
+        auto fp_binary = [&](uint8_t op) {
+            a.drop_next();
+            a.emit({0x66, 0x41, 0x0F, 0x6E, 0x04, 0x24, 0x66, 0x41, 0x0F, 0x6E, 0xCD,
+                    0xF3, 0x0F, op, 0xC1, 0x66, 0x41, 0x0F, 0x7E, 0xC5});
+        };
+        // mov eax, [r12]; xor edx, edx; div r13d
+        auto divide = [&]() {
+            a.emit({0x45, 0x85, 0xED});                                  // test r13d, r13d
+            a.jump(JZ);
+            toDivError.push_back(a.rel32());
+            a.drop_next();
+            a.emit({0x41, 0x8B, 0x04, 0x24, 0x31, 0xD2, 0x41, 0xF7, 0xF5});
+        };
+
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + instructionInfo[op].operands;
+            const uint32_t* operand = &instructions[pc + 1];
+            nativeAt[pc] = a.here();
+            switch (op) {
+                case DT_ADD:                                                    // add r13d, [r12]
+                    a.drop_next();
+                    a.emit({0x45, 0x03, 0x2C, 0x24});
+                    break;
+                case DT_SUB:                                                    // mov eax, [r12]; sub eax, r13d; mov r13d, eax
+                    a.drop_next();
+                    a.emit({0x41, 0x8B, 0x04, 0x24, 0x44, 0x29, 0xE8, 0x41, 0x89, 0xC5});
+                    break;
+                case DT_MUL:                                                    // imul r13d, [r12]
+                    a.drop_next();
+                    a.emit({0x45, 0x0F, 0xAF, 0x2C, 0x24});
+                    break;
+                case DT_DIV:
+                    divide();
+                    a.emit({0x41, 0x89, 0xC5});                                 // mov r13d, eax
+                    break;
+                case DT_MOD:
+                    divide();
+                    a.emit({0x41, 0x89, 0xD5});                                 // mov r13d, edx
+                    break;
+                case DT_SHL:
+                case DT_SHR:                                                    // mov ecx, r13d; r13d = [r12]; shl/shr r13d, cl
+                    a.emit({0x44, 0x89, 0xE9});
+                    a.pop_tos();
+                    a.emit({0x41, 0xD3, static_cast<uint8_t>(op == DT_SHL ? 0xE5 : 0xED)});
+                    break;
+                case DT_FP_ADD: fp_binary(0x58); break;
+                case DT_FP_SUB: fp_binary(0x5C); break;
+                case DT_FP_MUL: fp_binary(0x59); break;
+                case DT_FP_DIV:
+                    a.tos_to_eax();                                             // ±0.0 has no bits outside the sign
+                    a.emit({0x25});
+                    a.imm32(0x7FFFFFFF);
+                    a.jump(JZ);
+                    toDivError.push_back(a.rel32());
+                    fp_binary(0x5E);
+                    break;
+                case DT_DUP:
+                    a.push_tos();
+                    break;
+                case DT_END:
+                    a.emit({0xE9});
+                    toEpilogue.push_back(a.rel32());
+                    break;
+                case DT_LOD:                                                    // mov r13d, [r14 + offset]
+                    a.push_tos();
+                    a.emit({0x45, 0x8B, 0xAE});
+                    a.imm32(operand[0]);
+                    break;
+                case DT_STO:                                                    // mov [r14 + offset], r13d
+                    a.emit({0x45, 0x89, 0xAE});
+                    a.imm32(operand[0]);
+                    a.pop_tos();
+                    break;
+                case DT_IMMI:                                                   // mov r13d, imm32
+                    a.push_tos();
+                    a.emit({0x41, 0xBD});
+                    a.imm32(operand[0]);
+                    break;
+                case DT_INC:
+                    a.emit({0x41, 0xFF, 0xC5});
+                    break;
+                case DT_DEC:
+                    a.emit({0x41, 0xFF, 0xCD});
+                    break;
+                case DT_STO_IMMI:                                               // mov dword [r14 + offset], imm32
+                    a.emit({0x41, 0xC7, 0x86});
+                    a.imm32(operand[0]);
+                    a.imm32(operand[1]);
+                    break;
+                case DT_MEMCPY:
+                case DT_MEMSET:
+                    a.emit({0x49, 0x8D, 0xBE});                                 // lea rdi, [r14 + dest]
+                    a.imm32(operand[0]);
+                    if (op == DT_MEMCPY) {
+                        a.emit({0x49, 0x8D, 0xB6});                             // lea rsi, [r14 + src]
+                    } else {
+                        a.emit({0xBE});                                         // mov esi, value
+                    }
+                    a.imm32(operand[1]);
+                    a.emit({0xBA});                                             // mov edx, len
+                    a.imm32(operand[2]);
+                    a.call(op == DT_MEMCPY ? reinterpret_cast<const void*>(&memcpy)
+                                           : reinterpret_cast<const void*>(&memset));
+                    break;
+                case DT_JMP:
+                    a.emit({0xE9});
+                    fixups.push_back({a.rel32(), branch(pc, next, 0)});
+                    break;
+                case DT_JZ:
+                case DT_JUMP_IF:
+                case DT_IF_ELSE:
+                    a.tos_to_eax();
+                    a.pop_tos();
+                    a.emit({0x85, 0xC0});                                       // test eax, eax
+                    a.jump(op == DT_JZ ? JZ : JNZ);
+                    fixups.push_back({a.rel32(), branch(pc, next, 0)});
+                    if (op == DT_IF_ELSE) {
+                        a.emit({0xE9});
+                        fixups.push_back({a.rel32(), branch(pc, next, 1)});
+                    }
+                    break;
+                case DT_GT:    compare(0x97); break;                            // seta
+                case DT_LT:    compare(0x92); break;                            // setb
+                case DT_EQ:    compare(0x94); break;                            // sete
+                case DT_GT_EQ: compare(0x93); break;                            // setae
+                case DT_LT_EQ: compare(0x96); break;                            // setbe
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    a.emit({0x41, 0x81, 0xFD});                                 // cmp r13d, k
+                    a.imm32(operand[0]);
+                    a.jump(op == DT_GUARD_GT ? JA : JZ);
+                    fixups.push_back({a.rel32(), branch(pc, next, 1)});
+                    a.emit({0xE9});
+                    fixups.push_back({a.rel32(), branch(pc, next, 2)});
+                    break;
+                case DT_CALL_INC:
+                    a.push_tos();
+                    a.emit({0x41, 0xFF, 0xC5});                                 // inc r13d
+                    [[fallthrough]];
+                case DT_CALL: {
+                    // The callee's frame starts on the num_params values already
+                    // on the stack, so it grows the stack by frame_depth - num_params.
+                    uint32_t reserve = profile.frame_depth[operand[0]] - operand[1];
+                    // lea rax, [r12 + 4 * reserve]; cmp rax, [rbx + 16]; ja overflow
+                    a.emit({0x49, 0x8D, 0x84, 0x24});
+                    a.imm32(4 * reserve);
+                    a.emit({0x48, 0x3B, 0x43, 0x10});
+                    a.jump(JA);
+                    toOverflow.push_back(a.rel32());
+                    // inc r15; cmp r15, MAX_CALL_DEPTH; ja overflow
+                    a.emit({0x49, 0xFF, 0xC7, 0x49, 0x81, 0xFF});
+                    a.imm32(MAX_CALL_DEPTH);
+                    a.jump(JA);
+                    toOverflow.push_back(a.rel32());
+                    // sub rsp, 8; call callee; add rsp, 8 (keeps helper calls 16-byte aligned)
+                    a.emit({0x48, 0x83, 0xEC, 0x08, 0xE8});
+                    fixups.push_back({a.rel32(), operand[0]});
+                    a.emit({0x48, 0x83, 0xC4, 0x08});
+                    break;
+                }
+                case DT_TAILCALL: {
+                    // Move the parameters down over the rest of the frame,
+                    // whose depth the verifier knows; the top stays in r13d.
+                    uint32_t depth = static_cast<uint32_t>(profile.depth[pc]);
+                    uint32_t shift = depth - operand[1];
+                    for (uint32_t j = 0; shift > 0 && j + 1 < operand[1]; j++) {
+                        a.emit({0x41, 0x8B, 0x84, 0x24});                       // mov eax, [r12 - 4 * (n - 1 - j)]
+                        a.imm32(static_cast<uint32_t>(-4 * static_cast<int32_t>(operand[1] - 1 - j)));
+                        a.emit({0x41, 0x89, 0x84, 0x24});                       // mov [r12 - 4 * (depth - 1 - j)], eax
+                        a.imm32(static_cast<uint32_t>(-4 * static_cast<int32_t>(depth - 1 - j)));
+                    }
+                    if (shift > 0) {
+                        a.emit({0x49, 0x81, 0xEC});                             // sub r12, 4 * shift
+                        a.imm32(4 * shift);
+                        if (operand[1] == 0) {
+                            a.emit({0x45, 0x8B, 0x2C, 0x24});                   // mov r13d, [r12]
+                        }
+                    }
+                    uint32_t reserve = profile.frame_depth[operand[0]] - operand[1];
+                    // lea rax, [r12 + 4 * reserve]; cmp rax, [rbx + 16]; ja overflow
+                    a.emit({0x49, 0x8D, 0x84, 0x24});
+                    a.imm32(4 * reserve);
+                    a.emit({0x48, 0x3B, 0x43, 0x10});
+                    a.jump(JA);
+                    toOverflow.push_back(a.rel32());
+                    // jmp callee: it returns to this frame's caller
+                    a.emit({0xE9});
+                    fixups.push_back({a.rel32(), operand[0]});
+                    break;
+                }
+                case DT_RET: {
+                    // test r15, r15; jz epilogue (DT_RET in the top-level code ends the program)
+                    a.emit({0x4D, 0x85, 0xFF});
+                    a.jump(JZ);
+                    toEpilogue.push_back(a.rel32());
+                    // Drop the callee's frame below its top, which is the return value.
+                    int32_t depth = profile.depth[pc];
+                    if (depth > 1) {
+                        a.emit({0x49, 0x81, 0xEC});                             // sub r12, 4 * (depth - 1)
+                        a.imm32(4 * (depth - 1));
+                    }
+                    a.emit({0x49, 0xFF, 0xCF, 0xC3});                           // dec r15; ret
+                    break;
+                }
+                case DT_SEEK:                                                   // mov [rbx + 32], r13d
+                    a.emit({0x44, 0x89, 0x6B, 0x20});
+                    break;
+                case DT_PRINT:
+                    a.call_with_tos(reinterpret_cast<const void*>(&print_int));
+                    break;
+                case DT_FP_PRINT:
+                    a.call_with_tos(reinterpret_cast<const void*>(&print_fp));
+                    break;
+                case DT_READ_INT:
+                    a.call_with_imm(reinterpret_cast<const void*>(&read_int), operand[0]);
+                    break;
+                case DT_FP_READ:
+                    a.call_with_imm(reinterpret_cast<const void*>(&read_fp), operand[0]);
+                    break;
+                case DT_Tik:
+                    a.emit({0x48, 0x89, 0xDF});
+                    a.call(reinterpret_cast<const void*>(&tik));
+                    break;
+                case DT_RND:
+                    a.call_with_tos(reinterpret_cast<const void*>(&rnd));
+                    a.emit({0x41, 0x89, 0xC5});                                 // mov r13d, eax
+                    break;
+            }
+            pc = next - 1;
+        }
+
+        // Error exits report, then leave through the epilogue.
+        size_t divError = a.here();
+        a.emit({0x48, 0x89, 0xDF});
+        a.call(reinterpret_cast<const void*>(&divide_by_zero));
+        a.emit({0xE9});
+        toEpilogue.push_back(a.rel32());
+        size_t overflow = a.here();
+        a.emit({0x48, 0x89, 0xDF});
+        a.call(reinterpret_cast<const void*>(&stack_overflow));
+        // mov rsp, [rbx]; pop r15, r14, r13, r12, rbx; ret
+        size_t epilogue = a.here();
+        a.emit({0x48, 0x8B, 0x23, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+
+        for (const auto& [at, word] : fixups) {
+            a.patch(at, nativeAt[word]);
+        }
+        for (size_t at : toEpilogue) {
+            a.patch(at, epilogue);
+        }
+        for (size_t at : toDivError) {
+            a.patch(at, divError);
+        }
+        for (size_t at : toOverflow) {
+            a.patch(at, overflow);
+        }
+
+        release_native();
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        native_size = (a.code.size() + page - 1) / page * page;
+        void* mem = mmap(nullptr, native_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        native = static_cast<uint8_t*>(mem);
+        memcpy(native, a.code.data(), a.code.size());
+        if (mprotect(native, native_size, PROT_READ | PROT_EXEC) != 0) {
+            release_native();
+            return false;
+        }
+        return true;
+    }
+
+public:
+    uint32_t debug_num;
+
+    JitThreadingVM() : buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
+    }
+    ~JitThreadingVM() {
+        release_native();
+        delete[] buffer;
+    }
+
+    void run_vm(std::string filename, bool benchmarkMode) {
+        try {
+            instructions = readFileToUint32Array(filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        if (benchmarkMode) {
+            std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+        }
+        std::vector<uint32_t> code = instructions;
+        run_vm(code);
+    }
+
+    void run_vm(std::vector<uint32_t>& code) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+#if defined(__x86_64__) && !defined(_WIN32)
+        if (!compile()) {
+            std::cerr << "Error: cannot map executable memory for the generated code" << std::endl;
+            return;
+        }
+        // One slot for the empty top cached at the start, then the deepest
+        // chain of frames (or a large fixed stack when recursion is unbounded).
+        stack.resize(profile.recursive ? RECURSIVE_STACK_SLOTS : profile.max_stack + 2);
+        JitState state{0, stack.data(), stack.data() + stack.size(), buffer, debug_num, this};
+        reinterpret_cast<void (*)(JitState*)>(native)(&state);
+        debug_num = state.debug_num;
+#else
+        std::cerr << "Error: the JIT generates x86-64 code and cannot run on this target" << std::endl;
+#endif
+    }
+};
+
+#endif // JITTHREADING_H
@@ -1,4 +1,6 @@
 #include "interface.hpp"
+#include "optimizer.hpp"
+#include "nativebuild.hpp"
 #ifdef direct
 #include "directthreading.cpp"
 #endif
@@ -17,15 +19,57 @@
 #ifdef repl
 #include "replthreading.cpp"
 #endif
+#ifdef reg
+#include "regthreading.cpp"
+#endif
+#ifdef jit
+#include "jitthreading.cpp"
+#endif
+#ifdef stencil
+#include "stencilthreading.cpp"
+#endif
+#ifdef tail
+#include "tailthreading.cpp"
+#endif
+#ifdef tier
+#include "tierthreading.cpp"
+#endif
+#ifdef aot
+#include "aotthreading.cpp"
+#endif
+#ifdef MULTI_ENGINE
+#include "engineselect.cpp"
+#include "readfile.hpp"
+#endif
 
+#include <cstdlib>
 #include <memory>
 #include <iostream>
 int main(int argc, char* argv[]){
     bool isBenchmark = false;
+    #if defined(direct) || defined(MULTI_ENGINE)
+    bool emitC = false;
+    #endif
     std::string filename;
+    std::string engine = "auto"; // Used by the multi-engine build only
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
-        if (arg == "--benchmark" && i + 1 < argc) {
+        if (arg == "--emit-c") {
+    #if defined(direct) || defined(MULTI_ENGINE)
+            emitC = true;
+    #else
+            std::cerr << "Error: --emit-c is only supported by the direct engine" << std::endl;
+            return 1;
+    #endif
+        } else if (arg.rfind("--opt-level=", 0) == 0) {
+            setOptLevel(std::atoi(arg.c_str() + 12));
+        } else if (arg.rfind("--cache-dir=", 0) == 0) {
+            setCompileCacheDir(arg.substr(12));
+    #ifdef MULTI_ENGINE
+        } else if (arg.rfind("--engine=", 0) == 0) {
+            engine = arg.substr(9);
+    #endif
+        } else if (arg == "--benchmark" && i + 1 < argc) {
             isBenchmark = true;
             filename = argv[++i];
         } else if (filename.empty()) {
@@ -33,12 +77,44 @@ int main(int argc, char* argv[]){
         }
     }
     if (filename.empty()) {
-        std::cerr << "Usage: " << argv[0] << " [--benchmark] <filename>" << std::endl;
+    #ifdef MULTI_ENGINE
+        std::cerr << "Usage: " << argv[0] << " [--engine=NAME|auto] [--opt-level=0-2] [--cache-dir=DIR] [--benchmark] [--emit-c] <filename>" << std::endl;
+        std::cerr << "Engines: " << engineNames() << std::endl;
+    #elif defined(direct)
+        std::cerr << "Usage: " << argv[0] << " [--opt-level=0-2] [--cache-dir=DIR] [--benchmark] [--emit-c] <filename>" << std::endl;
+    #else
+        std::cerr << "Usage: " << argv[0] << " [--opt-level=0-2] [--cache-dir=DIR] [--benchmark] <filename>" << std::endl;
+    #endif
         return 1;
     }
     std::unique_ptr<Interface> vm;
+    #ifdef MULTI_ENGINE
+    const EngineEntry* entry = nullptr;
+    if (engine == "auto") {
+        std::vector<uint32_t> code;
+        try {
+            code = readFileToUint32Array(filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        entry = chooseEngine(code, isBenchmark);
+    } else {
+        entry = findEngine(engine);
+    }
+    if (!entry) {
+        std::cerr << "Unknown engine '" << engine << "', expected auto or one of: " << engineNames() << std::endl;
+        return 1;
+    }
+    vm = entry->make();
+    if (auto* directVM = dynamic_cast<DirectThreadingVM*>(vm.get())) {
+        directVM->emit_c = emitC; // Generate and compile C instead of running in-process
+    }
+    #endif
     #ifdef direct
-    vm = std::make_unique<DirectThreadingVM>();
+    auto directVM = std::make_unique<DirectThreadingVM>();
+    directVM->emit_c = emitC; // Generate and compile C instead of running in-process
+    vm = std::move(directVM);
     #elif indirect
     vm = std::make_unique<IndirectThreadingVM>(); 
     #elif routine
@@ -53,10 +129,32 @@ int main(int argc, char* argv[]){
     #if repl
     vm = std::make_unique<ReplThreadingModel>();
     #endif
+    #if reg
+    vm = std::make_unique<RegThreadingVM>();
+    #endif
+    #if jit
+    vm = std::make_unique<JitThreadingVM>();
+    #endif
+    #if stencil
+    vm = std::make_unique<StencilThreadingVM>();
+    #endif
+    #if tail
+    vm = std::make_unique<TailThreadingVM>();
+    #endif
+    #if tier
+    vm = std::make_unique<TierThreadingVM>();
+    #endif
+    #if aot
+    vm = std::make_unique<AotThreadingVM>();
+    #endif
     if (!vm) {
         std::cerr << "Virtual machine implementation not initialized." << std::endl;
         return 1;
     }
     vm->run_vm(filename,isBenchmark);
+    if (isBenchmark) {
+        std::cout << "Optimizer (level " << optLevel() << ") rewrites:" << std::endl;
+        printOptimizerStats(std::cout);
+    }
     return 0;
 }
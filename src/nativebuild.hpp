@@ -0,0 +1,297 @@
+#ifndef NATIVEBUILD_HPP
+#define NATIVEBUILD_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Building generated C into a shared object that an engine dlopens and runs
+// in-process, for the engines that hand the program to a C compiler, the
+// compile cache those engines share, and loading and running the fvm_run()
+// that the C of the whole-program engines (direct --emit-c, routine, aot)
+// exposes.
+
+// C compiler for the generated code: $CC, or the system's `cc`.
+inline std::string cCompilerCommand() {
+    const char* cc = std::getenv("CC");
+    return cc && *cc ? cc : "cc";
+}
+
+// Flags compileSharedObject passes after the compiler.
+inline const std::vector<std::string>& sharedObjectFlags() {
+    static const std::vector<std::string> flags{"-O2", "-shared", "-fPIC", "-w"};
+    return flags;
+}
+
+// The compiler and flags compileSharedObject runs, as one string.
+inline std::string sharedObjectCommand() {
+    std::string command = cCompilerCommand();
+    for (const std::string& flag : sharedObjectFlags()) {
+        command += " " + flag;
+    }
+    return command;
+}
+
+// Compiles `source` into the shared object `object`. Returns whether the
+// compiler ran and succeeded.
+inline bool compileSharedObject(const std::string& source, const std::string& object) {
+    std::string cc = cCompilerCommand();
+    std::vector<const char*> argv{cc.c_str()};
+    for (const std::string& flag : sharedObjectFlags()) {
+        argv.push_back(flag.c_str());
+    }
+    argv.insert(argv.end(), {"-o", object.c_str(), source.c_str(), nullptr});
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, const_cast<char* const*>(argv.data()), environ) != 0) {
+        return false;
+    }
+    int status = -1;
+    waitpid(pid, &status, 0);
+    return status == 0;
+}
+
+// Compile cache: what an engine builds from a program is stored under a key
+// that hashes everything the build depends on, so running the same program
+// again skips both code generation and the C compiler.
+
+// Directory set with main's --cache-dir; empty means the default.
+inline std::string& compileCacheSetting() {
+    static std::string dir;
+    return dir;
+}
+
+inline void setCompileCacheDir(const std::string& dir) {
+    compileCacheSetting() = dir;
+}
+
+// --cache-dir, else $THD_VM_CACHE_DIR, else $XDG_CACHE_HOME/thd_vm, else
+// $HOME/.cache/thd_vm, else /tmp/thd_vm_cache.
+inline std::string compileCacheDir() {
+    if (!compileCacheSetting().empty()) {
+        return compileCacheSetting();
+    }
+    const char* dir = std::getenv("THD_VM_CACHE_DIR");
+    if (dir && *dir) {
+        return dir;
+    }
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) {
+        return std::string(xdg) + "/thd_vm";
+    }
+    const char* home = std::getenv("HOME");
+    if (home && *home) {
+        return std::string(home) + "/.cache/thd_vm";
+    }
+    return "/tmp/thd_vm_cache";
+}
+
+// 64-bit FNV-1a, as 16 hex digits, of the engine, its generator version, the
+// compiler command with its flags, and the optimized bytecode it compiles.
+inline std::string compileCacheKey(const std::string& engine, uint32_t generator_version,
+                                   const std::string& compile_command, const std::vector<uint32_t>& code) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    mix(engine.c_str(), engine.size() + 1);
+    mix(&generator_version, sizeof(generator_version));
+    mix(compile_command.c_str(), compile_command.size() + 1);
+    mix(code.data(), code.size() * sizeof(uint32_t));
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+    return key;
+}
+
+// Path of the artifact `key` + `suffix` in the cache directory, which is
+// created if missing. Empty if the directory cannot be created, or if it is
+// not ours alone (another user's, or writable by others), since what it
+// holds gets loaded into this process.
+inline std::string compileCachePath(const std::string& key, const std::string& suffix) {
+    std::string dir = compileCacheDir();
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    struct stat info;
+    if (stat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid() ||
+        (info.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        return "";
+    }
+    return dir + "/" + key + suffix;
+}
+
+// A directory only this user can enter, made by mkdtemp() under the system
+// temporary directory, for code that is built and loaded at once when there
+// is no cache to hold it. Removed with its contents on destruction.
+class ScratchDir {
+    std::string dir;
+
+public:
+    explicit ScratchDir(const std::string& engine) {
+        std::error_code error;
+        std::string pattern = (std::filesystem::temp_directory_path(error) / ("thd_vm_" + engine + "_XXXXXX")).string();
+        if (!error && mkdtemp(pattern.data())) {
+            dir = pattern;
+        }
+    }
+    ScratchDir(const ScratchDir&) = delete;
+    ScratchDir& operator=(const ScratchDir&) = delete;
+    ~ScratchDir() {
+        if (!dir.empty()) {
+            std::error_code error;
+            std::filesystem::remove_all(dir, error);
+        }
+    }
+
+    // Empty if the directory could not be made.
+    const std::string& path() const {
+        return dir;
+    }
+};
+
+// Builds `path` atomically: `build` writes it under a scratch name in the
+// same directory, which rename() then moves to `path`, so a concurrent run
+// finds either no file or a complete one. Returns whether both succeeded.
+template <typename Build>
+bool publishAtomically(const std::string& path, Build build) {
+    static unsigned serial = 0;
+    std::string scratch = path + ".tmp" + std::to_string(getpid()) + "_" + std::to_string(serial++);
+    bool built = build(scratch) && std::rename(scratch.c_str(), path.c_str()) == 0;
+    if (!built) {
+        unlink(scratch.c_str());
+    }
+    return built;
+}
+
+// Mirrors `struct fvm_ctx` in the generated C (FVM_CONTEXT_C): the memory
+// buffer a run works on, and the state DT_SEEK and DT_RND leave behind.
+struct FvmContext {
+    char* buffer;
+    uint32_t debug_num;
+    uint32_t seed;
+};
+
+inline constexpr const char* FVM_CONTEXT_C =
+    "struct fvm_ctx {\n"
+    "    char* buffer;\n"
+    "    uint32_t debug_num;\n"
+    "    uint32_t seed;\n"
+    "};\n\n";
+
+// A loaded shared object exposing `int fvm_run(struct fvm_ctx*)`, which runs
+// the whole program and returns 0 when it ends, 1 on an error.
+class FvmLibrary {
+    using Run = int (*)(FvmContext*);
+
+    void* handle = nullptr;
+    Run entry = nullptr;
+
+    struct Call {
+        Run entry;
+        FvmContext* ctx;
+        int status;
+    };
+
+    static void* call(void* p) {
+        Call* c = static_cast<Call*>(p);
+        c->status = c->entry(c->ctx);
+        return nullptr;
+    }
+
+public:
+    FvmLibrary() = default;
+    FvmLibrary(const FvmLibrary&) = delete;
+    FvmLibrary& operator=(const FvmLibrary&) = delete;
+    ~FvmLibrary() {
+        close();
+    }
+
+    void close() {
+        if (handle) {
+            dlclose(handle);
+            handle = nullptr;
+            entry = nullptr;
+        }
+    }
+
+    // Loads fvm_run() for `code`, compiled by `engine` from the C that
+    // `write_c(path)` writes. The shared object comes from the compile cache,
+    // built and published there first if it is missing, with its C kept next
+    // to it. Without a cache directory both are built at `stem`.so and .c,
+    // or in a ScratchDir removed once loaded if `stem` is empty. Returns
+    // whether fvm_run() is loaded.
+    template <typename WriteC>
+    bool load(const std::string& engine, uint32_t generator_version, const std::vector<uint32_t>& code,
+              const std::string& stem, WriteC write_c) {
+        close();
+        std::string key = compileCacheKey(engine, generator_version, sharedObjectCommand(), code);
+        std::string base = compileCachePath(key, "");
+        bool cached = !base.empty();
+        bool scratch = !cached && stem.empty();
+        std::optional<ScratchDir> scratch_dir;
+        if (scratch) {
+            scratch_dir.emplace(engine);
+            if (scratch_dir->path().empty()) {
+                return false;
+            }
+            base = scratch_dir->path() + "/" + engine;
+        } else if (!cached) {
+            base = stem;
+        }
+        std::string object = base + ".so";
+        std::string source = base + ".c";
+        bool built = (cached && access(object.c_str(), R_OK) == 0) ||
+                     publishAtomically(object, [&](const std::string& path) {
+                         std::string c = path + ".c";
+                         bool compiled = write_c(c) && compileSharedObject(c, path);
+                         if (compiled && !scratch) {
+                             std::rename(c.c_str(), source.c_str());
+                         }
+                         unlink(c.c_str());
+                         return compiled;
+                     });
+        if (built) {
+            handle = dlopen(object.c_str(), RTLD_NOW | RTLD_LOCAL);
+        }
+        entry = handle ? reinterpret_cast<Run>(dlsym(handle, "fvm_run")) : nullptr;
+        return entry != nullptr;
+    }
+
+    // Runs the loaded fvm_run() on `ctx`, on a thread of its own with a
+    // `stack_bytes` stack for code that recurses natively, or on this thread
+    // when `stack_bytes` is 0. Returns fvm_run's status.
+    int run(FvmContext& ctx, size_t stack_bytes = 0) {
+        std::fflush(stdout);
+        if (stack_bytes == 0) {
+            return entry(&ctx);
+        }
+        Call c{entry, &ctx, 1};
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, stack_bytes);
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, call, &c) == 0) {
+            pthread_join(thread, nullptr);
+        } else {
+            std::fprintf(stderr, "Error: cannot start a thread for the compiled code\n");
+        }
+        pthread_attr_destroy(&attr);
+        return c.status;
+    }
+};
+
+#endif // NATIVEBUILD_HPP
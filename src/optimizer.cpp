@@ -0,0 +1,423 @@
+#include "optimizer.hpp"
+#include "superinstructions.hpp"
+#include "symbol.hpp"
+#include <atomic>
+#include <bit>
+
+namespace {
+
+std::atomic<int> level{DEFAULT_OPT_LEVEL};
+
+size_t nextOf(const std::vector<uint32_t>& code, size_t pc) {
+    return pc + 1 + instructionInfo[code[pc]].operands;
+}
+
+// Result of `a op b`, where b was on top, or false when the engine must see
+// it (division by zero, oversized shifts, or not an operator folded here).
+bool evaluate(uint32_t op, uint32_t a, uint32_t b, uint32_t& result) {
+    float fa = std::bit_cast<float>(a);
+    float fb = std::bit_cast<float>(b);
+    switch (op) {
+        case DT_ADD:    result = a + b; return true;
+        case DT_SUB:    result = a - b; return true;
+        case DT_MUL:    result = a * b; return true;
+        case DT_DIV:    if (b == 0) return false; result = a / b; return true;
+        case DT_MOD:    if (b == 0) return false; result = a % b; return true;
+        case DT_SHL:    if (b >= 32) return false; result = a << b; return true;
+        case DT_SHR:    if (b >= 32) return false; result = a >> b; return true;
+        case DT_GT:     result = a > b; return true;
+        case DT_LT:     result = a < b; return true;
+        case DT_EQ:     result = a == b; return true;
+        case DT_GT_EQ:  result = a >= b; return true;
+        case DT_LT_EQ:  result = a <= b; return true;
+        case DT_FP_ADD: result = std::bit_cast<uint32_t>(fa + fb); return true;
+        case DT_FP_SUB: result = std::bit_cast<uint32_t>(fa - fb); return true;
+        case DT_FP_MUL: result = std::bit_cast<uint32_t>(fa * fb); return true;
+        case DT_FP_DIV: if (fb == 0.0f) return false; result = std::bit_cast<uint32_t>(fa / fb); return true;
+        default:        return false;
+    }
+}
+
+// A branch to the next instruction: it only drops the top.
+bool isPop(const std::vector<uint32_t>& code, size_t pc) {
+    switch (code[pc]) {
+        case DT_JZ:
+        case DT_JUMP_IF:
+            return code[pc + 1] == 0;
+        case DT_IF_ELSE:
+            return code[pc + 1] == 0 && code[pc + 2] == 0;
+        default:
+            return false;
+    }
+}
+
+bool isPush(uint32_t op) {
+    return op == DT_DUP || op == DT_IMMI || op == DT_LOD;
+}
+
+bool isPureUnary(uint32_t op) {
+    return op == DT_INC || op == DT_DEC;
+}
+
+bool isPureBinary(uint32_t op) {
+    switch (op) {
+        case DT_ADD: case DT_SUB: case DT_MUL: case DT_SHL: case DT_SHR:
+        case DT_FP_ADD: case DT_FP_SUB: case DT_FP_MUL:
+        case DT_GT: case DT_LT: case DT_EQ: case DT_GT_EQ: case DT_LT_EQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Instructions that touch memory or the outside world, or can end the run.
+bool hasSideEffect(uint32_t op) {
+    switch (op) {
+        case DT_STO: case DT_STO_IMMI: case DT_MEMCPY: case DT_MEMSET:
+        case DT_SEEK: case DT_PRINT: case DT_READ_INT: case DT_FP_PRINT: case DT_FP_READ:
+        case DT_Tik: case DT_SYSCALL: case DT_RND: case DT_END:
+        case DT_DIV: case DT_MOD: case DT_FP_DIV:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// What inlineCalls knows about one function.
+struct Callee {
+    bool visited = false;
+    bool pure = false;      // No side effects, no loops, only calls pure functions
+    bool inlinable = false;
+    std::vector<uint32_t> body;  // Its straight-line code without the DT_RET, when inlinable
+};
+
+// Whether the function at `entry` is side-effect free and certain to return:
+// it has no instruction with a side effect and no backward branch, and it
+// calls only functions that are pure in turn (recursion is not).
+bool isPure(const std::vector<uint32_t>& code, uint32_t entry, std::vector<Callee>& callees) {
+    Callee& callee = callees[entry];
+    if (callee.visited) {
+        return callee.pure;  // false while `entry` is still being looked at
+    }
+    callee.visited = true;
+    std::vector<size_t> work{entry};
+    std::vector<uint8_t> seen(code.size(), 0);
+    bool pure = true;
+    while (pure && !work.empty()) {
+        size_t pc = work.back();
+        work.pop_back();
+        if (seen[pc]) {
+            continue;
+        }
+        seen[pc] = 1;
+        uint32_t op = code[pc];
+        size_t next = nextOf(code, pc);
+        if (hasSideEffect(op)) {
+            pure = false;
+        } else if (op == DT_CALL || op == DT_CALL_INC) {
+            pure = isPure(code, code[pc + 1], callees);
+            work.push_back(next);
+        } else if (op == DT_TAILCALL) {
+            pure = isPure(code, code[pc + 1], callees);
+        } else if (op != DT_RET) {
+            BranchOperands t = branchOperands(op);
+            for (int r : t.relative) {
+                if (r >= 0) {
+                    size_t target = next + static_cast<int32_t>(code[pc + 1 + r]);
+                    pure = pure && target > pc;
+                    work.push_back(target);
+                }
+            }
+            if (op != DT_JMP && op != DT_IF_ELSE && op != DT_GUARD_GT && op != DT_GUARD_EQ) {
+                work.push_back(next);
+            }
+        }
+    }
+    callee.pure = pure;
+    return pure;
+}
+
+// Fills in `body` and `inlinable` for the function at `entry`: it must run
+// straight through (its only branches are pops) to a DT_RET that leaves at
+// most one value, with no call on the way, in at most INLINE_MAX_WORDS words.
+constexpr size_t INLINE_MAX_WORDS = 16;
+
+void findBody(const std::vector<uint32_t>& code, const StackProfile& profile, uint32_t entry, Callee& callee) {
+    std::vector<uint32_t> body;
+    for (size_t pc = entry; pc < code.size() && body.size() <= INLINE_MAX_WORDS; pc = nextOf(code, pc)) {
+        uint32_t op = code[pc];
+        if (op == DT_RET) {
+            callee.inlinable = profile.depth[pc] <= 1;
+            callee.body = std::move(body);
+            return;
+        }
+        bool pop = isPop(code, pc);
+        if (op == DT_CALL || op == DT_CALL_INC || op == DT_TAILCALL || op == DT_END ||
+            (branchOperands(op).relative[0] >= 0 && !pop)) {
+            return;
+        }
+        body.push_back(op);
+        for (uint32_t k = 1; k <= instructionInfo[op].operands; k++) {
+            body.push_back(pop ? FALL_THROUGH : code[pc + k]);
+        }
+    }
+}
+
+struct Pass {
+    const char* name;
+    int level;  // Lowest level that runs it
+    size_t (*run)(std::vector<uint32_t>& code, StackProfile& profile);
+    std::atomic<size_t> rewrites{0};
+};
+
+Pass foldPass{"constant-folding", 2, foldConstants};
+Pass cancelPass{"push-pop-cancellation", 2, cancelPushPop};
+Pass threadPass{"jump-threading", 1, threadJumps};
+Pass inlinePass{"call-inlining", 2, inlineCalls};
+Pass tailCallPass{"tail-calls", 1, markTailCalls};
+Pass deadCodePass{"dead-code-removal", 2, removeDeadCode};
+Pass* const passes[] = {&foldPass, &cancelPass, &inlinePass, &threadPass, &tailCallPass, &deadCodePass};
+
+// Folding, cancelling and inlining feed each other (a folded comparison
+// becomes a push that a pop cancels, a callee whose guard was cancelled can
+// be inlined, and its body cancels against the call site's pushes); they
+// stop after this many rounds regardless.
+constexpr int MAX_ROUNDS = 16;
+
+size_t runPass(Pass& pass, std::vector<uint32_t>& code, StackProfile& profile) {
+    if (optLevel() < pass.level) {
+        return 0;
+    }
+    size_t count = pass.run(code, profile);
+    pass.rewrites += count;
+    return count;
+}
+
+} // namespace
+
+void setOptLevel(int l) {
+    level = l < 0 ? 0 : (l > MAX_OPT_LEVEL ? MAX_OPT_LEVEL : l);
+}
+
+int optLevel() {
+    return level;
+}
+
+size_t optimizeProgram(std::vector<uint32_t>& code, StackProfile& profile) {
+    size_t total = 0;
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        size_t count = runPass(foldPass, code, profile) + runPass(cancelPass, code, profile) +
+                       runPass(inlinePass, code, profile);
+        total += count;
+        if (count == 0) {
+            break;
+        }
+    }
+    total += runPass(threadPass, code, profile);
+    total += runPass(tailCallPass, code, profile);
+    total += runPass(deadCodePass, code, profile);
+    return total;
+}
+
+void printOptimizerStats(std::ostream& out) {
+    for (const Pass* pass : passes) {
+        out << pass->name << ": " << pass->rewrites << std::endl;
+    }
+}
+
+size_t foldConstants(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    std::vector<uint8_t> landing = landingWords(code, profile);
+    std::vector<Rewrite> rewrites(n);
+    size_t count = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        std::vector<size_t> run = straightRun(code, landing, pc, 3);
+        auto opAt = [&](size_t i) { return i < run.size() ? code[run[i]] : uint32_t{DT_NUM_INSTRUCTIONS}; };
+        Rewrite& r = rewrites[pc];
+        uint32_t result;
+        if (opAt(0) == DT_IMMI && opAt(1) == DT_IMMI &&
+            evaluate(opAt(2), code[pc + 1], code[run[1] + 1], result)) {
+            r.end = nextOf(code, run[2]);
+            r.words = {DT_IMMI, result};
+        } else if (opAt(0) == DT_IMMI && (opAt(1) == DT_INC || opAt(1) == DT_DEC)) {
+            r.end = nextOf(code, run[1]);
+            r.words = {DT_IMMI, opAt(1) == DT_INC ? code[pc + 1] + 1 : code[pc + 1] - 1};
+        } else if (opAt(0) == DT_IMMI && (opAt(1) == DT_JZ || opAt(1) == DT_JUMP_IF || opAt(1) == DT_IF_ELSE)) {
+            uint32_t c = code[pc + 1];
+            size_t branch = run[1];
+            size_t next = nextOf(code, branch);
+            size_t taken = next + static_cast<int32_t>(code[branch + 1]);
+            size_t to = next;
+            if (opAt(1) == DT_JZ) {
+                to = c == 0 ? taken : next;
+            } else if (opAt(1) == DT_JUMP_IF) {
+                to = c != 0 ? taken : next;
+            } else {
+                to = c != 0 ? taken : next + static_cast<int32_t>(code[branch + 2]);
+            }
+            r.end = next;
+            if (to != next) {
+                r.words = {DT_JMP, static_cast<uint32_t>(to)};
+            }
+        }
+        if (r.end) {
+            count++;
+            pc = r.end - 1;
+        } else {
+            pc = nextOf(code, pc) - 1;
+        }
+    }
+    return applyRewrites(code, profile, rewrites, count);
+}
+
+size_t cancelPushPop(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    std::vector<uint8_t> landing = landingWords(code, profile);
+    std::vector<Rewrite> rewrites(n);
+    size_t count = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        std::vector<size_t> run = straightRun(code, landing, pc, 3);
+        auto opAt = [&](size_t i) { return i < run.size() ? code[run[i]] : uint32_t{DT_NUM_INSTRUCTIONS}; };
+        auto popAt = [&](size_t i) { return i < run.size() && isPop(code, run[i]); };
+        Rewrite& r = rewrites[pc];
+        if (isPush(opAt(0)) && popAt(1)) {
+            r.end = nextOf(code, run[1]);
+        } else if (isPush(opAt(0)) && isPureBinary(opAt(1)) && popAt(2)) {
+            r.end = nextOf(code, run[2]);
+            r.words = {DT_JZ, static_cast<uint32_t>(r.end)};
+        } else if (isPureUnary(opAt(0)) && popAt(1)) {
+            r.end = nextOf(code, run[1]);
+            r.words = {DT_JZ, static_cast<uint32_t>(r.end)};
+        }
+        if (r.end) {
+            count++;
+            pc = r.end - 1;
+        } else {
+            pc = nextOf(code, pc) - 1;
+        }
+    }
+    return applyRewrites(code, profile, rewrites, count);
+}
+
+size_t inlineCalls(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    std::vector<Callee> callees(n);
+    for (size_t f = 1; f < profile.entries.size(); f++) {
+        uint32_t entry = profile.entries[f];
+        isPure(code, entry, callees);
+        findBody(code, profile, entry, callees[entry]);
+    }
+    std::vector<Rewrite> rewrites(n);
+    size_t count = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        size_t next = nextOf(code, pc);
+        uint32_t op = code[pc];
+        if (op == DT_CALL || op == DT_CALL_INC) {
+            uint32_t entry = code[pc + 1];
+            uint32_t params = code[pc + 2];
+            const Callee& callee = callees[entry];
+            Rewrite& r = rewrites[pc];
+            if (op == DT_CALL_INC) {
+                r.words = {DT_DUP, DT_INC};
+            }
+            if (callee.pure && !profile.returns_value[entry]) {
+                // Nothing to run: drop the parameters.
+                for (uint32_t k = 0; k < params; k++) {
+                    r.words.insert(r.words.end(), {DT_JZ, FALL_THROUGH});
+                }
+                r.end = next;
+            } else if (callee.inlinable) {
+                // The parameters are the top of the caller's frame, where the
+                // callee's frame would start, and the DT_RET leaves at most
+                // one value, which is already on top.
+                r.words.insert(r.words.end(), callee.body.begin(), callee.body.end());
+                r.end = next;
+            } else {
+                r.words.clear();
+            }
+            count += r.end ? 1 : 0;
+        }
+        pc = next - 1;
+    }
+    return applyRewrites(code, profile, rewrites, count);
+}
+
+size_t markTailCalls(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    size_t count = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        size_t next = nextOf(code, pc);
+        if (code[pc] == DT_CALL) {
+            // Follow jumps and pops to the DT_RET, if that is all there is.
+            size_t at = next;
+            size_t pops = 0;
+            for (size_t steps = 0; steps < n && code[at] != DT_RET; steps++) {
+                if (code[at] == DT_JMP) {
+                    at = at + 2 + static_cast<int32_t>(code[at + 1]);
+                } else if (isPop(code, at)) {
+                    at = nextOf(code, at);
+                    pops++;
+                } else {
+                    break;
+                }
+            }
+            // The callee's value is returned as it is, or nothing is: after
+            // dropping whatever the caller kept below the parameters.
+            bool in_tail = code[at] == DT_RET &&
+                        (profile.returns_value[code[pc + 1]] ? pops == 0 : profile.depth[at] == 0);
+            if (in_tail) {
+                code[pc] = DT_TAILCALL;
+                count++;
+            }
+        }
+        pc = next - 1;
+    }
+    if (count > 0) {
+        profile = verifyProgram(code);
+    }
+    return count;
+}
+
+size_t removeDeadCode(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    std::vector<Rewrite> rewrites(n);
+    size_t dead = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            dead++;
+            continue;
+        }
+        // So does a DT_JMP over nothing but dead words (converter.py ends the
+        // last branch body with a DT_JMP 0).
+        if (code[pc] == DT_JMP && static_cast<int32_t>(code[pc + 1]) >= 0) {
+            size_t target = pc + 2 + code[pc + 1];
+            size_t w = pc + 2;
+            while (w < target && profile.depth[w] < 0) {
+                w++;
+            }
+            if (w == target) {
+                rewrites[pc].end = pc + 2;
+                dead += 2;
+            }
+        }
+        pc = nextOf(code, pc) - 1;
+    }
+    if (dead == 0) {
+        return 0;
+    }
+    code = relayout(code, profile, rewrites);
+    profile = verifyProgram(code);
+    return dead;
+}
@@ -0,0 +1,86 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include "verifier.hpp"
+
+// Load-time bytecode optimizer. Every engine hands it the verified program
+// before pre-decoding, translating or generating code, and it runs the passes
+// up to the process's optimization level over it:
+//   level 0  nothing
+//   level 1  jump threading (threadJumps), then tail calls, both of which
+//            keep the code's layout
+//   level 2  the default: level 1, preceded by constant folding, push/pop
+//            cancellation and call inlining repeated until none of them
+//            finds anything, and followed by dead code removal
+// Each pass re-verifies what it rewrites, so `profile` always describes
+// `code`. Superinstruction fusion is not part of it: it is an engine's
+// choice, made on the optimized code.
+constexpr int DEFAULT_OPT_LEVEL = 2;
+constexpr int MAX_OPT_LEVEL = 2;
+
+// The level for every engine in the process (main's --opt-level).
+void setOptLevel(int level);
+int optLevel();
+
+// Runs the passes of optLevel() over `code`, which must already have passed
+// verifyProgram. Returns the number of rewrites all of them made.
+size_t optimizeProgram(std::vector<uint32_t>& code, StackProfile& profile);
+
+// Rewrites made by each pass, summed over every program optimized in this
+// process, one `name: count` line per pass.
+void printOptimizerStats(std::ostream& out);
+
+// The passes. Each takes verified code and returns what it changed (0 leaves
+// `code` and `profile` untouched). None of them rewrites a sequence that a
+// branch or call lands inside.
+
+// DT_IMMI a, DT_IMMI b, <arithmetic or comparison>  ->  DT_IMMI result
+// DT_IMMI a, DT_INC / DT_DEC                         ->  DT_IMMI a +/- 1
+// DT_IMMI c, DT_JZ / DT_JUMP_IF / DT_IF_ELSE         ->  DT_JMP to the branch
+//                                                       taken, or nothing
+// Division by zero and shifts by 32 or more are left for the engine. Returns
+// the number of sequences folded.
+size_t foldConstants(std::vector<uint32_t>& code, StackProfile& profile);
+
+// converter.py drops values with a branch to the next instruction (DT_JZ 0,
+// and DT_IF_ELSE 0 0 when both of its targets are the next instruction). Such
+// a pop cancels against the instructions that computed its value:
+//   <push>, <pop>            ->  nothing
+//   <push>, <binary>, <pop>  ->  <pop>
+//   <unary>, <pop>           ->  <pop>
+// where a push is DT_DUP, DT_IMMI or DT_LOD, and the unary and binary
+// instructions are those without side effects that cannot fail (no
+// division). Returns the number of sequences removed.
+size_t cancelPushPop(std::vector<uint32_t>& code, StackProfile& profile);
+
+// converter.py gives every terminal a function of its own, which after the
+// passes above only drops its parameter and returns. A call to a function
+// that is side-effect free and returns nothing becomes pops of its
+// parameters (which cancelPushPop then removes with the pushes that made
+// them), and a call to a function whose code runs straight to its DT_RET in
+// at most 16 words is replaced by a copy of that code. Side-effect free
+// means no memory writes, I/O, system calls, DT_RND, DT_END or division, no
+// backward branch, and calls to side-effect free functions only, so such a
+// function always returns. Returns the number of calls removed or inlined.
+size_t inlineCalls(std::vector<uint32_t>& code, StackProfile& profile);
+
+// converter.py ends a branch body that calls a rule with a DT_JMP to `_ret`,
+// which drops the parameter and returns: the call is in tail position. A
+// DT_CALL followed, through DT_JMPs and pops only, by a DT_RET becomes a
+// DT_TAILCALL (same operands) when that returns what the callee returns, or
+// nothing with a callee that returns nothing. The callee then runs in the
+// caller's frame, and right-recursive rules in constant stack space. Keeps
+// the layout; returns the number of calls rewritten.
+size_t markTailCalls(std::vector<uint32_t>& code, StackProfile& profile);
+
+// Drops every word no path from word 0 or a call target reaches: the code
+// after a DT_JMP, DT_RET or DT_END that nothing branches to, and the filler
+// threadJumps leaves behind, along with every DT_JMP that only skips dead
+// words. Returns the number of words removed.
+size_t removeDeadCode(std::vector<uint32_t>& code, StackProfile& profile);
+
+#endif
@@ -2,6 +2,8 @@
 #define READFILE_HPP
 
 #include <vector>
+#include <string>
+#include <cstdint>
 
 std::vector<uint32_t> readFileToUint32Array(const std::string& fileName);
 #endif
\ No newline at end of file
@@ -0,0 +1,763 @@
+#ifndef REGTHREADING_H
+#define REGTHREADING_H
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include "symbol.hpp"
+#include "readfile.hpp"
+#include "interface.hpp"
+#include "verifier.hpp"
+#include "optimizer.hpp"
+
+// Register VM: the stack bytecode is translated once, at load time, into a
+// three-address form and that form is interpreted with computed goto.
+//
+// Every operand-stack slot of a frame becomes a register of that frame (the
+// value at depth k lives in r[k]), so the verifier's per-instruction depths
+// fix each operand's register statically. While translating a basic block
+// the translator keeps an abstract stack whose entries say where a value is:
+// in a register, as a constant (DT_IMMI), or as a compare not yet evaluated.
+// DT_DUP and DT_IMMI therefore cost no instruction, arithmetic with a
+// constant uses an immediate form, and a compare followed by a conditional
+// branch becomes one compare-and-branch. At block boundaries, calls and
+// returns the abstract stack is written back so every value is in its own
+// register again.
+class RegThreadingVM : public Interface {
+    enum RegOp : uint32_t {
+        // Binary operations, register-register then register-immediate
+        R_ADD, R_SUB, R_MUL, R_DIV, R_MOD, R_SHL, R_SHR,
+        R_FP_ADD, R_FP_SUB, R_FP_MUL, R_FP_DIV,
+        R_GT, R_LT, R_EQ, R_NE, R_GT_EQ, R_LT_EQ,
+        I_ADD, I_SUB, I_MUL, I_DIV, I_MOD, I_SHL, I_SHR,
+        I_FP_ADD, I_FP_SUB, I_FP_MUL, I_FP_DIV,
+        I_GT, I_LT, I_EQ, I_NE, I_GT_EQ, I_LT_EQ,
+        // Compare and branch to `c` when the comparison holds
+        J_GT, J_LT, J_EQ, J_NE, J_GT_EQ, J_LT_EQ,
+        JI_GT, JI_LT, JI_EQ, JI_NE, JI_GT_EQ, JI_LT_EQ,
+        MOV, MOVI, LOAD, STORE, STOREI, MEMCPY, MEMSET,
+        JMP, JZ, JNZ, CALL, TAILCALL, RET, RET_VOID, END,
+        SEEK, PRINT, FP_PRINT, READ_INT, FP_READ, TIK, RND,
+        NUM_REG_OPS
+    };
+    // Offset from a register-register operation to its immediate form
+    static constexpr uint32_t IMM_FORM = I_ADD - R_ADD;
+
+    struct RegInstr {
+        uint32_t op;
+        uint32_t dst;
+        uint32_t a;
+        uint32_t b;   // Register or immediate, depending on the form
+        uint32_t c;   // Branch or call target (index into `code`)
+    };
+
+    // Where a value on the abstract stack lives during translation.
+    struct Operand {
+        enum Kind : uint8_t { REG, CONST, CMP } kind;
+        uint32_t value;  // Register or constant
+    };
+    // The compare on top of the abstract stack, when its kind is CMP.
+    struct PendingCmp {
+        uint32_t op;     // R_GT .. R_LT_EQ
+        Operand lhs;
+        Operand rhs;
+    };
+
+    struct CallFrame {
+        uint32_t ret;    // Index of the instruction after the CALL
+        uint32_t base;   // Caller's first register
+    };
+
+    StackProfile profile;
+    std::vector<uint32_t> instructions;
+    std::vector<RegInstr> code;
+    std::vector<uint32_t> regs;
+    std::vector<CallFrame> frames;
+    char* buffer;
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+
+    // Translation state
+    std::vector<Operand> vs;
+    PendingCmp pending;
+    std::vector<uint32_t> block_start;                         // Word -> first instruction, for leaders
+    std::vector<std::pair<size_t, uint32_t>> fixups;           // (instruction, target word)
+
+    uint32_t rd() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+    inline float to_float(uint32_t val) {
+        float f;
+        memcpy(&f, &val, sizeof(f));
+        return f;
+    }
+    inline uint32_t from_float(float val) {
+        uint32_t u;
+        memcpy(&u, &val, sizeof(u));
+        return u;
+    }
+    inline void write_mem32(uint32_t val, uint32_t offset) {
+        memcpy(buffer + offset, &val, 4);
+    }
+    inline uint32_t read_mem32(uint32_t offset) {
+        uint32_t val;
+        memcpy(&val, buffer + offset, 4);
+        return val;
+    }
+
+    static bool is_compare(uint32_t op) {
+        return op >= R_GT && op <= R_LT_EQ;
+    }
+    static bool is_commutative(uint32_t op) {
+        return op == R_ADD || op == R_MUL || op == R_EQ || op == R_NE;
+    }
+    // The comparison that holds when `op` holds with its operands swapped.
+    static uint32_t swapped(uint32_t op) {
+        switch (op) {
+            case R_GT: return R_LT;
+            case R_LT: return R_GT;
+            case R_GT_EQ: return R_LT_EQ;
+            case R_LT_EQ: return R_GT_EQ;
+            default: return op;
+        }
+    }
+    // The comparison that holds exactly when `op` does not (integers only).
+    static uint32_t negated(uint32_t op) {
+        switch (op) {
+            case R_GT: return R_LT_EQ;
+            case R_LT: return R_GT_EQ;
+            case R_EQ: return R_NE;
+            case R_NE: return R_EQ;
+            case R_GT_EQ: return R_LT;
+            default: return R_GT;  // R_LT_EQ
+        }
+    }
+
+    // Evaluates a binary operation on constants; false if it must run instead
+    // (division by zero reports its error at run time).
+    bool fold(uint32_t op, uint32_t a, uint32_t b, uint32_t& out) {
+        switch (op) {
+            case R_ADD: out = a + b; return true;
+            case R_SUB: out = a - b; return true;
+            case R_MUL: out = a * b; return true;
+            case R_DIV: if (b == 0) return false; out = a / b; return true;
+            case R_MOD: if (b == 0) return false; out = a % b; return true;
+            case R_SHL: out = a << b; return true;
+            case R_SHR: out = a >> b; return true;
+            case R_FP_ADD: out = from_float(to_float(a) + to_float(b)); return true;
+            case R_FP_SUB: out = from_float(to_float(a) - to_float(b)); return true;
+            case R_FP_MUL: out = from_float(to_float(a) * to_float(b)); return true;
+            case R_FP_DIV: if (to_float(b) == 0.0f) return false; out = from_float(to_float(a) / to_float(b)); return true;
+            case R_GT: out = a > b; return true;
+            case R_LT: out = a < b; return true;
+            case R_EQ: out = a == b; return true;
+            case R_NE: out = a != b; return true;
+            case R_GT_EQ: out = a >= b; return true;
+            case R_LT_EQ: out = a <= b; return true;
+            default: return false;
+        }
+    }
+
+    size_t emit(uint32_t op, uint32_t dst = 0, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+        code.push_back({op, dst, a, b, c});
+        return code.size() - 1;
+    }
+    void emit_jump(uint32_t op, uint32_t a, uint32_t b, uint32_t target_word) {
+        fixups.push_back({emit(op, 0, a, b), target_word});
+    }
+
+    // Puts the value of `v` into register `dst`.
+    void place(const Operand& v, uint32_t dst) {
+        if (v.kind == Operand::CONST) {
+            emit(MOVI, dst, 0, v.value);
+        } else if (v.value != dst) {
+            emit(MOV, dst, v.value);
+        }
+    }
+
+    // Emits `dst = lhs op rhs`, choosing the register or immediate form.
+    // A constant left operand of a non-commutative operation is first moved
+    // into `dst`, which no other live value refers to.
+    void emit_binary(uint32_t op, Operand lhs, Operand rhs, uint32_t dst) {
+        if (lhs.kind == Operand::CONST && rhs.kind == Operand::REG) {
+            if (is_commutative(op) || is_compare(op)) {
+                std::swap(lhs, rhs);
+                op = swapped(op);
+            } else {
+                emit(MOVI, dst, 0, lhs.value);
+                lhs = {Operand::REG, dst};
+            }
+        }
+        if (rhs.kind == Operand::CONST) {
+            emit(op + IMM_FORM, dst, lhs.value, rhs.value);
+        } else {
+            emit(op, dst, lhs.value, rhs.value);
+        }
+    }
+
+    // Evaluates a pending compare into its own register.
+    void flush_pending() {
+        if (!vs.empty() && vs.back().kind == Operand::CMP) {
+            uint32_t slot = vs.size() - 1;
+            emit_binary(pending.op, pending.lhs, pending.rhs, slot);
+            vs.back() = {Operand::REG, slot};
+        }
+    }
+
+    // Writes the abstract stack back so the value at depth k is in r[k].
+    // Going upwards is safe: a register is only referenced from above while
+    // its own slot still holds it, so a slot that needs writing is unused.
+    void materialize() {
+        flush_pending();
+        for (uint32_t k = 0; k < vs.size(); k++) {
+            if (vs[k].kind != Operand::REG || vs[k].value != k) {
+                place(vs[k], k);
+                vs[k] = {Operand::REG, k};
+            }
+        }
+    }
+
+    Operand pop_value() {
+        Operand v = vs.back();
+        vs.pop_back();
+        return v;
+    }
+
+    // Conditional branch to `target_word` when `cond` is non-zero (or zero,
+    // when `when_zero` is set). The rest of the stack is already materialized.
+    void emit_cond_jump(const Operand& cond, const PendingCmp& cmp, bool when_zero, uint32_t target_word) {
+        if (cond.kind == Operand::CONST) {
+            if ((cond.value == 0) == when_zero) {
+                emit_jump(JMP, 0, 0, target_word);
+            }
+        } else if (cond.kind == Operand::REG) {
+            emit_jump(when_zero ? JZ : JNZ, cond.value, 0, target_word);
+        } else {
+            uint32_t op = when_zero ? negated(cmp.op) : cmp.op;
+            Operand lhs = cmp.lhs;
+            Operand rhs = cmp.rhs;
+            if (lhs.kind == Operand::CONST && rhs.kind == Operand::CONST) {
+                uint32_t taken = 0;
+                fold(op, lhs.value, rhs.value, taken);
+                if (taken) {
+                    emit_jump(JMP, 0, 0, target_word);
+                }
+                return;
+            }
+            if (lhs.kind == Operand::CONST) {
+                std::swap(lhs, rhs);
+                op = swapped(op);
+            }
+            uint32_t form = (rhs.kind == Operand::CONST ? JI_GT : J_GT) + (op - R_GT);
+            emit_jump(form, lhs.value, rhs.value, target_word);
+        }
+    }
+
+    uint32_t branch_target(uint32_t pc, uint32_t next, int operand) {
+        return next + static_cast<int32_t>(instructions[pc + 1 + operand]);
+    }
+
+    // Translates the verified stack bytecode into `code`.
+    void translate() {
+        const std::vector<uint32_t>& in = instructions;
+        code.clear();
+        fixups.clear();
+        vs.clear();
+        block_start.assign(in.size(), UINT32_MAX);
+
+        // Leaders: function entries and branch targets
+        std::vector<uint8_t> leader(in.size(), 0);
+        for (uint32_t entry : profile.entries) {
+            leader[entry] = 1;
+        }
+        for (uint32_t pc = 0; pc < in.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = in[pc];
+            uint32_t next = pc + 1 + instructionInfo[op].operands;
+            if (op == DT_JMP || op == DT_JZ || op == DT_JUMP_IF) {
+                leader[branch_target(pc, next, 0)] = 1;
+            } else if (op == DT_IF_ELSE) {
+                leader[branch_target(pc, next, 0)] = 1;
+                leader[branch_target(pc, next, 1)] = 1;
+            } else if (op == DT_GUARD_GT || op == DT_GUARD_EQ) {
+                leader[branch_target(pc, next, 1)] = 1;
+                leader[branch_target(pc, next, 2)] = 1;
+            }
+        }
+
+        bool falls_through = false;
+        for (uint32_t pc = 0; pc < in.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = in[pc];
+            uint32_t next = pc + 1 + instructionInfo[op].operands;
+            if (leader[pc] || !falls_through) {
+                if (falls_through) {
+                    materialize();
+                }
+                block_start[pc] = code.size();
+                vs.clear();
+                for (int32_t k = 0; k < profile.depth[pc]; k++) {
+                    vs.push_back({Operand::REG, static_cast<uint32_t>(k)});
+                }
+            }
+            if (op != DT_JZ && op != DT_JUMP_IF && op != DT_IF_ELSE) {
+                flush_pending();
+            }
+            falls_through = true;
+            uint32_t top = vs.size();  // Register of a value pushed now
+            switch (op) {
+                case DT_ADD: case DT_SUB: case DT_MUL: case DT_DIV: case DT_MOD:
+                case DT_SHL: case DT_SHR:
+                case DT_FP_ADD: case DT_FP_SUB: case DT_FP_MUL: case DT_FP_DIV:
+                case DT_GT: case DT_LT: case DT_EQ: case DT_GT_EQ: case DT_LT_EQ: {
+                    uint32_t rop;
+                    switch (op) {
+                        case DT_ADD: rop = R_ADD; break;
+                        case DT_SUB: rop = R_SUB; break;
+                        case DT_MUL: rop = R_MUL; break;
+                        case DT_DIV: rop = R_DIV; break;
+                        case DT_MOD: rop = R_MOD; break;
+                        case DT_SHL: rop = R_SHL; break;
+                        case DT_SHR: rop = R_SHR; break;
+                        case DT_FP_ADD: rop = R_FP_ADD; break;
+                        case DT_FP_SUB: rop = R_FP_SUB; break;
+                        case DT_FP_MUL: rop = R_FP_MUL; break;
+                        case DT_FP_DIV: rop = R_FP_DIV; break;
+                        case DT_GT: rop = R_GT; break;
+                        case DT_LT: rop = R_LT; break;
+                        case DT_EQ: rop = R_EQ; break;
+                        case DT_GT_EQ: rop = R_GT_EQ; break;
+                        default: rop = R_LT_EQ; break;
+                    }
+                    Operand rhs = pop_value();
+                    Operand lhs = pop_value();
+                    uint32_t dst = vs.size();
+                    uint32_t folded;
+                    if (lhs.kind == Operand::CONST && rhs.kind == Operand::CONST &&
+                        fold(rop, lhs.value, rhs.value, folded)) {
+                        vs.push_back({Operand::CONST, folded});
+                    } else if (is_compare(rop)) {
+                        pending = {rop, lhs, rhs};
+                        vs.push_back({Operand::CMP, dst});
+                    } else {
+                        emit_binary(rop, lhs, rhs, dst);
+                        vs.push_back({Operand::REG, dst});
+                    }
+                    break;
+                }
+                case DT_INC:
+                case DT_DEC: {
+                    Operand v = pop_value();
+                    uint32_t dst = vs.size();
+                    if (v.kind == Operand::CONST) {
+                        vs.push_back({Operand::CONST, op == DT_INC ? v.value + 1 : v.value - 1});
+                    } else {
+                        emit(op == DT_INC ? I_ADD : I_SUB, dst, v.value, 1);
+                        vs.push_back({Operand::REG, dst});
+                    }
+                    break;
+                }
+                case DT_DUP:
+                    vs.push_back(vs.back());
+                    break;
+                case DT_IMMI:
+                    vs.push_back({Operand::CONST, in[pc + 1]});
+                    break;
+                case DT_LOD:
+                    emit(LOAD, top, 0, in[pc + 1]);
+                    vs.push_back({Operand::REG, top});
+                    break;
+                case DT_STO: {
+                    Operand v = pop_value();
+                    if (v.kind == Operand::CONST) {
+                        emit(STOREI, 0, in[pc + 1], v.value);
+                    } else {
+                        emit(STORE, 0, in[pc + 1], v.value);
+                    }
+                    break;
+                }
+                case DT_STO_IMMI:
+                    emit(STOREI, 0, in[pc + 1], in[pc + 2]);
+                    break;
+                case DT_MEMCPY:
+                    emit(MEMCPY, in[pc + 1], in[pc + 2], in[pc + 3]);
+                    break;
+                case DT_MEMSET:
+                    emit(MEMSET, in[pc + 1], in[pc + 2], in[pc + 3]);
+                    break;
+                case DT_END:
+                    emit(END);
+                    falls_through = false;
+                    break;
+                case DT_JMP:
+                    materialize();
+                    emit_jump(JMP, 0, 0, branch_target(pc, next, 0));
+                    falls_through = false;
+                    break;
+                case DT_JZ:
+                case DT_JUMP_IF: {
+                    Operand cond = pop_value();
+                    PendingCmp cmp = pending;
+                    materialize();
+                    emit_cond_jump(cond, cmp, op == DT_JZ, branch_target(pc, next, 0));
+                    break;
+                }
+                case DT_IF_ELSE: {
+                    Operand cond = pop_value();
+                    PendingCmp cmp = pending;
+                    materialize();
+                    uint32_t on_true = branch_target(pc, next, 0);
+                    uint32_t on_false = branch_target(pc, next, 1);
+                    if (on_true == next) {
+                        emit_cond_jump(cond, cmp, true, on_false);
+                    } else {
+                        emit_cond_jump(cond, cmp, false, on_true);
+                        if (on_false != next) {
+                            emit_jump(JMP, 0, 0, on_false);
+                            falls_through = false;
+                        }
+                    }
+                    break;
+                }
+                // Superinstructions are what the abstract stack makes of the
+                // idioms they fuse anyway: a compare with a constant that
+                // feeds the branch, and an increment of a copy of the top.
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ: {
+                    materialize();
+                    PendingCmp cmp = {op == DT_GUARD_GT ? R_GT : R_EQ, vs.back(), {Operand::CONST, in[pc + 1]}};
+                    Operand cond = {Operand::CMP, top};
+                    uint32_t on_true = branch_target(pc, next, 1);
+                    uint32_t on_false = branch_target(pc, next, 2);
+                    if (on_true == next) {
+                        emit_cond_jump(cond, cmp, true, on_false);
+                    } else {
+                        emit_cond_jump(cond, cmp, false, on_true);
+                        if (on_false != next) {
+                            emit_jump(JMP, 0, 0, on_false);
+                            falls_through = false;
+                        }
+                    }
+                    break;
+                }
+                case DT_CALL_INC: {
+                    Operand v = vs.back();
+                    if (v.kind == Operand::CONST) {
+                        vs.push_back({Operand::CONST, v.value + 1});
+                    } else {
+                        emit(I_ADD, top, v.value, 1);
+                        vs.push_back({Operand::REG, top});
+                    }
+                }
+                    [[fallthrough]];
+                case DT_CALL: {
+                    uint32_t target = in[pc + 1];
+                    uint32_t num_params = in[pc + 2];
+                    materialize();
+                    uint32_t shift = vs.size() - num_params;
+                    fixups.push_back({emit(CALL, profile.frame_depth[target], 0, shift), target});
+                    vs.resize(shift);
+                    if (profile.returns_value[target]) {
+                        vs.push_back({Operand::REG, shift});
+                    }
+                    break;
+                }
+                case DT_TAILCALL: {
+                    // The parameters move down to r[0..]: each register is
+                    // read before anything is written to it.
+                    uint32_t target = in[pc + 1];
+                    uint32_t num_params = in[pc + 2];
+                    materialize();
+                    uint32_t shift = vs.size() - num_params;
+                    for (uint32_t k = 0; shift > 0 && k < num_params; k++) {
+                        emit(MOV, k, shift + k);
+                    }
+                    fixups.push_back({emit(TAILCALL, profile.frame_depth[target]), target});
+                    falls_through = false;
+                    break;
+                }
+                case DT_RET:
+                    if (vs.empty()) {
+                        emit(RET_VOID);
+                    } else {
+                        Operand v = vs.back();
+                        if (v.kind == Operand::CONST) {
+                            place(v, top - 1);
+                            v = {Operand::REG, top - 1};
+                        }
+                        emit(RET, 0, v.value);
+                    }
+                    falls_through = false;
+                    break;
+                case DT_SEEK:
+                case DT_PRINT:
+                case DT_FP_PRINT: {
+                    Operand& v = vs.back();
+                    if (v.kind == Operand::CONST) {
+                        place(v, top - 1);
+                        v = {Operand::REG, top - 1};
+                    }
+                    emit(op == DT_SEEK ? SEEK : op == DT_PRINT ? PRINT : FP_PRINT, 0, v.value);
+                    break;
+                }
+                case DT_READ_INT:
+                    emit(READ_INT, 0, in[pc + 1]);
+                    break;
+                case DT_FP_READ:
+                    emit(FP_READ, 0, in[pc + 1]);
+                    break;
+                case DT_Tik:
+                    emit(TIK);
+                    break;
+                case DT_RND: {
+                    Operand v = pop_value();
+                    uint32_t dst = vs.size();
+                    if (v.kind == Operand::CONST) {
+                        emit(MOVI, dst, 0, v.value);
+                        v = {Operand::REG, dst};
+                    }
+                    emit(RND, dst, v.value);
+                    vs.push_back({Operand::REG, dst});
+                    break;
+                }
+            }
+        }
+        for (const auto& [index, word] : fixups) {
+            code[index].c = block_start[word];
+        }
+    }
+
+public:
+    uint32_t debug_num;
+    uint64_t dispatch_count = 0;  // Instructions dispatched, counted with -DCOUNT_DISPATCH
+
+    RegThreadingVM() : buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
+    }
+    ~RegThreadingVM() {
+        delete[] buffer;
+    }
+
+    void run_vm(std::string filename, bool benchmarkMode) {
+        std::vector<uint32_t> program;
+        try {
+            program = readFileToUint32Array(filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        if (benchmarkMode) {
+            std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+        }
+        run_vm(program);
+    }
+
+    // Number of register instructions the last program translated into.
+    size_t translated_size() const { return code.size(); }
+
+    void run_vm(std::vector<uint32_t>& program) {
+        try {
+            profile = verifyProgram(program);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = program;
+        optimizeProgram(instructions, profile);
+        translate();
+
+        static void* dispatch[NUM_REG_OPS] = {
+            &&L_R_ADD, &&L_R_SUB, &&L_R_MUL, &&L_R_DIV, &&L_R_MOD, &&L_R_SHL, &&L_R_SHR,
+            &&L_R_FP_ADD, &&L_R_FP_SUB, &&L_R_FP_MUL, &&L_R_FP_DIV,
+            &&L_R_GT, &&L_R_LT, &&L_R_EQ, &&L_R_NE, &&L_R_GT_EQ, &&L_R_LT_EQ,
+            &&L_I_ADD, &&L_I_SUB, &&L_I_MUL, &&L_I_DIV, &&L_I_MOD, &&L_I_SHL, &&L_I_SHR,
+            &&L_I_FP_ADD, &&L_I_FP_SUB, &&L_I_FP_MUL, &&L_I_FP_DIV,
+            &&L_I_GT, &&L_I_LT, &&L_I_EQ, &&L_I_NE, &&L_I_GT_EQ, &&L_I_LT_EQ,
+            &&L_J_GT, &&L_J_LT, &&L_J_EQ, &&L_J_NE, &&L_J_GT_EQ, &&L_J_LT_EQ,
+            &&L_JI_GT, &&L_JI_LT, &&L_JI_EQ, &&L_JI_NE, &&L_JI_GT_EQ, &&L_JI_LT_EQ,
+            &&L_MOV, &&L_MOVI, &&L_LOAD, &&L_STORE, &&L_STOREI, &&L_MEMCPY, &&L_MEMSET,
+            &&L_JMP, &&L_JZ, &&L_JNZ, &&L_CALL, &&L_TAILCALL, &&L_RET, &&L_RET_VOID, &&L_END,
+            &&L_SEEK, &&L_PRINT, &&L_FP_PRINT, &&L_READ_INT, &&L_FP_READ, &&L_TIK, &&L_RND,
+        };
+
+        frames.clear();
+        uint32_t base = 0;
+        if (regs.size() < profile.max_stack + 1) {
+            regs.resize(profile.max_stack + 1);
+        }
+        uint32_t* r = regs.data();
+        const RegInstr* ip = code.data();
+
+#ifdef COUNT_DISPATCH
+#define NEXT do { dispatch_count++; goto *dispatch[ip->op]; } while (0)
+#else
+#define NEXT goto *dispatch[ip->op]
+#endif
+// r[dst] = r[a] OP r[b] and r[dst] = r[a] OP imm
+#define BINARY(name, expr) \
+    L_R_##name: { uint32_t x = r[ip->a]; uint32_t y = r[ip->b]; r[ip->dst] = (expr); } ip++; NEXT; \
+    L_I_##name: { uint32_t x = r[ip->a]; uint32_t y = ip->b; r[ip->dst] = (expr); } ip++; NEXT;
+#define FP_BINARY(name, op) \
+    BINARY(name, from_float(to_float(x) op to_float(y)))
+#define COMPARE(name, op) \
+    BINARY(name, x op y ? 1u : 0u) \
+    L_J_##name: ip = r[ip->a] op r[ip->b] ? code.data() + ip->c : ip + 1; NEXT; \
+    L_JI_##name: ip = r[ip->a] op ip->b ? code.data() + ip->c : ip + 1; NEXT;
+// Division by zero reports the error and stops the program.
+#define CHECKED_BINARY(name, expr, zero) \
+    L_R_##name: { uint32_t x = r[ip->a]; uint32_t y = r[ip->b]; if (zero) goto divide_by_zero; r[ip->dst] = (expr); } ip++; NEXT; \
+    L_I_##name: { uint32_t x = r[ip->a]; uint32_t y = ip->b; if (zero) goto divide_by_zero; r[ip->dst] = (expr); } ip++; NEXT;
+
+        NEXT;
+
+        BINARY(ADD, x + y)
+        BINARY(SUB, x - y)
+        BINARY(MUL, x * y)
+        CHECKED_BINARY(DIV, x / y, y == 0)
+        CHECKED_BINARY(MOD, x % y, y == 0)
+        BINARY(SHL, x << y)
+        BINARY(SHR, x >> y)
+        FP_BINARY(FP_ADD, +)
+        FP_BINARY(FP_SUB, -)
+        FP_BINARY(FP_MUL, *)
+        CHECKED_BINARY(FP_DIV, from_float(to_float(x) / to_float(y)), to_float(y) == 0.0f)
+        COMPARE(GT, >)
+        COMPARE(LT, <)
+        COMPARE(EQ, ==)
+        COMPARE(NE, !=)
+        COMPARE(GT_EQ, >=)
+        COMPARE(LT_EQ, <=)
+
+    L_MOV:
+        r[ip->dst] = r[ip->a];
+        ip++;
+        NEXT;
+    L_MOVI:
+        r[ip->dst] = ip->b;
+        ip++;
+        NEXT;
+    L_LOAD:
+        r[ip->dst] = read_mem32(ip->b);
+        ip++;
+        NEXT;
+    L_STORE:
+        write_mem32(r[ip->b], ip->a);
+        ip++;
+        NEXT;
+    L_STOREI:
+        write_mem32(ip->b, ip->a);
+        ip++;
+        NEXT;
+    L_MEMCPY:
+        memcpy(buffer + ip->dst, buffer + ip->a, ip->b);
+        ip++;
+        NEXT;
+    L_MEMSET:
+        memset(buffer + ip->dst, ip->a, ip->b);
+        ip++;
+        NEXT;
+    L_JMP:
+        ip = code.data() + ip->c;
+        NEXT;
+    L_JZ:
+        ip = r[ip->a] == 0 ? code.data() + ip->c : ip + 1;
+        NEXT;
+    L_JNZ:
+        ip = r[ip->a] != 0 ? code.data() + ip->c : ip + 1;
+        NEXT;
+    L_CALL:
+    {
+        // The callee's frame starts at the first parameter register; make
+        // room for its deepest point before entering.
+        frames.push_back({static_cast<uint32_t>(ip + 1 - code.data()), base});
+        base += ip->b;
+        if (regs.size() < base + ip->dst + 1) {
+            regs.resize((base + ip->dst + 1) * 2);
+        }
+        r = regs.data() + base;
+        ip = code.data() + ip->c;
+    }
+        NEXT;
+    L_TAILCALL:
+        // The callee takes over the frame and its return address.
+        if (regs.size() < base + ip->dst + 1) {
+            regs.resize((base + ip->dst + 1) * 2);
+            r = regs.data() + base;
+        }
+        ip = code.data() + ip->c;
+        NEXT;
+    L_RET:
+    {
+        // The callee's r[0] is the caller's register for the result.
+        r[0] = r[ip->a];
+    }
+    L_RET_VOID:
+    {
+        if (frames.empty()) {
+            return; // DT_RET in the top-level code ends the program
+        }
+        CallFrame frame = frames.back();
+        frames.pop_back();
+        base = frame.base;
+        r = regs.data() + base;
+        ip = code.data() + frame.ret;
+    }
+        NEXT;
+    L_END:
+        return;
+    L_SEEK:
+        debug_num = r[ip->a];
+        ip++;
+        NEXT;
+    L_PRINT:
+        std::cout << static_cast<int>(r[ip->a]) << std::endl;
+        ip++;
+        NEXT;
+    L_FP_PRINT:
+        std::cout << to_float(r[ip->a]) << std::endl;
+        ip++;
+        NEXT;
+    L_READ_INT:
+    {
+        int val;
+        std::cin >> val;
+        write_mem32(val, ip->a);
+    }
+        ip++;
+        NEXT;
+    L_FP_READ:
+    {
+        float val;
+        std::cin >> val;
+        write_mem32(from_float(val), ip->a);
+    }
+        ip++;
+        NEXT;
+    L_TIK:
+        std::cout << "tik" << std::endl;
+        ip++;
+        NEXT;
+    L_RND:
+    {
+        uint32_t range = r[ip->a];
+        r[ip->dst] = range ? rd() % range : 0;
+    }
+        ip++;
+        NEXT;
+    divide_by_zero:
+        std::cerr << "Error: Divided by zero error" << std::endl;
+        return;
+#undef CHECKED_BINARY
+#undef COMPARE
+#undef FP_BINARY
+#undef BINARY
+#undef NEXT
+    }
+};
+
+#endif // REGTHREADING_H
@@ -13,25 +13,148 @@
 #include "symbol.hpp"
 #include "readfile.hpp"
 #include "interface.hpp"
+#include "framestack.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
 #ifdef _WIN32
 #include <windows.h>
 #endif
 #include <stdlib.h>
 
+// Replicated threading: every handler exists REPLICAS times, each copy with
+// its own indirect jump at its end (src/replhandlers.inc is expanded once per
+// replica). The loader pre-decodes the program into handler addresses with
+// inline operands, as the direct engine does, and picks each instruction's
+// replica by the opcode that runs before it. The indirect jump at the end of
+// a replica then follows only that pair of opcodes, so its prediction is no
+// longer shared by every occurrence of the opcode.
 class ReplThreadingModel : public Interface {
-    // (We still keep these members for memory, stacks, etc.)
+    static constexpr uint32_t REPLICAS = 4;
+
+    // One cell of pre-decoded code: a handler address followed by that
+    // instruction's operands, with branch and call targets resolved to the
+    // cell they land on.
+    union Cell {
+        const void* handler;
+        const Cell* target;
+        uint32_t value;
+    };
+
     uint32_t ip; 
-    std::vector<std::stack<uint32_t>> sts; 
-    std::stack<uint32_t> st;
+    FrameStack st;
+    StackProfile profile; // Verified stack depths of the loaded program
     std::vector<uint32_t> instructions; 
+    std::vector<Cell> threaded;          // Pre-decoded code
+    std::vector<const Cell*> callStack;  // Return addresses
     char* buffer; 
-    std::stack<uint32_t> callStack; 
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+
+    uint32_t rd() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    // Translates the verified `instructions` into `threaded`. Each
+    // instruction's replica is chosen by its predecessor: the instruction
+    // that falls through into it, DT_RET after a call, or none when it is
+    // only reached by a branch. The distinct predecessors of an opcode take
+    // its replicas in the order they first appear, so up to REPLICAS of
+    // them get an indirect jump of their own. DT_CALL, DT_CALL_INC and
+    // DT_TAILCALL get a third operand cell holding the room the callee's
+    // frame needs.
+    void predecode(const void* const (*handlers)[DT_NUM_INSTRUCTIONS]) {
+        std::vector<uint32_t> cellOf(instructions.size(), 0);
+        size_t cells = 0;
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            cellOf[pc] = cells;
+            cells += 1 + instructionInfo[op].operands + (op == DT_CALL || op == DT_CALL_INC || op == DT_TAILCALL ? 1 : 0);
+            pc += instructionInfo[op].operands;
+        }
+        threaded.assign(cells, Cell{nullptr});
+        // Replica of each (opcode, predecessor) pair, -1 until it is first
+        // seen; DT_NUM_INSTRUCTIONS stands for no predecessor.
+        constexpr uint32_t NONE = DT_NUM_INSTRUCTIONS;
+        std::vector<int8_t> replicaOf(DT_NUM_INSTRUCTIONS * (NONE + 1), -1);
+        uint32_t predecessors[DT_NUM_INSTRUCTIONS] = {};
+        uint32_t previous = NONE;
+        // Branch operands count from the word after the branch instruction.
+        auto branch = [&](size_t pc, size_t next, int operand) {
+            int32_t offset = static_cast<int32_t>(instructions[pc + 1 + operand]);
+            return &threaded[cellOf[next + offset]];
+        };
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + instructionInfo[op].operands;
+            Cell* cell = &threaded[cellOf[pc]];
+            int8_t& replica = replicaOf[op * (NONE + 1) + previous];
+            if (replica < 0) {
+                replica = static_cast<int8_t>(predecessors[op]++ % REPLICAS);
+            }
+            cell[0].handler = handlers[replica][op];
+            switch (op) {
+                case DT_CALL:
+                case DT_CALL_INC:
+                    previous = DT_RET;
+                    break;
+                case DT_JMP:
+                case DT_IF_ELSE:
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                case DT_RET:
+                case DT_END:
+                case DT_TAILCALL:
+                    previous = NONE;
+                    break;
+                default:
+                    previous = op;
+                    break;
+            }
+            switch (op) {
+                case DT_JMP:
+                case DT_JZ:
+                case DT_JUMP_IF:
+                    cell[1].target = branch(pc, next, 0);
+                    break;
+                case DT_IF_ELSE:
+                    cell[1].target = branch(pc, next, 0);
+                    cell[2].target = branch(pc, next, 1);
+                    break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    cell[1].value = instructions[pc + 1];
+                    cell[2].target = branch(pc, next, 1);
+                    cell[3].target = branch(pc, next, 2);
+                    break;
+                case DT_CALL:
+                case DT_CALL_INC:
+                case DT_TAILCALL:
+                    cell[1].target = &threaded[cellOf[instructions[pc + 1]]];
+                    cell[2].value = instructions[pc + 2];
+                    cell[3].value = profile.frame_depth[instructions[pc + 1]] + 1;
+                    break;
+                default:
+                    for (uint32_t k = 1; k <= instructionInfo[op].operands; k++) {
+                        cell[k].value = instructions[pc + k];
+                    }
+                    break;
+            }
+            pc = next - 1;
+        }
+    }
 
 public:
     uint32_t debug_num;
     ReplThreadingModel() : ip(0), buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
-        sts.push_back(std::stack<uint32_t>());
-        st = sts.back();
     }
     ~ReplThreadingModel() {
         delete[] buffer;
@@ -39,28 +162,24 @@ public:
 
     // These helper functions remain available.
     inline float to_float(uint32_t val) {
-        return *reinterpret_cast<float*>(&val);
+        float f;
+        memcpy(&f, &val, sizeof(f));
+        return f;
     }
     inline uint32_t from_float(float val) {
-        return *reinterpret_cast<uint32_t*>(&val);
-    }
-    inline void write_memory(char* buffer, uint32_t* src, uint32_t offset, uint32_t size) {
-        memcpy(buffer + offset, src, size);
+        uint32_t u;
+        memcpy(&u, &val, sizeof(u));
+        return u;
     }
     inline void write_mem32(char* buffer, uint32_t val, uint32_t offset) {
-        uint32_t buf[1] = { val };
-        write_memory(buffer, buf, offset, 4);
-    }
-    inline void read_memory(char* buffer, uint8_t* dst, uint32_t offset, uint32_t size) {
-        memcpy(dst, buffer + offset, size);
+        memcpy(buffer + offset, &val, 4);
     }
     inline uint32_t read_mem32(char* buffer, uint32_t offset) {
-        uint32_t buf[1];
-        read_memory(buffer, reinterpret_cast<uint8_t*>(buf), offset, 4);
-        return buf[0];
+        uint32_t val;
+        memcpy(&val, buffer + offset, 4);
+        return val;
     }
 
-    // New run_vm() using computed goto (direct threading) as the dispatch method.
     void run_vm(std::string filename, bool benchmarkMode) {
         try {
             instructions = readFileToUint32Array(filename);
@@ -71,376 +190,113 @@ public:
             std::cerr << "Error: " << e.what() << std::endl;
             return;
         }
-        // Convert the vector into a pointer for direct threaded code.
-        const uint32_t* ip_ptr = instructions.data();
-
-#define NEXT switch(*ip_ptr++) { \
-    case DT_ADD:        goto add; \
-    case DT_SUB:        goto sub; \
-    case DT_MUL:        goto mul; \
-    case DT_DIV:        goto div; \
-    case DT_SHL:        goto shl; \
-    case DT_SHR:        goto shr; \
-    case DT_FP_ADD:     goto fp_add; \
-    case DT_FP_SUB:     goto fp_sub; \
-    case DT_FP_MUL:     goto fp_mul; \
-    case DT_FP_DIV:     goto fp_div; \
-    case DT_END:        goto end; \
-    case DT_LOD:        goto lod; \
-    case DT_STO:        goto sto; \
-    case DT_IMMI:       goto immi; \
-    case DT_STO_IMMI:   goto sto_immi; \
-    case DT_MEMCPY:     goto memcpy_inst; \
-    case DT_MEMSET:     goto memset_inst; \
-    case DT_INC:        goto inc; \
-    case DT_DEC:        goto dec; \
-    case DT_JMP:        goto jmp; \
-    case DT_JZ:         goto jz; \
-    case DT_IF_ELSE:    goto if_else; \
-    case DT_JUMP_IF:    goto jump_if; \
-    case DT_GT:         goto gt; \
-    case DT_LT:         goto lt; \
-    case DT_EQ:         goto eq; \
-    case DT_GT_EQ:      goto gt_eq; \
-    case DT_LT_EQ:      goto lt_eq; \
-    case DT_CALL:       goto call; \
-    case DT_RET:        goto ret; \
-    case DT_SEEK:       goto seek; \
-    case DT_PRINT:      goto print; \
-    case DT_READ_INT:   goto read_int; \
-    case DT_FP_PRINT:   goto fp_print; \
-    case DT_FP_READ:    goto fp_read; \
-    case DT_Tik:        goto tik_inst; \
-    default: std::cerr << "Unknown instruction code: " << *(ip_ptr-1) << std::endl; return; \
-}
-
-        NEXT;
-
-    // Each label implements the operation then jumps back using NEXT.
-    add:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(a + b);
-        }
-        NEXT;
-
-    sub:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(b - a);
-        }
-        NEXT;
-
-    mul:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(a * b);
-        }
-        NEXT;
-
-    div:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            if (a == 0) {
-                std::cerr << "Error: Divided by zero error" << std::endl;
-                return;
-            }
-            st.push(b / a);
-        }
-        NEXT;
-
-    shl:
-        {
-            uint32_t shift = st.top(); st.pop();
-            uint32_t value = st.top(); st.pop();
-            st.push(value << shift);
-        }
-        NEXT;
-
-    shr:
-        {
-            uint32_t shift = st.top(); st.pop();
-            uint32_t value = st.top(); st.pop();
-            st.push(value >> shift);
-        }
-        NEXT;
-
-    fp_add:
-        {
-            float a = to_float(st.top()); st.pop();
-            float b = to_float(st.top()); st.pop();
-            st.push(from_float(a + b));
-        }
-        NEXT;
-
-    fp_sub:
-        {
-            float a = to_float(st.top()); st.pop();
-            float b = to_float(st.top()); st.pop();
-            st.push(from_float(b - a));
-        }
-        NEXT;
-
-    fp_mul:
-        {
-            float a = to_float(st.top()); st.pop();
-            float b = to_float(st.top()); st.pop();
-            st.push(from_float(a * b));
-        }
-        NEXT;
-
-    fp_div:
-        {
-            float a = to_float(st.top()); st.pop();
-            float b = to_float(st.top()); st.pop();
-            if (a == 0.0f) {
-                std::cerr << "Error: Division by zero error" << std::endl;
-                return;
-            }
-            st.push(from_float(b / a));
-        }
-        NEXT;
+        run_vm(instructions);
+    }
 
-    end:
-        {
-            st = std::stack<uint32_t>();
-            instructions = std::vector<uint32_t>();
+    void run_vm(std::vector<uint32_t>& code) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
             return;
         }
-
-    lod:
-        {
-            uint32_t offset = *ip_ptr++;
-            uint32_t a = read_mem32(buffer, offset);
-            st.push(a);
-        }
-        NEXT;
-
-    sto:
-        {
-            uint32_t offset = *ip_ptr++;
-            uint32_t a = st.top(); st.pop();
-            write_mem32(buffer, a, offset);
-        }
-        NEXT;
-
-    immi:
-        {
-            uint32_t a = *ip_ptr++;
-            st.push(a);
-        }
-        NEXT;
-
-    sto_immi:
-        {
-            uint32_t offset = *ip_ptr++;
-            uint32_t number = *ip_ptr++;
-            write_mem32(buffer, number, offset);
-        }
-        NEXT;
-
-    memcpy_inst:
-        {
-            uint32_t dest = *ip_ptr++;
-            uint32_t src = *ip_ptr++;
-            uint32_t len  = *ip_ptr++;
-            memcpy(buffer + dest, buffer + src, len);
-        }
-        NEXT;
-
-    memset_inst:
-        {
-            uint32_t dest = *ip_ptr++;
-            uint32_t val  = *ip_ptr++;
-            uint32_t len  = *ip_ptr++;
-            memset(buffer + dest, val, len);
-        }
-        NEXT;
-
-    inc:
-        {
-            uint32_t a = st.top(); st.pop();
-            st.push(++a);
-        }
-        NEXT;
-
-    dec:
-        {
-            uint32_t a = st.top(); st.pop();
-            st.push(--a);
-        }
-        NEXT;
-
-    jmp:
-        {
-            uint32_t target = *ip_ptr++;
-            ip_ptr = instructions.data() + target;
-        }
-        NEXT;
-
-    jz:
-        {
-            uint32_t target = *ip_ptr++;
-            uint32_t topVal = st.top(); st.pop();
-            if (topVal == 0) {
-                ip_ptr = instructions.data() + target;
-            }
-        }
-        NEXT;
-
-    jump_if:
-        {
-            uint32_t condition = st.top(); st.pop();
-            uint32_t target = *ip_ptr++;
-            if (condition) {
-                ip_ptr = instructions.data() + target;
-            }
-        }
-        NEXT;
-
-    if_else:
-        {
-            uint32_t condition = st.top(); st.pop();
-            uint32_t trueBranch = *ip_ptr++;
-            uint32_t falseBranch = *ip_ptr++;
-            ip_ptr = instructions.data() + (condition ? trueBranch : falseBranch);
-        }
-        NEXT;
-
-    gt:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(b > a ? 1 : 0);
-        }
-        NEXT;
-
-    lt:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(b < a ? 1 : 0);
-        }
-        NEXT;
-
-    eq:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(b == a ? 1 : 0);
-        }
-        NEXT;
-
-    gt_eq:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(b >= a ? 1 : 0);
-        }
-        NEXT;
-
-    lt_eq:
-        {
-            uint32_t a = st.top(); st.pop();
-            uint32_t b = st.top(); st.pop();
-            st.push(b <= a ? 1 : 0);
-        }
-        NEXT;
-
-    call:
-        {
-            uint32_t target = *ip_ptr++;
-            uint32_t num_params = *ip_ptr++;
-            std::stack<uint32_t> newStack;
-            for (uint32_t i = 0; i < num_params; ++i) {
-                newStack.push(st.top());
-                st.pop();
-            }
-            sts.push_back(newStack);
-            st = sts.back();
-            // Save current instruction pointer (as an index)
-            callStack.push(ip_ptr - instructions.data());
-            ip_ptr = instructions.data() + target;
-        }
-        NEXT;
-
-    ret:
-        {
-            if (callStack.empty()) {
-                std::cerr << "Error: Call stack underflow" << std::endl;
-                return;
-            }
-            uint32_t return_value = st.top();
-            st.pop();
-            uint32_t ret_index = callStack.top();
-            callStack.pop();
-            sts.pop_back();
-            if (!sts.empty()) {
-                st = sts.back();
-            }
-            st.push(return_value);
-            ip_ptr = instructions.data() + ret_index;
-        }
-        NEXT;
-
-    seek:
-        {
-            debug_num = st.top();
-        }
-        NEXT;
-
-    print:
-        {
-            if (!st.empty()) {
-                std::cout << static_cast<int>(st.top()) << std::endl;
-            } else {
-                std::cerr << "Stack is empty." << std::endl;
-            }
-        }
-        NEXT;
-
-    read_int:
-        {
-            uint32_t offset = *ip_ptr++;
-            int val;
-            std::cin >> val;
-            write_mem32(buffer, val, offset);
-        }
-        NEXT;
-
-    fp_print:
-        {
-            if (!st.empty()) {
-                uint32_t num = st.top();
-                float* floatPtr = reinterpret_cast<float*>(&num);
-                std::cout << *floatPtr << std::endl;
-            } else {
-                std::cerr << "Stack is empty." << std::endl;
-            }
-        }
-        NEXT;
-
-    fp_read:
-        {
-            uint32_t offset = *ip_ptr++;
-            float val;
-            std::cin >> val;
-            write_mem32(buffer, from_float(val), offset);
-        }
-        NEXT;
-
-    tik_inst:
-        {
-            std::cout << "tik" << std::endl;
-        }
-        NEXT;
-
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+
+// Handler table of one replica. Designators are kept in enum order so GCC
+// accepts them as well as clang.
+#define REPLICA_HANDLERS(r) { \
+            [DT_ADD]       = &&add_##r, \
+            [DT_SUB]       = &&sub_##r, \
+            [DT_MUL]       = &&mul_##r, \
+            [DT_DIV]       = &&div_##r, \
+            [DT_MOD]       = &&mod_##r, \
+            [DT_SHL]       = &&shl_##r, \
+            [DT_SHR]       = &&shr_##r, \
+            [DT_FP_ADD]    = &&fp_add_##r, \
+            [DT_FP_SUB]    = &&fp_sub_##r, \
+            [DT_FP_MUL]    = &&fp_mul_##r, \
+            [DT_FP_DIV]    = &&fp_div_##r, \
+            [DT_DUP]       = &&dup_##r, \
+            [DT_END]       = &&end_##r, \
+            [DT_LOD]       = &&lod_##r, \
+            [DT_STO]       = &&sto_##r, \
+            [DT_IMMI]      = &&immi_##r, \
+            [DT_INC]       = &&inc_##r, \
+            [DT_DEC]       = &&dec_##r, \
+            [DT_STO_IMMI]  = &&sto_immi_##r, \
+            [DT_MEMCPY]    = &&memcpy_inst_##r, \
+            [DT_MEMSET]    = &&memset_inst_##r, \
+            [DT_JMP]       = &&jmp_##r, \
+            [DT_JZ]        = &&jz_##r, \
+            [DT_IF_ELSE]   = &&if_else_##r, \
+            [DT_JUMP_IF]   = &&jump_if_##r, \
+            [DT_GT]        = &&gt_##r, \
+            [DT_LT]        = &&lt_##r, \
+            [DT_EQ]        = &&eq_##r, \
+            [DT_GT_EQ]     = &&gt_eq_##r, \
+            [DT_LT_EQ]     = &&lt_eq_##r, \
+            [DT_CALL]      = &&call_##r, \
+            [DT_RET]       = &&ret_##r, \
+            [DT_SEEK]      = &&seek_##r, \
+            [DT_PRINT]     = &&print_##r, \
+            [DT_READ_INT]  = &&read_int_##r, \
+            [DT_FP_PRINT]  = &&fp_print_##r, \
+            [DT_FP_READ]   = &&fp_read_##r, \
+            [DT_Tik]       = &&tik_inst_##r, \
+            [DT_SYSCALL]   = nullptr, \
+            [DT_RND]       = &&rnd_##r, \
+            [DT_GUARD_GT]  = &&guard_gt_##r, \
+            [DT_GUARD_EQ]  = &&guard_eq_##r, \
+            [DT_CALL_INC]  = &&call_inc_##r, \
+            [DT_TAILCALL]  = &&tail_call_##r, \
+        }
+        static const void* const handlers[REPLICAS][DT_NUM_INSTRUCTIONS] = {
+            REPLICA_HANDLERS(0), REPLICA_HANDLERS(1), REPLICA_HANDLERS(2), REPLICA_HANDLERS(3),
+        };
+#undef REPLICA_HANDLERS
+        predecode(handlers);
+        callStack.clear();
+
+        const Cell* pc = threaded.data();
+        // Cached top of stack and spill pointer, kept in registers across
+        // dispatch, with room for the deepest chain of frames.
+        uint32_t tos = 0;
+        uint32_t* sp = st.reserve(st.bottom() + st.frame_base(), profile.max_stack + 1);
+
+#define NEXT goto *pc->handler
+#define BINARY(expr) { uint32_t b = tos; uint32_t a = *--sp; tos = (expr); } pc += 1; NEXT
+#define FP_BINARY(op) BINARY(from_float(to_float(a) op to_float(b)))
+#define REPLICA_LABEL(name, r) name##_##r
+#define REPLICA_LABEL_OF(name, r) REPLICA_LABEL(name, r)
+#define H(name) REPLICA_LABEL_OF(name, REPLICA)
+
+        NEXT;
+
+#define REPLICA 0
+#include "replhandlers.inc"
+#undef REPLICA
+#define REPLICA 1
+#include "replhandlers.inc"
+#undef REPLICA
+#define REPLICA 2
+#include "replhandlers.inc"
+#undef REPLICA
+#define REPLICA 3
+#include "replhandlers.inc"
+#undef REPLICA
+
+    divide_by_zero:
+        std::cerr << "Error: Divided by zero error" << std::endl;
+        return;
+#undef H
+#undef REPLICA_LABEL_OF
+#undef REPLICA_LABEL
+#undef FP_BINARY
+#undef BINARY
 #undef NEXT
     }
 };
 
-#endif // REPLTHREADING_MODEL
\ No newline at end of file
+#endif // REPLTHREADING_MODEL
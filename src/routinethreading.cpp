@@ -2,7 +2,6 @@
 #define ROUTINETHREADING_H
 
 #include <vector>
-#include <stack>
 #include <iostream>
 #include <cstring>
 #include <fstream>
@@ -13,15 +12,25 @@
 #include <windows.h>
 #endif
 #include "symbol.hpp"      // Definitions for DT_ADD, DT_CALL, DT_RET, etc.
+#include "verifier.hpp"    // verifyProgram
+#include "superinstructions.hpp" // fuseSuperinstructions
+#include "optimizer.hpp"        // optimizeProgram
+#include "nativebuild.hpp"       // FvmLibrary
 
 class RoutineThreadingVM : public Interface {
 private:
-    uint32_t ip;                         // Instruction pointer
-    std::vector<std::stack<uint32_t>> sts; // Collection of operand stacks
-    std::stack<uint32_t> st;             // Current operand stack (st = sts.back())
     std::vector<uint32_t> instructions;  // Parsed instruction set
     char* buffer;                        // Memory buffer
-    std::stack<uint32_t> callStack;      // Call stack for function calls
+    uint32_t seed = 2463534242UL;        // Seed for random number generation
+    FvmLibrary library;                  // The compiled program
+
+    // Nested DT_CALLs the generated program allows before it stops with an
+    // overflow; each is a native call.
+    static constexpr uint32_t MAX_CALL_DEPTH = 131072;
+    static constexpr size_t NATIVE_STACK_BYTES = size_t(64) << 20;
+    // Part of the compile cache key: bump it whenever the generated C
+    // changes, so binaries cached by an older generator are not reused.
+    static constexpr uint32_t C_GENERATOR_VERSION = 2;
 
     // Helper functions for conversion between uint32_t and float
     float to_float(uint32_t val) {
@@ -47,349 +56,483 @@ private:
         read_memory(buffer, reinterpret_cast<uint8_t*>(buf), offset, 4);
         return buf[0];
     }
-    
+
+
+    void run_compiled(std::vector<uint32_t> code, const std::string& stem) {
+        StackProfile profile;
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        if (!library.load("routine", C_GENERATOR_VERSION, instructions, stem,
+                          [&](const std::string& path) { return write_c(path, profile); })) {
+            std::cerr << "Error: cannot compile and load the generated C" << std::endl;
+            return;
+        }
+        // Each guest call is a native one, so run on a stack that holds
+        // MAX_CALL_DEPTH of them.
+        FvmContext ctx{buffer, debug_num, seed};
+        library.run(ctx, NATIVE_STACK_BYTES);
+        debug_num = ctx.debug_num;
+        seed = ctx.seed;
+    }
+
 public:
-    RoutineThreadingVM() : ip(0), buffer(new char[4 * 1024 * 1024]) {
-        sts.push_back(std::stack<uint32_t>());
-        st = sts.back();
+    uint32_t debug_num;
+
+    RoutineThreadingVM() : buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
     }
     ~RoutineThreadingVM() {
+        library.close();
         delete[] buffer;
     }
     
     // run_vm:
-    // Reads the instruction file and generates a pure C source file that implements
-    // the virtual machine using routine threading (computed goto).
-    // The generated C file is then compiled and executed.
+    // Reads the instruction file and runs it as run_vm(code) does, keeping the
+    // generated C and shared object next to it when there is no compile cache.
     void run_vm(std::string filename, bool benchmarkMode) {
+        std::vector<uint32_t> code;
         try {
-            instructions = readFileToUint32Array(filename);
+            code = readFileToUint32Array(filename);
         } catch (const std::exception &e) {
             std::cerr << "Error reading file: " << e.what() << std::endl;
             return;
         }
-        std::string output_filename = filename + "_compiled.c";
+        if (benchmarkMode) {
+            std::cout << "Benchmark mode enabled." << std::endl;
+        }
+        run_compiled(code, filename + "_compiled");
+    }
+
+    // Generates a pure C source file that implements the virtual machine
+    // using subroutine threading (see write_c), compiles it into a shared
+    // object unless the compile cache holds it, and runs its fvm_run()
+    // in-process on this VM's buffer.
+    void run_vm(std::vector<uint32_t>& code) {
+        run_compiled(code, "");
+    }
+
+    // Writes the verified, fused `instructions` as C to `output_filename`: a
+    // library whose fvm_run() implements the virtual machine using subroutine
+    // threading on the caller's buffer, returning 0 when the program ends and
+    // 1 on an error.
+    bool write_c(const std::string& output_filename, const StackProfile& profile) {
         std::ofstream out(output_filename);
         if (!out) {
             std::cerr << "Unable to open file " << output_filename << " for writing." << std::endl;
-            return;
+            return false;
         }
         // Standard headers and macro definitions
-        out << "#include <stdio.h>\n#include <stdlib.h>\n#include <stdint.h>\n#include <string.h>\n\n";
-        out << "#define STACK_SIZE 1024\n#define BUFFER_SIZE (4 * 1024 * 1024)\n\n";
-        // Global variables: stack, stack pointer, memory buffer, and call stack
-        out << "uint32_t stack[STACK_SIZE];\n";
-        out << "int top_index = -1;\n";
-        out << "char buffer[BUFFER_SIZE];\n\n";
-        out << "// Call stack for function calls\n";
-        out << "uint32_t callStack[STACK_SIZE];\n";
-        out << "int call_top = -1;\n\n";
+        out << "#include <stdio.h>\n#include <stdlib.h>\n#include <stdint.h>\n#include <string.h>\n#include <setjmp.h>\n\n";
+        out << FVM_CONTEXT_C;
+        // Errors and the end of the program return from fvm_run.
+        out << "static jmp_buf fvm_exit;\n";
+        out << "#define FVM_EXIT(code) longjmp(fvm_exit, (code) + 1)\n";
+        // Every instruction stays a call to its routine, which is local to the
+        // library and so called directly rather than through the PLT.
+        out << "#define ROUTINE static __attribute__((noinline))\n\n";
+        // All frames share one stack: size it for the deepest verified call
+        // chain, or for CALL_STACK_SIZE nested frames of the largest size when
+        // recursion leaves the chain unbounded.
+        out << "#define CALL_STACK_SIZE " << MAX_CALL_DEPTH << "\n";
+        if (profile.recursive) {
+            out << "#define STACK_SIZE ((CALL_STACK_SIZE + 1) * " << profile.max_frame_depth + 1 << ")\n";
+        } else {
+            out << "#define STACK_SIZE " << profile.max_stack + 1 << "\n";
+        }
+        out << "\n";
+        // Global variables: stack, stack pointer, memory buffer, and call depth
+        out << "static uint32_t stack[STACK_SIZE];\n";
+        out << "static int top_index = -1;\n";
+        out << "static char* buffer; // The caller's\n\n";
+        out << "// Guest calls are native calls; this only counts them\n";
+        out << "static int call_depth = 0;\n";
+        out << "static uint32_t debug_num = 0; // For DT_SEEK\n\n";
         // Helper conversion functions
-        out << "float to_float(uint32_t val) {\n";
+        out << "static inline float to_float(uint32_t val) {\n";
         out << "    union { uint32_t i; float f; } u;\n";
         out << "    u.i = val;\n";
         out << "    return u.f;\n";
         out << "}\n";
-        out << "uint32_t from_float(float f) {\n";
+        out << "static inline uint32_t from_float(float f) {\n";
         out << "    union { uint32_t i; float f; } u;\n";
         out << "    u.f = f;\n";
         out << "    return u.i;\n";
         out << "}\n\n";
         // Routine-threading helper functions
-        out << "#define guard(n) asm(\"#\" #n)\n\n";
-        out << "uint32_t seed = 2463534242UL; // Seed for random number generation\n";
-        out << "inline uint32_t rd() {\n";
+        out << "static uint32_t seed = 2463534242UL; // Seed for random number generation\n";
+        out << "static inline uint32_t rd() {\n";
         out << "    seed ^= seed << 13;\n";
         out << "    seed ^= seed >> 17;\n";
         out << "    seed ^= seed << 5;\n";
         out << "    return seed;\n";
         out << "}\n\n";
-        out << "void loop_func() {\n    static int count = 100000000;\n";
-        out << "    if(count <= 0) exit(0);\n    count--; \n}\n\n";
         // Instruction implementation functions
-        out << "void do_add() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_add() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = a + b;\n}\n\n";
-        out << "void do_sub() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_sub() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = b - a;\n}\n\n";
-        out << "void do_mul() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_mul() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = a * b;\n}\n\n";
-        out << "void do_div() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
-        out << "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); exit(1); }\n";
+        out << "ROUTINE void do_div() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); FVM_EXIT(1); }\n";
         out << "    stack[++top_index] = b / a;\n}\n\n";
-        out << "void do_mod() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
-        out << "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); exit(1); }\n";
+        out << "ROUTINE void do_mod() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "    if(a == 0) { fprintf(stderr, \"Error: Division by zero\\n\"); FVM_EXIT(1); }\n";
         out << "    stack[++top_index] = b % a;\n}\n\n";
-        out << "void do_shl() {\n    uint32_t shift = stack[top_index--];\n    uint32_t value = stack[top_index--];\n";
+        out << "ROUTINE void do_shl() {\n    uint32_t shift = stack[top_index--];\n    uint32_t value = stack[top_index--];\n";
         out << "    stack[++top_index] = value << shift;\n}\n\n";
-        out << "void do_shr() {\n    uint32_t shift = stack[top_index--];\n    uint32_t value = stack[top_index--];\n";
+        out << "ROUTINE void do_shr() {\n    uint32_t shift = stack[top_index--];\n    uint32_t value = stack[top_index--];\n";
         out << "    stack[++top_index] = value >> shift;\n}\n\n";
-        out << "void do_fp_add() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
+        out << "ROUTINE void do_fp_add() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
         out << "    stack[++top_index] = from_float(a + b);\n}\n\n";
-        out << "void do_fp_sub() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
+        out << "ROUTINE void do_fp_sub() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
         out << "    stack[++top_index] = from_float(b - a);\n}\n\n";
-        out << "void do_fp_mul() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
+        out << "ROUTINE void do_fp_mul() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
         out << "    stack[++top_index] = from_float(a * b);\n}\n\n";
-        out << "void do_fp_div() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
-        out << "    if(a == 0.0f) { fprintf(stderr, \"Error: Division by zero\\n\"); exit(1); }\n";
+        out << "ROUTINE void do_fp_div() {\n    float a = to_float(stack[top_index--]);\n    float b = to_float(stack[top_index--]);\n";
+        out << "    if(a == 0.0f) { fprintf(stderr, \"Error: Division by zero\\n\"); FVM_EXIT(1); }\n";
         out << "    stack[++top_index] = from_float(b / a);\n}\n\n";
-        out << "void do_end() {\n    top_index = -1;\n    memset(buffer, 0, BUFFER_SIZE);\n}\n\n";
-        out << "void do_lod(uint32_t offset) {\n    uint32_t value;\n";
+        out << "ROUTINE void do_end() {\n    top_index = -1;\n}\n\n";
+        out << "ROUTINE void do_lod(uint32_t offset) {\n    uint32_t value;\n";
         out << "    memcpy(&value, buffer + offset, sizeof(uint32_t));\n";
         out << "    stack[++top_index] = value;\n}\n\n";
-        out << "void do_sto(uint32_t offset) {\n    uint32_t value = stack[top_index--];\n";
+        out << "ROUTINE void do_sto(uint32_t offset) {\n    uint32_t value = stack[top_index--];\n";
         out << "    memcpy(buffer + offset, &value, sizeof(uint32_t));\n}\n\n";
-        out << "void do_immi(uint32_t value) {\n    stack[++top_index] = value;\n}\n\n";
-        out << "void do_inc() {\n    uint32_t value = stack[top_index--];\n";
+        out << "ROUTINE void do_immi(uint32_t value) {\n    stack[++top_index] = value;\n}\n\n";
+        out << "ROUTINE void do_inc() {\n    uint32_t value = stack[top_index--];\n";
         out << "    stack[++top_index] = value + 1;\n}\n\n";
-        out << "void do_dec() {\n    uint32_t value = stack[top_index--];\n";
+        out << "ROUTINE void do_dec() {\n    uint32_t value = stack[top_index--];\n";
         out << "    stack[++top_index] = value - 1;\n}\n\n";
-        out << "void do_sto_immi(uint32_t offset, uint32_t number) {\n";
+        out << "ROUTINE void do_sto_immi(uint32_t offset, uint32_t number) {\n";
         out << "    memcpy(buffer + offset, &number, sizeof(uint32_t));\n}\n\n";
-        out << "void do_memcpy(uint32_t dest, uint32_t src, uint32_t len) {\n";
+        out << "ROUTINE void do_memcpy(uint32_t dest, uint32_t src, uint32_t len) {\n";
         out << "    memcpy(buffer + dest, buffer + src, len);\n}\n\n";
-        out << "void do_memset(uint32_t dest, uint32_t val, uint32_t len) {\n";
+        out << "ROUTINE void do_memset(uint32_t dest, uint32_t val, uint32_t len) {\n";
         out << "    memset(buffer + dest, val, len);\n}\n\n";
-        out << "void do_gt() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_gt() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = (b > a) ? 1 : 0;\n}\n\n";
-        out << "void do_lt() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_lt() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = (b < a) ? 1 : 0;\n}\n\n";
-        out << "void do_eq() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_eq() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = (b == a) ? 1 : 0;\n}\n\n";
-        out << "void do_gt_eq() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_gt_eq() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = (b >= a) ? 1 : 0;\n}\n\n";
-        out << "void do_lt_eq() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
+        out << "ROUTINE void do_lt_eq() {\n    uint32_t a = stack[top_index--];\n    uint32_t b = stack[top_index--];\n";
         out << "    stack[++top_index] = (b <= a) ? 1 : 0;\n}\n\n";
-        out << "void do_print() {\n    if (top_index >= 0) {\n";
-        out << "        printf(\"%u\\n\", stack[top_index]);\n";
-        out << "    } else { fprintf(stderr, \"Stack is empty.\\n\"); }\n";
+        out << "ROUTINE void do_print() {\n";
+        out << "    printf(\"%d\\n\", (int32_t)stack[top_index]);\n";
         out << "}\n\n";
-        out << "void do_read_int(uint32_t offset) {\n    uint32_t val;\n";
+        out << "ROUTINE void do_read_int(uint32_t offset) {\n    uint32_t val;\n";
         out << "    scanf(\"%u\", &val);\n";
         out << "    memcpy(buffer + offset, &val, sizeof(uint32_t));\n";
         out << "}\n\n";
-        out << "void do_fp_print() {\n    if (top_index >= 0) {\n";
-        out << "        float f = to_float(stack[top_index]);\n";
-        out << "        printf(\"%f\\n\", f);\n";
-        out << "    } else { fprintf(stderr, \"Stack is empty.\\n\"); }\n";
+        out << "ROUTINE void do_fp_print() {\n";
+        out << "    float f = to_float(stack[top_index]);\n";
+        out << "    printf(\"%f\\n\", f);\n";
         out << "}\n\n";
-        out << "void do_fp_read(uint32_t offset) {\n    float val;\n";
+        out << "ROUTINE void do_fp_read(uint32_t offset) {\n    float val;\n";
         out << "    scanf(\"%f\", &val);\n";
         out << "    uint32_t ival = from_float(val);\n";
         out << "    memcpy(buffer + offset, &ival, sizeof(uint32_t));\n";
         out << "}\n\n";
-        out << "void do_tik() { printf(\"tik\\n\"); }\n\n";
+        out << "ROUTINE void do_tik() { printf(\"tik\\n\"); }\n\n";
+        out << "ROUTINE void do_seek() {\n    debug_num = stack[top_index];\n}\n\n";
+        out << "ROUTINE void do_rnd() {\n    uint32_t max = stack[top_index--];\n";
+        out << "    stack[++top_index] = max == 0 ? 0 : rd() % max;\n}\n\n";
+        // A call leaves the callee's parameters on top of the stack, where its
+        // frame starts; DT_RET drops the frame, keeping the top if it returns it.
+        out << "ROUTINE void do_call() {\n    if(++call_depth > CALL_STACK_SIZE) {\n";
+        out << "        fprintf(stderr, \"Error: Stack overflow, too many nested function calls\\n\");\n";
+        out << "        FVM_EXIT(1);\n    }\n}\n\n";
+        out << "ROUTINE void do_ret(int depth, int returns_value) {\n";
+        out << "    if(returns_value) { stack[top_index - depth + 1] = stack[top_index]; top_index -= depth - 1; }\n";
+        out << "    else top_index -= depth;\n}\n\n";
+        // DT_TAILCALL: the callee's parameters replace the caller's frame.
+        out << "ROUTINE void do_tail_call(int depth, int num_params) {\n";
+        out << "    memmove(&stack[top_index - depth + 1], &stack[top_index - num_params + 1], num_params * sizeof(uint32_t));\n";
+        out << "    top_index -= depth - num_params;\n}\n\n";
         
         // ------------------------------
-        // Generate main() using labels (routine threading)
+        // Generate one native function per guest function (word 0 and every
+        // DT_CALL target), each a sequence of calls to the routines above
         // ------------------------------
-        out << "int main() {\n";
-        // Emit a label for each instruction in the instruction set.
-        size_t i = 0;
-        while (i < instructions.size()) {
-            // Emit a label for the current instruction index:
-            out << "L" << i << ":\n";
-            uint32_t opcode = instructions[i++];
-            switch (opcode) {
-                case DT_ADD:
-                    out << "    do_add();\n";
-                    break;
-                case DT_SUB:
-                    out << "    do_sub();\n";
-                    break;
-                case DT_MUL:
-                    out << "    do_mul();\n";
-                    break;
-                case DT_DIV:
-                    out << "    do_div();\n";
-                    break;
-                case DT_MOD:
-                    out << "    do_mod();\n";
-                    break;
-                case DT_SHL:
-                    out << "    do_shl();\n";
-                    break;
-                case DT_SHR:
-                    out << "    do_shr();\n";
-                    break;
-                case DT_FP_ADD:
-                    out << "    do_fp_add();\n";
-                    break;
-                case DT_FP_SUB:
-                    out << "    do_fp_sub();\n";
-                    break;
-                case DT_FP_MUL:
-                    out << "    do_fp_mul();\n";
-                    break;
-                case DT_FP_DIV:
-                    out << "    do_fp_div();\n";
-                    break;
-                case DT_INC:
-                    out << "    do_inc();\n";
-                    break;
-                case DT_DEC:
-                    out << "    do_dec();\n";
-                    break;
-                case DT_DUP:
-                    out << "    /* Duplicate top-of-stack */\n";
-                    out << "    if(top_index >= 0) { uint32_t tmp = stack[top_index]; stack[++top_index] = tmp; } else { fprintf(stderr, \"Stack is empty.\\n\"); }\n";
-                    break;
-                case DT_STO_IMMI: {
-                    if (i + 1 < instructions.size()) {
-                        uint32_t op1 = instructions[i++];
-                        uint32_t op2 = instructions[i++];
-                        out << "    do_sto_immi(" << op1 << ", " << op2 << ");\n";
-                    } else {
-                        out << "    /* Error: missing operands for DT_STO_IMMI */\n";
-                    }
-                } break;
-                case DT_MEMCPY: {
-                    if (i + 2 < instructions.size()) {
-                        uint32_t op1 = instructions[i++];
-                        uint32_t op2 = instructions[i++];
-                        uint32_t op3 = instructions[i++];
-                        out << "    do_memcpy(" << op1 << ", " << op2 << ", " << op3 << ");\n";
-                    } else {
-                        out << "    /* Error: missing operands for DT_MEMCPY */\n";
-                    }
-                } break;
-                case DT_MEMSET: {
-                    if (i + 2 < instructions.size()) {
-                        uint32_t op1 = instructions[i++];
-                        uint32_t op2 = instructions[i++];
-                        uint32_t op3 = instructions[i++];
-                        out << "    do_memset(" << op1 << ", " << op2 << ", " << op3 << ");\n";
-                    } else {
-                        out << "    /* Error: missing operands for DT_MEMSET */\n";
-                    }
-                } break;
-                case DT_JMP: {
-                    if (i < instructions.size()) {
-                        uint32_t target = instructions[i++];
-                        out << "    goto L" << target << ";\n";
+        for (uint32_t entry : profile.entries) {
+            out << "static void fn_" << entry << "(void);\n";
+        }
+        out << "\n";
+        for (uint32_t entry : profile.entries) {
+            out << "static void fn_" << entry << "(void) {\n";
+            out << "    goto L" << entry << ";\n";
+            // Emit a label for each instruction of the function.
+            for (size_t pc = 0; pc < instructions.size(); pc++) {
+                if (profile.owner[pc] != entry) {
+                    continue;
+                }
+                size_t i = pc;
+                // Emit a label for the current instruction index:
+                out << "L" << i << ":\n";
+                uint32_t opcode = instructions[i++];
+                switch (opcode) {
+                    case DT_END:
+                        out << "    do_end();\n";
+                        out << "    FVM_EXIT(0);\n";
                         continue;
-                    } else {
-                        out << "    /* Error: missing operand for DT_JMP */\n";
-                    }
-                } break;
-                case DT_JZ: {
-                    if (i < instructions.size()) {
+                    case DT_LOD:
+                        out << "    do_lod(" << instructions[i++] << ");\n";
+                        break;
+                    case DT_STO:
+                        out << "    do_sto(" << instructions[i++] << ");\n";
+                        break;
+                    case DT_IMMI:
+                        out << "    do_immi(" << instructions[i++] << ");\n";
+                        break;
+                    case DT_SEEK:
+                        out << "    do_seek();\n";
+                        break;
+                    case DT_ADD:
+                        out << "    do_add();\n";
+                        break;
+                    case DT_SUB:
+                        out << "    do_sub();\n";
+                        break;
+                    case DT_MUL:
+                        out << "    do_mul();\n";
+                        break;
+                    case DT_DIV:
+                        out << "    do_div();\n";
+                        break;
+                    case DT_MOD:
+                        out << "    do_mod();\n";
+                        break;
+                    case DT_SHL:
+                        out << "    do_shl();\n";
+                        break;
+                    case DT_SHR:
+                        out << "    do_shr();\n";
+                        break;
+                    case DT_FP_ADD:
+                        out << "    do_fp_add();\n";
+                        break;
+                    case DT_FP_SUB:
+                        out << "    do_fp_sub();\n";
+                        break;
+                    case DT_FP_MUL:
+                        out << "    do_fp_mul();\n";
+                        break;
+                    case DT_FP_DIV:
+                        out << "    do_fp_div();\n";
+                        break;
+                    case DT_INC:
+                        out << "    do_inc();\n";
+                        break;
+                    case DT_DEC:
+                        out << "    do_dec();\n";
+                        break;
+                    case DT_DUP:
+                        out << "    /* Duplicate top-of-stack */\n";
+                        out << "    { uint32_t tmp = stack[top_index]; stack[++top_index] = tmp; }\n";
+                        break;
+                    case DT_STO_IMMI: {
+                        if (i + 1 < instructions.size()) {
+                            uint32_t op1 = instructions[i++];
+                            uint32_t op2 = instructions[i++];
+                            out << "    do_sto_immi(" << op1 << ", " << op2 << ");\n";
+                        } else {
+                            out << "    /* Error: missing operands for DT_STO_IMMI */\n";
+                        }
+                    } break;
+                    case DT_MEMCPY: {
+                        if (i + 2 < instructions.size()) {
+                            uint32_t op1 = instructions[i++];
+                            uint32_t op2 = instructions[i++];
+                            uint32_t op3 = instructions[i++];
+                            out << "    do_memcpy(" << op1 << ", " << op2 << ", " << op3 << ");\n";
+                        } else {
+                            out << "    /* Error: missing operands for DT_MEMCPY */\n";
+                        }
+                    } break;
+                    case DT_MEMSET: {
+                        if (i + 2 < instructions.size()) {
+                            uint32_t op1 = instructions[i++];
+                            uint32_t op2 = instructions[i++];
+                            uint32_t op3 = instructions[i++];
+                            out << "    do_memset(" << op1 << ", " << op2 << ", " << op3 << ");\n";
+                        } else {
+                            out << "    /* Error: missing operands for DT_MEMSET */\n";
+                        }
+                    } break;
+                    // Branch operands are offsets from the word after the instruction.
+                    case DT_JMP: {
+                        if (i < instructions.size()) {
+                            int64_t target = static_cast<int64_t>(i + 1) + static_cast<int32_t>(instructions[i]);
+                            i++;
+                            out << "    goto L" << target << ";\n";
+                            continue;
+                        } else {
+                            out << "    /* Error: missing operand for DT_JMP */\n";
+                        }
+                    } break;
+                    case DT_JZ: {
+                        if (i < instructions.size()) {
+                            int64_t target = static_cast<int64_t>(i + 1) + static_cast<int32_t>(instructions[i]);
+                            i++;
+                            out << "    if(stack[top_index--] == 0) goto L" << target << ";\n";
+                        } else {
+                            out << "    /* Error: missing operand for DT_JZ */\n";
+                        }
+                    } break;
+                    case DT_JUMP_IF: {
+                        if (i < instructions.size()) {
+                            int64_t target = static_cast<int64_t>(i + 1) + static_cast<int32_t>(instructions[i]);
+                            i++;
+                            out << "    if(stack[top_index--] != 0) goto L" << target << ";\n";
+                        } else {
+                            out << "    /* Error: missing operand for DT_JUMP_IF */\n";
+                        }
+                    } break;
+                    case DT_IF_ELSE: {
+                        if (i + 1 < instructions.size()) {
+                            int64_t trueBranch = static_cast<int64_t>(i + 2) + static_cast<int32_t>(instructions[i]);
+                            int64_t falseBranch = static_cast<int64_t>(i + 2) + static_cast<int32_t>(instructions[i + 1]);
+                            i += 2;
+                            out << "    if(stack[top_index--] != 0) goto L" << trueBranch << ";\n";
+                            out << "    else goto L" << falseBranch << ";\n";
+                            continue;
+                        } else {
+                            out << "    /* Error: missing operands for DT_IF_ELSE */\n";
+                        }
+                    } break;
+                    case DT_GUARD_GT:
+                    case DT_GUARD_EQ: {
+                        if (i + 2 < instructions.size()) {
+                            uint32_t bound = instructions[i];
+                            int64_t trueBranch = static_cast<int64_t>(i + 3) + static_cast<int32_t>(instructions[i + 1]);
+                            int64_t falseBranch = static_cast<int64_t>(i + 3) + static_cast<int32_t>(instructions[i + 2]);
+                            i += 3;
+                            out << "    if(stack[top_index] " << (opcode == DT_GUARD_GT ? ">" : "==") << " " << bound
+                                << "u) goto L" << trueBranch << ";\n";
+                            out << "    else goto L" << falseBranch << ";\n";
+                            continue;
+                        } else {
+                            out << "    /* Error: missing operands for the guard */\n";
+                        }
+                    } break;
+                    case DT_GT:
+                        out << "    do_gt();\n";
+                        break;
+                    case DT_LT:
+                        out << "    do_lt();\n";
+                        break;
+                    case DT_EQ:
+                        out << "    do_eq();\n";
+                        break;
+                    case DT_GT_EQ:
+                        out << "    do_gt_eq();\n";
+                        break;
+                    case DT_LT_EQ:
+                        out << "    do_lt_eq();\n";
+                        break;
+                    case DT_PRINT:
+                        out << "    do_print();\n";
+                        break;
+                    case DT_READ_INT: {
+                        if (i < instructions.size()) {
+                            uint32_t op = instructions[i++];
+                            out << "    do_read_int(" << op << ");\n";
+                        } else {
+                            out << "    /* Error: missing operand for DT_READ_INT */\n";
+                        }
+                    } break;
+                    case DT_FP_PRINT:
+                        out << "    do_fp_print();\n";
+                        break;
+                    case DT_FP_READ: {
+                        if (i < instructions.size()) {
+                            uint32_t op = instructions[i++];
+                            out << "    do_fp_read(" << op << ");\n";
+                        } else {
+                            out << "    /* Error: missing operand for DT_FP_READ */\n";
+                        }
+                    } break;
+                    case DT_Tik:
+                        out << "    do_tik();\n";
+                        break;
+                    case DT_RND:
+                        out << "    do_rnd();\n";
+                        break;
+                    // ------------------------------
+                    // DT_CALL: A native call; the callee's frame starts at its
+                    // parameters on top of the stack, and it returns here.
+                    case DT_CALL_INC:
+                        out << "    { uint32_t tmp = stack[top_index]; stack[++top_index] = tmp + 1; }\n";
+                        [[fallthrough]];
+                    case DT_CALL: {
                         uint32_t target = instructions[i++];
-                        out << "    if(stack[top_index--] == 0) goto L" << target << ";\n";
-                    } else {
-                        out << "    /* Error: missing operand for DT_JZ */\n";
-                    }
-                } break;
-                case DT_JUMP_IF: {
-                    if (i < instructions.size()) {
+                        i++; // Parameter count: the verifier has checked the callee's frame
+                        // Only unbounded recursion needs the depth counted.
+                        if (profile.recursive) {
+                            out << "    do_call();\n";
+                        }
+                        out << "    fn_" << target << "();\n";
+                        if (profile.recursive) {
+                            out << "    call_depth--;\n";
+                        }
+                    } break;
+                    // DT_TAILCALL: The callee's frame replaces this one and it
+                    // returns for this function; calling itself is a loop.
+                    case DT_TAILCALL: {
                         uint32_t target = instructions[i++];
-                        out << "    if(stack[top_index--] != 0) goto L" << target << ";\n";
-                    } else {
-                        out << "    /* Error: missing operand for DT_JUMP_IF */\n";
-                    }
-                } break;
-                case DT_IF_ELSE: {
-                    if (i + 1 < instructions.size()) {
-                        uint32_t trueBranch = instructions[i++];
-                        uint32_t falseBranch = instructions[i++];
-                        out << "    if(stack[top_index--] != 0) goto L" << trueBranch << ";\n";
-                        out << "    else goto L" << falseBranch << ";\n";
+                        uint32_t num_params = instructions[i++];
+                        out << "    do_tail_call(" << profile.depth[pc] << ", " << num_params << ");\n";
+                        if (target == entry) {
+                            out << "    goto L" << entry << ";\n";
+                        } else {
+                            out << "    fn_" << target << "();\n";
+                            out << "    return;\n";
+                        }
                         continue;
-                    } else {
-                        out << "    /* Error: missing operands for DT_IF_ELSE */\n";
                     }
-                } break;
-                case DT_GT:
-                    out << "    do_gt();\n";
-                    break;
-                case DT_LT:
-                    out << "    do_lt();\n";
-                    break;
-                case DT_EQ:
-                    out << "    do_eq();\n";
-                    break;
-                case DT_GT_EQ:
-                    out << "    do_gt_eq();\n";
-                    break;
-                case DT_LT_EQ:
-                    out << "    do_lt_eq();\n";
-                    break;
-                case DT_PRINT:
-                    out << "    do_print();\n";
-                    break;
-                case DT_READ_INT: {
-                    if (i < instructions.size()) {
-                        uint32_t op = instructions[i++];
-                        out << "    do_read_int(" << op << ");\n";
-                    } else {
-                        out << "    /* Error: missing operand for DT_READ_INT */\n";
-                    }
-                } break;
-                case DT_FP_PRINT:
-                    out << "    do_fp_print();\n";
-                    break;
-                case DT_FP_READ: {
-                    if (i < instructions.size()) {
-                        uint32_t op = instructions[i++];
-                        out << "    do_fp_read(" << op << ");\n";
-                    } else {
-                        out << "    /* Error: missing operand for DT_FP_READ */\n";
-                    }
-                } break;
-                case DT_Tik:
-                    out << "    do_tik();\n";
-                    break;
-                case DT_RND:
-                    out << "    do_rnd();\n";
-                    break;
-                // ------------------------------
-                // DT_CALL: Save return address and jump to function target.
-                case DT_CALL: {
-                    if (i + 1 < instructions.size()) {
-                        uint32_t target = instructions[i++];
-                        uint32_t num_params = instructions[i++]; // Parameter count (for further extension)
-                        out << "    callStack[++call_top] = " << i << "; // Save return address\n";
-                        // (Parameter passing could be implemented here if needed)
-                        out << "    goto L" << target << ";\n";
+                    // ------------------------------
+                    // DT_RET: Drop the frame and return to the native caller.
+                    case DT_RET:
+                        out << "    do_ret(" << profile.depth[pc] << ", " << int(entry != 0 && profile.returns_value[entry])
+                            << ");\n";
+                        out << "    return;\n";
                         continue;
-                    } else {
-                        out << "    /* Error: missing operands for DT_CALL */\n";
-                    }
-                } break;
-                // ------------------------------
-                // DT_RET: Pop return address from call stack and jump back.
-                case DT_RET: {
-                    out << "    if(call_top < 0) return 0;\n";
-                    // Using computed goto; note that this is a GNU extension.
-                    out << "    goto *({ void* addr = &&RET_LABEL; addr; });\n";
-                    // Alternatively, if computed goto is not available, you may simulate by a switch:
-                    // out << "    goto L_return;\n";
-                    break;
+                    default:
+                        break;
+                }
+                // If no jump has transferred control, continue to the next instruction.
+                if (i < instructions.size()) {
+                    out << "    goto L" << i << ";\n";
                 }
-                default:
-                    break;
-            }
-            // If no jump has transferred control, continue to the next instruction.
-            if (i < instructions.size()) {
-                out << "    goto L" << i << ";\n";
             }
+            out << "}\n\n";
         }
-        out << "RET_LABEL:\n";
-        out << "    return 0;\n";
+        out << "int fvm_run(struct fvm_ctx* ctx) {\n";
+        out << "    buffer = ctx->buffer;\n";
+        out << "    debug_num = ctx->debug_num;\n";
+        out << "    seed = ctx->seed;\n";
+        out << "    top_index = -1;\n";
+        out << "    call_depth = 0;\n";
+        out << "    int status = setjmp(fvm_exit);\n";
+        out << "    if (status == 0) {\n";
+        out << "        fn_0();\n";
+        out << "        status = 1;\n";
+        out << "    }\n";
+        out << "    fflush(stdout);\n";
+        out << "    ctx->debug_num = debug_num;\n";
+        out << "    ctx->seed = seed;\n";
+        out << "    return status - 1;\n";
         out << "}\n";
         out.close();
-        
-        std::cout << "C file generated successfully: " << output_filename << std::endl;
-        // Compile the generated C file with clang (or your preferred compiler)
-        std::string clang_command = "clang -o " + filename + "_compiled " + output_filename;
-        std::cout << "Compiling generated C file with clang: " << clang_command << std::endl;
-        system(clang_command.c_str());
-        // Execute the compiled binary
-        std::string exec_command = filename + "_compiled";
-        std::cout << "Executing compiled binary: " << exec_command << std::endl;
-        if (benchmarkMode) {
-            std::cout << "Benchmark mode enabled." << std::endl;
-        }
-        system(exec_command.c_str());
+        return static_cast<bool>(out);
     }
 };
 
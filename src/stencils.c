@@ -0,0 +1,165 @@
+// Copy-and-patch stencils: the handler body of every instruction written as a
+// C function whose immediates and continuations are left as holes. The build
+// compiles this file once and build_stencils.py turns each stencil_<OP>
+// function into a byte template plus the list of its holes (stencils.hpp);
+// the stencil engine concatenates the templates for a program and patches the
+// holes with its operands and native addresses.
+//
+// Every stencil takes (sp, tos, mem, st) and passes them on by tail call, so
+// the four values stay in argument registers across the whole program. A
+// trailing tail call of HOLE_CONTINUE is cut off by build_stencils.py and the
+// next stencil is simply placed after it.
+
+#include <string.h>
+#include "stencilstate.h"
+
+extern char HOLE_IMM0[], HOLE_IMM1[], HOLE_IMM2[];
+
+#define IMM0 ((uint32_t)(uintptr_t)HOLE_IMM0)
+#define IMM1 ((uint32_t)(uintptr_t)HOLE_IMM1)
+#define IMM2 ((uint32_t)(uintptr_t)HOLE_IMM2)
+
+#define STENCIL_ARGS uint32_t* sp, uint32_t tos, char* mem, struct StencilState* st
+
+extern StencilRegs HOLE_CONTINUE(STENCIL_ARGS);
+extern StencilRegs HOLE_TARGET(STENCIL_ARGS);
+extern StencilRegs HOLE_ELSE(STENCIL_ARGS);
+
+#define STENCIL(op) StencilRegs stencil_##op(STENCIL_ARGS)
+#define CONTINUE() return HOLE_CONTINUE(sp, tos, mem, st)
+#define HALT(why) do { st->halted = (why); return (StencilRegs){sp, tos}; } while (0)
+
+static inline float as_float(uint32_t v) { float f; memcpy(&f, &v, 4); return f; }
+static inline uint32_t as_bits(float f) { uint32_t v; memcpy(&v, &f, 4); return v; }
+
+STENCIL(ADD) { tos = *--sp + tos; CONTINUE(); }
+STENCIL(SUB) { tos = *--sp - tos; CONTINUE(); }
+STENCIL(MUL) { tos = *--sp * tos; CONTINUE(); }
+
+STENCIL(DIV) {
+    if (tos == 0) HALT(STENCIL_DIVIDE_BY_ZERO);
+    tos = *--sp / tos;
+    CONTINUE();
+}
+
+STENCIL(MOD) {
+    if (tos == 0) HALT(STENCIL_DIVIDE_BY_ZERO);
+    tos = *--sp % tos;
+    CONTINUE();
+}
+
+STENCIL(SHL) { uint32_t n = tos; tos = *--sp << (n & 31); CONTINUE(); }
+STENCIL(SHR) { uint32_t n = tos; tos = *--sp >> (n & 31); CONTINUE(); }
+
+STENCIL(FP_ADD) { tos = as_bits(as_float(*--sp) + as_float(tos)); CONTINUE(); }
+STENCIL(FP_SUB) { tos = as_bits(as_float(*--sp) - as_float(tos)); CONTINUE(); }
+STENCIL(FP_MUL) { tos = as_bits(as_float(*--sp) * as_float(tos)); CONTINUE(); }
+
+STENCIL(FP_DIV) {
+    if ((tos & 0x7FFFFFFF) == 0) HALT(STENCIL_DIVIDE_BY_ZERO);
+    tos = as_bits(as_float(*--sp) / as_float(tos));
+    CONTINUE();
+}
+
+STENCIL(DUP) { *sp++ = tos; CONTINUE(); }
+STENCIL(END) { HALT(STENCIL_END); }
+
+STENCIL(LOD) { *sp++ = tos; memcpy(&tos, mem + IMM0, 4); CONTINUE(); }
+STENCIL(STO) { memcpy(mem + IMM0, &tos, 4); tos = *--sp; CONTINUE(); }
+STENCIL(IMMI) { *sp++ = tos; tos = IMM0; CONTINUE(); }
+STENCIL(INC) { tos++; CONTINUE(); }
+STENCIL(DEC) { tos--; CONTINUE(); }
+STENCIL(STO_IMMI) { uint32_t v = IMM1; memcpy(mem + IMM0, &v, 4); CONTINUE(); }
+STENCIL(MEMCPY) { st->copy(mem + IMM0, mem + IMM1, IMM2); CONTINUE(); }
+STENCIL(MEMSET) { st->fill(mem + IMM0, (int)IMM1, IMM2); CONTINUE(); }
+
+STENCIL(JMP) { return HOLE_TARGET(sp, tos, mem, st); }
+
+STENCIL(JZ) {
+    uint32_t c = tos;
+    tos = *--sp;
+    if (c != 0) CONTINUE();
+    return HOLE_TARGET(sp, tos, mem, st);
+}
+
+STENCIL(JUMP_IF) {
+    uint32_t c = tos;
+    tos = *--sp;
+    if (c == 0) CONTINUE();
+    return HOLE_TARGET(sp, tos, mem, st);
+}
+
+STENCIL(IF_ELSE) {
+    uint32_t c = tos;
+    tos = *--sp;
+    if (c != 0) return HOLE_TARGET(sp, tos, mem, st);
+    return HOLE_ELSE(sp, tos, mem, st);
+}
+
+STENCIL(GT) { tos = *--sp > tos; CONTINUE(); }
+STENCIL(LT) { tos = *--sp < tos; CONTINUE(); }
+STENCIL(EQ) { tos = *--sp == tos; CONTINUE(); }
+STENCIL(GT_EQ) { tos = *--sp >= tos; CONTINUE(); }
+STENCIL(LT_EQ) { tos = *--sp <= tos; CONTINUE(); }
+
+// IMM0 is how far the callee can grow the stack: its frame depth less the
+// num_params values of the caller's it starts on, since all frames share the
+// operand stack.
+STENCIL(CALL) {
+    if (sp + IMM0 > st->stack_limit || st->depth >= STENCIL_MAX_CALL_DEPTH) HALT(STENCIL_OVERFLOW);
+    st->depth++;
+    StencilRegs r = HOLE_TARGET(sp, tos, mem, st);
+    st->depth--;
+    if (st->halted) return r;
+    return HOLE_CONTINUE(r.sp, r.tos, mem, st);
+}
+
+// Superinstructions: the guards compare the top with IMM0 and keep it; CALL_INC
+// passes top + 1 as the last parameter of an ordinary call.
+STENCIL(GUARD_GT) {
+    if (tos > IMM0) return HOLE_TARGET(sp, tos, mem, st);
+    return HOLE_ELSE(sp, tos, mem, st);
+}
+
+STENCIL(GUARD_EQ) {
+    if (tos == IMM0) return HOLE_TARGET(sp, tos, mem, st);
+    return HOLE_ELSE(sp, tos, mem, st);
+}
+
+STENCIL(CALL_INC) {
+    *sp++ = tos;
+    tos++;
+    if (sp + IMM0 > st->stack_limit || st->depth >= STENCIL_MAX_CALL_DEPTH) HALT(STENCIL_OVERFLOW);
+    st->depth++;
+    StencilRegs r = HOLE_TARGET(sp, tos, mem, st);
+    st->depth--;
+    if (st->halted) return r;
+    return HOLE_CONTINUE(r.sp, r.tos, mem, st);
+}
+
+// A call in tail position: the top IMM1 values move down IMM2 slots over the
+// rest of the frame, and the callee returns straight to this frame's caller.
+// IMM0 is as for CALL; the native call depth does not grow.
+STENCIL(TAILCALL) {
+    if (IMM2) {
+        uint32_t* from = sp - IMM1;
+        uint32_t* to = from - IMM2;
+        if (IMM1 == 0) tos = *to;
+        for (uint32_t k = 1; k < IMM1; k++) to[k] = from[k];
+        sp = to + IMM1;
+    }
+    if (sp + IMM0 > st->stack_limit) HALT(STENCIL_OVERFLOW);
+    return HOLE_TARGET(sp, tos, mem, st);
+}
+
+// IMM0 is the number of values the callee's frame holds below its top; the
+// top, if any, is already in tos as the return value.
+STENCIL(RET) { return (StencilRegs){sp - IMM0, tos}; }
+
+STENCIL(SEEK) { st->debug_num = tos; CONTINUE(); }
+STENCIL(PRINT) { st->print_int(tos); CONTINUE(); }
+STENCIL(FP_PRINT) { st->print_fp(tos); CONTINUE(); }
+STENCIL(READ_INT) { st->read_int(mem + IMM0); CONTINUE(); }
+STENCIL(FP_READ) { st->read_fp(mem + IMM0); CONTINUE(); }
+STENCIL(Tik) { st->tik(); CONTINUE(); }
+STENCIL(RND) { tos = st->rnd(st, tos); CONTINUE(); }
@@ -0,0 +1,85 @@
+#ifndef STENCILSTATE_H
+#define STENCILSTATE_H
+
+// Shared between the stencils (src/stencils.c, compiled as C by the build) and
+// the copy-and-patch engine (src/stencilthreading.cpp).
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Machine state every stencil receives and passes on: the operand stack
+// pointer (one past the values spilled below the top) and the cached top of
+// stack come back from a call as this pair.
+typedef struct {
+    uint32_t* sp;
+    uint32_t tos;
+} StencilRegs;
+
+struct StencilState {
+    uint32_t* stack_limit;
+    uint32_t debug_num;
+    uint32_t halted;            // One of StencilHalt once the program stops early
+    uint32_t depth;             // Guest call depth
+    void (*print_int)(uint32_t);
+    void (*print_fp)(uint32_t);
+    void (*read_int)(char*);
+    void (*read_fp)(char*);
+    void (*tik)(void);
+    uint32_t (*rnd)(struct StencilState*, uint32_t);
+    void* (*copy)(void*, const void*, size_t);
+    void* (*fill)(void*, int, size_t);
+    void* vm;
+};
+
+enum StencilHalt {
+    STENCIL_RUNNING = 0,
+    STENCIL_END,
+    STENCIL_DIVIDE_BY_ZERO,
+    STENCIL_OVERFLOW
+};
+
+// What a hole in a stencil stands for; build_stencils.py maps the HOLE_*
+// symbols the stencils reference to these.
+enum StencilHole {
+    STENCIL_IMM0,       // Immediate operands
+    STENCIL_IMM1,
+    STENCIL_IMM2,
+    STENCIL_CONTINUE,   // Next instruction
+    STENCIL_TARGET,     // Branch target, or the callee of DT_CALL
+    STENCIL_ELSE        // False target of DT_IF_ELSE and the guards
+};
+
+// How a hole is patched: a rel32 to a native address, or a 32-bit immediate
+// (zero- or sign-extended by the instruction that holds it).
+enum StencilPatchKind {
+    STENCIL_REL32,
+    STENCIL_ABS32,
+    STENCIL_ABS32S
+};
+
+typedef struct {
+    uint16_t offset;
+    uint8_t hole;               // StencilHole
+    uint8_t kind;               // StencilPatchKind
+    int32_t addend;
+} StencilPatch;
+
+typedef struct {
+    uint32_t op;
+    const uint8_t* code;
+    uint16_t size;
+    const StencilPatch* holes;
+    uint8_t num_holes;
+} StencilCode;
+
+#define STENCIL_MAX_CALL_DEPTH (1u << 17)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STENCILSTATE_H
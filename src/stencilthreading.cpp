@@ -0,0 +1,238 @@
+#ifndef STENCILTHREADING_H
+#define STENCILTHREADING_H
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "symbol.hpp"
+#include "readfile.hpp"
+#include "interface.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
+#include "stencilstate.h"
+#include "stencils.hpp"     // Generated by build_stencils.py
+
+// Copy-and-patch engine: the machine code for every instruction is a stencil
+// compiled ahead of time from src/stencils.c. Loading a program only copies
+// the stencils of its reachable instructions one after another into
+// executable memory and patches their holes with immediates and the native
+// addresses of branch targets, so it runs close to compiled speed while
+// costing little more than pre-decoding.
+class StencilThreadingVM : public Interface {
+    using Entry = StencilRegs (*)(uint32_t*, uint32_t, char*, StencilState*);
+
+    // Operand stack for recursive programs, whose depth the verifier cannot bound.
+    static constexpr size_t RECURSIVE_STACK_SLOTS = 1 << 20;
+
+    StackProfile profile;
+    std::vector<uint32_t> instructions;
+    std::vector<uint32_t> stack;
+    const StencilCode* stencilFor[DT_NUM_INSTRUCTIONS] = {};
+    char* buffer;
+    uint8_t* native = nullptr;
+    size_t native_size = 0;
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+
+    uint32_t rd() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    static void print_int(uint32_t v) {
+        std::cout << static_cast<int>(v) << std::endl;
+    }
+    static void print_fp(uint32_t v) {
+        float f;
+        memcpy(&f, &v, sizeof(f));
+        std::cout << f << std::endl;
+    }
+    static void read_int(char* at) {
+        int val;
+        std::cin >> val;
+        memcpy(at, &val, 4);
+    }
+    static void read_fp(char* at) {
+        float val;
+        std::cin >> val;
+        memcpy(at, &val, 4);
+    }
+    static void tik() {
+        std::cout << "tik" << std::endl;
+    }
+    static uint32_t rnd(StencilState* s, uint32_t range) {
+        return range ? static_cast<StencilThreadingVM*>(s->vm)->rd() % range : 0;
+    }
+
+    void release_native() {
+        if (native) {
+            munmap(native, native_size);
+            native = nullptr;
+        }
+    }
+
+    // Value of a hole for the instruction at pc; next is the word after it.
+    uint64_t holeValue(uint8_t hole, size_t pc, size_t next, const std::vector<size_t>& nativeAt) const {
+        uint32_t op = instructions[pc];
+        bool is_call = op == DT_CALL || op == DT_CALL_INC || op == DT_TAILCALL;
+        // The guards' branch offsets follow their bound.
+        int first_branch = op == DT_GUARD_GT || op == DT_GUARD_EQ ? 1 : 0;
+        auto branch = [&](int operand) {
+            return nativeAt[next + static_cast<int32_t>(instructions[pc + 1 + first_branch + operand])];
+        };
+        switch (hole) {
+            case STENCIL_IMM0:
+                if (is_call) {
+                    return profile.frame_depth[instructions[pc + 1]] - instructions[pc + 2];
+                }
+                if (op == DT_RET) {
+                    return profile.depth[pc] > 1 ? profile.depth[pc] - 1 : 0;
+                }
+                return instructions[pc + 1];
+            case STENCIL_IMM1:
+                return instructions[pc + 2];
+            case STENCIL_IMM2:
+                if (op == DT_TAILCALL) {
+                    // How far the parameters move down: the rest of the frame.
+                    return profile.depth[pc] - instructions[pc + 2];
+                }
+                return instructions[pc + 3];
+            case STENCIL_CONTINUE:
+                return nativeAt[next];
+            case STENCIL_TARGET:
+                return is_call ? nativeAt[instructions[pc + 1]] : branch(0);
+            default:
+                return branch(1);
+        }
+    }
+
+    bool compile() {
+        std::vector<size_t> nativeAt(instructions.size(), 0);
+        size_t size = 0;
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            const StencilCode* s = stencilFor[instructions[pc]];
+            if (!s) {
+                std::cerr << "Error: no stencil for instruction code " << instructions[pc] << std::endl;
+                return false;
+            }
+            nativeAt[pc] = size;
+            size += s->size;
+            pc += instructionInfo[instructions[pc]].operands;
+        }
+
+        release_native();
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        native_size = (size + page - 1) / page * page;
+        void* mem = mmap(nullptr, native_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            std::cerr << "Error: cannot map executable memory for the stencils" << std::endl;
+            return false;
+        }
+        native = static_cast<uint8_t*>(mem);
+        const uint64_t base = reinterpret_cast<uint64_t>(native);
+
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            const StencilCode* s = stencilFor[instructions[pc]];
+            size_t next = pc + 1 + instructionInfo[instructions[pc]].operands;
+            uint8_t* at = native + nativeAt[pc];
+            memcpy(at, s->code, s->size);
+            for (uint8_t h = 0; h < s->num_holes; h++) {
+                const StencilPatch& p = s->holes[h];
+                uint64_t value = holeValue(p.hole, pc, next, nativeAt) + p.addend;
+                if (p.kind == STENCIL_REL32) {
+                    value = value + base - reinterpret_cast<uint64_t>(at + p.offset);
+                } else if (p.kind == STENCIL_ABS32S && value > INT32_MAX) {
+                    std::cerr << "Error: operand of the instruction at word " << pc << " does not fit its stencil" << std::endl;
+                    release_native();
+                    return false;
+                }
+                uint32_t patched = static_cast<uint32_t>(value);
+                memcpy(at + p.offset, &patched, 4);
+            }
+            pc = next - 1;
+        }
+
+        if (mprotect(native, native_size, PROT_READ | PROT_EXEC) != 0) {
+            release_native();
+            std::cerr << "Error: cannot map executable memory for the stencils" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    uint32_t debug_num;
+
+    StencilThreadingVM() : buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
+        for (const StencilCode& s : stencil_table) {
+            stencilFor[s.op] = &s;
+        }
+    }
+    ~StencilThreadingVM() {
+        release_native();
+        delete[] buffer;
+    }
+
+    void run_vm(std::string filename, bool benchmarkMode) {
+        try {
+            instructions = readFileToUint32Array(filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        if (benchmarkMode) {
+            std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+        }
+        std::vector<uint32_t> code = instructions;
+        run_vm(code);
+    }
+
+    void run_vm(std::vector<uint32_t>& code) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        if (!compile()) {
+            return;
+        }
+        // One slot for the empty top cached at the start, then the deepest
+        // chain of frames (or a large fixed stack when recursion is unbounded).
+        stack.resize(profile.recursive ? RECURSIVE_STACK_SLOTS : profile.max_stack + 2);
+        StencilState state{};
+        state.stack_limit = stack.data() + stack.size();
+        state.debug_num = debug_num;
+        state.print_int = print_int;
+        state.print_fp = print_fp;
+        state.read_int = read_int;
+        state.read_fp = read_fp;
+        state.tik = tik;
+        state.rnd = rnd;
+        state.copy = memcpy;
+        state.fill = memset;
+        state.vm = this;
+        reinterpret_cast<Entry>(native)(stack.data(), 0, buffer, &state);
+        debug_num = state.debug_num;
+        if (state.halted == STENCIL_DIVIDE_BY_ZERO) {
+            std::cerr << "Error: Divided by zero error" << std::endl;
+        } else if (state.halted == STENCIL_OVERFLOW) {
+            std::cerr << "Error: call stack overflow" << std::endl;
+        }
+    }
+};
+
+#endif // STENCILTHREADING_H
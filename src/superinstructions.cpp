@@ -0,0 +1,253 @@
+#include "superinstructions.hpp"
+#include "symbol.hpp"
+
+BranchOperands branchOperands(uint32_t op) {
+    BranchOperands t;
+    switch (op) {
+        case DT_JMP:
+        case DT_JZ:
+        case DT_JUMP_IF:
+            t.relative[0] = 0;
+            break;
+        case DT_IF_ELSE:
+            t.relative[0] = 0;
+            t.relative[1] = 1;
+            break;
+        case DT_GUARD_GT:
+        case DT_GUARD_EQ:
+            t.relative[0] = 1;
+            t.relative[1] = 2;
+            break;
+        case DT_CALL:
+        case DT_CALL_INC:
+        case DT_TAILCALL:
+            t.absolute = 0;
+            break;
+    }
+    return t;
+}
+
+namespace {
+
+size_t nextOf(const std::vector<uint32_t>& code, size_t pc) {
+    return pc + 1 + instructionInfo[code[pc]].operands;
+}
+
+} // namespace
+
+std::vector<uint8_t> landingWords(const std::vector<uint32_t>& code, const StackProfile& profile) {
+    std::vector<uint8_t> landing(code.size(), 0);
+    landing[0] = 1;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        size_t next = nextOf(code, pc);
+        BranchOperands t = branchOperands(code[pc]);
+        for (int r : t.relative) {
+            if (r >= 0) {
+                landing[next + static_cast<int32_t>(code[pc + 1 + r])] = 1;
+            }
+        }
+        if (t.absolute >= 0) {
+            landing[code[pc + 1 + t.absolute]] = 1;
+        }
+        pc = next - 1;
+    }
+    return landing;
+}
+
+std::vector<size_t> straightRun(const std::vector<uint32_t>& code, const std::vector<uint8_t>& landing,
+                                size_t pc, size_t count) {
+    std::vector<size_t> run{pc};
+    while (run.size() < count) {
+        size_t next = nextOf(code, run.back());
+        if (next >= code.size() || landing[next]) {
+            break;
+        }
+        run.push_back(next);
+    }
+    return run;
+}
+
+std::vector<uint32_t> relayout(const std::vector<uint32_t>& code, const StackProfile& profile,
+                               const std::vector<Rewrite>& rewrites) {
+    const size_t n = code.size();
+    std::vector<uint32_t> out;
+    std::vector<size_t> newAt(n, 0);
+    struct Relative {
+        size_t at;      // Operand word in `out`
+        size_t next;    // Word after its instruction in `out`
+        size_t target;  // Old word it must reach
+    };
+    std::vector<Relative> relative;
+    std::vector<std::pair<size_t, size_t>> absolute;
+    // Appends whole instructions whose relative operands hold old targets.
+    auto emit = [&](const std::vector<uint32_t>& words) {
+        for (size_t i = 0; i < words.size(); i = nextOf(words, i)) {
+            size_t base = out.size() + 1;
+            size_t next = out.size() + 1 + instructionInfo[words[i]].operands;
+            out.insert(out.end(), words.begin() + i, words.begin() + nextOf(words, i));
+            BranchOperands t = branchOperands(words[i]);
+            for (int r : t.relative) {
+                if (r >= 0 && words[i + 1 + r] == FALL_THROUGH) {
+                    out[base + r] = 0;
+                } else if (r >= 0) {
+                    relative.push_back({base + r, next, words[i + 1 + r]});
+                }
+            }
+            if (t.absolute >= 0) {
+                absolute.push_back({base + t.absolute, words[i + 1 + t.absolute]});
+            }
+        }
+    };
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        newAt[pc] = out.size();
+        size_t next = nextOf(code, pc);
+        if (rewrites[pc].end) {
+            emit(rewrites[pc].words);
+            pc = rewrites[pc].end - 1;
+            continue;
+        }
+        std::vector<uint32_t> words(code.begin() + pc, code.begin() + next);
+        for (int r : branchOperands(code[pc]).relative) {
+            if (r >= 0) {
+                words[1 + r] = static_cast<uint32_t>(next + static_cast<int32_t>(code[pc + 1 + r]));
+            }
+        }
+        emit(words);
+        pc = next - 1;
+    }
+    for (auto [at, target] : absolute) {
+        out[at] = static_cast<uint32_t>(newAt[target]);
+    }
+    for (const Relative& r : relative) {
+        out[r.at] = static_cast<uint32_t>(static_cast<int64_t>(newAt[r.target]) - static_cast<int64_t>(r.next));
+    }
+    return out;
+}
+
+size_t applyRewrites(std::vector<uint32_t>& code, StackProfile& profile, const std::vector<Rewrite>& rewrites,
+                     size_t count) {
+    if (count > 0) {
+        code = relayout(code, profile, rewrites);
+        profile = verifyProgram(code);
+    }
+    return count;
+}
+
+
+size_t fuseSuperinstructions(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    std::vector<uint8_t> landing = landingWords(code, profile);
+    std::vector<Rewrite> rewrites(n);
+    size_t count = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        std::vector<size_t> run = straightRun(code, landing, pc, 4);
+        auto opAt = [&](size_t i) { return i < run.size() ? code[run[i]] : uint32_t{DT_NUM_INSTRUCTIONS}; };
+        Rewrite& r = rewrites[pc];
+        if (opAt(0) == DT_DUP && opAt(1) == DT_IMMI && (opAt(2) == DT_GT || opAt(2) == DT_EQ) &&
+            opAt(3) == DT_IF_ELSE) {
+            size_t ifElse = run[3];
+            r.end = nextOf(code, ifElse);
+            r.words = {opAt(2) == DT_GT ? uint32_t{DT_GUARD_GT} : uint32_t{DT_GUARD_EQ}, code[run[1] + 1],
+                       static_cast<uint32_t>(r.end + static_cast<int32_t>(code[ifElse + 1])),
+                       static_cast<uint32_t>(r.end + static_cast<int32_t>(code[ifElse + 2]))};
+        } else if (opAt(0) == DT_DUP && opAt(1) == DT_INC && opAt(2) == DT_CALL) {
+            size_t call = run[2];
+            r.end = nextOf(code, call);
+            r.words = {DT_CALL_INC, code[call + 1], code[call + 2]};
+        }
+        if (r.end) {
+            count++;
+            pc = r.end - 1;
+        } else {
+            pc = nextOf(code, pc) - 1;
+        }
+    }
+    return applyRewrites(code, profile, rewrites, count);
+}
+
+size_t threadJumps(std::vector<uint32_t>& code, StackProfile& profile) {
+    const size_t n = code.size();
+    // Where a reachable DT_JMP at `pc` goes.
+    auto jmpTarget = [&](size_t pc) {
+        return static_cast<size_t>(static_cast<int64_t>(pc + 2) + static_cast<int32_t>(code[pc + 1]));
+    };
+    // First instruction that is not a DT_JMP along the chain from `word`, or
+    // `word` itself when the chain loops (a DT_JMP cycle never terminates,
+    // and is left for the engine to run).
+    auto finalTarget = [&](size_t word) {
+        size_t to = word;
+        for (size_t steps = 0; code[to] == DT_JMP; steps++) {
+            if (steps == n) {
+                return word;
+            }
+            to = jmpTarget(to);
+        }
+        return to;
+    };
+
+    size_t count = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        size_t next = nextOf(code, pc);
+        BranchOperands t = branchOperands(code[pc]);
+        for (int r : t.relative) {
+            if (r < 0) {
+                continue;
+            }
+            size_t target = next + static_cast<int32_t>(code[pc + 1 + r]);
+            size_t to = finalTarget(target);
+            if (to != target) {
+                code[pc + 1 + r] = static_cast<uint32_t>(static_cast<int64_t>(to) - static_cast<int64_t>(next));
+                count++;
+            }
+        }
+        pc = next - 1;
+    }
+    // A DT_JMP to a DT_RET or DT_END becomes that instruction; the offset
+    // word it leaves behind is filled with a copy, so a linear walk of the
+    // code still sees whole instructions.
+    for (size_t pc = 0; pc < n; pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        if (code[pc] == DT_JMP) {
+            uint32_t op = code[jmpTarget(pc)];
+            if (op == DT_RET || op == DT_END) {
+                code[pc] = op;
+                code[pc + 1] = op;
+                count++;
+            }
+        }
+        pc = nextOf(code, pc) - 1;
+    }
+    if (count > 0) {
+        profile = verifyProgram(code);
+    }
+    return count;
+}
+
+void resolveBranchTargets(std::vector<uint32_t>& code, const StackProfile& profile) {
+    for (size_t pc = 0; pc < code.size(); pc++) {
+        if (profile.depth[pc] < 0) {
+            continue;
+        }
+        size_t next = nextOf(code, pc);
+        for (int r : branchOperands(code[pc]).relative) {
+            if (r >= 0) {
+                code[pc + 1 + r] = static_cast<uint32_t>(static_cast<int64_t>(next) + static_cast<int32_t>(code[pc + 1 + r]));
+            }
+        }
+        pc = next - 1;
+    }
+}
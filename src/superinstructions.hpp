@@ -0,0 +1,83 @@
+#ifndef SUPERINSTRUCTIONS_HPP
+#define SUPERINSTRUCTIONS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "verifier.hpp"
+
+// Operand positions, counted from the first operand word, of the branch
+// offsets (relative to the word after the instruction) and of the absolute
+// call target of `op`; -1 where it has none.
+struct BranchOperands {
+    int relative[2] = {-1, -1};
+    int absolute = -1;
+};
+BranchOperands branchOperands(uint32_t op);
+
+// Helpers of the load-time rewrites below and in src/optimizer.cpp. Each
+// takes verified code.
+
+// Words something branches to or calls, and word 0; a rewritten sequence may
+// start at one but must not hide one.
+std::vector<uint8_t> landingWords(const std::vector<uint32_t>& code, const StackProfile& profile);
+
+// Up to `count` instructions that run one after the other from `pc`, stopping
+// before one that something lands on.
+std::vector<size_t> straightRun(const std::vector<uint32_t>& code, const std::vector<uint8_t>& landing,
+                                size_t pc, size_t count);
+
+// Replaces the instructions from a start word up to `end` with `words`, whole
+// instructions whose branch operands hold the old word they must reach
+// instead of an offset, or FALL_THROUGH for the instruction after them in
+// `words` (code copied from elsewhere has no old word of its own). Call
+// targets hold the old word of the callee, as they do in the code.
+constexpr uint32_t FALL_THROUGH = UINT32_MAX;
+
+struct Rewrite {
+    size_t end = 0;  // 0: no rewrite
+    std::vector<uint32_t> words;
+};
+
+// Lays the reachable code out again with `rewrites` (indexed by start word)
+// applied, relocating branch offsets and call targets, and drops every
+// unreachable word.
+std::vector<uint32_t> relayout(const std::vector<uint32_t>& code, const StackProfile& profile,
+                               const std::vector<Rewrite>& rewrites);
+
+// When `count`, the number of `rewrites`, is not 0: lays the code out again
+// with them and replaces `profile` by the profile of the result. Returns
+// `count`.
+size_t applyRewrites(std::vector<uint32_t>& code, StackProfile& profile, const std::vector<Rewrite>& rewrites,
+                     size_t count);
+
+// Load-time rewrite of the instruction sequences converter.py emits for every
+// function and call site into single superinstructions:
+//   DT_DUP, DT_IMMI k, DT_GT, DT_IF_ELSE t f  ->  DT_GUARD_GT k t f
+//   DT_DUP, DT_IMMI k, DT_EQ, DT_IF_ELSE t f  ->  DT_GUARD_EQ k t f
+//   DT_DUP, DT_INC, DT_CALL f n               ->  DT_CALL_INC f n
+// A sequence is fused only when no branch or call lands inside it. The fused
+// program is shorter, so every branch offset and call target is relocated and
+// unreachable words are dropped; `profile` is replaced by the profile of the
+// rewritten code. Returns the number of sequences fused (0 leaves `code` and
+// `profile` untouched). `code` must already have passed verifyProgram.
+size_t fuseSuperinstructions(std::vector<uint32_t>& code, StackProfile& profile);
+
+// Load-time jump threading. converter.py ends every branch body with a DT_JMP
+// to the function's `_ret` label, which holds only DT_RET, and nests branches
+// whose exits jump to further DT_JMPs. Every branch offset that lands on a
+// DT_JMP is retargeted to the end of the chain, and a DT_JMP that ends up on
+// DT_RET or DT_END is replaced by that instruction (its offset word becomes an
+// unreachable copy of it). The code keeps its length and layout. Returns the
+// number of operands and jumps rewritten; `profile` is replaced by the profile
+// of the rewritten code when that is not 0. `code` must already have passed
+// verifyProgram.
+size_t threadJumps(std::vector<uint32_t>& code, StackProfile& profile);
+
+// Rewrites the branch offsets of every reachable instruction in place into
+// the absolute word index they reach, for engines that index the code by
+// word and would otherwise add the offset on every branch. The result no
+// longer passes verifyProgram; run it after the other load-time passes.
+void resolveBranchTargets(std::vector<uint32_t>& code, const StackProfile& profile);
+
+#endif
@@ -13,14 +13,18 @@
 #include "symbol.hpp"
 #include "readfile.hpp"
 #include "interface.hpp"
+#include "framestack.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
 class SwThreadingVM : public Interface {
     uint32_t ip; 
-    std::vector<std::stack<uint32_t>> sts; 
-    std::stack<uint32_t> st;
+    FrameStack st;
+    StackProfile profile; // Verified stack depths of the loaded program
     std::vector<uint32_t> instructions; 
     char* buffer; 
     std::stack<uint32_t> callStack; 
@@ -52,107 +56,111 @@ class SwThreadingVM : public Interface {
         read_memory(buffer, reinterpret_cast<uint8_t*>(buf), offset, 4);
         return buf[0];
     }
-    inline void do_add() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(a + b);
-    }
-    inline void do_sub() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b - a);
-    }
-    inline void do_mul() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(a * b);
-    }
-    inline void do_div() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
+    // Top-of-stack cached push/pop: `tos` holds the top value and `sp` points
+    // one past the values spilled below it (see FrameStack). run_vm keeps both
+    // in locals, so they stay in registers across the dispatch switch. The
+    // program is verified before it runs, so neither checks the frame bounds.
+    inline void push(uint32_t& tos, uint32_t*& sp, uint32_t val) {
+        *sp++ = tos;
+        tos = val;
+    }
+    inline uint32_t pop(uint32_t& tos, uint32_t*& sp) {
+        uint32_t val = tos;
+        tos = *--sp;
+        return val;
+    }
+    inline void do_add(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b + tos;
+    }
+    inline void do_sub(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b - tos;
+    }
+    inline void do_mul(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b * tos;
+    }
+    inline void do_div(uint32_t& tos, uint32_t*& sp) {
+        uint32_t a = tos;
+        uint32_t b = *--sp;
         if (a == 0) { 
             std::cerr << "Error: Divided by zero error" << std::endl;
+            tos = *--sp;
             return;
         }
-        st.push(b / a);
+        tos = b / a;
     }
-    inline void do_mod() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
+    inline void do_mod(uint32_t& tos, uint32_t*& sp) {
+        uint32_t a = tos;
+        uint32_t b = *--sp;
         if (a == 0) { 
             std::cerr << "Error: Modulo by zero error" << std::endl;
+            tos = *--sp;
             return;
         }
-        st.push(b % a);
+        tos = b % a;
     }
-    inline void do_dup() {
-        if (st.empty()) {
-            std::cerr << "Error: Stack is empty" << std::endl;
-            return;
-        }
-        uint32_t a = st.top();
-        st.push(a);
-    }
-    inline void do_fp_add() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
-        st.push(from_float(a + b));
-    }
-    inline void do_fp_sub() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
-        st.push(from_float(b - a));
-    }
-    inline void do_fp_mul() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
-        st.push(from_float(a * b));
-    }
-    inline void do_fp_div() {
-        float a = to_float(st.top()); st.pop();
-        float b = to_float(st.top()); st.pop();
+    inline void do_dup(uint32_t& tos, uint32_t*& sp) {
+        push(tos, sp, tos);
+    }
+    inline void do_fp_add(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
+        tos = from_float(a + b);
+    }
+    inline void do_fp_sub(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
+        tos = from_float(b - a);
+    }
+    inline void do_fp_mul(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
+        tos = from_float(a * b);
+    }
+    inline void do_fp_div(uint32_t& tos, uint32_t*& sp) {
+        float a = to_float(tos);
+        float b = to_float(*--sp);
         if (a == 0.0f) { 
             std::cerr << "Error: Division by zero error" << std::endl;
+            tos = *--sp;
             return;
         }
-        st.push(from_float(b / a));
+        tos = from_float(b / a);
     }
-    inline void do_inc() {
-        uint32_t a = st.top(); st.pop();
-        st.push(++a);
+    inline void do_inc(uint32_t& tos) {
+        ++tos;
     }
-    inline void do_dec() {
-        uint32_t a = st.top(); st.pop();
-        st.push(--a);
+    inline void do_dec(uint32_t& tos) {
+        --tos;
     }
-    inline void do_shl() {
-        uint32_t shift = st.top(); st.pop();
-        uint32_t value = st.top(); st.pop();
-        st.push(value << shift);
+    inline void do_shl(uint32_t& tos, uint32_t*& sp) {
+        uint32_t value = *--sp;
+        tos = value << tos;
     }
-    inline void do_shr() {
-        uint32_t shift = st.top(); st.pop();
-        uint32_t value = st.top(); st.pop();
-        st.push(value >> shift);
+    inline void do_shr(uint32_t& tos, uint32_t*& sp) {
+        uint32_t value = *--sp;
+        tos = value >> tos;
     }
     inline void do_end() {
-        st = std::stack<uint32_t>();
+        st.clear();
         instructions = std::vector<uint32_t>();
         ip = 0;
     }
-    inline void do_lod() {
+    inline void do_lod(uint32_t& tos, uint32_t*& sp) {
         uint32_t offset = instructions[ip++];
         uint32_t a = read_mem32(buffer, offset);
-        st.push(a);
+        push(tos, sp, a);
     }
-    inline void do_sto() {
+    inline void do_sto(uint32_t& tos, uint32_t*& sp) {
         uint32_t offset = instructions[ip++];
-        uint32_t a = st.top(); st.pop();
+        uint32_t a = pop(tos, sp);
         write_mem32(buffer, a, offset);
     }
-    inline void do_immi() {
+    inline void do_immi(uint32_t& tos, uint32_t*& sp) {
         uint32_t a = instructions[ip++];
-        st.push(a);
+        push(tos, sp, a);
     }
     inline void do_memcpy() {
         uint32_t dest = instructions[ip++];
@@ -172,107 +180,104 @@ class SwThreadingVM : public Interface {
         write_mem32(buffer, number, offset);
     }
 
-    // 将 do_jmp 修改为使用相对偏移量
+    // Branch operands hold absolute word indices here: run_vm resolves the
+    // offsets once at load time (resolveBranchTargets).
     inline void do_jmp() {
-        int32_t offset = static_cast<int32_t>(instructions[ip++]);
-        ip = ip + offset;
+        ip = instructions[ip];
     }
-
-    // 修改 do_jz，使其跳转目标为当前 ip 加上相对偏移量
-    inline void do_jz() {
-        int32_t offset = static_cast<int32_t>(instructions[ip++]);
-        uint32_t topVal = st.top(); st.pop();
+    inline void do_jz(uint32_t& tos, uint32_t*& sp) {
+        uint32_t target = instructions[ip++];
+        uint32_t topVal = pop(tos, sp);
         if (topVal == 0) {
-            ip = ip + offset;
+            ip = target;
         }
     }
-
-    // 修改 do_jump_if，同样使用相对偏移量
-    inline void do_jump_if() {
-        uint32_t condition = st.top(); st.pop();
-        int32_t offset = static_cast<int32_t>(instructions[ip++]);
+    inline void do_jump_if(uint32_t& tos, uint32_t*& sp) {
+        uint32_t condition = pop(tos, sp);
+        uint32_t target = instructions[ip++];
         if (condition) {
-            ip = ip + offset;
+            ip = target;
         }
     }
+    inline void do_if_else(uint32_t& tos, uint32_t*& sp) {
+        uint32_t condition = pop(tos, sp);
+        ip = condition ? instructions[ip] : instructions[ip + 1];
+    }
 
-    // 修改 do_if_else，分别对 true 和 false 分支使用相对偏移量
-    inline void do_if_else() {
-        uint32_t condition = st.top(); st.pop();
-        int32_t trueOffset = static_cast<int32_t>(instructions[ip++]);
-        int32_t falseOffset = static_cast<int32_t>(instructions[ip++]);
-        ip = condition ? (ip + trueOffset) : (ip + falseOffset);
+    // Superinstructions: the top stays on the stack.
+    inline void do_guard_gt(uint32_t& tos) {
+        ip = tos > instructions[ip] ? instructions[ip + 1] : instructions[ip + 2];
+    }
+    inline void do_guard_eq(uint32_t& tos) {
+        ip = tos == instructions[ip] ? instructions[ip + 1] : instructions[ip + 2];
     }
 
-    inline void do_gt() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b > a ? 1 : 0);
-    }
-    inline void do_lt() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b < a ? 1 : 0);
-    }
-    inline void do_eq() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b == a ? 1 : 0);
-    }
-    inline void do_gt_eq() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b >= a ? 1 : 0);
-    }
-    inline void do_lt_eq() {
-        uint32_t a = st.top(); st.pop();
-        uint32_t b = st.top(); st.pop();
-        st.push(b <= a ? 1 : 0);
+    inline void do_gt(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b > tos ? 1 : 0;
+    }
+    inline void do_lt(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b < tos ? 1 : 0;
+    }
+    inline void do_eq(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b == tos ? 1 : 0;
+    }
+    inline void do_gt_eq(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b >= tos ? 1 : 0;
+    }
+    inline void do_lt_eq(uint32_t& tos, uint32_t*& sp) {
+        uint32_t b = *--sp;
+        tos = b <= tos ? 1 : 0;
     }
 
-    inline void do_call() {
+    inline void do_call(uint32_t& tos, uint32_t*& sp) {
         uint32_t target = instructions[ip++];
         uint32_t num_params = instructions[ip++];
-        std::stack<uint32_t> newStack;
-        for (uint32_t i = 0; i < num_params; ++i) {
-            newStack.push(st.top());
-            st.pop();
-        }
-        sts.push_back(newStack);
-        st = sts.back(); 
-        callStack.push(ip+num_params);
+        // Spill the cached top so the frame below the parameters is complete.
+        *sp = tos;
+        st.enter((sp - st.bottom()) - num_params);
+        sp = st.reserve(sp, profile.frame_depth[target] + 1);
+        callStack.push(ip);
+        ip = target;
+    }
+    inline void do_tail_call(uint32_t& tos, uint32_t*& sp) {
+        uint32_t target = instructions[ip++];
+        uint32_t num_params = instructions[ip++];
+        // The parameters take over the frame; the return address stays.
+        *sp = tos;
+        sp = st.replace(sp, num_params);
+        sp = st.reserve(sp, profile.frame_depth[target] + 1);
+        tos = *sp;
         ip = target;
     }
-    inline void do_ret() {
+    inline void do_ret(uint32_t& tos, uint32_t*& sp) {
         if (callStack.size() == 0) {
-            exit(0);
+            ip = instructions.size();
+            return;
         }
-        st.pop();
         ip = callStack.top(); callStack.pop();
-        sts.pop_back();
-        if (!sts.empty()) {
-            st = sts.back();
+        bool has_value = st.frame_size(sp) > 0;
+        sp = st.bottom() + st.leave();
+        if (has_value) {
+            sp++; // the callee's top becomes the caller's top, already in tos
+        } else {
+            tos = *sp;
         }
     }
 
-    inline void do_seek() {
-        debug_num = st.top();
+    inline void do_seek(uint32_t& tos) {
+        debug_num = tos;
     }
-    inline void do_print() {
-        if (!st.empty()) {
-            std::cout << static_cast<int>(st.top()) << std::endl;
-        } else {
-            std::cerr << "Stack is empty." << std::endl;
-        }
+    inline void do_print(uint32_t& tos) {
+        std::cout << static_cast<int>(tos) << std::endl;
     }
-    inline void do_print_fp() {
-        if (!st.empty()) {
-            uint32_t num = st.top();
-            float* floatPtr = reinterpret_cast<float*>(&num);
-            std::cout << *floatPtr << std::endl;
-        } else {
-            std::cerr << "Stack is empty." << std::endl;
-        }
+    inline void do_print_fp(uint32_t& tos) {
+        uint32_t num = tos;
+        float* floatPtr = reinterpret_cast<float*>(&num);
+        std::cout << *floatPtr << std::endl;
     }
     inline void do_read_fp() {
         uint32_t offset = instructions[ip++];
@@ -289,17 +294,12 @@ class SwThreadingVM : public Interface {
     inline void tik() {
         std::cout << "tik" << std::endl;
     }
-    inline void do_rnd() {
-        if (!st.empty()) {
-            uint32_t a = st.top(); st.pop();
-            st.push(rd() % a);
-        }
+    inline void do_rnd(uint32_t& tos) {
+        tos = tos ? rd() % tos : 0;
     }
 public:
     uint32_t debug_num;
     SwThreadingVM() : ip(0), buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
-        sts.push_back(std::stack<uint32_t>());
-        st = sts.back();
     }
     ~SwThreadingVM() {
         delete[] buffer;
@@ -316,55 +316,77 @@ public:
             std::cerr << "Error: " << e.what() << std::endl;
             return;
         }
+        run_vm(instructions);
+    }
+
+    void run_vm(std::vector<uint32_t>& code) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        resolveBranchTargets(instructions, profile);
+        // A run that ended inside a callee leaves its frames and return
+        // indices behind, pointing into the program just replaced.
+        callStack = {};
+        st.clear();
+        // Cached top of stack and spill pointer, with room for the deepest
+        // chain of frames the verifier found.
+        uint32_t tos = 0;
+        uint32_t* sp = st.reserve(st.bottom() + st.frame_base(), profile.max_stack + 1);
         ip = 0;
         while (ip < instructions.size()) {
             uint32_t opcode = instructions[ip];
             ip++;
             switch(opcode) {
                 case DT_ADD:
-                    do_add();
+                    do_add(tos, sp);
                     break;
                 case DT_SUB:
-                    do_sub();
+                    do_sub(tos, sp);
                     break;
                 case DT_MUL:
-                    do_mul();
+                    do_mul(tos, sp);
                     break;
                 case DT_DIV:
-                    do_div();
+                    do_div(tos, sp);
                     break;
                 case DT_MOD:
-                    do_mod();
+                    do_mod(tos, sp);
                     break;
                 case DT_SHL:
-                    do_shl();
+                    do_shl(tos, sp);
                     break;
                 case DT_SHR:
-                    do_shr();
+                    do_shr(tos, sp);
                     break;
                 case DT_FP_ADD:
-                    do_fp_add();
+                    do_fp_add(tos, sp);
                     break;
                 case DT_FP_SUB:
-                    do_fp_sub();
+                    do_fp_sub(tos, sp);
                     break;
                 case DT_FP_MUL:
-                    do_fp_mul();
+                    do_fp_mul(tos, sp);
                     break;
                 case DT_FP_DIV:
-                    do_fp_div();
+                    do_fp_div(tos, sp);
                     break;
                 case DT_END:
                     do_end();
                     break;
                 case DT_LOD:
-                    do_lod();
+                    do_lod(tos, sp);
                     break;
                 case DT_STO:
-                    do_sto();
+                    do_sto(tos, sp);
                     break;
                 case DT_IMMI:
-                    do_immi();
+                    do_immi(tos, sp);
                     break;
                 case DT_STO_IMMI:
                     do_sto_immi();
@@ -376,55 +398,69 @@ public:
                     do_memset();
                     break;
                 case DT_INC:
-                    do_inc();
+                    do_inc(tos);
                     break;
                 case DT_DEC:
-                    do_dec();
+                    do_dec(tos);
                     break;
                 case DT_JMP:
                     do_jmp();
                     break;
                 case DT_JZ:
-                    do_jz();
+                    do_jz(tos, sp);
                     break;
                 case DT_IF_ELSE:
-                    do_if_else();
+                    do_if_else(tos, sp);
                     break;
                 case DT_JUMP_IF:
-                    do_jump_if();
+                    do_jump_if(tos, sp);
                     break;
                 case DT_GT:
-                    do_gt();
+                    do_gt(tos, sp);
                     break;
                 case DT_LT:
-                    do_lt();
+                    do_lt(tos, sp);
                     break;
                 case DT_EQ:
-                    do_eq();
+                    do_eq(tos, sp);
                     break;
                 case DT_GT_EQ:
-                    do_gt_eq();
+                    do_gt_eq(tos, sp);
                     break;
                 case DT_LT_EQ:
-                    do_lt_eq();
+                    do_lt_eq(tos, sp);
+                    break;
+                case DT_GUARD_GT:
+                    do_guard_gt(tos);
+                    break;
+                case DT_GUARD_EQ:
+                    do_guard_eq(tos);
+                    break;
+                case DT_CALL_INC:
+                    // Pass top + 1 as the last parameter
+                    push(tos, sp, tos + 1);
+                    do_call(tos, sp);
                     break;
                 case DT_CALL:
-                    do_call();
+                    do_call(tos, sp);
+                    break;
+                case DT_TAILCALL:
+                    do_tail_call(tos, sp);
                     break;
                 case DT_RET:
-                    do_ret();
+                    do_ret(tos, sp);
                     break;
                 case DT_SEEK:
-                    do_seek();
+                    do_seek(tos);
                     break;
                 case DT_PRINT:
-                    do_print();
+                    do_print(tos);
                     break;
                 case DT_READ_INT:
                     do_read_int();
                     break;
                 case DT_FP_PRINT:
-                    do_print_fp();
+                    do_print_fp(tos);
                     break;
                 case DT_FP_READ:
                     do_read_fp();
@@ -433,10 +469,10 @@ public:
                     tik();
                     break;
                 case DT_RND:
-                    do_rnd();
+                    do_rnd(tos);
                     break;
                 case DT_DUP:
-                    do_dup();
+                    do_dup(tos, sp);
                     break;
                 default:
                     std::cerr << "Unknown instruction code: " << opcode << std::endl;
@@ -1,5 +1,7 @@
 // Define the set of instructions supported by the VM
 #pragma once
+#include <cstdint>
+
 enum Instruction {
     // arithmetic 
     DT_ADD, 
@@ -45,5 +47,70 @@ enum Instruction {
     DT_Tik,
     //System
     DT_SYSCALL,
-    DT_RND
+    DT_RND,
+    //Superinstructions (fuseSuperinstructions rewrites converter.py's idioms into these)
+    DT_GUARD_GT,    // DT_DUP, DT_IMMI k, DT_GT, DT_IF_ELSE t f: branch on top > k, keep the top
+    DT_GUARD_EQ,    // DT_DUP, DT_IMMI k, DT_EQ, DT_IF_ELSE t f: branch on top == k, keep the top
+    DT_CALL_INC,    // DT_DUP, DT_INC, DT_CALL f n: call f with top + 1 as its last parameter
+    //Tail calls (markTailCalls rewrites a DT_CALL in tail position into this)
+    DT_TAILCALL,    // DT_CALL f n, then DT_RET: f's frame replaces the current one
+    DT_NUM_INSTRUCTIONS // Keep last: size of the tables indexed by opcode
+};
+
+// Immediate words and operand-stack effect of every instruction, indexed by
+// opcode. `pops` is how many values the instruction needs on the stack and
+// `pushes` how many it leaves there (DT_PRINT needs one and leaves it).
+// DT_CALL, DT_CALL_INC, DT_TAILCALL and DT_RET depend on their operands and
+// the callee, so the verifier handles them itself.
+struct InstructionInfo {
+    uint8_t operands;
+    uint8_t pops;
+    uint8_t pushes;
+};
+
+inline constexpr InstructionInfo instructionInfo[DT_NUM_INSTRUCTIONS] = {
+    {0, 2, 1}, // DT_ADD
+    {0, 2, 1}, // DT_SUB
+    {0, 2, 1}, // DT_MUL
+    {0, 2, 1}, // DT_DIV
+    {0, 2, 1}, // DT_MOD
+    {0, 2, 1}, // DT_SHL
+    {0, 2, 1}, // DT_SHR
+    {0, 2, 1}, // DT_FP_ADD
+    {0, 2, 1}, // DT_FP_SUB
+    {0, 2, 1}, // DT_FP_MUL
+    {0, 2, 1}, // DT_FP_DIV
+    {0, 1, 2}, // DT_DUP
+    {0, 0, 0}, // DT_END
+    {1, 0, 1}, // DT_LOD
+    {1, 1, 0}, // DT_STO
+    {1, 0, 1}, // DT_IMMI
+    {0, 1, 1}, // DT_INC
+    {0, 1, 1}, // DT_DEC
+    {2, 0, 0}, // DT_STO_IMMI
+    {3, 0, 0}, // DT_MEMCPY
+    {3, 0, 0}, // DT_MEMSET
+    {1, 0, 0}, // DT_JMP
+    {1, 1, 0}, // DT_JZ
+    {2, 1, 0}, // DT_IF_ELSE
+    {1, 1, 0}, // DT_JUMP_IF
+    {0, 2, 1}, // DT_GT
+    {0, 2, 1}, // DT_LT
+    {0, 2, 1}, // DT_EQ
+    {0, 2, 1}, // DT_GT_EQ
+    {0, 2, 1}, // DT_LT_EQ
+    {2, 0, 0}, // DT_CALL (target, num_params)
+    {0, 0, 0}, // DT_RET
+    {0, 1, 1}, // DT_SEEK
+    {0, 1, 1}, // DT_PRINT
+    {1, 0, 0}, // DT_READ_INT
+    {0, 1, 1}, // DT_FP_PRINT
+    {1, 0, 0}, // DT_FP_READ
+    {0, 0, 0}, // DT_Tik
+    {0, 0, 0}, // DT_SYSCALL (not implemented by any engine)
+    {0, 1, 1}, // DT_RND
+    {3, 1, 1}, // DT_GUARD_GT (k, true target, false target)
+    {3, 1, 1}, // DT_GUARD_EQ (k, true target, false target)
+    {2, 0, 0}, // DT_CALL_INC (target, num_params)
+    {2, 0, 0}, // DT_TAILCALL (target, num_params)
 };
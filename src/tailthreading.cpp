@@ -0,0 +1,426 @@
+#ifndef TAILTHREADING_H
+#define TAILTHREADING_H
+
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include "symbol.hpp"
+#include "readfile.hpp"
+#include "interface.hpp"
+#include "framestack.hpp"
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
+
+// Every handler ends by calling the next one in tail position. clang is told
+// so with musttail; GCC turns these calls into jumps on its own from -O2 on
+// (sibling-call optimization), as long as no handler keeps the address of a
+// local alive across the call, which is why I/O goes through out-of-line
+// helpers below.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define TAIL_MUSTTAIL [[clang::musttail]]
+#endif
+#endif
+#ifndef TAIL_MUSTTAIL
+#define TAIL_MUSTTAIL
+#endif
+
+// Tail-call threading: each instruction is a separate function with the same
+// signature, and each handler dispatches by tail-calling the handler stored
+// in the next cell of the pre-decoded code. The VM state (code pointer,
+// spill pointer, cached top of stack, memory and the VM itself) therefore
+// lives in the argument registers for the whole run, and every handler is
+// register-allocated on its own instead of as part of one huge function.
+class TailThreadingVM : public Interface {
+    union Cell;
+    using Handler = void (*)(const Cell* pc, uint32_t* sp, uint32_t tos, char* mem, TailThreadingVM* vm);
+
+    // One cell of pre-decoded code: a handler followed by that instruction's
+    // operands, with branch and call targets resolved to the cell they land on.
+    union Cell {
+        Handler handler;
+        const Cell* target;
+        uint32_t value;
+    };
+
+    FrameStack st;                       // Operand stack shared by all call frames
+    StackProfile profile;                // Verified stack depths of the loaded program
+    std::vector<uint32_t> instructions;
+    std::vector<Cell> threaded;          // Pre-decoded code
+    std::vector<const Cell*> callStack;  // Return addresses
+    char* buffer;                        // Memory buffer
+    uint32_t seed = 2463534242UL; // Seed for random number generation
+
+    uint32_t rd() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+    static float to_float(uint32_t val) {
+        float f;
+        memcpy(&f, &val, sizeof(f));
+        return f;
+    }
+    static uint32_t from_float(float val) {
+        uint32_t u;
+        memcpy(&u, &val, sizeof(u));
+        return u;
+    }
+    static uint32_t read_mem32(const char* mem, uint32_t offset) {
+        uint32_t val;
+        memcpy(&val, mem + offset, 4);
+        return val;
+    }
+    static void write_mem32(char* mem, uint32_t val, uint32_t offset) {
+        memcpy(mem + offset, &val, 4);
+    }
+
+    [[gnu::noinline]] static void print_int(uint32_t v) {
+        std::cout << static_cast<int>(v) << std::endl;
+    }
+    [[gnu::noinline]] static void print_fp(uint32_t v) {
+        std::cout << to_float(v) << std::endl;
+    }
+    [[gnu::noinline]] static void read_int(char* mem, uint32_t offset) {
+        int val;
+        std::cin >> val;
+        write_mem32(mem, static_cast<uint32_t>(val), offset);
+    }
+    [[gnu::noinline]] static void read_fp(char* mem, uint32_t offset) {
+        float val;
+        std::cin >> val;
+        write_mem32(mem, from_float(val), offset);
+    }
+    [[gnu::noinline]] static void tik() {
+        std::cout << "tik" << std::endl;
+    }
+    [[gnu::noinline]] static void divide_by_zero() {
+        std::cerr << "Error: Divided by zero error" << std::endl;
+    }
+
+// Every handler takes the whole VM state, whether it uses all of it or not.
+#define HANDLER(name) \
+    static void name([[maybe_unused]] const Cell* pc, [[maybe_unused]] uint32_t* sp, [[maybe_unused]] uint32_t tos, \
+                     [[maybe_unused]] char* mem, [[maybe_unused]] TailThreadingVM* vm)
+#define NEXT(to) do { const Cell* next_ = (to); TAIL_MUSTTAIL return next_->handler(next_, sp, tos, mem, vm); } while (0)
+#define BINARY(name, expr) HANDLER(name) { uint32_t b = tos; uint32_t a = *--sp; tos = (expr); NEXT(pc + 1); }
+#define FP_BINARY(name, op) BINARY(name, from_float(to_float(a) op to_float(b)))
+// Division by zero reports the error and ends the run.
+#define CHECKED_BINARY(name, expr, zero) \
+    HANDLER(name) { \
+        uint32_t b = tos; \
+        if (zero) { divide_by_zero(); return; } \
+        uint32_t a = *--sp; \
+        tos = (expr); \
+        NEXT(pc + 1); \
+    }
+
+    BINARY(h_add, a + b)
+    BINARY(h_sub, a - b)
+    BINARY(h_mul, a * b)
+    BINARY(h_shl, a << b)
+    BINARY(h_shr, a >> b)
+    FP_BINARY(h_fp_add, +)
+    FP_BINARY(h_fp_sub, -)
+    FP_BINARY(h_fp_mul, *)
+    BINARY(h_gt, a > b ? 1 : 0)
+    BINARY(h_lt, a < b ? 1 : 0)
+    BINARY(h_eq, a == b ? 1 : 0)
+    BINARY(h_gt_eq, a >= b ? 1 : 0)
+    BINARY(h_lt_eq, a <= b ? 1 : 0)
+    CHECKED_BINARY(h_div, a / b, b == 0)
+    CHECKED_BINARY(h_mod, a % b, b == 0)
+    CHECKED_BINARY(h_fp_div, from_float(to_float(a) / to_float(b)), to_float(b) == 0.0f)
+
+    HANDLER(h_dup) {
+        *sp++ = tos;
+        NEXT(pc + 1);
+    }
+    HANDLER(h_end) {
+        vm->st.clear();
+    }
+    HANDLER(h_lod) {
+        *sp++ = tos;
+        tos = read_mem32(mem, pc[1].value);
+        NEXT(pc + 2);
+    }
+    HANDLER(h_sto) {
+        write_mem32(mem, tos, pc[1].value);
+        tos = *--sp;
+        NEXT(pc + 2);
+    }
+    HANDLER(h_immi) {
+        *sp++ = tos;
+        tos = pc[1].value;
+        NEXT(pc + 2);
+    }
+    HANDLER(h_inc) {
+        ++tos;
+        NEXT(pc + 1);
+    }
+    HANDLER(h_dec) {
+        --tos;
+        NEXT(pc + 1);
+    }
+    HANDLER(h_sto_immi) {
+        write_mem32(mem, pc[2].value, pc[1].value);
+        NEXT(pc + 3);
+    }
+    HANDLER(h_memcpy) {
+        memcpy(mem + pc[1].value, mem + pc[2].value, pc[3].value);
+        NEXT(pc + 4);
+    }
+    HANDLER(h_memset) {
+        memset(mem + pc[1].value, pc[2].value, pc[3].value);
+        NEXT(pc + 4);
+    }
+    HANDLER(h_jmp) {
+        NEXT(pc[1].target);
+    }
+    HANDLER(h_jz) {
+        uint32_t condition = tos;
+        tos = *--sp;
+        NEXT(condition == 0 ? pc[1].target : pc + 2);
+    }
+    HANDLER(h_jump_if) {
+        uint32_t condition = tos;
+        tos = *--sp;
+        NEXT(condition != 0 ? pc[1].target : pc + 2);
+    }
+    HANDLER(h_if_else) {
+        uint32_t condition = tos;
+        tos = *--sp;
+        NEXT(condition != 0 ? pc[1].target : pc[2].target);
+    }
+    HANDLER(h_guard_gt) {
+        NEXT(tos > pc[1].value ? pc[2].target : pc[3].target);
+    }
+    HANDLER(h_guard_eq) {
+        NEXT(tos == pc[1].value ? pc[2].target : pc[3].target);
+    }
+    HANDLER(h_call) {
+        // Spill the cached top so the frame below the parameters is complete.
+        *sp = tos;
+        vm->st.enter((sp - vm->st.bottom()) - pc[2].value);
+        sp = vm->st.reserve(sp, pc[3].value);
+        vm->callStack.push_back(pc + 4);
+        NEXT(pc[1].target);
+    }
+    HANDLER(h_call_inc) {
+        // Pass top + 1 as the last parameter, then call as DT_CALL does.
+        *sp++ = tos;
+        ++tos;
+        TAIL_MUSTTAIL return h_call(pc, sp, tos, mem, vm);
+    }
+    HANDLER(h_tail_call) {
+        // The parameters take over the frame; the return address stays.
+        *sp = tos;
+        sp = vm->st.replace(sp, pc[2].value);
+        sp = vm->st.reserve(sp, pc[3].value);
+        tos = *sp;
+        NEXT(pc[1].target);
+    }
+    HANDLER(h_ret) {
+        if (vm->callStack.empty()) {
+            return; // DT_RET in the top-level code ends the program
+        }
+        bool has_value = vm->st.frame_size(sp) > 0;
+        sp = vm->st.bottom() + vm->st.leave();
+        if (has_value) {
+            sp++; // the callee's top becomes the caller's top, already in tos
+        } else {
+            tos = *sp;
+        }
+        const Cell* back = vm->callStack.back();
+        vm->callStack.pop_back();
+        NEXT(back);
+    }
+    HANDLER(h_seek) {
+        vm->debug_num = tos;
+        NEXT(pc + 1);
+    }
+    HANDLER(h_print) {
+        print_int(tos);
+        NEXT(pc + 1);
+    }
+    HANDLER(h_read_int) {
+        read_int(mem, pc[1].value);
+        NEXT(pc + 2);
+    }
+    HANDLER(h_fp_print) {
+        print_fp(tos);
+        NEXT(pc + 1);
+    }
+    HANDLER(h_fp_read) {
+        read_fp(mem, pc[1].value);
+        NEXT(pc + 2);
+    }
+    HANDLER(h_tik) {
+        tik();
+        NEXT(pc + 1);
+    }
+    HANDLER(h_rnd) {
+        tos = tos ? vm->rd() % tos : 0;
+        NEXT(pc + 1);
+    }
+
+#undef CHECKED_BINARY
+#undef FP_BINARY
+#undef BINARY
+#undef NEXT
+#undef HANDLER
+
+    // Designators are kept in enum order so GCC accepts them as well as clang.
+    static constexpr Handler handlers[DT_NUM_INSTRUCTIONS] = {
+        [DT_ADD]       = h_add,
+        [DT_SUB]       = h_sub,
+        [DT_MUL]       = h_mul,
+        [DT_DIV]       = h_div,
+        [DT_MOD]       = h_mod,
+        [DT_SHL]       = h_shl,
+        [DT_SHR]       = h_shr,
+        [DT_FP_ADD]    = h_fp_add,
+        [DT_FP_SUB]    = h_fp_sub,
+        [DT_FP_MUL]    = h_fp_mul,
+        [DT_FP_DIV]    = h_fp_div,
+        [DT_DUP]       = h_dup,
+        [DT_END]       = h_end,
+        [DT_LOD]       = h_lod,
+        [DT_STO]       = h_sto,
+        [DT_IMMI]      = h_immi,
+        [DT_INC]       = h_inc,
+        [DT_DEC]       = h_dec,
+        [DT_STO_IMMI]  = h_sto_immi,
+        [DT_MEMCPY]    = h_memcpy,
+        [DT_MEMSET]    = h_memset,
+        [DT_JMP]       = h_jmp,
+        [DT_JZ]        = h_jz,
+        [DT_IF_ELSE]   = h_if_else,
+        [DT_JUMP_IF]   = h_jump_if,
+        [DT_GT]        = h_gt,
+        [DT_LT]        = h_lt,
+        [DT_EQ]        = h_eq,
+        [DT_GT_EQ]     = h_gt_eq,
+        [DT_LT_EQ]     = h_lt_eq,
+        [DT_CALL]      = h_call,
+        [DT_RET]       = h_ret,
+        [DT_SEEK]      = h_seek,
+        [DT_PRINT]     = h_print,
+        [DT_READ_INT]  = h_read_int,
+        [DT_FP_PRINT]  = h_fp_print,
+        [DT_FP_READ]   = h_fp_read,
+        [DT_Tik]       = h_tik,
+        [DT_SYSCALL]   = nullptr,  // Rejected by the verifier
+        [DT_RND]       = h_rnd,
+        [DT_GUARD_GT]  = h_guard_gt,
+        [DT_GUARD_EQ]  = h_guard_eq,
+        [DT_CALL_INC]  = h_call_inc,
+        [DT_TAILCALL]  = h_tail_call,
+    };
+
+    // Translates the verified `instructions` into `threaded`: one handler
+    // cell per reachable instruction, then its operands. DT_CALL,
+    // DT_CALL_INC and DT_TAILCALL get a third operand cell holding the room
+    // the callee's frame needs.
+    void predecode() {
+        std::vector<uint32_t> cellOf(instructions.size(), 0);
+        size_t cells = 0;
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            cellOf[pc] = cells;
+            cells += 1 + instructionInfo[op].operands + (op == DT_CALL || op == DT_CALL_INC || op == DT_TAILCALL ? 1 : 0);
+            pc += instructionInfo[op].operands;
+        }
+        threaded.assign(cells, Cell{nullptr});
+        // Branch operands count from the word after the branch instruction.
+        auto branch = [&](size_t pc, size_t next, int operand) {
+            int32_t offset = static_cast<int32_t>(instructions[pc + 1 + operand]);
+            return &threaded[cellOf[next + offset]];
+        };
+        for (size_t pc = 0; pc < instructions.size(); pc++) {
+            if (profile.depth[pc] < 0) {
+                continue;
+            }
+            uint32_t op = instructions[pc];
+            size_t next = pc + 1 + instructionInfo[op].operands;
+            Cell* cell = &threaded[cellOf[pc]];
+            cell[0].handler = handlers[op];
+            switch (op) {
+                case DT_JMP:
+                case DT_JZ:
+                case DT_JUMP_IF:
+                    cell[1].target = branch(pc, next, 0);
+                    break;
+                case DT_IF_ELSE:
+                    cell[1].target = branch(pc, next, 0);
+                    cell[2].target = branch(pc, next, 1);
+                    break;
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ:
+                    cell[1].value = instructions[pc + 1];
+                    cell[2].target = branch(pc, next, 1);
+                    cell[3].target = branch(pc, next, 2);
+                    break;
+                case DT_CALL:
+                case DT_CALL_INC:
+                case DT_TAILCALL:
+                    cell[1].target = &threaded[cellOf[instructions[pc + 1]]];
+                    cell[2].value = instructions[pc + 2];
+                    cell[3].value = profile.frame_depth[instructions[pc + 1]] + 1;
+                    break;
+                default:
+                    for (uint32_t k = 1; k <= instructionInfo[op].operands; k++) {
+                        cell[k].value = instructions[pc + k];
+                    }
+                    break;
+            }
+            pc = next - 1;
+        }
+    }
+
+public:
+    uint32_t debug_num;
+
+    TailThreadingVM() : buffer(new char[4 * 1024 * 1024]), debug_num(0xFFFFFFFF) {
+    }
+    ~TailThreadingVM() {
+        delete[] buffer;
+    }
+
+    void run_vm(std::string filename, bool benchmarkMode) {
+        try {
+            instructions = readFileToUint32Array(filename);
+            if (benchmarkMode) {
+                std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        run_vm(instructions);
+    }
+
+    void run_vm(std::vector<uint32_t>& code) {
+        try {
+            profile = verifyProgram(code);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        instructions = code;
+        optimizeProgram(instructions, profile);
+        fuseSuperinstructions(instructions, profile);
+        predecode();
+        callStack.clear();
+        uint32_t* sp = st.reserve(st.bottom() + st.frame_base(), profile.max_stack + 1);
+        // The chain of tail calls returns here once a handler ends the program.
+        threaded[0].handler(threaded.data(), sp, 0, buffer, this);
+    }
+};
+
+#endif // TAILTHREADING_H
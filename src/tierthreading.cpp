@@ -0,0 +1,195 @@
+#ifndef TIERTHREADING_H
+#define TIERTHREADING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "symbol.hpp"
+#include "readfile.hpp"
+#include "interface.hpp"
+#include "indirectthreading.cpp"
+#include "directthreading.cpp"
+#include "nativebuild.hpp"
+
+// Tiered execution: the program starts at once in the indirect interpreter,
+// while a background thread writes it out as the direct-threaded C of
+// DirectThreadingVM (in its resumable form), compiles that into a shared
+// object and loads it. Once the code is loaded the interpreter stops at its
+// next safe point (a DT_CALL or a backward branch) and fvm_resume() in the
+// compiled code carries on from that instruction, with the interpreter's
+// frames, calls and 4 MiB buffer. A program that ends before the compiler is
+// done never leaves the interpreter, and the compile is killed.
+class TierThreadingVM : public Interface {
+    // Mirrors `struct fvm_resume_state` in the generated C.
+    struct ResumeState {
+        char* buffer;
+        uint32_t ip;
+        uint32_t debug_num;
+        uint32_t seed;
+        uint32_t frames;
+        const uint32_t* sizes;
+        const uint32_t* values;
+        const uint32_t* return_ips;
+    };
+    using Resume = int (*)(ResumeState*);
+
+    IndirectThreadingVM interpreter;
+    DirectThreadingVM generator;
+    std::thread compiler;
+    std::atomic<bool> ready{false};      // `resume` is loaded
+    std::atomic<bool> cancelled{false};  // The program is over; stop compiling
+    std::atomic<pid_t> child{0};         // The running C compiler
+    Resume resume = nullptr;
+    void* library = nullptr;
+    bool switched = false;
+
+    // Runs on the background thread: C, then a shared object, then dlopen.
+    void compile(std::vector<uint32_t> code) {
+        ScratchDir dir("tier");
+        if (dir.path().empty()) {
+            return;
+        }
+        std::string source = dir.path() + "/program.c";
+        std::string object = dir.path() + "/program.so";
+        if (!generator.emit_resumable_c(code, source)) {
+            return;
+        }
+        std::string cc = cCompilerCommand();
+        const char* argv[] = {cc.c_str(), "-O2", "-shared", "-fPIC", "-w", "-o", object.c_str(), source.c_str(), nullptr};
+        // The driver runs in a process group of its own, so that cancelling
+        // kills cc1 and the assembler along with it. This process becomes
+        // their reaper once the driver is gone, so it can wait for them.
+        prctl(PR_SET_CHILD_SUBREAPER, 1);
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+        pid_t pid;
+        int status = -1;
+        if (!cancelled.load() &&
+            posix_spawnp(&pid, argv[0], nullptr, &attr, const_cast<char* const*>(argv), environ) == 0) {
+            child.store(pid);
+            // The program may have ended while the compiler was starting.
+            if (cancelled.load()) {
+                kill(-pid, SIGKILL);
+            }
+            waitpid(pid, &status, 0);
+            child.store(0);
+            // A killed driver's children are handed to this process (see
+            // above); reap them before the directory goes.
+            while (waitpid(-pid, nullptr, 0) > 0) {
+            }
+        }
+        posix_spawnattr_destroy(&attr);
+        if (status == 0 && !cancelled.load()) {
+            library = dlopen(object.c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (library) {
+                resume = reinterpret_cast<Resume>(dlsym(library, "fvm_resume"));
+            }
+        }
+        if (resume) {
+            ready.store(true, std::memory_order_release);
+        }
+    }
+
+    void finishCompile() {
+        cancelled.store(true);
+        pid_t pid = child.load();
+        if (pid > 0) {
+            kill(-pid, SIGKILL);
+        }
+        if (compiler.joinable()) {
+            compiler.join();
+        }
+    }
+
+    // Hands the suspended interpreter over to the compiled code.
+    void switchOver() {
+        const IndirectThreadingVM::Suspended& s = interpreter.suspended;
+        std::vector<uint32_t> returnIps;
+        for (uint32_t word : s.calls) {
+            returnIps.push_back(generator.c_label(word));
+        }
+        ResumeState state{buffer(), static_cast<uint32_t>(generator.c_label(s.word)), s.debug_num, s.seed,
+                          static_cast<uint32_t>(s.sizes.size()), s.sizes.data(), s.values.data(), returnIps.data()};
+        switched = true;
+        resume(&state);
+        debug_num = state.debug_num;
+    }
+
+    void unload() {
+        ready.store(false);
+        resume = nullptr;
+        if (library) {
+            dlclose(library);
+            library = nullptr;
+        }
+    }
+
+    char* buffer() { return interpreter.memory(); }
+
+public:
+    uint32_t debug_num;
+    // Finish compiling before the interpreter starts, so the first safe
+    // point switches over (for tests and measurements).
+    bool compile_first = false;
+
+    TierThreadingVM() : debug_num(0xFFFFFFFF) {
+        // fvm_resume keeps one stack per call.
+        interpreter.tier_max_calls = DirectThreadingVM::C_MAX_STACKS - 1;
+    }
+    ~TierThreadingVM() {
+        finishCompile();
+        unload();
+    }
+
+    // Whether the last run finished in compiled code.
+    bool tiered_up() const { return switched; }
+
+    void run_vm(std::string filename, bool benchmarkMode) {
+        std::vector<uint32_t> code;
+        try {
+            code = readFileToUint32Array(filename);
+            if (benchmarkMode) {
+                std::cout << "Preprocessing completed, starting benchmark..." << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return;
+        }
+        run_vm(code);
+        if (benchmarkMode) {
+            std::cout << (switched ? "Switched to compiled code" : "Finished in the interpreter") << std::endl;
+        }
+    }
+
+    void run_vm(std::vector<uint32_t>& code) {
+        finishCompile();
+        unload();
+        cancelled.store(false);
+        switched = false;
+        compiler = std::thread(&TierThreadingVM::compile, this, code);
+        if (compile_first) {
+            compiler.join();
+        }
+        interpreter.tier_request = &ready;
+        interpreter.run_vm(code);
+        debug_num = interpreter.debug_num;
+        if (interpreter.suspended.valid) {
+            switchOver();
+        }
+        finishCompile();
+    }
+};
+
+#endif // TIERTHREADING_H
@@ -0,0 +1,340 @@
+#include "verifier.hpp"
+#include "symbol.hpp"
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+namespace {
+
+constexpr uint32_t NO_OWNER = UINT32_MAX;
+
+struct CallSite {
+    uint32_t depth;      // Caller's frame depth before the DT_CALL
+    uint32_t num_params;
+    uint32_t target;
+    bool tail_call;      // DT_TAILCALL: the callee takes over the frame
+};
+
+[[noreturn]] void reject(uint32_t pc, const std::string& why) {
+    throw std::runtime_error("bytecode rejected at word " + std::to_string(pc) + ": " + why);
+}
+
+// One pass over the program under a fixed assumption about which callees
+// return a value. verifyProgram first repeats lenient passes, which clamp the
+// depth at zero instead of rejecting, until the assumption holds (this settles
+// recursive functions whose DT_RETs depend on their own calls), then makes one
+// strict pass that enforces every rule.
+class Analysis {
+    const std::vector<uint32_t>& code;
+    const std::vector<uint8_t>& assumed;
+    bool strict;
+    std::vector<uint8_t> role;          // 0 unseen, 1 opcode word, 2 operand word
+    std::vector<uint32_t> work;
+    std::unordered_map<uint32_t, uint32_t> params;
+
+public:
+    std::vector<int32_t> depth;
+    std::vector<uint32_t> owner;        // Function entry each instruction belongs to
+    std::vector<uint32_t> frame_depth;
+    std::vector<int8_t> observed;       // Per entry: -1 no DT_RET reached, else 0/1
+    std::vector<uint32_t> entries;
+    std::unordered_map<uint32_t, std::vector<CallSite>> calls;
+
+    Analysis(const std::vector<uint32_t>& code, const std::vector<uint8_t>& assumed, bool strict)
+        : code(code), assumed(assumed), strict(strict), role(code.size(), 0), depth(code.size(), -1),
+          owner(code.size(), NO_OWNER), frame_depth(code.size(), 0), observed(code.size(), -1) {}
+
+    void run() {
+        enter(0, 0, 0);
+        for (size_t f = 0; f < entries.size(); f++) {
+            walk(entries[f]);
+        }
+    }
+
+private:
+    void enter(uint32_t target, uint32_t num_params, uint32_t from) {
+        auto it = params.find(target);
+        if (it == params.end()) {
+            params.emplace(target, num_params);
+            entries.push_back(target);
+        } else if (it->second != num_params) {
+            reject(from, "function at word " + std::to_string(target) + " called with " +
+                   std::to_string(num_params) + " parameters here and " +
+                   std::to_string(it->second) + " elsewhere");
+        }
+    }
+
+    void flow(uint32_t entry, uint64_t pc, int32_t d, uint32_t from) {
+        if (pc >= code.size()) {
+            reject(from, "execution runs off the end of the code");
+        }
+        if (role[pc] == 2) {
+            reject(from, "branch into the operands of another instruction");
+        }
+        if (owner[pc] != NO_OWNER && owner[pc] != entry) {
+            reject(from, "control reaches code of the function at word " + std::to_string(owner[pc]));
+        }
+        if (depth[pc] < 0) {
+            depth[pc] = d;
+            owner[pc] = entry;
+            work.push_back(static_cast<uint32_t>(pc));
+        } else if (depth[pc] != d && strict) {
+            reject(static_cast<uint32_t>(pc), "reached with stack depths " + std::to_string(depth[pc]) +
+                   " and " + std::to_string(d));
+        }
+    }
+
+    // Branch operands are relative to the word after the instruction.
+    uint64_t target(uint32_t pc, size_t next, int operand) {
+        int64_t t = static_cast<int64_t>(next) + static_cast<int32_t>(code[pc + 1 + operand]);
+        if (t < 0 || t >= static_cast<int64_t>(code.size())) {
+            reject(pc, "branch target " + std::to_string(t) + " outside the code");
+        }
+        return static_cast<uint64_t>(t);
+    }
+
+    // Depth left after taking n values off a frame holding d.
+    int32_t take(uint32_t pc, int32_t d, uint32_t n) {
+        if (d < static_cast<int32_t>(n)) {
+            if (strict) {
+                reject(pc, "needs " + std::to_string(n) + " values but the frame holds " + std::to_string(d));
+            }
+            return 0;
+        }
+        return d - static_cast<int32_t>(n);
+    }
+
+    void returns(uint32_t entry, uint32_t pc, int8_t has_value) {
+        if (observed[entry] >= 0 && observed[entry] != has_value) {
+            if (strict) {
+                reject(pc, "returns a value here but not on another path");
+            }
+            has_value = 1;
+        }
+        observed[entry] = has_value;
+    }
+
+    void walk(uint32_t entry) {
+        int32_t frame_max = static_cast<int32_t>(params[entry]);
+        flow(entry, entry, frame_max, entry);
+        while (!work.empty()) {
+            uint32_t pc = work.back();
+            work.pop_back();
+            int32_t d = depth[pc];
+            uint32_t op = code[pc];
+            if (op >= DT_NUM_INSTRUCTIONS || op == DT_SYSCALL) {
+                reject(pc, "unknown instruction code " + std::to_string(op));
+            }
+            const InstructionInfo& info = instructionInfo[op];
+            size_t next = pc + 1 + info.operands;
+            if (next > code.size()) {
+                reject(pc, "instruction is missing its operands");
+            }
+            if (role[pc] == 2) {
+                reject(pc, "branch into the operands of another instruction");
+            }
+            role[pc] = 1;
+            for (size_t k = pc + 1; k < next; k++) {
+                if (role[k] == 1) {
+                    reject(pc, "operand overlaps the instruction at word " + std::to_string(k));
+                }
+                role[k] = 2;
+            }
+            switch (op) {
+                case DT_END:
+                    break;
+                case DT_RET:
+                    returns(entry, pc, d > 0 ? 1 : 0);
+                    break;
+                case DT_CALL:
+                case DT_CALL_INC: {
+                    uint32_t callee = code[pc + 1];
+                    uint32_t num_params = code[pc + 2];
+                    if (callee >= code.size()) {
+                        reject(pc, "call target " + std::to_string(callee) + " outside the code");
+                    }
+                    if (op == DT_CALL_INC) {
+                        // Pushes top + 1 as the last parameter first.
+                        d = take(pc, d, 1) + 2;
+                        frame_max = std::max(frame_max, d);
+                    }
+                    int32_t below = take(pc, d, num_params);
+                    enter(callee, num_params, pc);
+                    calls[entry].push_back({static_cast<uint32_t>(d), num_params, callee, false});
+                    int32_t nd = below + assumed[callee];
+                    frame_max = std::max(frame_max, nd);
+                    flow(entry, next, nd, pc);
+                    break;
+                }
+                case DT_TAILCALL: {
+                    // Returns to the caller whatever the callee returns.
+                    uint32_t callee = code[pc + 1];
+                    uint32_t num_params = code[pc + 2];
+                    if (callee >= code.size()) {
+                        reject(pc, "call target " + std::to_string(callee) + " outside the code");
+                    }
+                    take(pc, d, num_params);
+                    enter(callee, num_params, pc);
+                    calls[entry].push_back({static_cast<uint32_t>(d), num_params, callee, true});
+                    returns(entry, pc, assumed[callee]);
+                    break;
+                }
+                case DT_JMP:
+                    flow(entry, target(pc, next, 0), d, pc);
+                    break;
+                case DT_JZ:
+                case DT_JUMP_IF: {
+                    int32_t nd = take(pc, d, 1);
+                    flow(entry, next, nd, pc);
+                    flow(entry, target(pc, next, 0), nd, pc);
+                    break;
+                }
+                case DT_IF_ELSE: {
+                    int32_t nd = take(pc, d, 1);
+                    flow(entry, target(pc, next, 0), nd, pc);
+                    flow(entry, target(pc, next, 1), nd, pc);
+                    break;
+                }
+                case DT_GUARD_GT:
+                case DT_GUARD_EQ: {
+                    int32_t nd = take(pc, d, 1) + 1;
+                    flow(entry, target(pc, next, 1), nd, pc);
+                    flow(entry, target(pc, next, 2), nd, pc);
+                    break;
+                }
+                default: {
+                    int32_t nd = take(pc, d, info.pops) + info.pushes;
+                    frame_max = std::max(frame_max, nd);
+                    flow(entry, next, nd, pc);
+                    break;
+                }
+            }
+        }
+        frame_depth[entry] = static_cast<uint32_t>(frame_max);
+    }
+};
+
+// Deepest stack over any chain of calls from word 0. The call graph is split
+// into strongly connected components (Tarjan), which come out callees first.
+// Within a component only DT_TAILCALLs may link its functions: a DT_CALL
+// between two of them lies on a cycle that grows the stack without bound, and
+// sets `recursive`. A tail call reuses its caller's frame, so a component
+// needs the deepest frame of any of its functions, or the values below a
+// DT_CALL's parameters plus the callee's component on top of them.
+class ChainDepth {
+    const Analysis& a;
+    std::unordered_map<uint32_t, uint32_t> index;
+    std::unordered_map<uint32_t, uint32_t> low;
+    std::unordered_map<uint32_t, size_t> component;  // Of each finished function
+    std::vector<size_t> depth;                       // Of each component
+    std::vector<uint32_t> open;
+    std::unordered_map<uint32_t, bool> onOpen;
+
+    void visit(uint32_t entry) {
+        index[entry] = low[entry] = static_cast<uint32_t>(index.size());
+        open.push_back(entry);
+        onOpen[entry] = true;
+        auto sites = a.calls.find(entry);
+        if (sites != a.calls.end()) {
+            for (const CallSite& c : sites->second) {
+                if (!index.count(c.target)) {
+                    visit(c.target);
+                    low[entry] = std::min(low[entry], low[c.target]);
+                } else if (onOpen[c.target]) {
+                    low[entry] = std::min(low[entry], index[c.target]);
+                }
+            }
+        }
+        if (low[entry] != index[entry]) {
+            return;
+        }
+        std::vector<uint32_t> members;
+        uint32_t member;
+        do {
+            member = open.back();
+            open.pop_back();
+            onOpen[member] = false;
+            component[member] = depth.size();
+            members.push_back(member);
+        } while (member != entry);
+        size_t deepest = 0;
+        for (uint32_t f : members) {
+            deepest = std::max<size_t>(deepest, a.frame_depth[f]);
+            sites = a.calls.find(f);
+            if (sites == a.calls.end()) {
+                continue;
+            }
+            for (const CallSite& c : sites->second) {
+                size_t callee = component[c.target];
+                if (callee == depth.size()) {
+                    recursive = recursive || !c.tail_call;
+                } else {
+                    size_t below = c.tail_call ? 0 : c.depth - c.num_params;
+                    deepest = std::max(deepest, below + depth[callee]);
+                }
+            }
+        }
+        depth.push_back(deepest);
+    }
+
+public:
+    bool recursive = false;
+
+    explicit ChainDepth(const Analysis& a) : a(a) {}
+
+    size_t run() {
+        visit(0);
+        return depth[component[0]];
+    }
+};
+
+} // namespace
+
+StackProfile verifyProgram(const std::vector<uint32_t>& code) {
+    if (code.empty()) {
+        throw std::runtime_error("bytecode rejected: empty program");
+    }
+    std::vector<uint8_t> assumed(code.size(), 0);
+    for (size_t round = 0; ; round++) {
+        Analysis lenient(code, assumed, false);
+        lenient.run();
+        bool settled = true;
+        for (uint32_t entry : lenient.entries) {
+            uint8_t seen = lenient.observed[entry] > 0 ? 1 : 0;
+            if (seen != assumed[entry]) {
+                assumed[entry] = seen;
+                settled = false;
+            }
+        }
+        if (settled) {
+            break;
+        }
+        if (round > lenient.entries.size()) {
+            throw std::runtime_error("bytecode rejected: return values of recursive functions never settle");
+        }
+    }
+
+    Analysis a(code, assumed, true);
+    a.run();
+    for (uint32_t entry : a.entries) {
+        if ((a.observed[entry] > 0 ? 1 : 0) != assumed[entry]) {
+            reject(entry, "function's return value depends on itself");
+        }
+    }
+
+    StackProfile profile;
+    profile.depth = std::move(a.depth);
+    profile.owner = std::move(a.owner);
+    profile.frame_depth = a.frame_depth;
+    profile.returns_value = assumed;
+    profile.entries = a.entries;
+    for (uint32_t entry : a.entries) {
+        profile.max_frame_depth = std::max(profile.max_frame_depth, a.frame_depth[entry]);
+    }
+    ChainDepth chain(a);
+    size_t deepest = chain.run();
+    profile.recursive = chain.recursive;
+    profile.max_stack = chain.recursive ? a.frame_depth[0] : deepest;
+    return profile;
+}
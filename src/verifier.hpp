@@ -0,0 +1,47 @@
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Load-time bytecode verifier.
+// Walks every function reachable from word 0 (the top-level code) and from the
+// targets of its DT_CALLs, tracking the operand depth of the current frame
+// before each instruction. A program is accepted only if every instruction is
+// known and complete, every branch lands on an instruction start inside the
+// code, no path pops more than its frame holds, every path reaching an
+// instruction agrees on its depth, and no path runs off the end of the code.
+// Engines can then size their stacks once and drop per-instruction checks.
+//
+// Branch operands are offsets from the word after the branch instruction;
+// DT_CALL and DT_CALL_INC take the absolute word index of the callee and the
+// number of values they move into the callee's frame. DT_RET hands back the callee's top value
+// when its frame is non-empty, so every DT_RET of a function must agree on that.
+// DT_TAILCALL takes the same operands and ends its function: the callee's
+// frame replaces the current one, and what it returns is returned for both.
+struct StackProfile {
+    // Frame depth before each reachable instruction, -1 for every other word.
+    std::vector<int32_t> depth;
+    // Entry of the function each reachable instruction belongs to, UINT32_MAX
+    // for every other word. No instruction belongs to two functions.
+    std::vector<uint32_t> owner;
+    // At each function entry: the deepest its frame gets (0 for other words).
+    std::vector<uint32_t> frame_depth;
+    // At each function entry: 1 if the function returns a value.
+    std::vector<uint8_t> returns_value;
+    // Function entries in discovery order; entries[0] is the top-level code.
+    std::vector<uint32_t> entries;
+    // Largest single frame in the program.
+    uint32_t max_frame_depth = 0;
+    // Values live across the deepest chain of calls, or the top-level frame
+    // alone when recursion leaves the chain unbounded (recursion through
+    // DT_TAILCALLs alone does not).
+    size_t max_stack = 0;
+    bool recursive = false;
+};
+
+// Throws std::runtime_error naming the offending word if `code` is rejected.
+StackProfile verifyProgram(const std::vector<uint32_t>& code);
+
+#endif
@@ -4,9 +4,31 @@
 #include "directthreading.cpp"
 #include "indirectthreading.cpp"
 #include "routinethreading.cpp"
+#include "regthreading.cpp"
+#include "contextthreading.cpp"
+#include "replthreading.cpp"
+#include "jitthreading.cpp"
+#include "tailthreading.cpp"
+#include "tierthreading.cpp"
+#include "aotthreading.cpp"
+#include "engineselect.cpp"
+#ifdef HAVE_STENCILS
+#include "stencilthreading.cpp"   // needs stencils.hpp from the build directory
+#endif
+#include "verifier.hpp"
+#include "superinstructions.hpp"
+#include "optimizer.hpp"
 uint32_t float_to_uint32(float value) {
     return *reinterpret_cast<uint32_t*>(&value);
 }
+// Joins instructions written one per row into a program
+std::vector<uint32_t> flatten(const std::vector<std::vector<unsigned>>& rows) {
+    std::vector<uint32_t> code;
+    for (const auto& row : rows) {
+        code.insert(code.end(), row.begin(), row.end());
+    }
+    return code;
+}
 //Direct Threading
 TEST(Arithmetic, HandlesAddition) {
     std::vector<unsigned> instructions = {DT_IMMI, 5, DT_IMMI, 3, DT_ADD, DT_SEEK, DT_END};
@@ -153,7 +175,7 @@ TEST(MemoryOperations, HandleMemorySet) {
 }
 
 TEST(ControlFlow, HandleJump) {
-    std::vector<uint32_t> instructions = {DT_IMMI,0,DT_STO_IMMI,0,1,DT_LOD,0,DT_ADD,DT_LOD,0,DT_INC,DT_STO,0,DT_LOD,0,DT_IMMI,100,DT_GT,DT_JZ,5,DT_SEEK,DT_END};
+    std::vector<uint32_t> instructions = {DT_IMMI,0,DT_STO_IMMI,0,1,DT_LOD,0,DT_ADD,DT_LOD,0,DT_INC,DT_STO,0,DT_LOD,0,DT_IMMI,100,DT_GT,DT_JZ,static_cast<uint32_t>(-15),DT_SEEK,DT_END};
     DirectThreadingVM vm;
     vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 5050); 
@@ -209,7 +231,7 @@ TEST(ComparisonOperations, HandleLessThanEqualTo) {
 TEST(ControlFlow, HandleIfElse) {
     std::vector<uint32_t> instructions = {
         DT_IMMI, 1,               
-        DT_IF_ELSE, 9, 13,         
+        DT_IF_ELSE, 4, 8,          
         DT_IMMI, 0,               
         DT_SEEK, DT_END,
         DT_IMMI, 123,             
@@ -225,7 +247,7 @@ TEST(ControlFlow, HandleIfElse) {
 TEST(ControlFlow, HandleConditionalJump) {
     std::vector<uint32_t> instructions = {
         DT_IMMI, 1,               
-        DT_JUMP_IF, 8,           
+        DT_JUMP_IF, 4,           
         DT_IMMI, 0,               
         DT_SEEK, DT_END,
         DT_IMMI, 123,            
@@ -253,33 +275,29 @@ TEST(FunctionCalls, HandleFunctionCallAndReturn) {
 //Indirect Threading
 TEST(Arithmetic, HandlesAddition2) {
     std::vector<unsigned> instructions = {DT_IMMI, 5, DT_IMMI, 3, DT_ADD, DT_SEEK, DT_END};
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 8); 
 }
 
 TEST(Arithmetic, HandlesSubtraction2) {
     std::vector<unsigned> instructions = {DT_IMMI, 10, DT_IMMI, 4, DT_SUB, DT_SEEK, DT_END};
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 6);
 }
 
 TEST(Arithmetic, HandlesMultiplication2) {
     std::vector<uint32_t> instructions = {DT_IMMI, 6, DT_IMMI, 7, DT_MUL, DT_SEEK, DT_END};
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 42);
 }
 
 TEST(Arithmetic, HandlesDivision2) {
     std::vector<uint32_t> instructions = {DT_IMMI, 20, DT_IMMI, 5, DT_DIV, DT_SEEK, DT_END};
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 4);
 }
 
@@ -289,9 +307,8 @@ TEST(FloatingPoint, HandlesFPAddition2) {
         DT_IMMI, float_to_uint32(0.5f),
         DT_FP_ADD, DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, float_to_uint32(5.0f));
 }
 
@@ -301,9 +318,8 @@ TEST(ArithmeticOperations, HandleDecrement2) {
         DT_DEC,
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,3,4};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 4); // 5 - 1 = 4
 }
 
@@ -313,9 +329,8 @@ TEST(FloatingPoint, HandlesFPSubtraction2) {
         DT_IMMI, float_to_uint32(1.5f),
         DT_FP_SUB, DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, float_to_uint32(4.0f));
 }
 
@@ -325,9 +340,8 @@ TEST(FloatingPoint, HandlesFPMultiplication2) {
         DT_IMMI, float_to_uint32(3.5f),
         DT_FP_MUL, DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, float_to_uint32(7.0f));
 }
 
@@ -337,9 +351,8 @@ TEST(FloatingPoint, HandlesFPDivision2) {
         DT_IMMI, float_to_uint32(2.5f),
         DT_FP_DIV, DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, float_to_uint32(3.0f));
 }
 
@@ -350,9 +363,8 @@ TEST(BitwiseOperations, HandleLeftShift2) {
         DT_SHL,      
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 8); 
 }
 
@@ -363,9 +375,8 @@ TEST(BitwiseOperations, HandleRightShift2) {
         DT_SHR,      
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = {0,2,4,5,6};
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 1); 
 }
 
@@ -376,9 +387,8 @@ TEST(MemoryOperations, HandleLoadAndStore2) {
         DT_LOD, 0,              
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 2, 4, 6, 7 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 100); 
 }
 
@@ -389,9 +399,8 @@ TEST(MemoryOperations, HandleMemoryCopy2) {
         DT_LOD, 4,           
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 3, 7, 9, 10 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 123);
 }
 
@@ -401,17 +410,15 @@ TEST(MemoryOperations, HandleMemorySet2) {
         DT_LOD, 0,            
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 4, 6, 7 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 0xFFFFFFFF); 
 }
 
 TEST(ControlFlow, HandleJump2) {
-    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_STO_IMMI, 0, 1, DT_LOD, 0, DT_ADD, DT_LOD, 0, DT_INC, DT_STO, 0, DT_LOD, 0, DT_IMMI, 100, DT_GT, DT_JZ, 2, DT_SEEK, DT_END };
-    std::vector<unsigned> thread = { 0, 2, 5, 7, 8, 10, 11, 13, 15, 17, 18, 20, 21 };
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_STO_IMMI, 0, 1, DT_LOD, 0, DT_ADD, DT_LOD, 0, DT_INC, DT_STO, 0, DT_LOD, 0, DT_IMMI, 100, DT_GT, DT_JZ, static_cast<uint32_t>(-15), DT_SEEK, DT_END };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 5050); 
 }
 
@@ -422,9 +429,8 @@ TEST(ComparisonOperations, HandleLessThan2) {
         DT_LT,
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 2, 4, 5, 6 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 1); // 5 < 10
 }
 
@@ -435,9 +441,8 @@ TEST(ComparisonOperations, HandleEqualTo2) {
         DT_EQ,
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 2, 4, 5, 6 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 1); // 10 == 10
 }
 
@@ -448,9 +453,8 @@ TEST(ComparisonOperations, HandleGreaterThanEqualTo2) {
         DT_GT_EQ,
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 2, 4, 5, 6 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 1); // 10 >= 5
 }
 
@@ -461,62 +465,565 @@ TEST(ComparisonOperations, HandleLessThanEqualTo2) {
         DT_LT_EQ,
         DT_SEEK, DT_END
     };
-    std::vector<unsigned> thread = { 0, 2, 4, 5, 6 };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 1); // 5 <= 10
 }
 
 TEST(ControlFlow, HandleIfElse2) {
-    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_IF_ELSE, 5, 8, DT_IMMI, 0, DT_SEEK, DT_END, DT_IMMI, 123, DT_SEEK, DT_END, DT_IMMI, 456, DT_SEEK, DT_END };
-    std::vector<unsigned> thread = { 0, 2, 5, 7, 8, 9, 11, 12, 13, 15, 16 };
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_IF_ELSE, 4, 8, DT_IMMI, 0, DT_SEEK, DT_END, DT_IMMI, 123, DT_SEEK, DT_END, DT_IMMI, 456, DT_SEEK, DT_END };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 123); 
 }
 
 TEST (ControlFlow, HandleConditionalJump2) {
-    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_JUMP_IF, 5, DT_IMMI, 0, DT_SEEK, DT_END, DT_IMMI, 123, DT_SEEK, DT_END };
-    std::vector<unsigned> thread = { 0, 2, 4, 6, 7, 8, 10, 11 };
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_JUMP_IF, 4, DT_IMMI, 0, DT_SEEK, DT_END, DT_IMMI, 123, DT_SEEK, DT_END };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 123); 
 }
 
 TEST(FunctionCalls, HandleFunctionCallAndReturn2) {
-    std::vector<uint32_t> instructions = { DT_IMMI, 10, DT_CALL, 4, 1, DT_SEEK, DT_END, DT_IMMI, 2, DT_ADD, DT_RET };
-    std::vector<unsigned> thread = { 0, 2, 5, 6, 7, 9, 10 };
+    std::vector<uint32_t> instructions = { DT_IMMI, 10, DT_CALL, 7, 1, DT_SEEK, DT_END, DT_IMMI, 2, DT_ADD, DT_RET };
     IndirectThreadingVM vm;
-    vm.run_vm(instructions,thread);
+    vm.run_vm(instructions);
     EXPECT_EQ(vm.debug_num, 12);
 }
 
+TEST(FunctionCalls, HandleCallerFrameSurvivesCall2) {
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_IMMI, 10, DT_CALL, 10, 1, DT_ADD, DT_SEEK, DT_END, DT_IMMI, 2, DT_ADD, DT_RET };
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 19);
+}
+
+TEST(StackOperations, HandleCachedTopAcrossSpills2) {
+    // (1 + (2 * (3 - 1))) with every operand pushed before the first operator
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_IMMI, 2, DT_IMMI, 3, DT_IMMI, 1, DT_SUB, DT_MUL, DT_ADD, DT_DUP, DT_ADD, DT_SEEK, DT_END };
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 10);
+}
+
+TEST(Verifier, HandleStackUnderflowRejected2) {
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_ADD, DT_SEEK, DT_END };
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 0xFFFFFFFF); // rejected before running
+}
+
+TEST(Verifier, HandleFrameDepths) {
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_IMMI, 10, DT_CALL, 10, 1, DT_ADD, DT_SEEK, DT_END, DT_IMMI, 2, DT_DUP, DT_ADD, DT_ADD, DT_RET };
+    StackProfile profile = verifyProgram(instructions);
+    EXPECT_EQ(profile.frame_depth[0], 2u);
+    EXPECT_EQ(profile.frame_depth[10], 3u);
+    EXPECT_EQ(profile.returns_value[10], 1);
+    EXPECT_EQ(profile.max_stack, 4u);
+    EXPECT_FALSE(profile.recursive);
+    // A loop that leaves a value behind on every iteration is rejected
+    std::vector<uint32_t> unbalanced = { DT_IMMI, 1, DT_JMP, static_cast<uint32_t>(-4), DT_END };
+    EXPECT_THROW(verifyProgram(unbalanced), std::runtime_error);
+}
+
+TEST(ControlFlow, HandleResolvedTargets2) {
+    // Double 1 three times through a call inside a counted loop
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_IMMI, 3,
+                                           DT_DUP, DT_JZ, 10, DT_STO, 0, DT_CALL, 21, 1,
+                                           DT_LOD, 0, DT_DEC, DT_JMP, static_cast<uint32_t>(-13),
+                                           DT_STO, 0, DT_SEEK, DT_END,
+                                           DT_DUP, DT_ADD, DT_RET };
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 8);
+}
+
+TEST(FunctionCalls, HandleRunAfterEndInCallee2) {
+    // The first run ends inside its callee; the second run's top-level DT_RET must still end it
+    std::vector<uint32_t> first = { DT_IMMI, 1, DT_CALL, 7, 0, DT_SEEK, DT_RET, DT_END };
+    std::vector<uint32_t> second = { DT_IMMI, 7, DT_SEEK, DT_IMMI, 9, DT_RET, DT_IMMI, 3, DT_SEEK, DT_END };
+    IndirectThreadingVM vm;
+    vm.run_vm(first);
+    vm.run_vm(second);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+#ifdef HAVE_STENCILS
+TEST(IndirectThreading, InlineStraightLineRuns) {
+    // Sum 1..100 through memory: the loop body is one inlined run between the branch and its target
+    std::vector<uint32_t> instructions = { DT_STO_IMMI, 0, 0, DT_STO_IMMI, 4, 1,
+                                           DT_LOD, 0, DT_LOD, 4, DT_ADD, DT_STO, 0, DT_LOD, 4, DT_INC, DT_DUP, DT_STO, 4,
+                                           DT_IMMI, 100, DT_GT, DT_JZ, static_cast<uint32_t>(-18),
+                                           DT_LOD, 0, DT_SEEK, DT_END };
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 5050);
+    EXPECT_EQ(vm.inlined_runs(), 2);
+}
+#endif
+
+//Context Threading
+TEST(ContextThreading, HandleNativeCallsAndBranches) {
+    // Recursive sum 1..50: f(n) = n == 0 ? 0 : n + f(n - 1), with native call/ret per guest call
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    ContextThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+}
+
+TEST(ContextThreading, StopDeepRecursion) {
+    // Recursive sum 1..1000000 nests deeper than MAX_CALL_DEPTH and ends with an error, not a crash
+    std::vector<uint32_t> instructions = { DT_IMMI, 1000000, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    ContextThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 0xFFFFFFFF);
+    instructions[1] = 100000;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 5000050000u & 0xFFFFFFFF);
+}
+
+TEST(ContextThreading, HandleRunAfterErrorInCallee) {
+    // A division by zero inside a callee leaves its frame behind; the next run starts without it
+    int level = optLevel();
+    setOptLevel(0);
+    std::vector<uint32_t> first = { DT_IMMI, 1, DT_CALL, 6, 1, DT_END, DT_IMMI, 0, DT_DIV, DT_RET };
+    std::vector<uint32_t> second = { DT_IMMI, 7, DT_SEEK, DT_IMMI, 9, DT_RET };
+    ContextThreadingVM vm;
+    vm.run_vm(first);
+    vm.run_vm(second);
+    setOptLevel(level);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+//Replicated Threading
+TEST(ReplicatedThreading, HandleReplicasAcrossSites) {
+    // Recursive sum 1..50: the two DT_DUPs and the two DT_CALLs follow different opcodes, so each runs through its own replica
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    ReplThreadingModel vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+}
+
+//Random
+TEST(Random, RangeOfZeroPushesZero) {
+    // DT_RND with a range of 0 pushes 0 instead of taking a remainder by zero
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_RND, DT_INC, DT_SEEK, DT_END };
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1);
+}
+
+//Register VM
+TEST(RegisterVM, HandleLoopSum) {
+    // Sum 1..100 through memory; the compare and DT_JZ fuse into one branch
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_STO_IMMI, 0, 1, DT_LOD, 0, DT_ADD, DT_LOD, 0, DT_INC, DT_STO, 0,
+                                           DT_LOD, 0, DT_IMMI, 100, DT_GT, DT_JZ, static_cast<uint32_t>(-15), DT_SEEK, DT_END };
+    RegThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 5050);
+}
+
+TEST(RegisterVM, HandleCallFrames) {
+    // The callee's registers start at its parameter; its result lands there
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_IMMI, 10, DT_CALL, 10, 1, DT_ADD, DT_SEEK, DT_END, DT_IMMI, 2, DT_DUP, DT_ADD, DT_ADD, DT_RET };
+    RegThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 21);
+}
+
+//Template JIT
+TEST(TemplateJit, HandleNativeCallsAndBranches) {
+    // Recursive sum 1..50; each guest DT_CALL/DT_RET is a native call/ret
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    JitThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+}
+
+TEST(TemplateJit, HandleDivisionByZero) {
+    // Division by zero leaves through the epilogue before DT_SEEK
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_SEEK, DT_IMMI, 0, DT_DIV, DT_SEEK, DT_END };
+    JitThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+//Copy-and-patch Stencils
+#ifdef HAVE_STENCILS
+TEST(Stencils, HandleLoopAndCalls) {
+    // Sum 1..100 through a callee that adds its two parameters; branches and calls are patched holes
+    std::vector<uint32_t> instructions = { DT_STO_IMMI, 0, 0, DT_STO_IMMI, 4, 1,
+                                           DT_LOD, 0, DT_LOD, 4, DT_CALL, 30, 2, DT_STO, 0,
+                                           DT_LOD, 4, DT_INC, DT_DUP, DT_STO, 4, DT_IMMI, 100, DT_GT, DT_JZ, static_cast<uint32_t>(-20),
+                                           DT_LOD, 0, DT_SEEK, DT_END,
+                                           DT_ADD, DT_RET };
+    StencilThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 5050);
+}
+#endif
+
+//Superinstructions
+TEST(Superinstructions, FuseConverterIdioms) {
+    // f(x) = x > 5 ? x : f(x + 1), guarded and recursing the way converter.py emits it
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_IMMI, 5, DT_GT, DT_IF_ELSE, 0, 1, DT_RET,
+                                           DT_DUP, DT_INC, DT_CALL, 7, 1, DT_RET };
+    std::vector<uint32_t> fused = instructions;
+    StackProfile profile = verifyProgram(fused);
+    EXPECT_EQ(fuseSuperinstructions(fused, profile), 2);
+    EXPECT_EQ(fused[7], DT_GUARD_GT);
+    EXPECT_LT(fused.size(), instructions.size());
+    IndirectThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 6);
+}
+
+TEST(Superinstructions, KeepIdiomsThatAreBranchedInto) {
+    // The loop jumps back onto the DT_IMMI of `DUP, IMMI, GT, IF_ELSE`, so it must stay as it is
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_IMMI, 3, DT_DUP, DT_IMMI, 3, DT_GT, DT_IF_ELSE, 0, 4,
+                                           DT_INC, DT_DUP, DT_JMP, static_cast<uint32_t>(-10), DT_SEEK, DT_END };
+    std::vector<uint32_t> fused = instructions;
+    StackProfile profile = verifyProgram(fused);
+    EXPECT_EQ(fuseSuperinstructions(fused, profile), 0);
+    EXPECT_EQ(fused, instructions);
+}
+
+//Jump Threading
+TEST(JumpThreading, CollapseChainsIntoReturns) {
+    // f(x) = x == 0 ? 10 : x + 1, both branch bodies leaving through a DT_JMP to a `_ret` DT_JMP
+    std::vector<uint32_t> instructions = { DT_IMMI, 4, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 3, DT_INC, DT_JMP, 5,
+                                           DT_IMMI, 10, DT_ADD, DT_JMP, 0, DT_JMP, 0, DT_RET };
+    std::vector<uint32_t> threaded = instructions;
+    StackProfile profile = verifyProgram(threaded);
+    EXPECT_EQ(threadJumps(threaded, profile), 5);
+    EXPECT_EQ(threaded.size(), instructions.size());
+    EXPECT_EQ(threaded[11], DT_RET);
+    EXPECT_EQ(threaded[16], DT_RET);
+    SwThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 5);
+}
+
+TEST(JumpThreading, LeaveJumpCyclesAlone) {
+    // The DT_JMP to itself is never collapsed; DT_JZ skips over it
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_JZ, 2, DT_JMP, static_cast<uint32_t>(-2), DT_END };
+    std::vector<uint32_t> threaded = instructions;
+    StackProfile profile = verifyProgram(threaded);
+    EXPECT_EQ(threadJumps(threaded, profile), 0);
+    EXPECT_EQ(threaded, instructions);
+}
+
+TEST(JumpThreading, HandleRunAfterEndInCallee) {
+    // The first run ends inside its callee; the second run's top-level DT_RET must still end it
+    std::vector<uint32_t> first = { DT_IMMI, 1, DT_CALL, 7, 0, DT_SEEK, DT_RET, DT_END };
+    std::vector<uint32_t> second = { DT_IMMI, 7, DT_SEEK, DT_IMMI, 9, DT_RET, DT_IMMI, 3, DT_SEEK, DT_END };
+    SwThreadingVM vm;
+    vm.run_vm(first);
+    vm.run_vm(second);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+//Bytecode Optimizer
+TEST(BytecodeOptimizer, FoldAndCancelTerminals) {
+    // 2 * 3 folds into one DT_IMMI; the terminal callee's depth guard pushes and pops for nothing
+    std::vector<uint32_t> instructions = { DT_IMMI, 2, DT_IMMI, 3, DT_MUL, DT_DUP, DT_CALL, 11, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_IMMI, 5, DT_GT, DT_IF_ELSE, 0, 0, DT_JZ, 0, DT_RET };
+    std::vector<uint32_t> optimized = instructions;
+    StackProfile profile = verifyProgram(optimized);
+    EXPECT_EQ(foldConstants(optimized, profile), 1);
+    EXPECT_EQ(cancelPushPop(optimized, profile), 1);
+    EXPECT_EQ(cancelPushPop(optimized, profile), 1);
+    EXPECT_EQ(optimized, (std::vector<uint32_t>{ DT_IMMI, 6, DT_DUP, DT_CALL, 8, 1, DT_SEEK, DT_END,
+                                                 DT_JZ, 0, DT_RET }));
+    SwThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 6);
+}
+
+TEST(BytecodeOptimizer, RemoveCodeAfterJumps) {
+    // The DT_JMP skips three dead words, so it goes with them
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_JMP, 3, DT_IMMI, 9, DT_INC, DT_SEEK, DT_END };
+    StackProfile profile = verifyProgram(instructions);
+    EXPECT_EQ(removeDeadCode(instructions, profile), 5);
+    EXPECT_EQ(instructions, (std::vector<uint32_t>{ DT_IMMI, 1, DT_SEEK, DT_END }));
+}
+
+//Call Inlining
+TEST(CallInlining, DropCallsToTerminals) {
+    // Once its guard is cancelled the terminal only drops its parameter, so the
+    // call goes, the DT_DUP feeding it goes, and the callee is dead code
+    std::vector<uint32_t> instructions = { DT_IMMI, 6, DT_DUP, DT_CALL, 8, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_IMMI, 5, DT_GT, DT_IF_ELSE, 0, 0, DT_JZ, 0, DT_RET };
+    StackProfile profile = verifyProgram(instructions);
+    optimizeProgram(instructions, profile);
+    EXPECT_EQ(instructions, (std::vector<uint32_t>{ DT_IMMI, 6, DT_SEEK, DT_END }));
+}
+
+TEST(CallInlining, InlineValueReturningCallee) {
+    // x -> x * 2 + 1 is copied into both call sites (removeDeadCode drops it
+    // afterwards); the recursive function is left alone
+    std::vector<uint32_t> instructions = { DT_IMMI, 4, DT_CALL, 14, 1, DT_CALL_INC, 14, 1, DT_ADD, DT_CALL, 18, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_ADD, DT_INC, DT_RET,
+                                           DT_DUP, DT_JZ, 5, DT_DEC, DT_CALL, 18, 1, DT_INC, DT_RET };
+    std::vector<uint32_t> optimized = instructions;
+    StackProfile profile = verifyProgram(optimized);
+    EXPECT_EQ(inlineCalls(optimized, profile), 2);
+    EXPECT_EQ(optimized, (std::vector<uint32_t>{ DT_IMMI, 4, DT_DUP, DT_ADD, DT_INC, DT_DUP, DT_INC, DT_DUP, DT_ADD, DT_INC,
+                                                 DT_ADD, DT_CALL, 20, 1, DT_SEEK, DT_END,
+                                                 DT_DUP, DT_ADD, DT_INC, DT_RET,
+                                                 DT_DUP, DT_JZ, 5, DT_DEC, DT_CALL, 20, 1, DT_INC, DT_RET }));
+    SwThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 30);
+}
+
+//Tail-call Threading
+TEST(TailCallThreading, HandleCallsAndBranches) {
+    // Recursive sum 1..50; every handler hands over to the next by a tail call
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    TailThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+}
+
+TEST(TailCallThreading, HandleDivisionByZero) {
+    // Division by zero returns out of the chain of handlers before DT_SEEK
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_SEEK, DT_IMMI, 0, DT_DIV, DT_SEEK, DT_END };
+    TailThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+//Tiered Execution
+TEST(TieredExecution, SwitchAtACall) {
+    // Recursive sum 1..50 with the compiled code ready up front: the interpreter
+    // stops at the first DT_CALL and the compiled code runs the recursion
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    TierThreadingVM vm;
+    vm.compile_first = true;
+    vm.run_vm(instructions);
+    EXPECT_TRUE(vm.tiered_up());
+    EXPECT_EQ(vm.debug_num, 1275);
+}
+
+TEST(TieredExecution, CarryMemoryAcrossTheSwitch) {
+    // Sum 1..100 through memory; the switch happens at the loop's backward DT_JZ
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_STO_IMMI, 0, 1, DT_LOD, 0, DT_ADD, DT_LOD, 0, DT_INC, DT_STO, 0,
+                                           DT_LOD, 0, DT_IMMI, 100, DT_GT, DT_JZ, static_cast<uint32_t>(-15), DT_SEEK, DT_END };
+    TierThreadingVM vm;
+    vm.compile_first = true;
+    vm.run_vm(instructions);
+    EXPECT_TRUE(vm.tiered_up());
+    EXPECT_EQ(vm.debug_num, 5050);
+}
+
+//AOT Compilation
+TEST(AotCompilation, OneCFunctionPerGuestFunction) {
+    // Recursive sum 1..50: the rule at word 7 becomes a C function taking its
+    // parameter and returning the sum, and calls itself natively
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    AotThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+    std::string path = "/tmp/thd_vm_aot_test_" + std::to_string(getpid()) + ".c";
+    ASSERT_TRUE(vm.write_c(path));
+    std::ifstream in(path);
+    std::string c((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    unlink(path.c_str());
+    EXPECT_NE(c.find("static uint32_t fvm_f7(uint32_t s0) {"), std::string::npos);
+    EXPECT_NE(c.find("s1 = fvm_f7(s1);"), std::string::npos);
+}
+
+TEST(AotCompilation, HandleDivisionByZero) {
+    // Division by zero leaves every C function at once, before the second DT_SEEK
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_SEEK, DT_LOD, 0, DT_IMMI, 0, DT_DIV, DT_SEEK, DT_END };
+    AotThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+//In-process Compiled C
+TEST(CompiledC, DirectEmitCRunsInProcess) {
+    // The direct-threaded C is loaded as a shared object and runs on the VM's buffer
+    std::vector<uint32_t> instructions = { DT_STO_IMMI, 8, 41, DT_LOD, 8, DT_INC, DT_STO, 12, DT_LOD, 12, DT_SEEK, DT_END };
+    DirectThreadingVM vm;
+    vm.emit_c = true;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 42);
+}
+
+TEST(CompiledC, DirectEmitCMasksShiftCounts) {
+    // The generated C shifts by the low five bits of the count, as the interpreters do on x86
+    std::vector<uint32_t> instructions = { DT_IMMI, 1, DT_IMMI, 33, DT_SHL, DT_SEEK, DT_END };
+    DirectThreadingVM vm;
+    vm.emit_c = true;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 2);
+}
+
+TEST(CompiledC, RoutineRecursionReturnsToEachCaller) {
+    // Recursive sum 1..50: every DT_RET returns to its own DT_CALL
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    RoutineThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+}
+
+TEST(CompiledC, RoutineHandleDivisionByZero) {
+    // The error returns from fvm_run instead of exiting the process
+    std::vector<uint32_t> instructions = { DT_IMMI, 7, DT_SEEK, DT_LOD, 0, DT_IMMI, 0, DT_DIV, DT_SEEK, DT_END };
+    RoutineThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 7);
+}
+
+TEST(CompiledC, RoutinePrintsSignedValues) {
+    // DT_PRINT shows the top as a signed value, as the other engines do
+    std::vector<uint32_t> instructions = { DT_IMMI, static_cast<uint32_t>(-7), DT_PRINT, DT_SEEK, DT_END };
+    RoutineThreadingVM vm;
+    testing::internal::CaptureStdout();
+    vm.run_vm(instructions);
+    fflush(stdout);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "-7\n");
+}
+
+//Compile Cache
+TEST(CompileCache, KeyCoversEveryInput) {
+    std::vector<uint32_t> code = { DT_IMMI, 1, DT_SEEK, DT_END };
+    std::vector<uint32_t> other = { DT_IMMI, 2, DT_SEEK, DT_END };
+    std::string key = compileCacheKey("aot", 1, "cc -O2", code);
+    EXPECT_EQ(key, compileCacheKey("aot", 1, "cc -O2", code));
+    EXPECT_NE(key, compileCacheKey("aot", 1, "cc -O2", other));
+    EXPECT_NE(key, compileCacheKey("direct", 1, "cc -O2", code));
+    EXPECT_NE(key, compileCacheKey("aot", 2, "cc -O2", code));
+    EXPECT_NE(key, compileCacheKey("aot", 1, "cc -O3", code));
+}
+
+TEST(CompileCache, ReuseAnAotBuild) {
+    // The second run loads the shared object the first one published next to its C
+    std::string dir = "/tmp/thd_vm_cache_test_" + std::to_string(getpid());
+    setCompileCacheDir(dir);
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    for (int run = 0; run < 2; run++) {
+        std::vector<uint32_t> code = instructions;
+        AotThreadingVM vm;
+        vm.run_vm(code);
+        EXPECT_EQ(vm.debug_num, 1275);
+        auto entries = std::filesystem::directory_iterator(dir);
+        EXPECT_EQ(std::distance(begin(entries), end(entries)), 2);
+    }
+    setCompileCacheDir("");
+    std::filesystem::remove_all(dir);
+}
+
+TEST(CompileCache, IgnoreASharedDirectory) {
+    // A cache others can write to is not loaded from; the build goes through a private directory
+    std::string dir = "/tmp/thd_vm_cache_test_" + std::to_string(getpid());
+    std::filesystem::create_directories(dir);
+    std::filesystem::permissions(dir, std::filesystem::perms::all);
+    setCompileCacheDir(dir);
+    std::vector<uint32_t> instructions = { DT_IMMI, 50, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 6, DT_DUP, DT_DEC, DT_CALL, 7, 1, DT_ADD, DT_RET };
+    AotThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1275);
+    EXPECT_TRUE(std::filesystem::is_empty(dir));
+    setCompileCacheDir("");
+    std::filesystem::remove_all(dir);
+}
+
+//Engine Selection
+TEST(EngineSelection, ClassifyProgramShape) {
+    // Only a backward branch or a call lets a program run longer than its length
+    std::vector<uint32_t> straight = { DT_IMMI, 1, DT_JZ, 2, DT_INC, DT_INC, DT_SEEK, DT_END };
+    std::vector<uint32_t> loop = { DT_IMMI, 3, DT_DEC, DT_DUP, DT_JUMP_IF, static_cast<uint32_t>(-4), DT_SEEK, DT_END };
+    std::vector<uint32_t> call = { DT_IMMI, 2, DT_CALL, 6, 1, DT_END, DT_RET };
+    EXPECT_FALSE(programShape(straight).loops);
+    EXPECT_FALSE(programShape(straight).calls);
+    EXPECT_TRUE(programShape(loop).loops);
+    EXPECT_TRUE(programShape(call).calls);
+    EXPECT_STREQ(chooseEngine(straight, false)->name, STRAIGHT_LINE_ENGINE);
+    EXPECT_NE(chooseEngine(loop, false)->time_run, nullptr);
+    EXPECT_EQ(findEngine("bogus"), nullptr);
+}
+
+//Tail Calls
+TEST(TailCalls, MarkCallsBeforeReturns) {
+    // A converter.py rule counting its parameter down a million times; the
+    // recursive call only jumps to `_ret` and pops the parameter after it
+    std::vector<uint32_t> instructions = { DT_STO_IMMI, 0, 0, DT_IMMI, 1000000, DT_CALL, 12, 1, DT_LOD, 0, DT_SEEK, DT_END,
+                                           DT_DUP, DT_JZ, 10, DT_LOD, 0, DT_INC, DT_STO, 0, DT_DUP, DT_DEC, DT_CALL, 12, 1,
+                                           DT_JMP, 0, DT_JZ, 0, DT_RET };
+    std::vector<uint32_t> marked = instructions;
+    StackProfile profile = verifyProgram(marked);
+    EXPECT_TRUE(profile.recursive);
+    EXPECT_EQ(markTailCalls(marked, profile), 1);
+    EXPECT_EQ(marked[22], DT_TAILCALL);
+    EXPECT_FALSE(profile.recursive);
+    SwThreadingVM vm;
+    vm.run_vm(instructions);
+    EXPECT_EQ(vm.debug_num, 1000000);
+}
+
+TEST(TailCalls, RunDeepRecursionInOneFrame) {
+    // f(x) = x > 1000000 ? x : f(x + 1) never grows the native or the operand stack
+    std::vector<uint32_t> instructions = { DT_IMMI, 0, DT_CALL, 7, 1, DT_SEEK, DT_END,
+                                           DT_DUP, DT_IMMI, 1000000, DT_GT, DT_IF_ELSE, 0, 1, DT_RET,
+                                           DT_DUP, DT_INC, DT_CALL, 7, 1, DT_RET };
+    JitThreadingVM jitVm;
+    jitVm.run_vm(instructions);
+    EXPECT_EQ(jitVm.debug_num, 1000001);
+#ifdef HAVE_STENCILS
+    StencilThreadingVM stencilVm;
+    stencilVm.run_vm(instructions);
+    EXPECT_EQ(stencilVm.debug_num, 1000001);
+#endif
+    RegThreadingVM regVm;
+    regVm.run_vm(instructions);
+    EXPECT_EQ(regVm.debug_num, 1000001);
+}
+
 //Routine Threading
 TEST(Arithmetic, HandlesAddition3) {
     std::vector<std::vector<unsigned> > instructions = {{DT_IMMI, 5}, {DT_IMMI, 3}, {DT_ADD}, {DT_SEEK}, {DT_END}};
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 8); 
 }
 
 TEST(Arithmetic, HandlesSubtraction3) {
     std::vector<std::vector<unsigned> > instructions = {{DT_IMMI, 10}, {DT_IMMI, 4}, {DT_SUB}, {DT_SEEK}, {DT_END}};
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 6);
 }
 
 TEST(Arithmetic, HandlesMultiplication3) {
     std::vector<std::vector<unsigned> > instructions = {{DT_IMMI, 6}, {DT_IMMI, 7}, {DT_MUL}, {DT_SEEK}, {DT_END}};
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 42);
 }
 
 TEST(Arithmetic, HandlesDivision3) {
     std::vector<std::vector<unsigned> > instructions = {{DT_IMMI, 20}, {DT_IMMI, 5}, {DT_DIV}, {DT_SEEK}, {DT_END}};
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 4);
 }
 
@@ -527,7 +1034,8 @@ TEST(FloatingPoint, HandlesFPAddition3) {
         {DT_FP_ADD}, {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, float_to_uint32(5.0f));
 }
 
@@ -538,7 +1046,8 @@ TEST(ArithmeticOperations, HandleDecrement3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 4); // 5 - 1 = 4
 }
 
@@ -549,7 +1058,8 @@ TEST(FloatingPoint, HandlesFPSubtraction3) {
         {DT_FP_SUB}, {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, float_to_uint32(4.0f));
 }
 
@@ -560,7 +1070,8 @@ TEST(FloatingPoint, HandlesFPMultiplication3) {
         {DT_FP_MUL}, {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, float_to_uint32(7.0f));
 }
 
@@ -571,7 +1082,8 @@ TEST(FloatingPoint, HandlesFPDivision3) {
         {DT_FP_DIV}, {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, float_to_uint32(3.0f));
 }
 
@@ -583,7 +1095,8 @@ TEST(BitwiseOperations, HandleLeftShift3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 8); 
 }
 
@@ -595,7 +1108,8 @@ TEST(BitwiseOperations, HandleRightShift3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 1); 
 }
 
@@ -607,7 +1121,8 @@ TEST(MemoryOperations, HandleLoadAndStore3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 100); 
 }
 
@@ -619,7 +1134,8 @@ TEST(MemoryOperations, HandleMemoryCopy3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 123);
 }
 
@@ -630,14 +1146,16 @@ TEST(MemoryOperations, HandleMemorySet3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 0xFFFFFFFF); 
 }
 
 TEST(ControlFlow, HandleJump3) {
-    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 0},{DT_STO_IMMI, 0, 1},{DT_LOD, 0},{DT_ADD},{DT_LOD, 0},{DT_INC},{DT_STO, 0},{DT_LOD, 0},{DT_IMMI, 100},{DT_GT},{DT_JZ, 2},{DT_SEEK},{DT_END} };
+    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 0},{DT_STO_IMMI, 0, 1},{DT_LOD, 0},{DT_ADD},{DT_LOD, 0},{DT_INC},{DT_STO, 0},{DT_LOD, 0},{DT_IMMI, 100},{DT_GT},{DT_JZ, static_cast<uint32_t>(-15)},{DT_SEEK},{DT_END} };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 5050); 
 }
 
@@ -649,7 +1167,8 @@ TEST(ComparisonOperations, HandleLessThan3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 1); // 5 < 10
 }
 
@@ -661,7 +1180,8 @@ TEST(ComparisonOperations, HandleEqualTo3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 1); // 10 == 10
 }
 
@@ -673,7 +1193,8 @@ TEST(ComparisonOperations, HandleGreaterThanEqualTo3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 1); // 10 >= 5
 }
 
@@ -685,28 +1206,32 @@ TEST(ComparisonOperations, HandleLessThanEqualTo3) {
         {DT_SEEK}, {DT_END}
     };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 1); // 5 <= 10
 }
 
 TEST(ControlFlow, HandleIfElse3) {
-    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 1},{DT_IF_ELSE, 5, 8},{DT_IMMI, 0},{DT_SEEK},{DT_END},{DT_IMMI, 123},{DT_SEEK},{DT_END},{DT_IMMI, 456},{DT_SEEK},{DT_END} };
+    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 1},{DT_IF_ELSE, 4, 8},{DT_IMMI, 0},{DT_SEEK},{DT_END},{DT_IMMI, 123},{DT_SEEK},{DT_END},{DT_IMMI, 456},{DT_SEEK},{DT_END} };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 123); 
 }
 
 TEST (ControlFlow, HandleConditionalJump3) {
-    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 1},{DT_JUMP_IF, 5},{DT_IMMI, 0},{DT_SEEK},{DT_END},{DT_IMMI, 123},{DT_SEEK},{DT_END} };
+    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 1},{DT_JUMP_IF, 4},{DT_IMMI, 0},{DT_SEEK},{DT_END},{DT_IMMI, 123},{DT_SEEK},{DT_END} };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 123); 
 }
 
 TEST(FunctionCalls, HandleFunctionCallAndReturn3) {
-    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 10},{DT_CALL, 4, 1},{DT_SEEK},{DT_END},{DT_IMMI, 2},{DT_ADD},{DT_RET} };
+    std::vector<std::vector<unsigned> > instructions = { {DT_IMMI, 10},{DT_CALL, 7, 1},{DT_SEEK},{DT_END},{DT_IMMI, 2},{DT_ADD},{DT_RET} };
     RoutineThreadingVM vm;
-    vm.run_vm(instructions);
+    std::vector<uint32_t> code = flatten(instructions);
+    vm.run_vm(code);
     EXPECT_EQ(vm.debug_num, 12);
 }
 